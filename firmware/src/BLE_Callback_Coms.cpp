@@ -3,6 +3,7 @@
 #include <FreeRTOS.h>
 #include <Arduino.h>
 #include <SD.h>
+#include <esp_timer.h>
 
 /**
  * @brief macro for when client requests to server to respond to confirm command
@@ -27,13 +28,69 @@ BLE_Callback_Coms::~BLE_Callback_Coms()
     delete[] responsePacket;
 }
 
+bool BLE_Callback_Coms::begin(BLECharacteristic *characteristic)
+{
+    this->characteristic = characteristic;
+    characteristic->setCallbacks(this);
+
+    return xTaskCreate(WorkerTask,
+                       "ble_coms",
+                       BLECC_STACK_SIZE,
+                       this,
+                       1,
+                       &task) == pdPASS;
+}
+
 void BLE_Callback_Coms::onWrite(BLECharacteristic *pCharacteristic)
+{
+    int64_t start = esp_timer_get_time();
+
+    size_t length = pCharacteristic->getLength();
+    if (!task || length > MAX_PACKET_SIZE) {
+        ++dropped;
+    }
+    else if (length) {
+        // straight into the slot, the stack's task has little stack to spare
+        Packet_t *packet = packets.reserve();
+        if (packet) {
+            packet->length = length;
+            memcpy(packet->data, pCharacteristic->getData(), length);
+            packets.commit();
+            xTaskNotifyGive(task);
+        }
+    }
+
+    callbackLast = esp_timer_get_time() - start;
+    if (callbackLast > callbackMax) callbackMax = callbackLast;
+    if (callbackLast > BLECC_CALLBACK_BUDGET) ++callbackOver;
+}
+
+void BLE_Callback_Coms::WorkerTask(void *arg)
+{
+    BLE_Callback_Coms *callbacks = static_cast<BLE_Callback_Coms *>(arg);
+
+    while (true) {
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+        // handled in its slot, which is only freed afterwards
+        Packet_t *packet;
+        while ((packet = callbacks->packets.front()) != nullptr) {
+            // the rest of the slot is zeroed, as short commands read past what was sent
+            memset(packet->data + packet->length, 0, sizeof(packet->data) - packet->length);
+            callbacks->handle(callbacks->characteristic, packet->data, packet->length);
+            callbacks->packets.release();
+            ++callbacks->handled;
+        }
+    }
+}
+
+void BLE_Callback_Coms::handle(BLECharacteristic *pCharacteristic, uint8_t *receivedPacket, size_t length)
 {
     #ifdef DEV_DEBUG
     Serial.println("On Write received from BLE_Callback_Coms");
     #endif
-    
-    uint8_t *receivedPacket = pCharacteristic->getData();
+
+    if (length < 3) return;
 
     Props_t *receivedProps     = BLECC_getProps(receivedPacket);
     Command_t *receivedCommand = BLECC_getCommand(receivedPacket);
@@ -80,6 +137,27 @@ void BLE_Callback_Coms::onWrite(BLECharacteristic *pCharacteristic)
             break;
         }
     
+        /* Packet Pattern: [2 Props, 1 Command, 2 address, 2 size], response carries the main buffer from address, up to mtu - 3 bytes */
+        case COMMAND_READ: {
+            uint16_t address, size;
+            memcpy(&address, receivedPacket + 3, sizeof(address));
+            memcpy(&size, receivedPacket + 5, sizeof(size));
+
+            *responseCommand = COMMAND_READ;
+            if (size > mtu - 3 || address + size > sizeof(mainBuffer) / sizeof(mainBuffer[0])) {
+                *responseProps |= PROPS_FAIL;
+                strlcpy(reinterpret_cast<char *>(responsePacket + 3), "ERR: Out of bounds", mtu - 3);
+            }
+            else {
+                *responseProps |= PROPS_SUCCESS;
+                memcpy(responsePacket + 3, &mainBuffer[address], size);
+            }
+
+            pCharacteristic->setValue(responsePacket, mtu);
+            NOTIFY_IF_REQUESTED(*receivedProps);
+            break;
+        }
+
         case COMMAND_REC_BUFFER_SIZE: {
     
             *responseProps |= PROPS_SUCCESS;
@@ -143,8 +221,8 @@ void BLE_Callback_Coms::onWrite(BLECharacteristic *pCharacteristic)
 
             switch (*subCommand) {
                 case SUBCOMMAND_MTU_FULL_SEND: {
-                    const size_t tmpBufferSize = 512;
-                    uint8_t *tmpBuffer = new uint8_t[tmpBufferSize];
+                    const size_t tmpBufferSize = MAX_PACKET_SIZE;
+                    static uint8_t tmpBuffer[tmpBufferSize];
                     memset(tmpBuffer, 0xFF, tmpBufferSize);
 
                     Props_t *tmpProps = BLECC_getProps(tmpBuffer);
@@ -155,8 +233,37 @@ void BLE_Callback_Coms::onWrite(BLECharacteristic *pCharacteristic)
 
                     pCharacteristic->setValue(tmpBuffer, tmpBufferSize);
                     pCharacteristic->indicate();
-                    
-                    delete[] tmpBuffer;
+                    break;
+                }
+
+                /* Packet Pattern: [2 Props, 1 Command, 1 Subcommand], response carries the uint16 size */
+                case SUBCOMMAND_MTU_GET: {
+                    *responseProps |= PROPS_SUCCESS;
+                    *responseCommand = COMMAND_MTU_SETTING;
+                    memcpy(responsePacket + 3, &mtu, sizeof(mtu));
+
+                    pCharacteristic->setValue(responsePacket, mtu);
+                    NOTIFY_IF_REQUESTED(*receivedProps);
+                    break;
+                }
+
+                /* Packet Pattern: [2 Props, 1 Command, 1 Subcommand, 2 size], the usable size the client negotiated */
+                case SUBCOMMAND_MTU_SET: {
+                    uint16_t size;
+                    memcpy(&size, receivedPacket + 4, sizeof(size));
+                    bool success = size >= 20 && size <= MAX_PACKET_SIZE && resizeMTU(size);
+                    memset(responsePacket, 0, mtu);
+
+                    // the response packet was reallocated at the new size
+                    responseProps = BLECC_getProps(responsePacket);
+                    responseCommand = BLECC_getCommand(responsePacket);
+                    *responseProps = PROPS_SERVER_RESPONSE | (success ? PROPS_SUCCESS : PROPS_FAIL);
+                    *responseCommand = COMMAND_MTU_SETTING;
+                    memcpy(responsePacket + 3, &mtu, sizeof(mtu));
+
+                    pCharacteristic->setValue(responsePacket, mtu);
+                    NOTIFY_IF_REQUESTED(*receivedProps);
+                    break;
                 }
             }
 
@@ -170,6 +277,9 @@ void BLE_Callback_Coms::onWrite(BLECharacteristic *pCharacteristic)
             File f = SD.open(filename, "w+");
             f.close();
 
+            appendStart = appendLast = millis();
+            appendBytes = 0;
+
             DEFAULT_RESPONSE_FOR_SERVER_REQUEST_TO_RESPOND(*responseProps);
             if (*receivedProps & PROPS_REQUEST_FOR_NO_NOTIFY) pCharacteristic->notify();
 
@@ -190,8 +300,27 @@ void BLE_Callback_Coms::onWrite(BLECharacteristic *pCharacteristic)
             break;
         }
 
+        /* Packet Pattern: [2 Props, 1 Command], the file named in the small buffer. Response carries uint32 size, uint8 is directory */
         case COMMAND_FILE_INFO: {
-            assert(false /* Implement this */);
+            char filename[smallBufferSize + 1] = { 0 };
+            strncpy(filename, smallBuffer, smallBufferSize);
+
+            File f = SD.open(filename);
+            *responseCommand = COMMAND_FILE_INFO;
+            if (!f) {
+                *responseProps |= PROPS_FAIL;
+            }
+            else {
+                uint32_t size = f.isDirectory() ? 0 : f.size();
+                responsePacket[3 + sizeof(size)] = f.isDirectory();
+                memcpy(responsePacket + 3, &size, sizeof(size));
+                f.close();
+                *responseProps |= PROPS_SUCCESS;
+            }
+
+            pCharacteristic->setValue(responsePacket, mtu);
+            NOTIFY_IF_REQUESTED(*receivedProps);
+            break;
         }
 
         /* Packet Pattern: [2 Props, 1 Command, 2 size in bytes to write to file from main buffer] */
@@ -220,10 +349,12 @@ void BLE_Callback_Coms::onWrite(BLECharacteristic *pCharacteristic)
                 break;
             }
 
-            // create file and append
-            File f = SD.open(filename);
+            // append, the handle is only held for this packet
+            File f = SD.open(filename, FILE_APPEND);
             uint16_t bytesToWrite = bufferSizeRequestToWrite == 0 ? sizeof(mainBuffer) / sizeof(mainBuffer[0]) : bufferSizeRequestToWrite;
-            f.write(reinterpret_cast<uint8_t *>(mainBuffer), bytesToWrite);
+            appendBytes += f.write(reinterpret_cast<uint8_t *>(mainBuffer), bytesToWrite);
+            f.close();
+            appendLast = millis();
             
             DEFAULT_RESPONSE_FOR_SERVER_REQUEST_TO_RESPOND(*responseProps);
             if (*receivedProps & PROPS_REQUEST_FOR_NO_NOTIFY) pCharacteristic->notify();
@@ -240,6 +371,22 @@ const char * BLE_Callback_Coms::getReadBuffer()
     return mainBuffer;
 }
 
+uint32_t BLE_Callback_Coms::appendRate(uint32_t &bytes) const
+{
+    bytes = appendBytes;
+    if (!appendBytes) return 0;
+    return (uint64_t) appendBytes * 1000 / (appendLast - appendStart ? appendLast - appendStart : 1);
+}
+
+void BLE_Callback_Coms::stats(uint32_t &handled, uint32_t &dropped, uint32_t &callbackLast, uint32_t &callbackMax, uint32_t &callbackOver) const
+{
+    handled = this->handled;
+    dropped = packets.droppedCount() + this->dropped;
+    callbackLast = this->callbackLast;
+    callbackMax = this->callbackMax;
+    callbackOver = this->callbackOver;
+}
+
 bool BLE_Callback_Coms::resizeMTU(uint16_t size)
 {
     delete[] responsePacket;
@@ -2,15 +2,30 @@
 
 #include <BLEDevice.h>
 #include <FreeRTOS.h>
+#include "SPSCQueue.hpp"
 
 #define MAX_PACKET_SIZE 512
 
 #define BLECC_CHARACTERISTIC_UUID "f5db5ef9-c1d0-4d1b-8907-d3f2075872c5"
 
+#define BLECC_QUEUE_SLOTS       8               // commands waiting for the worker, a power of two
+#define BLECC_STACK_SIZE        4 * 1024
+#define BLECC_CALLBACK_BUDGET   200             // us onWrite may take before it counts as over
+
 #define BLECC_getProps(packet) reinterpret_cast<Props_t *>(packet)
 #define BLECC_getCommand(packet) packet + 2
 
 
+/**
+ * Command characteristic. onWrite runs in the Bluetooth stack's task, and a
+ * command can wait on the SD card, so the callback only copies the packet into
+ * a pre-allocated queue slot and returns; a worker task of its own runs the
+ * command and sets or notifies the response. The callback never waits: a
+ * command that finds the queue full, is longer than MAX_PACKET_SIZE or comes
+ * before begin() is dropped and counted, and gets no response. A client reading the response back rather than taking the
+ * notification should wait for it, since the write is acknowledged before the
+ * command runs.
+ */
 class BLE_Callback_Coms : public BLECharacteristicCallbacks
 {
 public:
@@ -68,7 +83,26 @@ private:
 
     uint8_t *responsePacket;
 
-    TaskHandle_t *task = nullptr;
+    typedef struct {
+        uint16_t length;
+        uint8_t data[MAX_PACKET_SIZE];
+    } Packet_t;
+
+    BLECharacteristic *characteristic = nullptr;
+    SPSCQueue<Packet_t, BLECC_QUEUE_SLOTS> packets;
+    TaskHandle_t task = nullptr;
+
+    // time spent in onWrite, us
+    uint32_t callbackLast = 0;
+    uint32_t callbackMax = 0;
+    uint32_t callbackOver = 0;          // calls over BLECC_CALLBACK_BUDGET
+    uint32_t handled = 0;
+    uint32_t dropped = 0;               // too long, or before the worker started; a full queue counts its own
+
+    // legacy upload throughput, from COMMAND_FILE_CREATE to the last COMMAND_FILE_APPEND
+    uint32_t appendStart = 0;       // ms
+    uint32_t appendLast = 0;        // ms
+    uint32_t appendBytes = 0;
 
 public:
 
@@ -76,14 +110,34 @@ public:
 
     ~BLE_Callback_Coms();
 
-    void onWrite(BLECharacteristic *pCharacteristic);
+    /**
+     * @brief Starts the worker task and takes the characteristic's writes
+     */
+    bool begin(BLECharacteristic *characteristic);
 
-    void registerTask(TaskHandle_t *task);
+    void onWrite(BLECharacteristic *pCharacteristic);
 
     const char * getReadBuffer();
 
+    /**
+     * @brief Throughput of the last upload through COMMAND_FILE_APPEND, for
+     *          comparing with the bulk upload characteristic
+     *
+     * @return uint32_t bytes per second, 0 before the first
+     */
+    uint32_t appendRate(uint32_t &bytes) const;
+
+    /**
+     * @brief Commands run and dropped, and the time onWrite took in us
+     */
+    void stats(uint32_t &handled, uint32_t &dropped, uint32_t &callbackLast, uint32_t &callbackMax, uint32_t &callbackOver) const;
+
 private:
 
+    static void WorkerTask(void *arg);
+
+    void handle(BLECharacteristic *pCharacteristic, uint8_t *receivedPacket, size_t length);
+
     bool resizeMTU(uint16_t size);
     
 };
@@ -0,0 +1,112 @@
+#include "BLE_Callback_Telemetry.h"
+#include <Arduino.h>
+#include "driver/miclone.hpp"
+#include "diagnostics/runrecorder.h"
+#include "program/ProgramScheduler.hpp"
+
+
+BLE_Callback_Telemetry::BLE_Callback_Telemetry()
+    : telemetry(sample, notify, this)
+{ }
+
+bool BLE_Callback_Telemetry::begin(BLECharacteristic *characteristic)
+{
+    this->characteristic = characteristic;
+    subscription = static_cast<BLE2902 *>(characteristic->getDescriptorByUUID(BLEUUID((uint16_t) 0x2902)));
+    characteristic->setCallbacks(this);
+    publishConfig();
+
+    return xTaskCreate(TelemetryTask,
+                       "ble_telemetry",
+                       BLETM_STACK_SIZE,
+                       this,
+                       1,
+                       &task) == pdPASS;
+}
+
+void BLE_Callback_Telemetry::publishConfig()
+{
+    Driver::BleTelemetryConfig_t config;
+    config.interval = telemetry.getInterval();
+    config.mtu = 0;
+    characteristic->setValue(reinterpret_cast<uint8_t *>(&config), sizeof(config));
+}
+
+void BLE_Callback_Telemetry::onWrite(BLECharacteristic *pCharacteristic)
+{
+    Driver::BleTelemetryConfig_t config;
+    if (!task || pCharacteristic->getLength() != sizeof(config)) return;
+
+    // applied by the task, which owns the batch
+    memcpy(&config, pCharacteristic->getData(), sizeof(config));
+    pending = config.interval | (uint32_t) config.mtu << 16;
+    xTaskNotifyGive(task);
+}
+
+bool BLE_Callback_Telemetry::subscribed() const
+{
+    // the descriptor keeps its value after a disconnect
+    return subscription && subscription->getNotifications() &&
+           characteristic->getService()->getServer()->getConnectedCount();
+}
+
+void BLE_Callback_Telemetry::sample(void *, Driver::BleTelemetryRecord_t &record)
+{
+    const Driver::MiClonePump_t &pump = Driver::miclone_pump(0);
+    record.state = Driver::miclone_state(0);
+    record.pumpStatus = Driver::miclone_last_status(0);
+    record.elapsed = Driver::miclone_elapsed(0);
+    record.remaining = Driver::miclone_remaining(0);
+    record.rate = record.state == Driver::MICLONE_IDLE ? 0 : pump.rate;
+
+    for (uint8_t i = 0; i < Driver::miclone_pump_count(); ++i) {
+        if (Driver::miclone_pump(i).lastResult != Driver::MICLONE_TIMEOUT) record.pumpLinks |= 1 << i;
+    }
+
+    // a program runs the pump untimed step by step, what is left is the program's
+    _ProgramScheduler::Progress progress = ProgramScheduler.getProgress();
+    if (progress.running) {
+        record.flags |= BLETELEMETRY_PROGRAM;
+        record.remaining = progress.totalRemaining * 1000;
+    }
+    else if (record.remaining == Driver::MICLONE_FOREVER) {
+        record.remaining = BLETELEMETRY_FOREVER;
+    }
+
+    Diagnostics::recorder_battery(record.batteryMillivolts, record.batterySOC);
+}
+
+void BLE_Callback_Telemetry::notify(void *arg, const uint8_t *data, size_t length)
+{
+    BLE_Callback_Telemetry *callbacks = static_cast<BLE_Callback_Telemetry *>(arg);
+    callbacks->characteristic->setValue(const_cast<uint8_t *>(data), length);
+    callbacks->characteristic->notify();
+
+    // a read gives the config rather than the last batch
+    callbacks->publishConfig();
+}
+
+void BLE_Callback_Telemetry::TelemetryTask(void *arg)
+{
+    BLE_Callback_Telemetry *callbacks = static_cast<BLE_Callback_Telemetry *>(arg);
+    uint32_t wait = 0;
+
+    while (true) {
+        ulTaskNotifyTake(pdTRUE, wait / portTICK_PERIOD_MS);
+
+        uint32_t config = callbacks->pending;
+        if (config) {
+            callbacks->pending = 0;
+            callbacks->telemetry.configure(config & 0xFFFF, config >> 16);
+            callbacks->publishConfig();
+        }
+
+        if (callbacks->subscribed()) {
+            wait = callbacks->telemetry.poll(millis());
+        }
+        else {
+            callbacks->telemetry.reset();
+            wait = BLETM_IDLE_INTERVAL;
+        }
+    }
+}
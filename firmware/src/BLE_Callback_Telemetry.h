@@ -0,0 +1,52 @@
+#pragma once
+
+#include <BLEDevice.h>
+#include <BLE2902.h>
+#include <FreeRTOS.h>
+#include "driver/bletelemetry.hpp"
+
+#define BLETM_CHARACTERISTIC_UUID "19458a03-bce2-4f58-9e93-9eb648f3ddbf"
+
+#define BLETM_STACK_SIZE    3 * 1024
+#define BLETM_IDLE_INTERVAL 1000                    // ms between checks while nobody is subscribed
+
+/**
+ * Telemetry characteristic (see driver/bletelemetry.hpp). The phone subscribes
+ * to the notifications and writes a BleTelemetryConfig_t to set the interval;
+ * reading gives back the one in use. A task of its own samples and notifies,
+ * and sleeps until the next sample in between, or until someone subscribes.
+ * The battery comes from the run recorder's last fuel gauge reading, so
+ * sampling never touches I2C.
+ */
+class BLE_Callback_Telemetry : public BLECharacteristicCallbacks
+{
+private:
+    BLECharacteristic *characteristic = nullptr;
+    BLE2902 *subscription = nullptr;
+    Driver::BleTelemetry telemetry;
+    TaskHandle_t task = nullptr;
+
+    // a config written by the phone, interval in the low half and MTU in the high, 0 for none
+    volatile uint32_t pending = 0;
+
+    static void sample(void *arg, Driver::BleTelemetryRecord_t &record);
+    static void notify(void *arg, const uint8_t *data, size_t length);
+    static void TelemetryTask(void *arg);
+
+    bool subscribed() const;
+    void publishConfig();
+
+public:
+
+    BLE_Callback_Telemetry();
+
+    /**
+     * @brief Starts the telemetry task. The characteristic needs its BLE2902
+     *          descriptor added first
+     */
+    bool begin(BLECharacteristic *characteristic);
+
+    void onWrite(BLECharacteristic *pCharacteristic);
+
+    const Driver::BleTelemetry &getTelemetry() const { return telemetry; }
+};
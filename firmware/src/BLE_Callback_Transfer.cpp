@@ -0,0 +1,62 @@
+#include "BLE_Callback_Transfer.h"
+#include <Arduino.h>
+#include "driver/usbfilestore.hpp"
+#include "driver/otaupdate.hpp"
+
+
+BLE_Callback_Transfer::BLE_Callback_Transfer()
+    : transfer(Driver::usbfilestore_files(Driver::USBFILESTORE_BLE), notify, this)
+{ }
+
+bool BLE_Callback_Transfer::begin(BLECharacteristic *characteristic)
+{
+    this->characteristic = characteristic;
+    characteristic->setCallbacks(this);
+    transfer.setFirmware(&Driver::otaupdate_firmware());
+
+    return xTaskCreate(WorkerTask,
+                       "ble_transfer",
+                       BLETC_STACK_SIZE,
+                       this,
+                       1,
+                       &task) == pdPASS;
+}
+
+void BLE_Callback_Transfer::notify(void *arg, const uint8_t *data, size_t length)
+{
+    BLE_Callback_Transfer *callbacks = static_cast<BLE_Callback_Transfer *>(arg);
+    callbacks->characteristic->setValue(const_cast<uint8_t *>(data), length);
+    callbacks->characteristic->notify();
+}
+
+void BLE_Callback_Transfer::onWrite(BLECharacteristic *pCharacteristic)
+{
+    Packet_t packet;
+    size_t length = pCharacteristic->getLength();
+    if (!task || !length || length > sizeof(packet.data)) return;
+
+    packet.length = length;
+    memcpy(packet.data, pCharacteristic->getData(), length);
+    if (packets.push(packet)) xTaskNotifyGive(task);
+}
+
+void BLE_Callback_Transfer::WorkerTask(void *arg)
+{
+    BLE_Callback_Transfer *callbacks = static_cast<BLE_Callback_Transfer *>(arg);
+    static Packet_t packet;
+
+    while (true) {
+        ulTaskNotifyTake(pdTRUE, BLETC_POLL_INTERVAL / portTICK_PERIOD_MS);
+
+        while (callbacks->packets.pop(packet)) {
+            callbacks->transfer.receive(packet.data, packet.length, millis());
+        }
+        callbacks->transfer.poll(millis());
+
+        // into the new firmware, or the factory firmware to take it
+        if (Driver::otaupdate_restart_pending()) {
+            delay(OTAUPDATE_RESTART_DELAY);
+            ESP.restart();
+        }
+    }
+}
@@ -0,0 +1,55 @@
+#pragma once
+
+#include <BLEDevice.h>
+#include <FreeRTOS.h>
+#include "SPSCQueue.hpp"
+#include "driver/bletransfer.hpp"
+
+#define BLETC_CHARACTERISTIC_UUID "693f1cf3-c3e2-4ba9-8077-3bf199e70cdc"
+
+#define BLETC_QUEUE_SLOTS   BLETRANSFER_WINDOW      // a whole window fits, a power of two
+#define BLETC_STACK_SIZE    4 * 1024
+#define BLETC_POLL_INTERVAL 1000                    // ms between idle checks while nothing arrives
+
+/**
+ * Bulk transfer characteristic, written without response by the phone and
+ * notifying acks, download chunks and listings back (see driver/bletransfer.hpp).
+ * Firmware images go through driver/otaupdate.hpp, and the device restarts
+ * once one is in. onWrite runs in the Bluetooth stack's task, so it only copies
+ * the packet into a queue slot; a worker task of its own reads and writes the
+ * file and sends the notifications, a download window at a time as the acks come
+ * in. A packet that finds the queue full is dropped and shows up to the phone
+ * as a gap.
+ */
+class BLE_Callback_Transfer : public BLECharacteristicCallbacks
+{
+private:
+    typedef struct {
+        uint16_t length;
+        uint8_t data[BLETRANSFER_MAX_PACKET];
+    } Packet_t;
+
+    BLECharacteristic *characteristic = nullptr;
+    Driver::BleTransfer transfer;
+    SPSCQueue<Packet_t, BLETC_QUEUE_SLOTS> packets;
+    TaskHandle_t task = nullptr;
+
+    static void notify(void *arg, const uint8_t *data, size_t length);
+    static void WorkerTask(void *arg);
+
+public:
+
+    BLE_Callback_Transfer();
+
+    /**
+     * @brief Starts the worker task. SD and SPIFFS must already be mounted and
+     *          usbfilestore_begin() called
+     */
+    bool begin(BLECharacteristic *characteristic);
+
+    void onWrite(BLECharacteristic *pCharacteristic);
+
+    const Driver::BleTransfer &getTransfer() const { return transfer; }
+
+    uint32_t droppedPackets() const { return packets.droppedCount(); }
+};
@@ -0,0 +1,189 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include "Tokenizer.hpp"
+
+/**
+ * Table driven command dispatch. Each command is one row naming its handler
+ * and its arguments; the dispatcher parses and range checks the arguments
+ * before the handler runs. Names are found through a perfect hash: the seed is
+ * searched for at compile time (command_find_seed) so that every name in the
+ * table lands in its own slot, and a lookup is one hash and one compare
+ * however many commands there are
+ */
+
+#define COMMAND_MAX_ARGS        3
+#define COMMAND_NO_SEED         UINT32_MAX
+#define COMMAND_SEED_SEARCH     256         // seeds tried before giving up, make the table bigger if none fit
+
+// argument declarations for a command row
+#define COMMAND_INT(min, max)       { COMMAND_ARG_INT,  false, (min), (max) }
+#define COMMAND_INT_OPT(min, max)   { COMMAND_ARG_INT,  true,  (min), (max) }
+#define COMMAND_WORD                { COMMAND_ARG_WORD, false, 0, 0 }
+#define COMMAND_WORD_OPT            { COMMAND_ARG_WORD, true,  0, 0 }
+#define COMMAND_REST                { COMMAND_ARG_REST, false, 0, 0 }
+#define COMMAND_REST_OPT            { COMMAND_ARG_REST, true,  0, 0 }
+
+enum CommandArgType : uint8_t {
+    COMMAND_ARG_NONE = 0,
+    COMMAND_ARG_INT,            // decimal integer within [min, max]
+    COMMAND_ARG_WORD,           // one word
+    COMMAND_ARG_REST            // the rest of the line, must be last
+};
+
+struct CommandArg {
+    CommandArgType type;
+    bool optional;              // may be left out, only followed by optional arguments
+    int32_t min;
+    int32_t max;
+};
+
+/**
+ * @brief A parsed argument. present is false for a left out optional argument
+ */
+struct CommandValue {
+    bool present;
+    int32_t number;             // COMMAND_ARG_INT only
+    Token token;
+};
+
+typedef void (*CommandHandler)(const CommandValue *args);
+
+struct Command {
+    const char *name;
+    CommandHandler handler;
+    const char *usage;
+    CommandArg args[COMMAND_MAX_ARGS];
+};
+
+enum CommandResult : uint8_t {
+    COMMAND_OK = 0,
+    COMMAND_UNKNOWN,            // no command by that name
+    COMMAND_MISSING_ARG,        // a required argument was left out
+    COMMAND_BAD_ARG,            // an argument is not a number or is out of range
+    COMMAND_EXTRA_ARGS          // words left over after the last argument
+};
+
+/* compile-time perfect hash search */
+
+// FNV-1a, with the seed folded into the offset basis
+constexpr uint32_t command_hash(const char *str, size_t length, uint32_t hash)
+{
+    return length ? command_hash(str + 1, length - 1, (hash ^ (uint8_t) *str) * 16777619u) : hash;
+}
+
+constexpr size_t command_strlen(const char *str)
+{
+    return *str ? 1 + command_strlen(str + 1) : 0;
+}
+
+constexpr uint32_t command_slot(const char *name, size_t length, uint32_t seed, uint8_t bits)
+{
+    return command_hash(name, length, 2166136261u ^ seed) & ((1u << bits) - 1);
+}
+
+constexpr uint32_t command_slot(const char *name, uint32_t seed, uint8_t bits)
+{
+    return command_slot(name, command_strlen(name), seed, bits);
+}
+
+// rows before i all hash to a different slot than row i
+template <size_t N>
+constexpr bool command_slot_unique(const Command (&table)[N], uint32_t seed, uint8_t bits, size_t i, size_t j)
+{
+    return j >= i || (command_slot(table[j].name, seed, bits) != command_slot(table[i].name, seed, bits) &&
+                      command_slot_unique(table, seed, bits, i, j + 1));
+}
+
+template <size_t N>
+constexpr bool command_seed_perfect(const Command (&table)[N], uint32_t seed, uint8_t bits, size_t i=0)
+{
+    return i >= N || (command_slot_unique(table, seed, bits, i, 0) && command_seed_perfect(table, seed, bits, i + 1));
+}
+
+/**
+ * @brief The first seed that gives every name in the table its own slot.
+ *          Evaluate in a constexpr and static_assert it is not COMMAND_NO_SEED
+ *
+ * @param bits the hash table has 1 << bits slots
+ */
+template <size_t N>
+constexpr uint32_t command_find_seed(const Command (&table)[N], uint8_t bits, uint32_t seed=0)
+{
+    return seed >= COMMAND_SEED_SEARCH     ? COMMAND_NO_SEED :
+           command_seed_perfect(table, seed, bits) ? seed :
+           command_find_seed(table, bits, seed + 1);
+}
+
+/**
+ * @brief Looks up and runs the commands of one table
+ *
+ * @tparam N number of rows
+ * @tparam Bits the hash table has 1 << Bits slots
+ */
+template <size_t N, uint8_t Bits>
+class CommandDispatcher
+{
+    static_assert(N < 0xFF && N <= (1u << Bits), "Too many commands for the hash table");
+
+private:
+    static const uint8_t EMPTY = 0xFF;
+
+    const Command *table;
+    uint32_t seed;
+    uint8_t slots[1u << Bits];      // row index of the name hashing to each slot
+
+public:
+    /**
+     * @param seed from command_find_seed(table, Bits)
+     */
+    CommandDispatcher(const Command (&table)[N], uint32_t seed) : table(table), seed(seed)
+    {
+        memset(slots, EMPTY, sizeof(slots));
+        for (size_t i = 0; i < N; ++i) slots[command_slot(table[i].name, seed, Bits)] = i;
+    }
+
+    const Command *find(const Token &name) const
+    {
+        uint8_t index = slots[command_slot(name.data, name.length, seed, Bits)];
+        if (index == EMPTY || !name.equals(table[index].name)) return nullptr;
+        return &table[index];
+    }
+
+    /**
+     * @brief Reads a command name and its arguments and runs the command
+     *
+     * @param command set to the row found, for printing its usage on an error
+     * @param arg set to the index of the argument that failed
+     */
+    CommandResult dispatch(Tokenizer &tokens, const Command *&command, uint8_t &arg) const
+    {
+        arg = 0;
+        command = find(tokens.next());
+        if (!command) return COMMAND_UNKNOWN;
+
+        CommandValue values[COMMAND_MAX_ARGS] = {};
+        for (arg = 0; arg < COMMAND_MAX_ARGS && command->args[arg].type != COMMAND_ARG_NONE; ++arg) {
+            const CommandArg &spec = command->args[arg];
+            CommandValue &value = values[arg];
+
+            value.token = spec.type == COMMAND_ARG_REST ? tokens.rest() : tokens.next();
+            if (value.token.empty()) {
+                if (spec.optional) continue;
+                return COMMAND_MISSING_ARG;
+            }
+
+            if (spec.type == COMMAND_ARG_INT &&
+                (!value.token.toInt(value.number) || value.number < spec.min || value.number > spec.max)) {
+                return COMMAND_BAD_ARG;
+            }
+            value.present = true;
+        }
+
+        if (!tokens.done()) return COMMAND_EXTRA_ARGS;
+
+        command->handler(values);
+        return COMMAND_OK;
+    }
+};
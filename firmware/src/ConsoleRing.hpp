@@ -0,0 +1,98 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+enum ConsoleDropPolicy_t : uint8_t {
+    CONSOLE_DROP_OLDEST = 0,    // make room by discarding the oldest whole lines
+    CONSOLE_DROP_NEWEST         // refuse text that does not fit
+};
+
+/**
+ * @brief Byte ring for console text that never waits for the reader. When a
+ *          write does not fit, either the oldest lines are discarded to make
+ *          room or the new text is refused, and the discarded bytes are
+ *          counted. Not thread-safe: the caller serializes writers and the reader
+ *
+ * @tparam N capacity in bytes. Must be a power of two
+ */
+template <size_t N>
+class ConsoleRing
+{
+    static_assert(N && (N & (N - 1)) == 0, "ConsoleRing capacity must be a power of two");
+
+private:
+    uint8_t buffer[N];
+    uint32_t head;              // free running, masked into the buffer
+    uint32_t tail;
+    ConsoleDropPolicy_t policy;
+    uint32_t dropped;           // bytes discarded or refused
+    size_t highWater;           // most bytes ever held
+
+public:
+    explicit ConsoleRing(ConsoleDropPolicy_t policy=CONSOLE_DROP_OLDEST)
+        : head(0), tail(0), policy(policy), dropped(0), highWater(0) { }
+
+    /**
+     * @brief Copies text in, dropping by the policy when it does not fit
+     *
+     * @return bytes of the text that were kept
+     */
+    size_t write(const uint8_t *data, size_t length)
+    {
+        if (!length) return 0;
+
+        if (length > N || (policy == CONSOLE_DROP_NEWEST && size() + length > N)) {
+            if (policy == CONSOLE_DROP_NEWEST) {
+                dropped += length;
+                return 0;
+            }
+            // only the end of text longer than the whole ring can be kept
+            dropped += length - N;
+            data += length - N;
+            length = N;
+        }
+
+        if (size() + length > N) {
+            // the cut continues to the end of the line it lands in, so the reader
+            // never starts in the middle of one
+            uint32_t cut = tail + size() + length - N;
+            while (cut != head && buffer[(cut - 1) & (N - 1)] != '\n') ++cut;
+            dropped += cut - tail;
+            tail = cut;
+        }
+
+        size_t index = head & (N - 1);
+        size_t first = length < N - index ? length : N - index;
+        memcpy(buffer + index, data, first);
+        memcpy(buffer, data + first, length - first);
+        head += length;
+
+        if (size() > highWater) highWater = size();
+        return length;
+    }
+
+    /**
+     * @brief Copies out and removes up to length of the oldest bytes
+     */
+    size_t read(uint8_t *data, size_t length)
+    {
+        if (length > size()) length = size();
+
+        size_t index = tail & (N - 1);
+        size_t first = length < N - index ? length : N - index;
+        memcpy(data, buffer + index, first);
+        memcpy(data + first, buffer, length - first);
+        tail += length;
+        return length;
+    }
+
+    size_t size() const { return head - tail; }
+
+    constexpr size_t capacity() const { return N; }
+
+    uint32_t droppedBytes() const { return dropped; }
+
+    size_t highWaterMark() const { return highWater; }
+};
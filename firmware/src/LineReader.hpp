@@ -0,0 +1,87 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * @brief Assembles lines from a byte stream in a fixed buffer, one byte at a
+ *          time, so a reader can dispatch each line the moment its terminator
+ *          arrives. CR, LF and CRLF all end a line; the LF of a CRLF does not
+ *          produce a second, empty line. Empty lines are skipped. A line longer
+ *          than the buffer is discarded up to its terminator and reported once
+ *
+ * @tparam N buffer size, including the null terminator
+ */
+template <size_t N>
+class LineReader
+{
+    static_assert(N >= 2, "LineReader needs room for at least one character");
+
+public:
+    enum Result : uint8_t {
+        LINE_NONE = 0,      // no complete line yet
+        LINE_READY,         // line() holds a complete line until the next feed()
+        LINE_OVERFLOW       // a line did not fit and was discarded
+    };
+
+private:
+    char buffer[N];
+    size_t length;
+    bool discarding;        // the current line overflowed, waiting for its terminator
+    bool afterCR;           // the last byte was a CR, so an LF completes a CRLF
+    uint32_t overflows;
+
+public:
+    LineReader() : length(0), discarding(false), afterCR(false), overflows(0) { buffer[0] = '\0'; }
+
+    /**
+     * @brief Adds a byte to the line being assembled
+     */
+    Result feed(char c)
+    {
+        bool lf = c == '\n';
+        bool terminator = lf || c == '\r';
+
+        if (lf && afterCR) {
+            afterCR = false;
+            return LINE_NONE;
+        }
+        afterCR = c == '\r';
+
+        if (!terminator) {
+            if (length < N - 1) buffer[length++] = c;
+            else discarding = true;
+            return LINE_NONE;
+        }
+
+        buffer[length] = '\0';
+        bool overflowed = discarding;
+        bool empty = length == 0;
+        discarding = false;
+        length = 0;
+
+        if (overflowed) {
+            ++overflows;
+            return LINE_OVERFLOW;
+        }
+        return empty ? LINE_NONE : LINE_READY;
+    }
+
+    /**
+     * @brief The last complete line, without its terminator
+     */
+    const char *line() const { return buffer; }
+
+    /**
+     * @brief Discards a partly assembled line
+     */
+    void reset()
+    {
+        length = 0;
+        discarding = false;
+        afterCR = false;
+        buffer[0] = '\0';
+    }
+
+    uint32_t overflowCount() const { return overflows; }
+};
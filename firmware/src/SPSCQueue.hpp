@@ -0,0 +1,133 @@
+#pragma once
+
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * @brief Lock-free single-producer/single-consumer ring buffer. One task (or ISR)
+ *          may push and one task may pop without taking any lock. Items are copied
+ *          in and out, so T should be a small trivially copyable type
+ * 
+ * @tparam T item type
+ * @tparam N capacity. Must be a power of two
+ */
+template <typename T, size_t N>
+class SPSCQueue
+{
+    static_assert(N && (N & (N - 1)) == 0, "SPSCQueue capacity must be a power of two");
+
+private:
+    T buffer[N];
+
+    std::atomic<uint32_t> head;         // next slot to write, owned by the producer
+    std::atomic<uint32_t> tail;         // next slot to read, owned by the consumer
+    std::atomic<uint32_t> dropped;      // items rejected because the queue was full
+    std::atomic<uint32_t> highWater;    // largest number of items ever queued
+
+public:
+    SPSCQueue() : head(0), tail(0), dropped(0), highWater(0) { }
+
+    /**
+     * @brief Copies an item into the queue. Producer side only
+     * 
+     * @return false the queue is full and the item was dropped
+     */
+    bool push(const T &item)
+    {
+        const uint32_t h = head.load(std::memory_order_relaxed);
+        const uint32_t used = h - tail.load(std::memory_order_acquire);
+
+        if (used >= N) {
+            dropped.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+
+        buffer[h & (N - 1)] = item;
+        head.store(h + 1, std::memory_order_release);
+
+        if (used + 1 > highWater.load(std::memory_order_relaxed)) {
+            highWater.store(used + 1, std::memory_order_relaxed);
+        }
+        return true;
+    }
+
+    /**
+     * @brief The slot the next push would fill, for the producer to fill in
+     *          place instead of copying an item in. Producer side only
+     *
+     * @return T* nullptr and counted as dropped when the queue is full
+     */
+    T *reserve()
+    {
+        const uint32_t h = head.load(std::memory_order_relaxed);
+
+        if (h - tail.load(std::memory_order_acquire) >= N) {
+            dropped.fetch_add(1, std::memory_order_relaxed);
+            return nullptr;
+        }
+        return &buffer[h & (N - 1)];
+    }
+
+    /**
+     * @brief Queues the slot reserve() returned. Producer side only
+     */
+    void commit()
+    {
+        const uint32_t h = head.load(std::memory_order_relaxed);
+        const uint32_t used = h + 1 - tail.load(std::memory_order_acquire);
+        head.store(h + 1, std::memory_order_release);
+
+        if (used > highWater.load(std::memory_order_relaxed)) {
+            highWater.store(used, std::memory_order_relaxed);
+        }
+    }
+
+    /**
+     * @brief Copies the oldest item out of the queue. Consumer side only
+     * 
+     * @return false the queue is empty
+     */
+    bool pop(T &item)
+    {
+        const uint32_t t = tail.load(std::memory_order_relaxed);
+
+        if (t == head.load(std::memory_order_acquire)) return false;
+
+        item = buffer[t & (N - 1)];
+        tail.store(t + 1, std::memory_order_release);
+        return true;
+    }
+
+    /**
+     * @brief The oldest item, left in its slot until release(). Consumer side only
+     *
+     * @return T* nullptr when the queue is empty
+     */
+    T *front()
+    {
+        const uint32_t t = tail.load(std::memory_order_relaxed);
+
+        if (t == head.load(std::memory_order_acquire)) return nullptr;
+        return &buffer[t & (N - 1)];
+    }
+
+    /**
+     * @brief Frees the slot front() returned. Consumer side only
+     */
+    void release()
+    {
+        tail.store(tail.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+
+    size_t size() const
+    {
+        return head.load(std::memory_order_acquire) - tail.load(std::memory_order_acquire);
+    }
+
+    constexpr size_t capacity() const { return N; }
+
+    uint32_t droppedCount() const { return dropped.load(std::memory_order_relaxed); }
+
+    uint32_t highWaterMark() const { return highWater.load(std::memory_order_relaxed); }
+};
@@ -0,0 +1,119 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+/**
+ * @brief A word in a line, pointing into the line rather than copying it.
+ *          Only valid while the line it points into is unchanged
+ */
+struct Token
+{
+    const char *data;
+    size_t length;
+
+    Token() : data(nullptr), length(0) { }
+    Token(const char *data, size_t length) : data(data), length(length) { }
+
+    bool empty() const { return length == 0; }
+
+    bool equals(const char *str) const
+    {
+        return strlen(str) == length && !memcmp(data, str, length);
+    }
+
+    /**
+     * @brief Parses the whole token as a decimal integer with an optional sign
+     *
+     * @return false The token is not a number or does not fit
+     */
+    bool toInt(int32_t &value) const
+    {
+        size_t i = 0;
+        bool negative = false;
+        if (length && (data[0] == '-' || data[0] == '+')) {
+            negative = data[0] == '-';
+            i = 1;
+        }
+        if (i == length) return false;
+
+        int64_t result = 0;
+        for (; i < length; ++i) {
+            if (data[i] < '0' || data[i] > '9') return false;
+            result = result * 10 + (data[i] - '0');
+            if (result > (int64_t) INT32_MAX + 1) return false;
+        }
+
+        if (negative) result = -result;
+        if (result > INT32_MAX || result < INT32_MIN) return false;
+
+        value = (int32_t) result;
+        return true;
+    }
+
+    /**
+     * @brief Copies the token into a null terminated buffer
+     *
+     * @return false The token does not fit and nothing was copied
+     */
+    bool copy(char *buffer, size_t size) const
+    {
+        if (length >= size) return false;
+        memcpy(buffer, data, length);
+        buffer[length] = '\0';
+        return true;
+    }
+};
+
+/**
+ * @brief Splits a line into space separated words without allocating or
+ *          modifying the line. CR and LF are treated as spaces
+ */
+class Tokenizer
+{
+private:
+    const char *cursor;
+    const char *end;
+
+    static bool isSeparator(char c) { return c == ' ' || c == '\r' || c == '\n'; }
+
+    void skipSeparators()
+    {
+        while (cursor < end && isSeparator(*cursor)) ++cursor;
+    }
+
+public:
+    Tokenizer(const char *line, size_t length) : cursor(line), end(line + length) { }
+    explicit Tokenizer(const char *line) : cursor(line), end(line + strlen(line)) { }
+    explicit Tokenizer(const Token &token) : cursor(token.data), end(token.data + token.length) { }
+
+    /**
+     * @brief The next word, empty at the end of the line
+     */
+    Token next()
+    {
+        skipSeparators();
+        const char *start = cursor;
+        while (cursor < end && !isSeparator(*cursor)) ++cursor;
+        return Token(start, cursor - start);
+    }
+
+    /**
+     * @brief Everything after the next separators, for free text such as JSON.
+     *          It runs to the end of the line, so it is null terminated when the line is
+     */
+    Token rest()
+    {
+        skipSeparators();
+        Token token(cursor, end - cursor);
+        cursor = end;
+        return token;
+    }
+
+    bool done()
+    {
+        skipSeparators();
+        return cursor == end;
+    }
+};
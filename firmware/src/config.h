@@ -22,6 +22,8 @@
 
 // #define DEV_DEBUG
 
+// #define TRACE_HEAP   // records the heap in /trace.bin every TRACE_HEAP_INTERVAL
+
 #define SAFE_CODE    // enabling this will compile runtime checking code
                         // at expense of potential runtime performance
 
@@ -0,0 +1,176 @@
+#include "latency.h"
+
+#include <Arduino.h>
+#include <FreeRTOS.h>
+#include <esp_timer.h>
+#include <string.h>
+
+namespace Diagnostics
+{
+    static const char *LATENCY_STAGE_NAMES[LATENCY_NUM_STAGES] = {
+        "queue",
+        "dispatch",
+        "draw submit",
+        "draw complete",
+        "total"
+    };
+
+    struct LatencyHistogram {
+        uint32_t buckets[DIAGNOSTICS_LATENCY_BUCKETS];
+        uint32_t count;
+        uint32_t max;       // us
+    };
+
+    // recorded from the touch task, read and reset from the console
+    static LatencyHistogram histograms[LATENCY_NUM_STAGES];
+    static portMUX_TYPE _latencyLock = portMUX_INITIALIZER_UNLOCKED;
+
+    // the touch currently being dispatched
+    static struct {
+        TaskHandle_t task;
+        int64_t detected;
+        int64_t dequeued;
+        int64_t dispatched;
+        int64_t drawSubmitted;
+        int64_t drawCompleted;
+    } current;
+
+    static uint16_t latency_bucket(uint32_t us)
+    {
+        uint32_t ms = us / 1000;
+        if (ms < DIAGNOSTICS_LATENCY_FINE_BUCKETS) return ms;
+
+        uint32_t coarse = (ms - DIAGNOSTICS_LATENCY_FINE_BUCKETS) / 10;
+        if (coarse < DIAGNOSTICS_LATENCY_COARSE_BUCKETS) return DIAGNOSTICS_LATENCY_FINE_BUCKETS + coarse;
+
+        return DIAGNOSTICS_LATENCY_BUCKETS - 1;
+    }
+
+    // upper bound of a bucket in us
+    static uint32_t latency_bucket_limit(uint16_t bucket)
+    {
+        if (bucket < DIAGNOSTICS_LATENCY_FINE_BUCKETS) return (bucket + 1) * 1000;
+        return (DIAGNOSTICS_LATENCY_FINE_BUCKETS + (bucket - DIAGNOSTICS_LATENCY_FINE_BUCKETS + 1) * 10) * 1000;
+    }
+
+    static void latency_record(LatencyStage stage, int64_t from, int64_t to)
+    {
+        if (!from || to < from) return;
+
+        uint32_t us = to - from;
+        uint16_t bucket = latency_bucket(us);
+        LatencyHistogram &histogram = histograms[stage];
+
+        portENTER_CRITICAL(&_latencyLock);
+        ++histogram.buckets[bucket];
+        ++histogram.count;
+        if (us > histogram.max) histogram.max = us;
+        portEXIT_CRITICAL(&_latencyLock);
+    }
+
+    // a copy of one stage, so the buckets and count agree with each other
+    static void latency_snapshot(LatencyStage stage, LatencyHistogram &histogram)
+    {
+        portENTER_CRITICAL(&_latencyLock);
+        histogram = histograms[stage];
+        portEXIT_CRITICAL(&_latencyLock);
+    }
+
+    static bool latency_active()
+    {
+        return current.task && current.task == xTaskGetCurrentTaskHandle();
+    }
+
+    void latency_touch_begin(int64_t detected)
+    {
+        memset(&current, 0, sizeof(current));
+        current.task = xTaskGetCurrentTaskHandle();
+        current.detected = detected;
+        current.dequeued = esp_timer_get_time();
+    }
+
+    void latency_mark_dispatch()
+    {
+        if (latency_active() && !current.dispatched) current.dispatched = esp_timer_get_time();
+    }
+
+    void latency_mark_draw_submit()
+    {
+        if (latency_active() && current.dispatched && !current.drawSubmitted) current.drawSubmitted = esp_timer_get_time();
+    }
+
+    void latency_mark_draw_complete()
+    {
+        if (latency_active() && current.drawSubmitted) current.drawCompleted = esp_timer_get_time();
+    }
+
+    void latency_touch_end()
+    {
+        if (!latency_active()) return;
+
+        latency_record(LATENCY_QUEUE, current.detected, current.dequeued);
+
+        if (current.dispatched) {
+            latency_record(LATENCY_DISPATCH, current.detected, current.dispatched);
+            latency_record(LATENCY_DRAW_SUBMIT, current.dispatched, current.drawSubmitted);
+            latency_record(LATENCY_DRAW_COMPLETE, current.drawSubmitted, current.drawCompleted);
+            latency_record(LATENCY_TOTAL, current.detected, current.drawCompleted);
+        }
+
+        current.task = nullptr;
+    }
+
+    static uint32_t latency_percentile(const LatencyHistogram &histogram, float percentile)
+    {
+        if (!histogram.count) return 0;
+
+        // rank of the sample at the requested percentile, rounded up
+        uint32_t rank = (uint32_t)(percentile / 100.0f * histogram.count + 0.999f);
+        if (rank < 1) rank = 1;
+
+        uint32_t seen = 0;
+        for (uint16_t i = 0; i < DIAGNOSTICS_LATENCY_BUCKETS; ++i) {
+            seen += histogram.buckets[i];
+            if (seen >= rank) {
+                // the overflow bucket has no upper bound, report the maximum instead
+                return i == DIAGNOSTICS_LATENCY_BUCKETS - 1 ? histogram.max : min(latency_bucket_limit(i), histogram.max);
+            }
+        }
+
+        return histogram.max;
+    }
+
+    uint32_t latency_percentile(LatencyStage stage, float percentile)
+    {
+        portENTER_CRITICAL(&_latencyLock);
+        uint32_t us = latency_percentile(histograms[stage], percentile);
+        portEXIT_CRITICAL(&_latencyLock);
+        return us;
+    }
+
+    void latency_report(Stream &stream)
+    {
+        stream.println("-> Touch latency (ms)");
+        stream.printf("   %-14s %7s %7s %7s %7s %7s\n", "stage", "count", "p50", "p95", "p99", "max");
+
+        // kept off the console task's stack
+        static LatencyHistogram histogram;
+        for (uint8_t i = 0; i < LATENCY_NUM_STAGES; ++i) {
+            latency_snapshot(static_cast<LatencyStage>(i), histogram);
+            stream.printf("   %-14s %7u %7.1f %7.1f %7.1f %7.1f\n",
+                          LATENCY_STAGE_NAMES[i],
+                          histogram.count,
+                          latency_percentile(histogram, 50) / 1000.0f,
+                          latency_percentile(histogram, 95) / 1000.0f,
+                          latency_percentile(histogram, 99) / 1000.0f,
+                          histogram.max / 1000.0f);
+        }
+    }
+
+    void latency_reset()
+    {
+        portENTER_CRITICAL(&_latencyLock);
+        memset(histograms, 0, sizeof(histograms));
+        portEXIT_CRITICAL(&_latencyLock);
+    }
+}
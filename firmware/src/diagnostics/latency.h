@@ -0,0 +1,73 @@
+#pragma once
+
+#include <Arduino.h>
+#include <Stream.h>
+#include <stdint.h>
+
+// Histogram layout: 1ms buckets below 100ms, 10ms buckets up to 1s, then one overflow bucket
+#define DIAGNOSTICS_LATENCY_FINE_BUCKETS    100
+#define DIAGNOSTICS_LATENCY_COARSE_BUCKETS   90
+#define DIAGNOSTICS_LATENCY_BUCKETS         (DIAGNOSTICS_LATENCY_FINE_BUCKETS + DIAGNOSTICS_LATENCY_COARSE_BUCKETS + 1)
+
+/**
+ * Touch-to-display latency instrumentation. A touch is timestamped when the
+ * driver samples it, when it is dequeued by the UI task, when a widget handler
+ * runs (Button::performAction), when the first draw call is submitted and when
+ * the last draw call returns from the SPI transfer (TFT_eSPI calls are blocking,
+ * so returning means the pixels were sent). All marks are made from the UI task.
+ */
+namespace Diagnostics
+{
+    enum LatencyStage : uint8_t {
+        LATENCY_QUEUE = 0,          // detection -> dequeued by the UI task
+        LATENCY_DISPATCH,           // detection -> widget handler
+        LATENCY_DRAW_SUBMIT,        // widget handler -> first draw call
+        LATENCY_DRAW_COMPLETE,      // first draw call -> last draw call finished
+        LATENCY_TOTAL,              // detection -> last draw call finished
+        LATENCY_NUM_STAGES
+    };
+
+    /**
+     * @brief Starts tracking a touch event. Call from the UI task before the
+     *          event handler runs
+     * 
+     * @param detected esp_timer_get_time() when the touch was sampled
+     */
+    void latency_touch_begin(int64_t detected);
+
+    /**
+     * @brief Marks that a widget handler is running for the current touch
+     */
+    void latency_mark_dispatch();
+
+    /**
+     * @brief Marks a draw call being submitted for the current touch
+     */
+    void latency_mark_draw_submit();
+
+    /**
+     * @brief Marks a draw call finishing for the current touch
+     */
+    void latency_mark_draw_complete();
+
+    /**
+     * @brief Finishes tracking the current touch and records its latencies.
+     *          Touches that never reached a widget only record LATENCY_QUEUE
+     */
+    void latency_touch_end();
+
+    /**
+     * @brief Latency percentile of a stage in us. Resolution is 1ms below
+     *          100ms and 10ms above
+     * 
+     * @param percentile 0 to 100
+     */
+    uint32_t latency_percentile(LatencyStage stage, float percentile);
+
+    /**
+     * @brief Prints sample count and p50/p95/p99/max for each stage
+     */
+    void latency_report(Stream &stream = Serial);
+
+    void latency_reset();
+}
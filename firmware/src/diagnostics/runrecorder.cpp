@@ -0,0 +1,268 @@
+#include "runrecorder.h"
+
+#include <Arduino.h>
+#include <FreeRTOS.h>
+#include <esp_timer.h>
+#include "../driver/lipo.h"
+#include "../driver/miclone.hpp"
+
+namespace Diagnostics
+{
+    static fs::FS *_recorderFS = nullptr;
+    static TaskHandle_t _recorderTask = nullptr;
+    static portMUX_TYPE _recorderLock = portMUX_INITIALIZER_UNLOCKED;
+
+    // RAM ring, filled by any task and drained by the recorder task
+    static RunRecord_t _recorderRing[RECORDER_RING_RECORDS];
+    static uint16_t _recorderHead = 0;
+    static uint16_t _recorderTail = 0;
+    static uint32_t _recorderDropped = 0;
+
+    // state of the run being recorded
+    static bool _recorderRunning = false;
+    static uint32_t _recorderRunStart = 0;
+    static uint16_t _recorderRate = 0;
+
+    // cached by the recorder task so logging never waits on I2C
+    static volatile uint16_t _recorderBatteryMillivolts = 0;
+    static volatile uint8_t _recorderBatterySOC = 0;
+
+    // owned by the recorder task
+    static File _recorderFile;
+    static uint32_t _recorderRunIndex = 0;
+    static uint8_t _recorderSector[RECORDER_SECTOR_SIZE];
+    static size_t _recorderSectorLength = 0;
+    static uint32_t _recorderWritten = 0;
+    static uint32_t _recorderOrphans = 0;
+    static uint32_t _recorderReportedDrops = 0;
+
+    static uint32_t recorder_now()
+    {
+        return esp_timer_get_time() / 1000;
+    }
+
+    // call with _recorderLock held
+    static void recorder_push(RunRecordType_t type, uint8_t arg, uint32_t elapsed)
+    {
+        uint16_t next = (_recorderHead + 1) % RECORDER_RING_RECORDS;
+        if (next == _recorderTail) {
+            ++_recorderDropped;
+            return;
+        }
+
+        RunRecord_t &record = _recorderRing[_recorderHead];
+        record.time = recorder_now();
+        record.elapsed = elapsed;
+        record.rate = _recorderRate;
+        record.batteryMillivolts = _recorderBatteryMillivolts;
+        record.type = type;
+        record.pumpStatus = Driver::miclone_last_status();
+        record.batterySOC = _recorderBatterySOC;
+        record.arg = arg;
+
+        _recorderHead = next;
+    }
+
+    static void recorder_log(RunRecordType_t type, uint8_t arg=0)
+    {
+        portENTER_CRITICAL(&_recorderLock);
+        recorder_push(type, arg, recorder_now() - _recorderRunStart);
+        portEXIT_CRITICAL(&_recorderLock);
+    }
+
+    void recorder_start_run(uint16_t rate)
+    {
+        portENTER_CRITICAL(&_recorderLock);
+        _recorderRunning = true;
+        _recorderRunStart = recorder_now();
+        _recorderRate = rate;
+        recorder_push(RUN_RECORD_START, 0, 0);
+        portEXIT_CRITICAL(&_recorderLock);
+
+        if (_recorderTask) xTaskNotifyGive(_recorderTask);
+    }
+
+    void recorder_set_rate(uint16_t rate)
+    {
+        portENTER_CRITICAL(&_recorderLock);
+        _recorderRate = rate;
+        recorder_push(RUN_RECORD_RATE, 0, recorder_now() - _recorderRunStart);
+        portEXIT_CRITICAL(&_recorderLock);
+    }
+
+    void recorder_pump_ack(bool accepted)
+    {
+        recorder_log(RUN_RECORD_PUMP_ACK, accepted);
+    }
+
+    void recorder_touch(RunTouchAction_t action)
+    {
+        recorder_log(RUN_RECORD_TOUCH, action);
+    }
+
+    void recorder_stop_run(RunStopReason_t reason)
+    {
+        portENTER_CRITICAL(&_recorderLock);
+        bool running = _recorderRunning;
+        if (running) {
+            _recorderRate = 0;
+            recorder_push(RUN_RECORD_STOP, reason, recorder_now() - _recorderRunStart);
+            _recorderRunning = false;
+        }
+        portEXIT_CRITICAL(&_recorderLock);
+
+        if (running && _recorderTask) xTaskNotifyGive(_recorderTask);
+    }
+
+    bool recorder_running()
+    {
+        return _recorderRunning;
+    }
+
+    void recorder_battery(uint16_t &millivolts, uint8_t &soc)
+    {
+        millivolts = _recorderBatteryMillivolts;
+        soc = _recorderBatterySOC;
+    }
+
+    static void recorder_write_sector()
+    {
+        if (!_recorderSectorLength) return;
+
+        if (_recorderFile) {
+            _recorderFile.write(_recorderSector, _recorderSectorLength);
+            _recorderFile.flush();
+        }
+
+        _recorderSectorLength = 0;
+    }
+
+    static void recorder_append(const void *data, size_t size)
+    {
+        memcpy(_recorderSector + _recorderSectorLength, data, size);
+        _recorderSectorLength += size;
+        if (_recorderSectorLength == RECORDER_SECTOR_SIZE) recorder_write_sector();
+    }
+
+    static void recorder_close()
+    {
+        // the last sector of a file may be partial
+        recorder_write_sector();
+        if (_recorderFile) _recorderFile.close();
+    }
+
+    static void recorder_open()
+    {
+        recorder_close();
+
+        char path[32];
+        do {
+            snprintf(path, sizeof(path), RECORDER_DIRECTORY "/run_%04d.bin", ++_recorderRunIndex);
+        } while (_recorderFS->exists(path));
+
+        _recorderFile = _recorderFS->open(path, FILE_WRITE);
+        if (!_recorderFile) {
+            Serial.printf("Error: Cannot create run record \"%s\"\n", path);
+            return;
+        }
+
+        RunFileHeader_t header;
+        header.magic = RECORDER_MAGIC;
+        header.version = RECORDER_VERSION;
+        header.recordSize = sizeof(RunRecord_t);
+        header.sampleInterval = RECORDER_SAMPLE_INTERVAL;
+        header.runIndex = _recorderRunIndex;
+        recorder_append(&header, sizeof(header));
+
+        Serial.printf("-> [RECORDER] Recording run to \"%s\"\n", path);
+    }
+
+    static void recorder_drain()
+    {
+        RunRecord_t record;
+
+        while (true) {
+            portENTER_CRITICAL(&_recorderLock);
+            bool empty = _recorderTail == _recorderHead;
+            if (!empty) {
+                record = _recorderRing[_recorderTail];
+                _recorderTail = (_recorderTail + 1) % RECORDER_RING_RECORDS;
+            }
+            portEXIT_CRITICAL(&_recorderLock);
+
+            if (empty) break;
+
+            if (record.type == RUN_RECORD_START) recorder_open();
+
+            if (_recorderFile) {
+                recorder_append(&record, sizeof(record));
+                ++_recorderWritten;
+            }
+            else {
+                ++_recorderOrphans;
+            }
+
+            if (record.type == RUN_RECORD_STOP) recorder_close();
+        }
+    }
+
+    static void RecorderTask(void *)
+    {
+        const TickType_t sampleTicks = RECORDER_SAMPLE_INTERVAL / portTICK_PERIOD_MS;
+        TickType_t lastSample = xTaskGetTickCount();
+        TickType_t lastBattery = 0;
+
+        while (true) {
+            // woken early when a run starts or stops
+            ulTaskNotifyTake(pdTRUE, sampleTicks);
+
+            TickType_t now = xTaskGetTickCount();
+            if (!lastBattery || now - lastBattery >= RECORDER_BATTERY_INTERVAL / portTICK_PERIOD_MS) {
+                _recorderBatteryMillivolts = Driver::lipo.getVoltage() * 1000;
+                _recorderBatterySOC = constrain(Driver::lipo.getSOC(), 0, 100);
+                lastBattery = now;
+            }
+
+            if (now - lastSample >= sampleTicks) {
+                lastSample += sampleTicks * ((now - lastSample) / sampleTicks);
+                if (_recorderRunning) recorder_log(RUN_RECORD_SAMPLE);
+            }
+
+            // report records the ring could not hold, in the file they were lost from
+            portENTER_CRITICAL(&_recorderLock);
+            uint32_t dropped = _recorderDropped - _recorderReportedDrops;
+            if (dropped && _recorderRunning && (_recorderHead + 1) % RECORDER_RING_RECORDS != _recorderTail) {
+                recorder_push(RUN_RECORD_DROPPED, 0, dropped);
+                _recorderReportedDrops = _recorderDropped;
+            }
+            portEXIT_CRITICAL(&_recorderLock);
+
+            recorder_drain();
+        }
+    }
+
+    bool recorder_begin(fs::FS &fs)
+    {
+        if (_recorderTask) return false;
+
+        _recorderFS = &fs;
+        if (!fs.exists(RECORDER_DIRECTORY)) fs.mkdir(RECORDER_DIRECTORY);
+
+        return xTaskCreate(RecorderTask,
+                           "run-recorder",
+                           RECORDER_STACK_SIZE,
+                           nullptr,
+                           1,
+                           &_recorderTask
+                           ) == pdPASS;
+    }
+
+    void recorder_report(Stream &stream)
+    {
+        stream.printf("-> Run recorder: %s, %d records written, %d dropped, %d outside a run\n",
+                      _recorderRunning ? "recording" : "idle",
+                      _recorderWritten,
+                      _recorderDropped,
+                      _recorderOrphans);
+    }
+}
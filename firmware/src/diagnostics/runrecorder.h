@@ -0,0 +1,105 @@
+#pragma once
+
+#include <Arduino.h>
+#include <FS.h>
+#include <SD.h>
+#include <Stream.h>
+#include <stdint.h>
+
+#define RECORDER_DIRECTORY          "/runs"
+#define RECORDER_MAGIC              0x544E5552      // "RUNT"
+#define RECORDER_VERSION            1
+
+#define RECORDER_SECTOR_SIZE        512             // the SD card is written in whole sectors
+#define RECORDER_RING_RECORDS       256             // records buffered in RAM, 4KB
+#define RECORDER_SAMPLE_INTERVAL    100             // ms between samples during a run
+#define RECORDER_BATTERY_INTERVAL   1000            // ms between fuel gauge reads
+#define RECORDER_STACK_SIZE         4 * 1024
+
+/**
+ * Run telemetry recorder. Each run is written to RECORDER_DIRECTORY/run_NNNN.bin
+ * as a RunFileHeader_t followed by fixed-size RunRecord_t, little endian.
+ * tools/runlog_to_csv.py converts the files to CSV.
+ * 
+ * The logging functions only copy a record into a RAM ring and never touch
+ * the card, so they are safe to call from the pump and UI tasks. The recorder
+ * task takes the periodic samples and writes the ring to SD in sector-sized chunks.
+ */
+namespace Diagnostics
+{
+    enum RunRecordType_t : uint8_t {
+        RUN_RECORD_START = 1,       // a run started, rate is the commanded rate (0 for a program)
+        RUN_RECORD_SAMPLE,          // periodic sample
+        RUN_RECORD_PUMP_ACK,        // the pump replied to a start, arg is 1 when it accepted
+        RUN_RECORD_RATE,            // the commanded rate changed
+        RUN_RECORD_TOUCH,           // a run was started or stopped from the touch screen, arg is RunTouchAction_t
+        RUN_RECORD_STOP,            // the run ended, arg is RunStopReason_t
+        RUN_RECORD_DROPPED          // the ring was full, elapsed holds the number of records lost
+    };
+
+    enum RunStopReason_t : uint8_t {
+        RUN_STOP_COMPLETE = 0,      // the timer or program ran out
+        RUN_STOP_MANUAL,            // stopped by the user
+        RUN_STOP_ERROR              // the pump did not accept a command
+    };
+
+    enum RunTouchAction_t : uint8_t {
+        RUN_TOUCH_START = 0,
+        RUN_TOUCH_STOP
+    };
+
+    typedef struct __attribute__((packed)) {
+        uint32_t magic;
+        uint16_t version;
+        uint16_t recordSize;
+        uint32_t sampleInterval;    // ms
+        uint32_t runIndex;
+    } RunFileHeader_t;
+
+    typedef struct __attribute__((packed)) {
+        uint32_t time;              // ms since boot
+        uint32_t elapsed;           // ms since the run started
+        uint16_t rate;              // commanded ul/min, 0 when the pump is paused or stopped
+        uint16_t batteryMillivolts;
+        uint8_t  type;              // RunRecordType_t
+        uint8_t  pumpStatus;        // last status byte the pump replied with
+        uint8_t  batterySOC;        // %
+        uint8_t  arg;
+    } RunRecord_t;
+
+    static_assert(sizeof(RunFileHeader_t) == sizeof(RunRecord_t), "The header must be one record long to keep sectors aligned");
+    static_assert(RECORDER_SECTOR_SIZE % sizeof(RunRecord_t) == 0, "Records must not straddle sectors");
+
+    /**
+     * @brief Starts the recorder task. Call after the SD card is mounted
+     */
+    bool recorder_begin(fs::FS &fs = SD);
+
+    /**
+     * @brief Starts recording a new run into a new file
+     * 
+     * @param rate commanded ul/min
+     */
+    void recorder_start_run(uint16_t rate);
+
+    void recorder_set_rate(uint16_t rate);
+
+    void recorder_pump_ack(bool accepted);
+
+    void recorder_touch(RunTouchAction_t action);
+
+    /**
+     * @brief Ends the run and closes its file once the buffered records are written
+     */
+    void recorder_stop_run(RunStopReason_t reason);
+
+    bool recorder_running();
+
+    /**
+     * @brief Last fuel gauge reading, taken by the recorder task every
+     *          RECORDER_BATTERY_INTERVAL so nothing else waits on I2C
+     */
+    void recorder_battery(uint16_t &millivolts, uint8_t &soc);
+
+    void recorder_report(Stream &stream = Serial);
+}
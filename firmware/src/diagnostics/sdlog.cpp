@@ -0,0 +1,248 @@
+#include "sdlog.h"
+
+#include <Arduino.h>
+#include <FreeRTOS.h>
+#include <stdarg.h>
+#include "../config.h"
+
+namespace Diagnostics
+{
+    static_assert((SDLOG_RING_SIZE & (SDLOG_RING_SIZE - 1)) == 0, "SDLOG_RING_SIZE must be a power of two");
+
+    typedef struct __attribute__((packed)) {
+        uint8_t file;               // SdLogFile_t
+        uint16_t length;            // bytes of text that follow in the ring
+    } SdLogRecord_t;
+
+    static const char *const _sdlogPaths[SDLOG_FILES] = { MICLONE_LOG_FILENAME, "/debug.log", "/trace.bin" };
+
+    // files with a cap are moved aside whole once the next line would pass it, 0 grows forever
+    static const char *const _sdlogOldPaths[SDLOG_FILES] = { nullptr, nullptr, "/trace.old.bin" };
+    static const uint32_t _sdlogMaxSizes[SDLOG_FILES] = { 0, 0, SDLOG_TRACE_MAX_SIZE };
+
+    static fs::FS *_sdlogFS = nullptr;
+    static TaskHandle_t _sdlogTask = nullptr;
+    static portMUX_TYPE _sdlogLock = portMUX_INITIALIZER_UNLOCKED;
+
+    // RAM ring, filled by any task and drained by the writer task. The offsets
+    // run freely and are masked into the ring
+    static uint8_t _sdlogRing[SDLOG_RING_SIZE];
+    static uint32_t _sdlogHead = 0;
+    static uint32_t _sdlogTail = 0;
+    static uint32_t _sdlogDropped = 0;
+    static uint32_t _sdlogHighWater = 0;
+
+    // owned by the writer task
+    static File _sdlogFiles[SDLOG_FILES];
+    static uint32_t _sdlogFileSizes[SDLOG_FILES] = { };
+    static bool _sdlogDirty[SDLOG_FILES] = { };
+    static uint8_t _sdlogSectors[SDLOG_FILES][SDLOG_SECTOR_SIZE];
+    static size_t _sdlogSectorLengths[SDLOG_FILES] = { };
+    static uint32_t _sdlogWritten = 0;
+    static uint32_t _sdlogWrites = 0;
+    static uint32_t _sdlogLost = 0;
+    static uint32_t _sdlogRotations = 0;
+
+    // call with _sdlogLock held
+    static void sdlog_ring_put(uint32_t offset, const void *data, size_t length)
+    {
+        size_t index = offset & (SDLOG_RING_SIZE - 1);
+        size_t first = length < SDLOG_RING_SIZE - index ? length : SDLOG_RING_SIZE - index;
+        memcpy(_sdlogRing + index, data, first);
+        memcpy(_sdlogRing, static_cast<const uint8_t *>(data) + first, length - first);
+    }
+
+    // call with _sdlogLock held
+    static void sdlog_ring_get(uint32_t offset, void *data, size_t length)
+    {
+        size_t index = offset & (SDLOG_RING_SIZE - 1);
+        size_t first = length < SDLOG_RING_SIZE - index ? length : SDLOG_RING_SIZE - index;
+        memcpy(data, _sdlogRing + index, first);
+        memcpy(static_cast<uint8_t *>(data) + first, _sdlogRing, length - first);
+    }
+
+    bool sdlog_write(SdLogFile_t file, const char *text, size_t length)
+    {
+        if (file >= SDLOG_FILES || !length) return false;
+        if (length > SDLOG_LINE_SIZE) length = SDLOG_LINE_SIZE;
+
+        SdLogRecord_t record;
+        record.file = file;
+        record.length = length;
+
+        portENTER_CRITICAL(&_sdlogLock);
+        uint32_t used = _sdlogHead - _sdlogTail;
+        bool fits = used + sizeof(record) + length <= SDLOG_RING_SIZE;
+        if (fits) {
+            sdlog_ring_put(_sdlogHead, &record, sizeof(record));
+            sdlog_ring_put(_sdlogHead + sizeof(record), text, length);
+            _sdlogHead += sizeof(record) + length;
+            used += sizeof(record) + length;
+            if (used > _sdlogHighWater) _sdlogHighWater = used;
+        }
+        else {
+            ++_sdlogDropped;
+        }
+        portEXIT_CRITICAL(&_sdlogLock);
+
+        if (fits && used >= SDLOG_HIGH_WATER && _sdlogTask) xTaskNotifyGive(_sdlogTask);
+        return fits;
+    }
+
+    bool sdlog_printf(SdLogFile_t file, const char *format, ...)
+    {
+        char line[SDLOG_LINE_SIZE + 1];
+
+        va_list args;
+        va_start(args, format);
+        int length = vsnprintf(line, sizeof(line), format, args);
+        va_end(args);
+
+        if (length < 0) return false;
+        return sdlog_write(file, line, length < SDLOG_LINE_SIZE ? length : SDLOG_LINE_SIZE);
+    }
+
+    static void sdlog_open(uint8_t file)
+    {
+        if (_sdlogFiles[file]) return;
+
+        _sdlogFiles[file] = _sdlogFS->open(_sdlogPaths[file], FILE_APPEND);
+        _sdlogFileSizes[file] = _sdlogFiles[file] ? _sdlogFiles[file].size() : 0;
+    }
+
+    static void sdlog_write_sector(uint8_t file)
+    {
+        size_t length = _sdlogSectorLengths[file];
+        if (!length) return;
+        _sdlogSectorLengths[file] = 0;
+
+        sdlog_open(file);
+        File &f = _sdlogFiles[file];
+        size_t written = f ? f.write(_sdlogSectors[file], length) : 0;
+        if (written != length) {
+            // the card is full or was taken out, the file is opened again for the next batch
+            if (f) f.close();
+            _sdlogLost += length - written;
+        }
+
+        _sdlogFileSizes[file] += written;
+        _sdlogWritten += written;
+        _sdlogDirty[file] = true;
+        ++_sdlogWrites;
+    }
+
+    static void sdlog_rotate(uint8_t file)
+    {
+        sdlog_write_sector(file);
+        if (_sdlogFiles[file]) _sdlogFiles[file].close();
+        _sdlogDirty[file] = false;
+
+        // a file that can't be moved is thrown away rather than left to grow
+        _sdlogFS->remove(_sdlogOldPaths[file]);
+        if (!_sdlogFS->rename(_sdlogPaths[file], _sdlogOldPaths[file])) _sdlogFS->remove(_sdlogPaths[file]);
+        ++_sdlogRotations;
+
+        sdlog_open(file);
+    }
+
+    static void sdlog_drain()
+    {
+        uint8_t line[SDLOG_LINE_SIZE];
+        SdLogRecord_t record;
+
+        while (true) {
+            portENTER_CRITICAL(&_sdlogLock);
+            bool empty = _sdlogTail == _sdlogHead;
+            if (!empty) {
+                sdlog_ring_get(_sdlogTail, &record, sizeof(record));
+                sdlog_ring_get(_sdlogTail + sizeof(record), line, record.length);
+                _sdlogTail += sizeof(record) + record.length;
+            }
+            portEXIT_CRITICAL(&_sdlogLock);
+
+            if (empty) break;
+
+            // a line is never split across two files, trace records can't be read from half
+            uint32_t maxSize = _sdlogMaxSizes[record.file];
+            sdlog_open(record.file);
+            if (maxSize && _sdlogFileSizes[record.file] + _sdlogSectorLengths[record.file] + record.length > maxSize) {
+                sdlog_rotate(record.file);
+            }
+
+            // a batch ends where the file reaches a sector boundary, so whole
+            // sectors are written instead of the same one over and over
+            for (size_t copied = 0; copied < record.length; ) {
+                size_t &sectorLength = _sdlogSectorLengths[record.file];
+                size_t room = SDLOG_SECTOR_SIZE - (_sdlogFileSizes[record.file] + sectorLength) % SDLOG_SECTOR_SIZE;
+                size_t chunk = record.length - copied < room ? record.length - copied : room;
+
+                memcpy(_sdlogSectors[record.file] + sectorLength, line + copied, chunk);
+                sectorLength += chunk;
+                copied += chunk;
+                if (chunk == room) sdlog_write_sector(record.file);
+            }
+        }
+    }
+
+    static void sdlog_flush()
+    {
+        for (uint8_t file = 0; file < SDLOG_FILES; ++file) {
+            sdlog_write_sector(file);
+            if (_sdlogDirty[file] && _sdlogFiles[file]) _sdlogFiles[file].flush();
+            _sdlogDirty[file] = false;
+        }
+    }
+
+    static void SdLogTask(void *)
+    {
+        const TickType_t flushTicks = SDLOG_FLUSH_INTERVAL / portTICK_PERIOD_MS;
+        TickType_t lastFlush = xTaskGetTickCount();
+
+        while (true) {
+            // woken early when the ring passes the high-water mark
+            TickType_t waited = xTaskGetTickCount() - lastFlush;
+            ulTaskNotifyTake(pdTRUE, waited < flushTicks ? flushTicks - waited : 0);
+
+            sdlog_drain();
+
+            TickType_t now = xTaskGetTickCount();
+            if (now - lastFlush >= flushTicks) {
+                sdlog_flush();
+                lastFlush = now;
+            }
+        }
+    }
+
+    bool sdlog_begin(fs::FS &fs)
+    {
+        if (_sdlogTask) return false;
+
+        _sdlogFS = &fs;
+        return xTaskCreate(SdLogTask,
+                           "sd-log",
+                           SDLOG_STACK_SIZE,
+                           nullptr,
+                           1,
+                           &_sdlogTask
+                           ) == pdPASS;
+    }
+
+    void sdlog_report(Stream &stream)
+    {
+        portENTER_CRITICAL(&_sdlogLock);
+        uint32_t buffered = _sdlogHead - _sdlogTail;
+        uint32_t highWater = _sdlogHighWater;
+        uint32_t dropped = _sdlogDropped;
+        portEXIT_CRITICAL(&_sdlogLock);
+
+        stream.printf("-> SD log: %d bytes written in %d writes, %d bytes buffered (most %d of %d), %d lines dropped, %d bytes lost, %d files rotated\n",
+                      _sdlogWritten,
+                      _sdlogWrites,
+                      buffered,
+                      highWater,
+                      SDLOG_RING_SIZE,
+                      dropped,
+                      _sdlogLost,
+                      _sdlogRotations);
+    }
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <Arduino.h>
+#include <FS.h>
+#include <SD.h>
+#include <Stream.h>
+#include <stdint.h>
+
+#define SDLOG_RING_SIZE             4096            // bytes of log text buffered in RAM, a power of two
+#define SDLOG_SECTOR_SIZE           512             // the card is written in batches ending on sector boundaries
+#define SDLOG_HIGH_WATER            (SDLOG_RING_SIZE / 2)   // buffered bytes that wake the writer before its timer
+#define SDLOG_FLUSH_INTERVAL        2000            // ms a line may wait before it is written and flushed
+#define SDLOG_LINE_SIZE             192             // longer lines are cut
+#define SDLOG_STACK_SIZE            3 * 1024
+#define SDLOG_TRACE_MAX_SIZE        (1024 * 1024)   // bytes, /trace.bin is moved to /trace.old.bin before it passes this
+
+/**
+ * Write-behind logging to text files on the SD card. The files stay open and
+ * the logging functions only copy a line into a RAM ring, so any task can log
+ * without waiting on the card. A low priority writer task moves the lines into
+ * one sector buffer per file and appends each buffer when it reaches a sector
+ * boundary; what is left over is written and flushed every SDLOG_FLUSH_INTERVAL.
+ * Lines that find the ring full are dropped and counted. The trace file is
+ * capped: the record that would take it past its size goes to a new file,
+ * and the previous one is kept as the old file, replacing the one before it.
+ */
+namespace Diagnostics
+{
+    enum SdLogFile_t : uint8_t {
+        SDLOG_MICLONE = 0,          // MICLONE_LOG_FILENAME, commands passed through to the MiClone
+        SDLOG_DEBUG,                // /debug.log, dev_file() in DEV_DEBUG builds
+        SDLOG_TRACE,                // /trace.bin, binary TRACE() records, capped at SDLOG_TRACE_MAX_SIZE
+        SDLOG_FILES
+    };
+
+    /**
+     * @brief Starts the writer task. Call after the SD card is mounted, lines
+     *          logged before are kept in the ring until then
+     */
+    bool sdlog_begin(fs::FS &fs = SD);
+
+    /**
+     * @brief Queues text to be appended to a log file. Not for use from an ISR
+     *
+     * @return false the ring is full and the text was dropped
+     */
+    bool sdlog_write(SdLogFile_t file, const char *text, size_t length);
+
+    bool sdlog_printf(SdLogFile_t file, const char *format, ...) __attribute__((format(printf, 2, 3)));
+
+    void sdlog_report(Stream &stream = Serial);
+}
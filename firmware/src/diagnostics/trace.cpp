@@ -0,0 +1,45 @@
+#include "trace.h"
+
+#include <Arduino.h>
+#include <atomic>
+#include <esp_timer.h>
+#include "sdlog.h"
+
+namespace Diagnostics
+{
+    static std::atomic<uint32_t> _traceWritten(0);
+    static std::atomic<uint32_t> _traceDropped(0);
+    static std::atomic<uint32_t> _traceBytes(0);
+
+    uint32_t trace_time()
+    {
+        return esp_timer_get_time() / 1000;
+    }
+
+    void trace_write(const uint8_t *record, size_t length)
+    {
+        if (!sdlog_write(SDLOG_TRACE, reinterpret_cast<const char *>(record), length)) {
+            trace_dropped();
+            return;
+        }
+        _traceWritten.fetch_add(1, std::memory_order_relaxed);
+        _traceBytes.fetch_add(length, std::memory_order_relaxed);
+    }
+
+    void trace_dropped()
+    {
+        _traceDropped.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void trace_report(Stream &stream)
+    {
+        uint32_t written = _traceWritten.load(std::memory_order_relaxed);
+        uint32_t bytes = _traceBytes.load(std::memory_order_relaxed);
+
+        stream.printf("-> Trace: %d records in %d bytes (%d per record), %d dropped\n",
+                      written,
+                      bytes,
+                      written ? bytes / written : 0,
+                      _traceDropped.load(std::memory_order_relaxed));
+    }
+}
@@ -0,0 +1,172 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <type_traits>
+
+class Stream;
+
+#define TRACE_RECORD_SIZE           64              // longest record, longer ones are dropped
+#define TRACE_STRING_SIZE           24              // %s arguments are cut to this length
+#define TRACE_MAX_ID                0xFFFF          // .trace_fmt must stay under 64KB
+
+#define TRACE_STRINGIFY_(x)         #x
+#define TRACE_STRINGIFY(x)          TRACE_STRINGIFY_(x)
+
+/**
+ * @brief Logs a printf-style message without formatting it. The record holds
+ *          the format's ID, the time and the raw arguments, and goes to the
+ *          SDLOG_TRACE file; tools/trace_decode.py turns it back into text
+ *          using the firmware ELF.
+ *
+ *          The location and format are kept in .trace_fmt. The section is
+ *          declared without the "a" flag, and the '#' comments out the flags
+ *          GCC appends, so it is kept in the ELF but never loaded into flash
+ *          or RAM. Being unallocated it links at address 0, so a format's
+ *          address is its offset in the section and serves as its ID.
+ *
+ *          Integers are recorded in 4 bytes (8 for 64-bit), floating point as
+ *          a float, char pointers as the string itself. The number of
+ *          arguments is checked against the format when compiling.
+ */
+#define TRACE(format, ...)                                                                      \
+    do {                                                                                        \
+        static const char _traceFormat[]                                                        \
+            __attribute__((section(".trace_fmt,\"\",@progbits #"), used, aligned(1))) =          \
+            __FILE__ ":" TRACE_STRINGIFY(__LINE__) "\0" format;                                 \
+        Diagnostics::trace_record<Diagnostics::trace_count_args(format)>(                        \
+            reinterpret_cast<uintptr_t>(_traceFormat), ##__VA_ARGS__);                          \
+    } while (0)
+
+namespace Diagnostics
+{
+    /* compile-time argument count */
+
+    constexpr bool trace_is_conversion(char c, const char *conversions="diouxXcsfFeEgGaAp")
+    {
+        return *conversions && (*conversions == c || trace_is_conversion(c, conversions + 1));
+    }
+
+    constexpr size_t trace_count_args(const char *format, size_t count=0);
+
+    // inside a conversion, each '*' takes an argument of its own
+    constexpr size_t trace_count_spec(const char *format, size_t count)
+    {
+        return !*format                        ? count :
+               trace_is_conversion(*format)    ? trace_count_args(format + 1, count + 1) :
+               *format == '*'                  ? trace_count_spec(format + 1, count + 1) :
+                                                 trace_count_spec(format + 1, count);
+    }
+
+    /**
+     * @brief The number of arguments a printf format takes
+     */
+    constexpr size_t trace_count_args(const char *format, size_t count)
+    {
+        return !*format                              ? count :
+               *format != '%'                        ? trace_count_args(format + 1, count) :
+               format[1] == '%'                      ? trace_count_args(format + 2, count) :
+                                                       trace_count_spec(format + 1, count);
+    }
+
+    /* record encoding, little endian */
+
+    typedef struct {
+        uint8_t data[TRACE_RECORD_SIZE];    // length of the rest, ID, ms since boot, arguments
+        size_t length;
+        bool overflow;
+    } TraceRecord_t;
+
+    inline void trace_put_bytes(TraceRecord_t &record, const void *data, size_t length)
+    {
+        if (record.length + length > sizeof(record.data)) {
+            record.overflow = true;
+            return;
+        }
+        memcpy(record.data + record.length, data, length);
+        record.length += length;
+    }
+
+    template <typename T>
+    typename std::enable_if<std::is_integral<T>::value || std::is_enum<T>::value>::type
+    trace_put(TraceRecord_t &record, T value)
+    {
+        if (sizeof(T) > sizeof(uint32_t)) {
+            uint64_t wide = (uint64_t) value;
+            trace_put_bytes(record, &wide, sizeof(wide));
+        }
+        else {
+            uint32_t narrow = (uint32_t) value;
+            trace_put_bytes(record, &narrow, sizeof(narrow));
+        }
+    }
+
+    template <typename T>
+    typename std::enable_if<std::is_floating_point<T>::value>::type
+    trace_put(TraceRecord_t &record, T value)
+    {
+        float single = value;
+        trace_put_bytes(record, &single, sizeof(single));
+    }
+
+    inline void trace_put(TraceRecord_t &record, const char *text)
+    {
+        uint8_t length = text ? strnlen(text, TRACE_STRING_SIZE) : 0;
+        trace_put_bytes(record, &length, sizeof(length));
+        trace_put_bytes(record, text, length);
+    }
+
+    inline void trace_put(TraceRecord_t &record, char *text)
+    {
+        trace_put(record, static_cast<const char *>(text));
+    }
+
+    // any other pointer is recorded as its address, for %p
+    template <typename T>
+    void trace_put(TraceRecord_t &record, const T *pointer)
+    {
+        trace_put(record, (uint32_t) reinterpret_cast<uintptr_t>(pointer));
+    }
+
+    /* provided by the platform, trace.cpp on the board */
+
+    uint32_t trace_time();
+
+    void trace_write(const uint8_t *record, size_t length);
+
+    void trace_dropped();
+
+    void trace_report(Stream &stream);
+
+    template <size_t N, typename... Args>
+    void trace_record(uintptr_t id, Args... args)
+    {
+        static_assert(N == sizeof...(Args), "TRACE arguments do not match its format");
+
+        if (id > TRACE_MAX_ID) {
+            trace_dropped();
+            return;
+        }
+
+        TraceRecord_t record;
+        record.length = 1;
+        record.overflow = false;
+
+        uint16_t shortId = id;
+        uint32_t time = trace_time();
+        trace_put_bytes(record, &shortId, sizeof(shortId));
+        trace_put_bytes(record, &time, sizeof(time));
+
+        int expand[] = { 0, (trace_put(record, args), 0)... };
+        (void) expand;
+
+        if (record.overflow) {
+            trace_dropped();
+            return;
+        }
+
+        record.data[0] = record.length - 1;
+        trace_write(record.data, record.length);
+    }
+}
@@ -0,0 +1,275 @@
+#include "usage.h"
+
+#include <Arduino.h>
+#include <FreeRTOS.h>
+#include <Preferences.h>
+#include <esp_attr.h>
+#include <esp_timer.h>
+#include <rom/crc.h>
+
+namespace Diagnostics
+{
+    // survives soft resets, garbage after a power cycle until validated
+    static RTC_NOINIT_ATTR UsageRecord_t _usageRTC;
+
+    static TaskHandle_t _usageTask = nullptr;
+    static portMUX_TYPE _usageLock = portMUX_INITIALIZER_UNLOCKED;
+    static Preferences _usagePreferences;
+
+    // a pump run not yet fully added to the totals
+    typedef struct {
+        bool active;
+        uint16_t rate;              // ul/min
+        uint32_t start;             // ms
+        uint32_t accounted;         // ms of the run already in the totals
+    } UsageRun_t;
+
+    static UsageRun_t _usageRuns[USAGE_MAX_PUMPS];
+    static uint32_t _usageRevision = 0;     // bumped on every change to the totals
+    static uint32_t _usageCommits = 0;
+    static uint32_t _usageCommitFailures = 0;
+    static const char *_usageSource = "new";
+
+    static const char *_usageKeys[2] = { "record0", "record1" };
+
+    static uint32_t usage_now()
+    {
+        return esp_timer_get_time() / 1000;
+    }
+
+    static uint32_t usage_crc(const UsageRecord_t &record)
+    {
+        return crc32_le(0, reinterpret_cast<const uint8_t *>(&record), offsetof(UsageRecord_t, crc));
+    }
+
+    static bool usage_valid(const UsageRecord_t &record)
+    {
+        return record.magic == USAGE_MAGIC && record.version == USAGE_VERSION && record.crc == usage_crc(record);
+    }
+
+    // call with _usageLock held
+    static void usage_add(UsageRun_t &run, uint32_t now)
+    {
+        uint32_t ms = (now - run.start) - run.accounted;
+        run.accounted += ms;
+
+        _usageRTC.totals.pumpMs += ms;
+        _usageRTC.totals.volumeNl += (uint64_t) run.rate * ms / 60;     // ul/min * ms / 60 = nl
+    }
+
+    // call with _usageLock held
+    static void usage_changed()
+    {
+        _usageRTC.dirty = 1;
+        _usageRTC.crc = usage_crc(_usageRTC);
+        ++_usageRevision;
+    }
+
+    /**
+     * @brief Adds the time running pumps have run since the last fold to the
+     *          RTC totals, so a reset mid run loses at most one fold interval
+     */
+    static void usage_fold()
+    {
+        uint32_t now = usage_now();
+        bool changed = false;
+
+        portENTER_CRITICAL(&_usageLock);
+        for (UsageRun_t &run : _usageRuns) {
+            if (!run.active) continue;
+            usage_add(run, now);
+            changed = true;
+        }
+        if (changed) usage_changed();
+        portEXIT_CRITICAL(&_usageLock);
+    }
+
+    /**
+     * @brief Newest valid NVS record
+     *
+     * @return false Neither record is valid
+     */
+    static bool usage_load(UsageRecord_t &record)
+    {
+        bool found = false;
+
+        for (const char *key : _usageKeys) {
+            UsageRecord_t candidate;
+            if (_usagePreferences.getBytes(key, &candidate, sizeof(candidate)) != sizeof(candidate)) continue;
+            if (!usage_valid(candidate)) continue;
+
+            if (!found || (int32_t) (candidate.sequence - record.sequence) > 0) {
+                record = candidate;
+                found = true;
+            }
+        }
+
+        return found;
+    }
+
+    static void UsageTask(void *)
+    {
+        uint32_t lastCommit = usage_now();
+
+        while (true) {
+            // notified when a run ends
+            bool runEnded = ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(USAGE_FOLD_INTERVAL));
+            usage_fold();
+
+            if (runEnded || usage_now() - lastCommit >= USAGE_COMMIT_INTERVAL) {
+                usage_commit();
+                lastCommit = usage_now();
+            }
+        }
+    }
+
+    bool usage_begin()
+    {
+        if (_usageTask) return false;
+
+        if (!_usagePreferences.begin(USAGE_NVS_NAMESPACE, false)) {
+            Serial.println("Error: Cannot open usage counters in NVS");
+            return false;
+        }
+
+        UsageRecord_t stored;
+        bool haveStored = usage_load(stored);
+
+        // the RTC copy is never behind NVS, it is what gets committed
+        if (usage_valid(_usageRTC)) {
+            _usageSource = "RTC";
+            if (haveStored && (int32_t) (stored.sequence - _usageRTC.sequence) > 0) {
+                _usageRTC = stored;
+                _usageSource = "NVS";
+            }
+        }
+        else if (haveStored) {
+            _usageRTC = stored;
+            _usageSource = "NVS";
+        }
+        else {
+            memset(&_usageRTC, 0, sizeof(_usageRTC));
+            _usageRTC.magic = USAGE_MAGIC;
+            _usageRTC.version = USAGE_VERSION;
+        }
+        _usageRTC.crc = usage_crc(_usageRTC);
+
+        memset(_usageRuns, 0, sizeof(_usageRuns));
+
+        return xTaskCreate(UsageTask,
+                           "usage",
+                           USAGE_STACK_SIZE,
+                           nullptr,
+                           1,
+                           &_usageTask
+                           ) == pdPASS;
+    }
+
+    void usage_run_start(uint8_t pump, uint16_t rate)
+    {
+        if (pump >= USAGE_MAX_PUMPS) return;
+
+        portENTER_CRITICAL(&_usageLock);
+        UsageRun_t &run = _usageRuns[pump];
+        run.active = true;
+        run.rate = rate;
+        run.start = usage_now();
+        run.accounted = 0;
+
+        ++_usageRTC.totals.runs;
+        usage_changed();
+        portEXIT_CRITICAL(&_usageLock);
+    }
+
+    void usage_run_end(uint8_t pump)
+    {
+        if (pump >= USAGE_MAX_PUMPS) return;
+
+        portENTER_CRITICAL(&_usageLock);
+        UsageRun_t &run = _usageRuns[pump];
+        bool active = run.active;
+        if (active) {
+            usage_add(run, usage_now());
+            run.active = false;
+            usage_changed();
+        }
+        portEXIT_CRITICAL(&_usageLock);
+
+        if (active && _usageTask) xTaskNotifyGive(_usageTask);
+    }
+
+    void usage_totals(UsageTotals_t &totals)
+    {
+        uint32_t now = usage_now();
+
+        portENTER_CRITICAL(&_usageLock);
+        totals = _usageRTC.totals;
+        for (const UsageRun_t &run : _usageRuns) {
+            if (!run.active) continue;
+            uint32_t ms = (now - run.start) - run.accounted;
+            totals.pumpMs += ms;
+            totals.volumeNl += (uint64_t) run.rate * ms / 60;
+        }
+        portEXIT_CRITICAL(&_usageLock);
+    }
+
+    bool usage_commit()
+    {
+        if (!_usageTask) return false;
+
+        UsageRecord_t record;
+        uint32_t revision;
+
+        portENTER_CRITICAL(&_usageLock);
+        bool dirty = _usageRTC.dirty;
+        record = _usageRTC;
+        revision = _usageRevision;
+        portEXIT_CRITICAL(&_usageLock);
+
+        if (!dirty) return true;
+
+        // alternate records, so the last good one survives a write cut short
+        record.dirty = 0;
+        record.sequence += 1;
+        record.crc = usage_crc(record);
+
+        const char *key = _usageKeys[record.sequence & 1];
+        if (_usagePreferences.putBytes(key, &record, sizeof(record)) != sizeof(record)) {
+            ++_usageCommitFailures;
+            Serial.println("Error: Cannot commit usage counters to NVS");
+            return false;
+        }
+
+        portENTER_CRITICAL(&_usageLock);
+        _usageRTC.sequence = record.sequence;
+        // anything added during the write is committed next time
+        if (revision == _usageRevision) _usageRTC.dirty = 0;
+        _usageRTC.crc = usage_crc(_usageRTC);
+        portEXIT_CRITICAL(&_usageLock);
+
+        ++_usageCommits;
+        return true;
+    }
+
+    void usage_report(Stream &stream)
+    {
+        UsageTotals_t totals;
+        usage_totals(totals);
+
+        portENTER_CRITICAL(&_usageLock);
+        uint32_t sequence = _usageRTC.sequence;
+        bool dirty = _usageRTC.dirty;
+        portEXIT_CRITICAL(&_usageLock);
+
+        stream.printf("-> Usage: %u runs, %.2f pump-hours, %.1f ml pumped\n",
+                      totals.runs,
+                      totals.pumpMs / 3600000.0,
+                      totals.volumeNl / 1000000.0);
+        stream.printf("-> Usage counters: restored from %s, %u commits total, %u this boot, %u failed, %s\n",
+                      _usageSource,
+                      sequence,
+                      _usageCommits,
+                      _usageCommitFailures,
+                      dirty ? "uncommitted changes" : "committed");
+    }
+}
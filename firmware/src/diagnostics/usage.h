@@ -0,0 +1,79 @@
+#pragma once
+
+#include <Arduino.h>
+#include <Stream.h>
+#include <stdint.h>
+
+#define USAGE_NVS_NAMESPACE         "usage"
+#define USAGE_MAGIC                 0x45475355      // "USGE"
+#define USAGE_VERSION               1
+
+#define USAGE_FOLD_INTERVAL         (60 * 1000)         // ms between folding running pumps into the totals
+#define USAGE_COMMIT_INTERVAL       (10 * 60 * 1000)    // ms between NVS commits while the totals change
+#define USAGE_STACK_SIZE            3 * 1024
+#define USAGE_MAX_PUMPS             4
+
+/**
+ * Lifetime usage counters for maintenance scheduling. The running totals live
+ * in RTC slow memory, which keeps its contents through soft resets and
+ * hardReset(), so updating them costs nothing. They are committed to NVS only
+ * when a run ends or every USAGE_COMMIT_INTERVAL while pumps run, alternating
+ * between two records so a power loss during a write leaves the other intact.
+ * At boot the RTC copy is used if it is valid, otherwise the newest valid NVS record
+ */
+namespace Diagnostics
+{
+    typedef struct __attribute__((packed)) {
+        uint32_t runs;              // runs the pumps accepted
+        uint32_t reserved;
+        uint64_t pumpMs;            // pump run time, summed over pumps
+        uint64_t volumeNl;          // commanded volume pumped, nl
+    } UsageTotals_t;
+
+    /**
+     * @brief Layout of the RTC copy and of each NVS record. crc covers every byte before it
+     */
+    typedef struct __attribute__((packed)) {
+        uint32_t magic;
+        uint16_t version;
+        uint8_t  dirty;             // RTC only, changed since the last commit
+        uint8_t  reserved;
+        uint32_t sequence;          // commits since the counters were created
+        UsageTotals_t totals;
+        uint32_t crc;
+    } UsageRecord_t;
+
+    /**
+     * @brief Restores the counters and starts the commit task. Call before
+     *          anything that can start a run
+     */
+    bool usage_begin();
+
+    /**
+     * @brief A pump accepted a run. Only touches RAM and RTC memory
+     *
+     * @param pump pump index, counting from 0
+     * @param rate commanded ul/min
+     */
+    void usage_run_start(uint8_t pump, uint16_t rate);
+
+    /**
+     * @brief A pump's run ended. Adds the rest of the run and schedules a commit
+     */
+    void usage_run_end(uint8_t pump);
+
+    /**
+     * @brief Current totals, including the part of running pumps' runs not yet folded in
+     */
+    void usage_totals(UsageTotals_t &totals);
+
+    /**
+     * @brief Writes the totals to NVS now, if they changed since the last commit.
+     *          Blocks on the flash write
+     *
+     * @return false The write failed
+     */
+    bool usage_commit();
+
+    void usage_report(Stream &stream = Serial);
+}
@@ -0,0 +1,85 @@
+#include "bletelemetry.hpp"
+#include <string.h>
+
+namespace Driver
+{
+    BleTelemetry::BleTelemetry(BleTelemetrySample sample, BleTelemetryNotify notify, void *arg)
+        : sample(sample)
+        , notify(notify)
+        , arg(arg)
+        , interval(BLETELEMETRY_DEFAULT_INTERVAL)
+        , perBatch(1)
+        , period(BLETELEMETRY_DEFAULT_INTERVAL)
+        , started(false)
+        , nextSample(0)
+        , count(0)
+        , notifications(0)
+        , late(0)
+    {
+        configure(BLETELEMETRY_DEFAULT_INTERVAL, BLETELEMETRY_MIN_MTU);
+    }
+
+    bool BleTelemetry::configure(uint16_t interval, uint16_t mtu)
+    {
+        if (interval < BLETELEMETRY_MIN_INTERVAL || interval > BLETELEMETRY_MAX_INTERVAL || mtu < BLETELEMETRY_MIN_MTU) {
+            return false;
+        }
+
+        // a notification carries MTU - 3 bytes
+        size_t room = mtu - 3u < sizeof(packet) ? mtu - 3u : sizeof(packet);
+        size_t fit = (room - sizeof(BleTelemetryHeader_t)) / sizeof(BleTelemetryRecord_t);
+        size_t often = interval / BLETELEMETRY_MIN_INTERVAL;
+
+        this->interval = interval;
+        perBatch = fit < often ? fit : often;
+        period = interval / perBatch;
+        reset();
+        return true;
+    }
+
+    void BleTelemetry::reset()
+    {
+        started = false;
+        count = 0;
+    }
+
+    uint32_t BleTelemetry::poll(uint32_t now)
+    {
+        if (!started) {
+            started = true;
+            nextSample = now;
+        }
+
+        int32_t wait = nextSample - now;
+        if (wait > 0) return wait;
+
+        BleTelemetryRecord_t record;
+        memset(&record, 0, sizeof(record));
+        sample(arg, record);
+        memcpy(packet + sizeof(BleTelemetryHeader_t) + count * sizeof(record), &record, sizeof(record));
+
+        if (++count == perBatch) {
+            BleTelemetryHeader_t header;
+            header.count = count;
+            header.period = period;
+            memcpy(packet, &header, sizeof(header));
+            notify(arg, packet, sizeof(header) + count * sizeof(record));
+            ++notifications;
+            count = 0;
+        }
+
+        // a task held up for a period or more carries on from now rather than catch up
+        nextSample += period;
+        if ((int32_t) (nextSample - now) <= 0) {
+            ++late;
+            nextSample = now + period;
+        }
+        return nextSample - now;
+    }
+
+    void BleTelemetry::stats(uint32_t &notifications, uint32_t &late) const
+    {
+        notifications = this->notifications;
+        late = this->late;
+    }
+}
@@ -0,0 +1,112 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Live telemetry over BLE, on a characteristic of its own that the phone
+// subscribes to.
+//
+// The device samples the run and the battery into BleTelemetryRecord_t and
+// batches them, so one notification goes out per interval however often it
+// samples. The phone writes BleTelemetryConfig_t to set the interval and says
+// what MTU it negotiated, and a batch holds as many records as fit, up to one
+// every BLETELEMETRY_MIN_INTERVAL. A long interval samples less often rather
+// than send bigger notifications, so the radio and the CPU wake up once per
+// interval either way.
+//
+// A notification is BleTelemetryHeader_t then count records, little endian
+
+#define BLETELEMETRY_MIN_INTERVAL       100     // ms, also the shortest time between samples
+#define BLETELEMETRY_MAX_INTERVAL       10000   // ms
+#define BLETELEMETRY_DEFAULT_INTERVAL   1000    // ms, until the phone sets one
+#define BLETELEMETRY_MIN_MTU            23      // the default ATT MTU, fits one record
+#define BLETELEMETRY_MAX_PACKET         512     // largest attribute value
+#define BLETELEMETRY_FOREVER            UINT32_MAX
+#define BLETELEMETRY_PROGRAM            0x01    // BleTelemetryRecord_t flags, a program is running
+
+namespace Driver
+{
+    typedef struct __attribute__((packed)) {
+        uint16_t interval;          // ms between notifications
+        uint16_t mtu;               // ATT MTU the phone negotiated
+    } BleTelemetryConfig_t;
+
+    typedef struct __attribute__((packed)) {
+        uint8_t count;              // records that follow
+        uint16_t period;            // ms between them, the last one is the newest
+    } BleTelemetryHeader_t;
+
+    typedef struct __attribute__((packed)) {
+        uint8_t state;              // MiCloneState_t of the first pump
+        uint8_t flags;              // BLETELEMETRY_PROGRAM
+        uint8_t pumpLinks;          // bit n set: pump n answered its last command
+        uint8_t pumpStatus;         // status byte of the first pump's last reply
+        uint32_t elapsed;           // ms into the pump's run
+        uint32_t remaining;         // ms left in the run or program, BLETELEMETRY_FOREVER untimed
+        uint16_t rate;              // ul/min, 0 when stopped
+        uint16_t batteryMillivolts;
+        uint8_t batterySOC;         // %
+    } BleTelemetryRecord_t;
+
+    static_assert(BLETELEMETRY_MIN_MTU - 3 >= sizeof(BleTelemetryHeader_t) + sizeof(BleTelemetryRecord_t),
+                  "A record must fit the default MTU");
+
+    // fills in one record, called from poll()
+    typedef void (*BleTelemetrySample)(void *arg, BleTelemetryRecord_t &record);
+
+    // sends one notification to the phone
+    typedef void (*BleTelemetryNotify)(void *arg, const uint8_t *data, size_t length);
+
+    class BleTelemetry
+    {
+    private:
+        BleTelemetrySample sample;
+        BleTelemetryNotify notify;
+        void *arg;
+
+        uint16_t interval;
+        uint8_t perBatch;
+        uint16_t period;            // ms between samples
+
+        bool started;
+        uint32_t nextSample;        // ms
+        uint8_t count;
+        uint8_t packet[BLETELEMETRY_MAX_PACKET];
+
+        uint32_t notifications;
+        uint32_t late;              // samples taken a period or more after they were due
+
+    public:
+        BleTelemetry(BleTelemetrySample sample, BleTelemetryNotify notify, void *arg=nullptr);
+
+        /**
+         * @brief Sets the interval and sizes the batches to the MTU. Drops the
+         *          batch being gathered and starts sampling again
+         *
+         * @return false interval out of range or MTU too small, nothing changes
+         */
+        bool configure(uint16_t interval, uint16_t mtu);
+
+        /**
+         * @brief Takes a sample if one is due, and sends the batch once it is full
+         *
+         * @param now ms
+         * @return uint32_t ms until the next sample
+         */
+        uint32_t poll(uint32_t now);
+
+        /**
+         * @brief Drops the batch being gathered, such as when the phone unsubscribes.
+         *          The next poll() samples straight away
+         */
+        void reset();
+
+        uint16_t getInterval() const { return interval; }
+
+        uint8_t recordsPerBatch() const { return perBatch; }
+
+        uint16_t samplePeriod() const { return period; }
+
+        void stats(uint32_t &notifications, uint32_t &late) const;
+    };
+}
@@ -0,0 +1,528 @@
+#include "bletransfer.hpp"
+#include <string.h>
+
+namespace Driver
+{
+    BleTransfer::BleTransfer(const UsbFileSystem_t &files, BleTransferNotify notify, void *arg)
+        : files(files)
+        , firmware(nullptr)
+        , notify(notify)
+        , notifyArg(arg)
+        , open(false)
+        , flashing(false)
+        , reading(false)
+        , failed(false)
+        , gapSent(false)
+        , next(0)
+        , sinceAck(0)
+        , received(0)
+        , crc(0)
+        , opened(0)
+        , lastPacket(0)
+        , buffered(0)
+        , dataSize(0)
+        , readStart(0)
+        , readSize(0)
+        , readChunks(0)
+        , sendNext(0)
+        , readAcked(0)
+        , crcChunks(0)
+        , cacheOffset(0)
+        , bytesSent(0)
+        , chunksResent(0)
+        , lastBytes(0)
+        , lastElapsed(0)
+        , totalBytes(0)
+        , gaps(0)
+    { }
+
+    void BleTransfer::setFirmware(const BleTransferFirmware_t *firmware)
+    {
+        this->firmware = firmware;
+    }
+
+    bool BleTransfer::flush()
+    {
+        // after a failed write the rest of the upload is dropped
+        if (failed) buffered = 0;
+        if (!buffered || failed) return !failed;
+        if (flashing) failed = !firmware->write(firmware->context, buffer, buffered);
+        else failed = files.write(files.context, buffer, buffered) != buffered;
+        buffered = 0;
+        return !failed;
+    }
+
+    // keep: the data is complete, or it is a file and a partial one is still worth having
+    void BleTransfer::finish(bool keep)
+    {
+        if (flashing) {
+            if (!keep) firmware->abort(firmware->context);
+        }
+        else {
+            flush();
+            files.close(files.context);
+        }
+        open = false;
+    }
+
+    void BleTransfer::endRead()
+    {
+        files.close(files.context);
+        reading = false;
+    }
+
+    void BleTransfer::close()
+    {
+        if (open) finish(false);
+        if (reading) endRead();
+    }
+
+    void BleTransfer::sendAck(uint8_t flags)
+    {
+        uint8_t packet[1 + sizeof(BleTransferAck_t)] = { BLETRANSFER_ACK };
+        BleTransferAck_t ack;
+        ack.status = failed ? BLETRANSFER_IO : BLETRANSFER_OK;
+        ack.flags = flags;
+        ack.next = next;
+        ack.received = received;
+        memcpy(packet + 1, &ack, sizeof(ack));
+
+        sinceAck = 0;
+        notify(notifyArg, packet, sizeof(packet));
+    }
+
+    void BleTransfer::sendOpened(BleTransferStatus_t status, uint32_t size, uint16_t mtu, bool download)
+    {
+        // a notification carries MTU - 3 bytes, and so does a write without response
+        uint16_t packet = mtu - 3 < BLETRANSFER_MAX_PACKET ? mtu - 3 : BLETRANSFER_MAX_PACKET;
+
+        uint8_t reply[1 + sizeof(BleTransferOpened_t)] = { BLETRANSFER_OPENED };
+        BleTransferOpened_t opened;
+        opened.status = status;
+        opened.size = size;
+        opened.dataSize = status == BLETRANSFER_OK ? packet - BLETRANSFER_DATA_HEADER : 0;
+        opened.ackEvery = download ? BLETRANSFER_READ_ACK_EVERY : BLETRANSFER_ACK_EVERY;
+        opened.window = download ? BLETRANSFER_READ_WINDOW : BLETRANSFER_WINDOW;
+        memcpy(reply + 1, &opened, sizeof(opened));
+        notify(notifyArg, reply, sizeof(reply));
+    }
+
+    void BleTransfer::sendClosed(const BleTransferClosed_t &closed)
+    {
+        uint8_t reply[1 + sizeof(BleTransferClosed_t)] = { BLETRANSFER_CLOSED };
+        memcpy(reply + 1, &closed, sizeof(closed));
+        notify(notifyArg, reply, sizeof(reply));
+    }
+
+    void BleTransfer::receive(const uint8_t *packet, size_t length, uint32_t now)
+    {
+        if (!length) return;
+        lastPacket = now;
+
+        switch (packet[0]) {
+            case BLETRANSFER_OPEN:
+                handleOpen(packet + 1, length - 1, now);
+                break;
+
+            case BLETRANSFER_DATA:
+                handleData(packet + 1, length - 1);
+                break;
+
+            case BLETRANSFER_SYNC:
+                if (open) flush();
+                sendAck(0);
+                break;
+
+            case BLETRANSFER_CLOSE:
+                if (reading) handleReadClose(packet + 1, length - 1, now);
+                else handleClose(packet + 1, length - 1, now);
+                break;
+
+            case BLETRANSFER_READ:
+                handleRead(packet + 1, length - 1, now);
+                break;
+
+            case BLETRANSFER_READ_ACK:
+                handleReadAck(packet + 1, length - 1);
+                break;
+
+            case BLETRANSFER_LIST:
+                handleList(packet + 1, length - 1);
+                break;
+
+            case BLETRANSFER_STAT:
+                handleStat(packet + 1, length - 1);
+                break;
+        }
+    }
+
+    void BleTransfer::handleOpen(const uint8_t *payload, size_t length, uint32_t now)
+    {
+        BleTransferOpen_t request;
+        char path[USBFILE_PATH_SIZE + 1];
+
+        if (length < sizeof(request)) return sendOpened(BLETRANSFER_BAD_PACKET, 0, 0);
+        memcpy(&request, payload, sizeof(request));
+
+        bool image = request.fs == BLETRANSFER_FIRMWARE;
+        if (request.mtu < BLETRANSFER_DATA_HEADER + 4 ||
+            (image && (!firmware || request.mode != USBFILE_WRITE || length != sizeof(request))) ||
+            (!image && ((request.fs != USBFILE_SD && request.fs != USBFILE_SPIFFS) ||
+                        (request.mode != USBFILE_WRITE && request.mode != USBFILE_APPEND) ||
+                        !usbfile_copy_path(payload + sizeof(request), length - sizeof(request), path)))) {
+            return sendOpened(BLETRANSFER_BAD_PACKET, 0, 0);
+        }
+
+        close();
+
+        uint32_t size = 0;
+        if (image) {
+            BleTransferStatus_t status = firmware->begin(firmware->context);
+            if (status != BLETRANSFER_OK) return sendOpened(status, 0, 0);
+        }
+        else if (!files.open(files.context, (UsbFileSystemId_t) request.fs, path, (UsbFileMode_t) request.mode, size)) {
+            return sendOpened(filesBusy() ? BLETRANSFER_BUSY : BLETRANSFER_IO, 0, 0);
+        }
+
+        open = true;
+        flashing = image;
+        failed = false;
+        gapSent = false;
+        next = 0;
+        sinceAck = 0;
+        received = 0;
+        crc = 0;
+        buffered = 0;
+        opened = now;
+        sendOpened(BLETRANSFER_OK, size, request.mtu);
+    }
+
+    void BleTransfer::handleData(const uint8_t *payload, size_t length)
+    {
+        uint16_t sequence;
+
+        if (!open || length < sizeof(sequence)) return;
+        memcpy(&sequence, payload, sizeof(sequence));
+
+        // the window still in flight after a failed write gets the IO status, not the file
+        if (failed) return sendAck(0);
+
+        // a packet from before a go-back is already written
+        int16_t ahead = sequence - next;
+        if (ahead < 0) return;
+
+        // one after a hole is dropped, and the phone hears about it once
+        if (ahead > 0) {
+            if (!gapSent) {
+                gapSent = true;
+                ++gaps;
+                sendAck(BLETRANSFER_ACK_GAP);
+            }
+            return;
+        }
+
+        const uint8_t *data = payload + sizeof(sequence);
+        size_t size = length - sizeof(sequence);
+
+        gapSent = false;
+        ++next;
+        received += size;
+        crc = usbfile_crc32(data, size, crc);
+
+        while (size) {
+            size_t room = sizeof(buffer) - buffered;
+            size_t taken = size < room ? size : room;
+            memcpy(buffer + buffered, data, taken);
+            buffered += taken;
+            data += taken;
+            size -= taken;
+            if (buffered == sizeof(buffer) && !flush()) break;
+        }
+
+        if (failed || ++sinceAck >= BLETRANSFER_ACK_EVERY) sendAck(0);
+    }
+
+    void BleTransfer::handleClose(const uint8_t *payload, size_t length, uint32_t now)
+    {
+        uint32_t expected[2];       // length, CRC-32
+        BleTransferClosed_t closed;
+
+        memset(&closed, 0, sizeof(closed));
+        if (!open) closed.status = BLETRANSFER_NOT_OPEN;
+        else if (length != sizeof(expected) + (flashing ? BLETRANSFER_DIGEST_SIZE : 0)) closed.status = BLETRANSFER_BAD_PACKET;
+        else {
+            memcpy(expected, payload, sizeof(expected));
+
+            if (!flush()) closed.status = BLETRANSFER_IO;
+            else if (received < expected[0]) closed.status = BLETRANSFER_SHORT;
+            else if (received != expected[0] || crc != expected[1]) closed.status = BLETRANSFER_CRC;
+            else if (flashing && !firmware->end(firmware->context, payload + sizeof(expected))) closed.status = BLETRANSFER_VERIFY;
+            else closed.status = BLETRANSFER_OK;
+
+            closed.ack.status = failed ? BLETRANSFER_IO : BLETRANSFER_OK;
+            closed.ack.next = next;
+            closed.ack.received = received;
+            closed.crc = crc;
+            closed.elapsed = now - opened;
+
+            // short stays open for the rest; end() already dealt with the image either way
+            if (closed.status == BLETRANSFER_VERIFY) open = false;
+            else if (closed.status != BLETRANSFER_SHORT) finish(closed.status == BLETRANSFER_OK);
+
+            if (closed.status == BLETRANSFER_OK) {
+                lastBytes = received;
+                lastElapsed = closed.elapsed;
+                totalBytes += received;
+            }
+        }
+
+        sendClosed(closed);
+    }
+
+    void BleTransfer::handleRead(const uint8_t *payload, size_t length, uint32_t now)
+    {
+        BleTransferRead_t request;
+        char path[USBFILE_PATH_SIZE + 1];
+
+        if (length < sizeof(request)) return sendOpened(BLETRANSFER_BAD_PACKET, 0, 0);
+        memcpy(&request, payload, sizeof(request));
+
+        if (request.mtu < BLETRANSFER_DATA_HEADER + 4 ||
+            (request.fs != USBFILE_SD && request.fs != USBFILE_SPIFFS) ||
+            !usbfile_copy_path(payload + sizeof(request), length - sizeof(request), path)) {
+            return sendOpened(BLETRANSFER_BAD_PACKET, 0, 0);
+        }
+
+        close();
+
+        uint32_t size = 0;
+        if (!files.open(files.context, (UsbFileSystemId_t) request.fs, path, USBFILE_READ, size)) {
+            return sendOpened(filesBusy() ? BLETRANSFER_BUSY : BLETRANSFER_NOT_FOUND, 0, 0);
+        }
+        if (request.offset > size) {
+            files.close(files.context);
+            return sendOpened(BLETRANSFER_BAD_PACKET, size, 0);
+        }
+
+        uint16_t packet = request.mtu - 3 < BLETRANSFER_MAX_PACKET ? request.mtu - 3 : BLETRANSFER_MAX_PACKET;
+        reading = true;
+        dataSize = packet - BLETRANSFER_DATA_HEADER;
+        readStart = request.offset;
+        readSize = size;
+        readChunks = (size - readStart + dataSize - 1) / dataSize;
+        sendNext = 0;
+        readAcked = 0;
+        crcChunks = 0;
+        crc = 0;
+        buffered = 0;
+        opened = now;
+        sendOpened(BLETRANSFER_OK, size, request.mtu, true);
+    }
+
+    void BleTransfer::handleReadAck(const uint8_t *payload, size_t length)
+    {
+        BleTransferReadAck_t ack;
+
+        if (!reading || length != sizeof(ack)) return;
+        memcpy(&ack, payload, sizeof(ack));
+
+        // sequence numbers wrap on the wire, an ack past what went out is stale
+        uint16_t acked = ack.next - (uint16_t) readAcked;
+        if (acked > sendNext - readAcked) return;
+        readAcked += acked;
+
+        // a chunk the stack had no room for, or the phone waited and heard nothing
+        if (ack.flags & BLETRANSFER_ACK_GAP) {
+            chunksResent += sendNext - readAcked;
+            sendNext = readAcked;
+        }
+    }
+
+    // copies from the pieces the file is read in, which start at the download offset
+    bool BleTransfer::readFile(uint32_t offset, uint8_t *data, size_t length)
+    {
+        while (length) {
+            uint32_t piece = readStart + (offset - readStart) / USBFILE_CHUNK_SIZE * USBFILE_CHUNK_SIZE;
+            if (!buffered || piece != cacheOffset) {
+                // the read-ahead hands out whole chunks, so always ask for one
+                size_t wanted = readSize - piece < USBFILE_CHUNK_SIZE ? readSize - piece : USBFILE_CHUNK_SIZE;
+                buffered = files.read(files.context, piece, buffer, wanted);
+                cacheOffset = piece;
+                if (buffered != wanted) {
+                    buffered = 0;
+                    return false;
+                }
+            }
+
+            size_t start = offset - piece;
+            size_t taken = buffered - start < length ? buffered - start : length;
+            memcpy(data, buffer + start, taken);
+            data += taken;
+            offset += taken;
+            length -= taken;
+        }
+        return true;
+    }
+
+    bool BleTransfer::sendChunk(uint32_t chunk)
+    {
+        uint8_t packet[BLETRANSFER_MAX_PACKET] = { BLETRANSFER_CHUNK };
+        uint16_t sequence = chunk;
+        uint32_t offset = readStart + chunk * dataSize;
+        size_t size = readSize - offset < dataSize ? readSize - offset : dataSize;
+
+        if (!readFile(offset, packet + BLETRANSFER_DATA_HEADER, size)) return false;
+        memcpy(packet + 1, &sequence, sizeof(sequence));
+
+        // chunks go out in order, so the CRC takes each the first time
+        if (chunk == crcChunks) {
+            crc = usbfile_crc32(packet + BLETRANSFER_DATA_HEADER, size, crc);
+            bytesSent += size;
+            ++crcChunks;
+        }
+
+        notify(notifyArg, packet, BLETRANSFER_DATA_HEADER + size);
+        return true;
+    }
+
+    void BleTransfer::handleReadClose(const uint8_t *payload, size_t length, uint32_t now)
+    {
+        uint32_t expected[2];       // length, CRC-32 the phone received
+        BleTransferClosed_t closed;
+
+        memset(&closed, 0, sizeof(closed));
+        if (length != sizeof(expected)) {
+            closed.status = BLETRANSFER_BAD_PACKET;
+            return sendClosed(closed);
+        }
+        memcpy(expected, payload, sizeof(expected));
+
+        uint32_t sent = crcChunks == readChunks ? readSize - readStart : crcChunks * dataSize;
+        if (expected[0] < readSize - readStart) closed.status = BLETRANSFER_SHORT;
+        else if (expected[0] != sent || expected[1] != crc) closed.status = BLETRANSFER_CRC;
+        else closed.status = BLETRANSFER_OK;
+
+        closed.ack.next = sendNext;
+        closed.ack.received = sent;
+        closed.crc = crc;
+        closed.elapsed = now - opened;
+
+        // the phone carries on a short download by reading again from where it got to
+        endRead();
+        sendClosed(closed);
+    }
+
+    void BleTransfer::handleList(const uint8_t *payload, size_t length)
+    {
+        BleTransferList_t request;
+        char path[USBFILE_PATH_SIZE + 1];
+        char name[USBFILE_PATH_SIZE + 1];
+        uint8_t reply[BLETRANSFER_MAX_PACKET] = { BLETRANSFER_LISTED, BLETRANSFER_OK };
+        size_t used = 2;
+
+        if (length < sizeof(request)) {
+            reply[1] = BLETRANSFER_BAD_PACKET;
+            return notify(notifyArg, reply, used);
+        }
+        memcpy(&request, payload, sizeof(request));
+
+        if (request.mtu < BLETRANSFER_MIN_LIST_MTU ||
+            (request.fs != USBFILE_SD && request.fs != USBFILE_SPIFFS) ||
+            !usbfile_copy_path(payload + sizeof(request), length - sizeof(request), path)) {
+            reply[1] = BLETRANSFER_BAD_PACKET;
+            return notify(notifyArg, reply, used);
+        }
+        size_t room = request.mtu - 3u < sizeof(reply) ? request.mtu - 3u : sizeof(reply);
+
+        // as many entries as fit, none once past the last
+        for (uint16_t index = request.first; ; ++index) {
+            uint32_t size = 0;
+            bool directory = false;
+            int found = files.entry(files.context, (UsbFileSystemId_t) request.fs, path, index, name, size, directory);
+            if (found < 0 && used == 2) reply[1] = BLETRANSFER_NOT_FOUND;
+            if (found <= 0) break;
+
+            UsbFileEntry_t entry;
+            entry.size = size;
+            entry.flags = directory ? USBFILE_DIRECTORY : 0;
+            entry.nameLength = strlen(name);
+            if (used + sizeof(entry) + entry.nameLength > room) break;
+
+            memcpy(reply + used, &entry, sizeof(entry));
+            memcpy(reply + used + sizeof(entry), name, entry.nameLength);
+            used += sizeof(entry) + entry.nameLength;
+        }
+
+        notify(notifyArg, reply, used);
+    }
+
+    void BleTransfer::handleStat(const uint8_t *payload, size_t length)
+    {
+        char path[USBFILE_PATH_SIZE + 1];
+        uint8_t reply[1 + sizeof(BleTransferStat_t)] = { BLETRANSFER_STATED };
+        BleTransferStat_t stat;
+        uint32_t size = 0;
+        bool directory = false;
+
+        memset(&stat, 0, sizeof(stat));
+        if (length < 1 || (payload[0] != USBFILE_SD && payload[0] != USBFILE_SPIFFS) ||
+            !usbfile_copy_path(payload + 1, length - 1, path)) {
+            stat.status = BLETRANSFER_BAD_PACKET;
+        }
+        else if (!files.stat(files.context, (UsbFileSystemId_t) payload[0], path, size, directory)) {
+            stat.status = BLETRANSFER_NOT_FOUND;
+        }
+        else {
+            stat.status = BLETRANSFER_OK;
+            stat.size = size;
+            stat.flags = directory ? USBFILE_DIRECTORY : 0;
+        }
+
+        memcpy(reply + 1, &stat, sizeof(stat));
+        notify(notifyArg, reply, sizeof(reply));
+    }
+
+    void BleTransfer::poll(uint32_t now)
+    {
+        if (open && now - lastPacket >= BLETRANSFER_IDLE_TIMEOUT) finish(!flashing);
+        if (reading && now - lastPacket >= BLETRANSFER_IDLE_TIMEOUT) endRead();
+
+        while (sending()) {
+            if (sendChunk(sendNext)) {
+                ++sendNext;
+                continue;
+            }
+
+            // the card failed, the download is over
+            BleTransferClosed_t closed;
+            memset(&closed, 0, sizeof(closed));
+            closed.status = BLETRANSFER_IO;
+            closed.ack.status = BLETRANSFER_IO;
+            closed.ack.next = sendNext;
+            closed.crc = crc;
+            closed.elapsed = now - opened;
+            endRead();
+            sendClosed(closed);
+        }
+    }
+
+    uint32_t BleTransfer::lastRate() const
+    {
+        if (!lastBytes) return 0;
+        return (uint64_t) lastBytes * 1000 / (lastElapsed ? lastElapsed : 1);
+    }
+
+    void BleTransfer::stats(uint32_t &lastBytes, uint32_t &lastElapsed, uint32_t &totalBytes, uint32_t &gaps) const
+    {
+        lastBytes = this->lastBytes;
+        lastElapsed = this->lastElapsed;
+        totalBytes = this->totalBytes;
+        gaps = this->gaps;
+    }
+
+    void BleTransfer::readStats(uint32_t &bytesSent, uint32_t &chunksResent) const
+    {
+        bytesSent = this->bytesSent;
+        chunksResent = this->chunksResent;
+    }
+}
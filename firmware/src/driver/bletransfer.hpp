@@ -0,0 +1,278 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include "usbfile.hpp"
+
+// Bulk file transfer over BLE, on a characteristic of its own next to the command
+// characteristic of BLE_Callback_Coms.
+//
+// The phone negotiates the largest MTU it can and says what it got when opening
+// the file. Data goes as write-without-response packets of up to
+// BLETRANSFER_MAX_PACKET bytes, each carrying a sequence number, so the phone
+// streams a window of them without waiting on an ATT response per packet. The
+// device notifies a cumulative ack every ackEvery packets in order; a packet out
+// of sequence (dropped when the receive queue was full) is not written and an ack
+// flagged BLETRANSFER_ACK_GAP goes out once, telling the phone where to go back
+// to. Data is gathered into BLETRANSFER_WRITE_BUFFER sized writes, and the file
+// stays open from BLETRANSFER_OPEN to BLETRANSFER_CLOSE, which checks the length
+// and CRC-32 of what arrived.
+//
+// Opening BLETRANSFER_FIRMWARE instead of a file system streams a firmware image
+// into the update partition through BleTransferFirmware_t. Its close also carries
+// the SHA-256 of the image, and the image only becomes the one to boot once it
+// matches.
+//
+// Downloads go the other way round: BLETRANSFER_READ opens a file and the device
+// streams it in BLETRANSFER_CHUNK notifications sized to the MTU, each with a
+// sequence number. At most BLETRANSFER_READ_WINDOW go out before the phone acks
+// them, which is the flow control: the Bluetooth stack drops notifications it
+// has no buffer for, so never more are queued than it can hold. The file is read
+// in USBFILE_CHUNK_SIZE pieces through the file system's read-ahead, so the next
+// piece is already coming off the card while one is being sent. The phone closes
+// with the length and CRC-32 of what it got. BLETRANSFER_LIST and
+// BLETRANSFER_STAT look at the card without opening anything.
+//
+// Every packet is a BleTransferOp_t byte then its fields, little endian
+
+#define BLETRANSFER_MAX_MTU         517     // largest ATT MTU the device offers
+#define BLETRANSFER_MAX_PACKET      512     // largest attribute value
+#define BLETRANSFER_DATA_HEADER     3       // op, uint16 sequence
+#define BLETRANSFER_MAX_DATA        (BLETRANSFER_MAX_PACKET - BLETRANSFER_DATA_HEADER)
+#define BLETRANSFER_ACK_EVERY       8       // packets in order between acks
+#define BLETRANSFER_WINDOW          16      // packets the phone may have unacked, bounded by the receive queue
+#define BLETRANSFER_WRITE_BUFFER    4096    // bytes gathered before a file write
+#define BLETRANSFER_IDLE_TIMEOUT    10000   // ms without a packet before an open upload is given up
+#define BLETRANSFER_READ_ACK_EVERY  4       // chunks the phone acks at a time
+#define BLETRANSFER_READ_WINDOW     8       // chunks notified ahead of the phone's acks
+#define BLETRANSFER_MIN_LIST_MTU    (3 + 2 + 6 + USBFILE_PATH_SIZE)    // ATT header, op, status, then an entry with the longest name
+#define BLETRANSFER_FIRMWARE        0x80    // in place of a file system, for a firmware image
+#define BLETRANSFER_DIGEST_SIZE     32      // SHA-256
+
+namespace Driver
+{
+    enum BleTransferOp_t : uint8_t {
+        // phone to device
+        BLETRANSFER_OPEN = 0x01,        // BleTransferOpen_t then the path, notifies BLETRANSFER_OPENED
+        BLETRANSFER_DATA,               // uint16 sequence then the data, written without response
+        BLETRANSFER_SYNC,               // empty, notifies an ack straight away, for the end of the data or a lost ack
+        BLETRANSFER_CLOSE,              // uint32 length, uint32 CRC-32 of the data (then the SHA-256 for firmware), notifies BLETRANSFER_CLOSED
+        BLETRANSFER_READ,               // BleTransferRead_t then the path, notifies BLETRANSFER_OPENED then the chunks
+        BLETRANSFER_READ_ACK,           // BleTransferReadAck_t, written without response
+        BLETRANSFER_LIST,               // BleTransferList_t then the path, notifies BLETRANSFER_LISTED
+        BLETRANSFER_STAT,               // uint8 file system, path. Notifies BLETRANSFER_STATED
+
+        // device to phone
+        BLETRANSFER_OPENED = 0x81,      // BleTransferOpened_t
+        BLETRANSFER_ACK,                // BleTransferAck_t
+        BLETRANSFER_CLOSED,             // BleTransferClosed_t
+        BLETRANSFER_CHUNK,              // uint16 sequence then the data
+        BLETRANSFER_LISTED,             // uint8 BleTransferStatus_t then packed UsbFileEntry_t, none past the last entry
+        BLETRANSFER_STATED              // BleTransferStat_t
+    };
+
+    enum BleTransferStatus_t : uint8_t {
+        BLETRANSFER_OK = 0,
+        BLETRANSFER_BAD_PACKET,
+        BLETRANSFER_NOT_OPEN,
+        BLETRANSFER_IO,                 // the file could not be opened, read or written, the transfer is over
+        BLETRANSFER_SHORT,              // closing before all the data arrived, carry on from the ack in the reply
+        BLETRANSFER_CRC,                // the data arrived but does not match, the file is closed
+        BLETRANSFER_VERIFY,             // the firmware image failed its checks, the running firmware stays
+        BLETRANSFER_RESTARTING,         // the device restarts into the firmware that takes updates, reconnect and open again
+        BLETRANSFER_BUSY,               // the device won't restart for an update now, such as during a run, or USB-C has a file open
+        BLETRANSFER_NOT_FOUND           // nothing at the path to read or stat
+    };
+
+    #define BLETRANSFER_ACK_GAP     0x01    // a packet was out of sequence, resend from next
+
+    typedef struct __attribute__((packed)) {
+        uint8_t fs;                 // UsbFileSystemId_t or BLETRANSFER_FIRMWARE, which has no path
+        uint8_t mode;               // USBFILE_WRITE or USBFILE_APPEND, firmware is only written whole
+        uint16_t mtu;               // ATT MTU the phone negotiated
+    } BleTransferOpen_t;
+
+    typedef struct __attribute__((packed)) {
+        uint8_t status;             // BleTransferStatus_t
+        uint32_t size;              // file size, where the data carries on from
+        uint16_t dataSize;          // data bytes in a full packet
+        uint8_t ackEvery;
+        uint8_t window;
+    } BleTransferOpened_t;
+
+    typedef struct __attribute__((packed)) {
+        uint8_t status;             // BleTransferStatus_t
+        uint8_t flags;              // BLETRANSFER_ACK_GAP
+        uint16_t next;              // sequence expected next, every packet before it is in
+        uint32_t received;          // data bytes in since BLETRANSFER_OPEN
+    } BleTransferAck_t;
+
+    typedef struct __attribute__((packed)) {
+        uint8_t status;             // BleTransferStatus_t
+        BleTransferAck_t ack;       // where to carry on from after BLETRANSFER_SHORT
+        uint32_t crc;               // CRC-32 of the data received
+        uint32_t elapsed;           // ms from BLETRANSFER_OPEN
+    } BleTransferClosed_t;
+
+    typedef struct __attribute__((packed)) {
+        uint8_t fs;                 // UsbFileSystemId_t
+        uint16_t mtu;               // ATT MTU the phone negotiated
+        uint32_t offset;            // where to start, such as to carry on from a partial download
+    } BleTransferRead_t;
+
+    typedef struct __attribute__((packed)) {
+        uint8_t flags;              // BLETRANSFER_ACK_GAP
+        uint16_t next;              // chunk expected next, every one before it is in
+    } BleTransferReadAck_t;
+
+    typedef struct __attribute__((packed)) {
+        uint8_t fs;                 // UsbFileSystemId_t
+        uint16_t mtu;               // at least BLETRANSFER_MIN_LIST_MTU
+        uint16_t first;             // entry to start from, the count of those already listed
+    } BleTransferList_t;
+
+    typedef struct __attribute__((packed)) {
+        uint8_t status;             // BleTransferStatus_t
+        uint32_t size;
+        uint8_t flags;              // USBFILE_DIRECTORY
+    } BleTransferStat_t;
+
+    typedef struct {
+        void *context;
+
+        /**
+         * @brief Starts writing an image to the update partition
+         *
+         * @return BleTransferStatus_t BLETRANSFER_OK, BLETRANSFER_IO, or when this
+         *          firmware can't write it BLETRANSFER_RESTARTING or BLETRANSFER_BUSY
+         */
+        BleTransferStatus_t (*begin)(void *context);
+
+        bool (*write)(void *context, const uint8_t *data, size_t length);
+
+        /**
+         * @brief Checks the whole image against digest, and makes it the one to boot
+         *
+         * @return false it doesn't match or isn't a valid image, and has been thrown away
+         */
+        bool (*end)(void *context, const uint8_t *digest);
+
+        // throws away a partly written image
+        void (*abort)(void *context);
+    } BleTransferFirmware_t;
+
+    // sends one notification to the phone
+    typedef void (*BleTransferNotify)(void *arg, const uint8_t *data, size_t length);
+
+    class BleTransfer
+    {
+    private:
+        UsbFileSystem_t files;
+        const BleTransferFirmware_t *firmware;
+        BleTransferNotify notify;
+        void *notifyArg;
+
+        bool open;                  // an upload
+        bool flashing;              // the open upload is a firmware image
+        bool reading;               // a download
+        bool failed;                // a file write failed, every reply says so until the next open
+        bool gapSent;               // the gap ack for the current hole is out
+        uint16_t next;
+        uint8_t sinceAck;
+        uint32_t received;
+        uint32_t crc;
+        uint32_t opened;            // ms
+        uint32_t lastPacket;        // ms
+
+        // upload: data gathered for the next write. Download: the piece of the file last read
+        uint8_t buffer[BLETRANSFER_WRITE_BUFFER];
+        size_t buffered;
+
+        // download, chunks counted from the start offset
+        uint16_t dataSize;
+        uint32_t readStart;
+        uint32_t readSize;          // file size
+        uint32_t readChunks;
+        uint32_t sendNext;
+        uint32_t readAcked;
+        uint32_t crcChunks;         // chunks in crc, each is only counted the first time it goes out
+        uint32_t cacheOffset;
+        uint32_t bytesSent;
+        uint32_t chunksResent;
+
+        uint32_t lastBytes;
+        uint32_t lastElapsed;
+        uint32_t totalBytes;
+        uint32_t gaps;
+
+        bool flush();
+        void finish(bool keep=true);
+        void sendAck(uint8_t flags);
+        void sendOpened(BleTransferStatus_t status, uint32_t size, uint16_t mtu, bool download=false);
+        void sendClosed(const BleTransferClosed_t &closed);
+        bool sendChunk(uint32_t chunk);
+        bool readFile(uint32_t offset, uint8_t *data, size_t length);
+        void endRead();
+
+        // the other transport has the file open
+        bool filesBusy() const { return files.busy && files.busy(files.context); }
+
+        void handleOpen(const uint8_t *payload, size_t length, uint32_t now);
+        void handleData(const uint8_t *payload, size_t length);
+        void handleClose(const uint8_t *payload, size_t length, uint32_t now);
+        void handleReadClose(const uint8_t *payload, size_t length, uint32_t now);
+        void handleRead(const uint8_t *payload, size_t length, uint32_t now);
+        void handleReadAck(const uint8_t *payload, size_t length);
+        void handleList(const uint8_t *payload, size_t length);
+        void handleStat(const uint8_t *payload, size_t length);
+
+    public:
+        BleTransfer(const UsbFileSystem_t &files, BleTransferNotify notify, void *arg=nullptr);
+
+        /**
+         * @brief Takes firmware images as well as files. Without this they are refused
+         */
+        void setFirmware(const BleTransferFirmware_t *firmware);
+
+        /**
+         * @brief Takes one packet written by the phone. Notifications go out from
+         *          here, so call it from a task that may block on the file system
+         *
+         * @param now ms, for the idle timeout and throughput
+         */
+        void receive(const uint8_t *packet, size_t length, uint32_t now);
+
+        /**
+         * @brief Sends the download chunks the window has room for, and gives up
+         *          a transfer the phone went quiet on, such as after it disconnected
+         */
+        void poll(uint32_t now);
+
+        /**
+         * @brief Closes the open file, keeping what has arrived or ending the
+         *          download. A firmware image not closed whole is thrown away
+         */
+        void close();
+
+        bool active() const { return open || reading; }
+
+        /**
+         * @brief A download has chunks it can send now, so poll() straight away
+         */
+        bool sending() const { return reading && sendNext < readChunks && sendNext - readAcked < BLETRANSFER_READ_WINDOW; }
+
+        /**
+         * @brief Throughput of the last upload closed with the data complete
+         *
+         * @return uint32_t bytes per second, 0 before the first
+         */
+        uint32_t lastRate() const;
+
+        void stats(uint32_t &lastBytes, uint32_t &lastElapsed, uint32_t &totalBytes, uint32_t &gaps) const;
+
+        /**
+         * @brief Data bytes downloaded since boot, resends not counted, and chunks sent again after a gap
+         */
+        void readStats(uint32_t &bytesSent, uint32_t &chunksResent) const;
+    };
+}
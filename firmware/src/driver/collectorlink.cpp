@@ -0,0 +1,102 @@
+#include "collectorlink.hpp"
+#include <string.h>
+
+namespace Driver
+{
+    CollectorLink::CollectorLink(const CollectorUartOps_t &ops, CollectorFrameCallback onFrame, void *arg)
+        : ops(ops)
+        , onFrame(onFrame)
+        , onFrameArg(arg)
+        , lineLength(0)
+        , discarding(false)
+        , frames(0)
+        , droppedFrames(0)
+        , overflows(0)
+    { }
+
+    bool CollectorLink::send(const char *command)
+    {
+        uint8_t buffer[COLLECTOR_COMMAND_SIZE];
+        size_t length = strlen(command);
+        if (length + 1 > sizeof(buffer)) return false;
+
+        memcpy(buffer, command, length);
+        buffer[length++] = COLLECTOR_COMMAND_TERMINATOR;
+
+        return ops.write(ops.context, buffer, length) == (int) length;
+    }
+
+    void CollectorLink::feed(const uint8_t *data, size_t length)
+    {
+        for (size_t i = 0; i < length; ++i) {
+            char c = data[i];
+
+            if (c != COLLECTOR_LINE_TERMINATOR) {
+                if (lineLength < sizeof(line) - 1) {
+                    line[lineLength++] = c;
+                }
+                else if (!discarding) {
+                    discarding = true;
+                    ++droppedFrames;
+                }
+                continue;
+            }
+
+            if (!discarding) {
+                if (lineLength && line[lineLength - 1] == '\r') --lineLength;
+                line[lineLength] = '\0';
+
+                if (lineLength) {
+                    ++frames;
+                    if (onFrame) onFrame(line, lineLength, onFrameArg);
+                }
+            }
+
+            lineLength = 0;
+            discarding = false;
+        }
+    }
+
+    void CollectorLink::handleEvent(CollectorUartEvent_t event)
+    {
+        uint8_t buffer[COLLECTOR_FRAME_SIZE];
+
+        switch (event) {
+        case COLLECTOR_UART_PATTERN:
+            // read each line up to and including its terminator, so any bytes after it
+            // stay buffered until their own terminator arrives
+            for (int position = ops.popPattern(ops.context); position >= 0; position = ops.popPattern(ops.context)) {
+                size_t remaining = position + 1;
+
+                while (remaining) {
+                    size_t chunk = remaining < sizeof(buffer) ? remaining : sizeof(buffer);
+                    int received = ops.read(ops.context, buffer, chunk);
+                    if (received <= 0) break;
+
+                    feed(buffer, received);
+                    remaining -= received;
+                }
+            }
+            break;
+
+        case COLLECTOR_UART_OVERFLOW:
+            ++overflows;
+            reset();
+            break;
+
+        case COLLECTOR_UART_DATA:
+        default:
+            // partial line, it's read once its terminator is detected
+            break;
+        }
+    }
+
+    void CollectorLink::reset()
+    {
+        ops.flushInput(ops.context);
+
+        if (lineLength) ++droppedFrames;
+        lineLength = 0;
+        discarding = false;
+    }
+}
@@ -0,0 +1,86 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Hardware independent half of the collector port: frames received bytes into
+// lines and queues commands for transmit. The UART itself is reached through
+// CollectorUartOps_t so this can run against the IDF driver or a fake on the host
+
+#define COLLECTOR_FRAME_SIZE        64      // longest reply line, including the null terminator
+#define COLLECTOR_COMMAND_SIZE      72      // longest command, including its terminator
+#define COLLECTOR_LINE_TERMINATOR   '\n'    // the UART pattern detector matches one repeated character, so
+                                            // replies are framed on LF and the CR before it is stripped
+#define COLLECTOR_COMMAND_TERMINATOR '\r'
+
+namespace Driver
+{
+    typedef struct {
+        void *context;
+
+        // reads up to length buffered bytes without blocking, returns the number read or -1
+        int (*read)(void *context, uint8_t *data, size_t length);
+
+        // queues bytes for transmit, returns the number queued or -1
+        int (*write)(void *context, const uint8_t *data, size_t length);
+
+        // pops the buffer offset of the oldest detected terminator, -1 if there is none
+        int (*popPattern)(void *context);
+
+        // discards all received bytes and pending terminator positions
+        void (*flushInput)(void *context);
+    } CollectorUartOps_t;
+
+    enum CollectorUartEvent_t : uint8_t {
+        COLLECTOR_UART_DATA = 0,        // bytes arrived without a terminator
+        COLLECTOR_UART_PATTERN,         // a terminator was detected
+        COLLECTOR_UART_OVERFLOW         // the receive buffer or FIFO overflowed
+    };
+
+    typedef void (*CollectorFrameCallback)(const char *frame, size_t length, void *arg);
+
+    class CollectorLink
+    {
+    private:
+        CollectorUartOps_t ops;
+        CollectorFrameCallback onFrame;
+        void *onFrameArg;
+
+        char line[COLLECTOR_FRAME_SIZE];
+        size_t lineLength;
+        bool discarding;            // the current line overflowed and is dropped up to its terminator
+
+        uint32_t frames;
+        uint32_t droppedFrames;
+        uint32_t overflows;
+
+        void feed(const uint8_t *data, size_t length);
+
+    public:
+        CollectorLink(const CollectorUartOps_t &ops, CollectorFrameCallback onFrame, void *arg=nullptr);
+
+        /**
+         * @brief Queues a command followed by COLLECTOR_COMMAND_TERMINATOR in a
+         *          single write and returns without waiting for it to go out
+         * 
+         * @param command command without a terminator
+         * @return false The command is too long or was not queued in full
+         */
+        bool send(const char *command);
+
+        /**
+         * @brief Handles an event from the UART, delivering every complete line
+         *          to the frame callback
+         */
+        void handleEvent(CollectorUartEvent_t event);
+
+        /**
+         * @brief Drops any partial line and received bytes
+         */
+        void reset();
+
+        uint32_t frameCount() const { return frames; }
+        uint32_t droppedFrameCount() const { return droppedFrames; }
+        uint32_t overflowCount() const { return overflows; }
+    };
+}
@@ -0,0 +1,150 @@
+#include "collectorport.hpp"
+#include "console.hpp"
+#include <Arduino.h>
+#include <string.h>
+
+namespace Driver
+{
+    static QueueHandle_t _collectorEventQueue = nullptr;
+    static QueueHandle_t _collectorFrameQueue = nullptr;
+    static uint32_t _collectorQueueDrops = 0;
+
+    static int collector_uart_read(void *, uint8_t *data, size_t length)
+    {
+        return uart_read_bytes(COLLECTOR_UART, data, length, 0);
+    }
+
+    static int collector_uart_write(void *, const uint8_t *data, size_t length)
+    {
+        // copies into the TX ring buffer and returns, the ISR drains it into the FIFO.
+        // This only waits when more than COLLECTOR_TX_BUFFER_SIZE bytes are still unsent
+        return uart_write_bytes(COLLECTOR_UART, reinterpret_cast<const char *>(data), length);
+    }
+
+    static int collector_uart_pop_pattern(void *)
+    {
+        return uart_pattern_pop_pos(COLLECTOR_UART);
+    }
+
+    static void collector_uart_flush_input(void *)
+    {
+        uart_flush_input(COLLECTOR_UART);
+        uart_pattern_queue_reset(COLLECTOR_UART, COLLECTOR_PATTERN_QUEUE_SIZE);
+        xQueueReset(_collectorEventQueue);
+    }
+
+    static void collector_on_frame(const char *frame, size_t length, void *)
+    {
+        CollectorFrame_t message;
+        message.length = length;
+        memcpy(message.data, frame, length + 1);
+
+        if (xQueueSend(_collectorFrameQueue, &message, 0) != pdTRUE) ++_collectorQueueDrops;
+    }
+
+    static const CollectorUartOps_t _collectorUartOps = {
+        nullptr,
+        collector_uart_read,
+        collector_uart_write,
+        collector_uart_pop_pattern,
+        collector_uart_flush_input
+    };
+
+    static CollectorLink _collectorLink(_collectorUartOps, collector_on_frame);
+
+    static void CollectorPortTask(void *)
+    {
+        uart_event_t event;
+
+        while (true) {
+            if (xQueueReceive(_collectorEventQueue, &event, portMAX_DELAY) != pdTRUE) continue;
+
+            switch (event.type) {
+            case UART_PATTERN_DET:
+                _collectorLink.handleEvent(COLLECTOR_UART_PATTERN);
+                break;
+
+            case UART_FIFO_OVF:
+            case UART_BUFFER_FULL:
+                Driver::console.println("-> [COLLECTOR] Receive overflow, input flushed");
+                _collectorLink.handleEvent(COLLECTOR_UART_OVERFLOW);
+                break;
+
+            case UART_DATA:
+                _collectorLink.handleEvent(COLLECTOR_UART_DATA);
+                break;
+
+            default:
+                break;
+            }
+        }
+    }
+
+    bool collector_port_begin(uint32_t baud, int8_t rxPin, int8_t txPin)
+    {
+        if (_collectorEventQueue) return false;
+
+        uart_config_t config = {};
+        config.baud_rate = baud;
+        config.data_bits = UART_DATA_8_BITS;
+        config.parity = UART_PARITY_DISABLE;
+        config.stop_bits = UART_STOP_BITS_1;
+        config.flow_ctrl = UART_HW_FLOWCTRL_DISABLE;
+
+        if (uart_driver_install(COLLECTOR_UART,
+                                COLLECTOR_RX_BUFFER_SIZE,
+                                COLLECTOR_TX_BUFFER_SIZE,
+                                COLLECTOR_EVENT_QUEUE_SIZE,
+                                &_collectorEventQueue,
+                                0) != ESP_OK) {
+            return false;
+        }
+
+        ESP_ERROR_CHECK(uart_param_config(COLLECTOR_UART, &config));
+        ESP_ERROR_CHECK(uart_set_pin(COLLECTOR_UART, txPin, rxPin, UART_PIN_NO_CHANGE, UART_PIN_NO_CHANGE));
+
+        // one terminator character, no idle time required around it. The timeouts are in baud cycles
+        ESP_ERROR_CHECK(uart_enable_pattern_det_baud_intr(COLLECTOR_UART, COLLECTOR_LINE_TERMINATOR, 1, 1, 0, 0));
+        ESP_ERROR_CHECK(uart_pattern_queue_reset(COLLECTOR_UART, COLLECTOR_PATTERN_QUEUE_SIZE));
+
+        _collectorFrameQueue = xQueueCreate(COLLECTOR_FRAME_QUEUE_SIZE, sizeof(CollectorFrame_t));
+        assert(_collectorFrameQueue);
+
+        xTaskCreate(CollectorPortTask,
+                    "collector-port",
+                    COLLECTOR_STACK_SIZE,
+                    nullptr,
+                    2,
+                    nullptr
+                    );
+
+        return true;
+    }
+
+    bool collector_port_send(const char *command)
+    {
+        return _collectorLink.send(command);
+    }
+
+    bool collector_port_receive(CollectorFrame_t &frame, TickType_t wait)
+    {
+        return xQueueReceive(_collectorFrameQueue, &frame, wait) == pdTRUE;
+    }
+
+    void collector_port_flush()
+    {
+        xQueueReset(_collectorFrameQueue);
+    }
+
+    void collector_port_wait_sent(TickType_t wait)
+    {
+        uart_wait_tx_done(COLLECTOR_UART, wait);
+    }
+
+    void collector_port_stats(uint32_t &frames, uint32_t &dropped, uint32_t &overflows)
+    {
+        frames = _collectorLink.frameCount();
+        dropped = _collectorLink.droppedFrameCount() + _collectorQueueDrops;
+        overflows = _collectorLink.overflowCount();
+    }
+}
@@ -0,0 +1,60 @@
+#pragma once
+
+#include <stdint.h>
+#include <FreeRTOS.h>
+#include <driver/uart.h>
+#include "collectorlink.hpp"
+
+#define COLLECTOR_UART              UART_NUM_2
+#define COLLECTOR_RX_BUFFER_SIZE    1024
+#define COLLECTOR_TX_BUFFER_SIZE    512
+#define COLLECTOR_EVENT_QUEUE_SIZE  16
+#define COLLECTOR_PATTERN_QUEUE_SIZE 16
+#define COLLECTOR_FRAME_QUEUE_SIZE  8
+#define COLLECTOR_STACK_SIZE        3 * 1024
+
+namespace Driver
+{
+    typedef struct {
+        uint8_t length;
+        char data[COLLECTOR_FRAME_SIZE];    // null terminated, line terminator removed
+    } CollectorFrame_t;
+
+    /**
+     * @brief Installs the IDF UART driver on the collector port with a transmit
+     *          ring buffer and terminator detection, and starts the task that
+     *          turns UART events into frames
+     */
+    bool collector_port_begin(uint32_t baud, int8_t rxPin, int8_t txPin);
+
+    /**
+     * @brief Queues a command for transmit and returns without waiting for it to go out
+     * 
+     * @param command command without its terminator
+     * @return false The command was too long or not queued
+     */
+    bool collector_port_send(const char *command);
+
+    /**
+     * @brief Waits for the next received frame
+     * 
+     * @param wait ticks to wait
+     * @return false No frame arrived in time
+     */
+    bool collector_port_receive(CollectorFrame_t &frame, TickType_t wait);
+
+    /**
+     * @brief Discards received frames that nobody waited for
+     */
+    void collector_port_flush();
+
+    /**
+     * @brief Blocks until every queued byte has been sent
+     */
+    void collector_port_wait_sent(TickType_t wait=portMAX_DELAY);
+
+    /**
+     * @brief Frames received, dropped (too long or no room in the frame queue), and receive overflows
+     */
+    void collector_port_stats(uint32_t &frames, uint32_t &dropped, uint32_t &overflows);
+}
@@ -0,0 +1,83 @@
+#include "console.hpp"
+
+namespace Driver
+{
+    ConsoleSink console(Serial, CONSOLE_DROP_POLICY);
+
+    ConsoleSink::ConsoleSink(Print &output, ConsoleDropPolicy_t policy)
+        : output(output)
+        , ring(policy)
+        , task(nullptr)
+    {
+        portMUX_INITIALIZE(&lock);
+    }
+
+    void ConsoleSink::DrainTask(void *arg)
+    {
+        ConsoleSink *sink = static_cast<ConsoleSink *>(arg);
+        uint8_t chunk[CONSOLE_CHUNK_SIZE];
+
+        while (true) {
+            ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+            // the lock is only held to copy a chunk out, never while the UART sends it
+            while (true) {
+                portENTER_CRITICAL(&sink->lock);
+                size_t length = sink->ring.read(chunk, sizeof(chunk));
+                portEXIT_CRITICAL(&sink->lock);
+
+                if (!length) break;
+                sink->output.write(chunk, length);
+            }
+        }
+    }
+
+    bool ConsoleSink::begin()
+    {
+        if (task) return false;
+
+        if (xTaskCreate(DrainTask,
+                        "console",
+                        CONSOLE_STACK_SIZE,
+                        this,
+                        1,
+                        &task
+                        ) != pdPASS) {
+            return false;
+        }
+
+        xTaskNotifyGive(task);
+        return true;
+    }
+
+    size_t ConsoleSink::write(uint8_t c)
+    {
+        return write(&c, 1);
+    }
+
+    size_t ConsoleSink::write(const uint8_t *data, size_t length)
+    {
+        portENTER_CRITICAL(&lock);
+        size_t kept = ring.write(data, length);
+        portEXIT_CRITICAL(&lock);
+
+        if (kept && task) xTaskNotifyGive(task);
+        return kept;
+    }
+
+    void ConsoleSink::report(Stream &stream)
+    {
+        portENTER_CRITICAL(&lock);
+        uint32_t buffered = ring.size();
+        uint32_t highWater = ring.highWaterMark();
+        uint32_t dropped = ring.droppedBytes();
+        portEXIT_CRITICAL(&lock);
+
+        stream.printf("-> Console: %d bytes buffered (most %d of %d), %d bytes dropped (%s)\n",
+                      buffered,
+                      highWater,
+                      CONSOLE_RING_SIZE,
+                      dropped,
+                      CONSOLE_DROP_POLICY == CONSOLE_DROP_OLDEST ? "oldest first" : "newest first");
+    }
+}
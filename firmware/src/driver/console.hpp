@@ -0,0 +1,59 @@
+#pragma once
+
+#include <Arduino.h>
+#include <Print.h>
+#include <Stream.h>
+#include <FreeRTOS.h>
+#include "ConsoleRing.hpp"
+
+#define CONSOLE_RING_SIZE           2048        // bytes waiting for the UART, a power of two
+#define CONSOLE_CHUNK_SIZE          64          // bytes handed to the UART at a time
+#define CONSOLE_STACK_SIZE          2 * 1024
+
+#ifndef CONSOLE_DROP_POLICY
+#define CONSOLE_DROP_POLICY         CONSOLE_DROP_OLDEST
+#endif
+
+/**
+ * Console output that does not wait for the UART. At 9600 baud a line takes
+ * tens of milliseconds to send; printing through the console only formats it
+ * into a RAM ring and returns, and a low priority task writes the ring out.
+ * When the UART cannot keep up the ring drops by CONSOLE_DROP_POLICY and
+ * counts the bytes lost. Command replies on the USB-C port still print to
+ * Serial directly, this is for the UI and background tasks.
+ */
+namespace Driver
+{
+    class ConsoleSink : public Print
+    {
+    private:
+        Print &output;
+        ConsoleRing<CONSOLE_RING_SIZE> ring;
+        portMUX_TYPE lock;
+        TaskHandle_t task;
+
+        static void DrainTask(void *arg);
+
+    public:
+        ConsoleSink(Print &output, ConsoleDropPolicy_t policy);
+
+        /**
+         * @brief Starts the task writing to the UART. Text printed before is
+         *          kept until then
+         */
+        bool begin();
+
+        size_t write(uint8_t c) override;
+
+        /**
+         * @brief Queues text for the UART. Not for use from an ISR
+         *
+         * @return bytes kept, less than length when the ring dropped them
+         */
+        size_t write(const uint8_t *data, size_t length) override;
+
+        void report(Stream &stream);
+    };
+
+    extern ConsoleSink console;
+}
@@ -1,147 +1,392 @@
 #include "miclone.hpp"
+#include "console.hpp"
 #include <Arduino.h>
-#include <Stream.h>
 #include <FreeRTOS.h>
+#include <esp_timer.h>
 #include "../config.h"
+#include "../diagnostics/runrecorder.h"
+#include "../diagnostics/usage.h"
 
 #ifdef DEV_DEBUG
 #include "utils.h"
 #endif
 
+static_assert(MICLONE_MAX_PUMPS <= USAGE_MAX_PUMPS, "Usage accounting must cover every pump");
+
 namespace Driver
 {
-    // const char *MICLONE_FORMAT  = "/1ZJ0J0J3M3000J7gV3000IP3000V%dOD3000GJ3M15000J0R\r\n";
-    // const char *MICLONE_FORMAT  = "/1ZJ0J0J6gV3000IP3000OV%dD3000GJ2M30000J0R\r\n";
-    // const char *MICLONE_FORMAT  = "/1ZJ0J0J7gV3000IP3000OV%dD3000GJ3M30000J0R\r\n";
-    const char *MICLONE_FORMAT  = "/1ZJ0J0J7gV3000IP3000OV%dD3000GJ3M30000J0R\r\n";
-    
-    void MiCloneTask(void *args)
+    static uint32_t _miclonePollInterval = MICLONE_POLL_INTERVAL;
+
+    // requests from other tasks, handed to the scheduler by the run task
+    typedef struct {
+        MiCloneData_t run;
+        volatile bool start;
+        volatile bool stop;
+        uint8_t stopType;
+        bool recorded;                  // the run is logged by the run recorder
+        bool active;                    // a run was started and has not returned to idle
+        int64_t stopRequested;          // esp_timer time of the stop request, 0 if none
+    } MiCloneRequest_t;
+
+    static MiCloneRequest_t _micloneRequests[MICLONE_MAX_PUMPS];
+
+    static uint32_t _micloneStopLatency = 0;
+    static uint32_t _micloneStopLatencyMax = 0;
+
+    /* Collector port transport for the protocol exchanges, used with the bus semaphore held */
+
+    static bool miclone_port_send(void *, const char *command)
     {
-        #ifdef SAFE_CODE
-        // if (!args) {
-            // assert(false && "TODO: Implement this");
-            // vTaskDelete()
-        // }
-        #endif
+        return collector_port_send(command);
+    }
+
+    static bool miclone_port_receive(void *, char *line, size_t size, uint32_t timeout)
+    {
+        CollectorFrame_t frame;
+        if (!collector_port_receive(frame, timeout / portTICK_PERIOD_MS)) return false;
+
+        size_t length = frame.length < size - 1 ? frame.length : size - 1;
+        memcpy(line, frame.data, length);
+        line[length] = '\0';
+        return true;
+    }
+
+    static void miclone_port_flush(void *)
+    {
+        collector_port_flush();
+    }
+
+    static void miclone_port_sleep(void *, uint32_t ms)
+    {
+        vTaskDelay(ms / portTICK_PERIOD_MS);
+    }
+
+    static uint32_t miclone_port_millis(void *)
+    {
+        return millis();
+    }
+
+    static void miclone_port_reply(void *, const char *command, const MiCloneResponse_t &response)
+    {
+        if (response.error != MICLONE_ERROR_NONE) {
+            Driver::console.printf("-> [MICLONE] \"%s\" rejected: %s\n", command, miclone_error_str(response.error));
+        }
+    }
 
-        MiCloneData_t micloneData = *reinterpret_cast<MiCloneData_t *>(args);
-        free(args);
+    static const MiCloneTransport_t _micloneTransport = {
+        nullptr,
+        miclone_port_send,
+        miclone_port_receive,
+        miclone_port_flush,
+        miclone_port_sleep,
+        miclone_port_millis,
+        miclone_port_reply
+    };
 
-        for (int i = 0; i < 3; ++i) {
+    static MiCloneTiming_t miclone_timing(uint32_t timeout=MICLONE_RESPONSE_TIMEOUT)
+    {
+        MiCloneTiming_t timing = { timeout, MICLONE_ATTEMPTS, _miclonePollInterval, MICLONE_READY_TIMEOUT };
+        return timing;
+    }
+
+    static void miclone_on_state(void *, uint8_t pump, MiCloneState_t from, MiCloneState_t to);
 
-            miclone_send_start(micloneData.rate);
-            vTaskDelay(1000 / portTICK_PERIOD_MS);
+    static MiCloneScheduler _micloneScheduler(_micloneTransport, miclone_timing(), miclone_on_state);
+
+    static Diagnostics::RunStopReason_t miclone_stop_reason(MiCloneStopReason_t reason)
+    {
+        switch (reason) {
+        case MICLONE_STOP_MANUAL:   return Diagnostics::RUN_STOP_MANUAL;
+        case MICLONE_STOP_ERROR:    return Diagnostics::RUN_STOP_ERROR;
+        default:                    return Diagnostics::RUN_STOP_COMPLETE;
         }
+    }
+
+    // runs in the run task, from within the scheduler's step
+    static void miclone_on_state(void *, uint8_t pump, MiCloneState_t from, MiCloneState_t to)
+    {
+        MiCloneRequest_t &request = _micloneRequests[pump];
+        const MiClonePump_t &state = _micloneScheduler.pump(pump);
+
+        if (to == MICLONE_RUNNING) Diagnostics::usage_run_start(pump, state.rate);
+        if (from == MICLONE_RUNNING) Diagnostics::usage_run_end(pump);
 
-        
-        TickType_t sleepTime = micloneData.time ? (micloneData.time / portTICK_PERIOD_MS) : portMAX_DELAY;
-        Serial.printf("-> [MICLONE] timer is %dms and actual sleep time is: %d\n", micloneData.time, sleepTime);
-        vTaskDelay(sleepTime);
-        
-        for (int i = 0; i < 3; ++i) {
+        if (from == MICLONE_STARTING) {
+            if (request.recorded) Diagnostics::recorder_pump_ack(to == MICLONE_RUNNING);
 
-            miclone_send_stop();
-            vTaskDelay(1000 / portTICK_PERIOD_MS);
+            if (to == MICLONE_RUNNING) {
+                Driver::console.printf("-> [MICLONE] Pump %c running at %d ul/min for %dms\n", state.address, state.rate, state.runTime);
+            }
+            else if (state.reason == MICLONE_STOP_ERROR) {
+                Driver::console.printf("-> [MICLONE] Pump %c start failed: %s\n", state.address, miclone_result_str(state.stopResult));
+            }
         }
 
+        if (to != MICLONE_IDLE) return;
+
+        if (!state.acknowledged) {
+            Driver::console.printf("-> [MICLONE] Pump %c did not acknowledge the stop\n", state.address);
+        }
+
+        if (request.active && request.recorded) Diagnostics::recorder_stop_run(miclone_stop_reason(state.reason));
+
+        xSemaphoreTake(MiCloneHandlerSemaphore, portMAX_DELAY);
+        if (request.active && request.stopRequested) {
+            _micloneStopLatency = (esp_timer_get_time() - request.stopRequested) / 1000;
+            if (_micloneStopLatency > _micloneStopLatencyMax) _micloneStopLatencyMax = _micloneStopLatency;
+            Driver::console.printf("-> [MICLONE] Pump %c stopped in %dms\n", state.address, _micloneStopLatency);
+        }
+        request.stopRequested = 0;
+        request.active = false;
+        request.recorded = false;
+        xSemaphoreGive(MiCloneHandlerSemaphore);
+    }
+
+    // hands pending requests to the scheduler, a start before a stop so a quick
+    // start then stop cancels the run instead of being lost
+    static void miclone_apply_requests()
+    {
         xSemaphoreTake(MiCloneHandlerSemaphore, portMAX_DELAY);
-        TaskHandle_t thisTask = _MiCloneTaskHandler;
-        _MiCloneTaskHandler = nullptr;
 
-        Serial.println("[MICLONE] This task is done!");
+        for (uint8_t i = 0; i < _micloneScheduler.pumpCount(); ++i) {
+            MiCloneRequest_t &request = _micloneRequests[i];
+
+            if (request.start) {
+                request.active = _micloneScheduler.start(i, request.run.rate, request.run.time);
+                request.start = false;
+            }
+
+            if (request.stop) {
+                _micloneScheduler.stop(i, request.stopType);
+                request.stop = false;
+            }
+        }
 
         xSemaphoreGive(MiCloneHandlerSemaphore);
-        
-        vTaskDelete(thisTask);
     }
-    
-    bool miclone_begin(Stream *stream)
+
+    void MiCloneTask(void *args)
     {
-        if (MiCloneHandlerSemaphore) return false;
+        uint32_t wait = MICLONE_FOREVER;
 
-        _micloneStream = stream;
-        MiCloneHandlerSemaphore = xSemaphoreCreateMutex();
-        return true;
+        while (true) {
+            xTaskNotifyWait(0, MICLONE_NOTIFY_REQUEST, nullptr, wait == MICLONE_FOREVER ? portMAX_DELAY : wait / portTICK_PERIOD_MS);
+            miclone_apply_requests();
+
+            // the bus is released between commands, so passthrough commands can go out in between
+            xSemaphoreTake(MiCloneBusSemaphore, portMAX_DELAY);
+            wait = _micloneScheduler.step(millis());
+            xSemaphoreGive(MiCloneBusSemaphore);
+        }
     }
-    
-    bool miclone_start(uint16_t rate, uint32_t time)
+
+    bool miclone_begin(uint8_t pumps)
     {
-        xSemaphoreTake(MiCloneHandlerSemaphore, portMAX_DELAY);
-        
-        // task handler exists, so it's already started
-        if (_MiCloneTaskHandler) {
-            xSemaphoreGive(MiCloneHandlerSemaphore);
-            return false;
+        if (MiCloneHandlerSemaphore) return false;
+
+        MiCloneHandlerSemaphore = xSemaphoreCreateMutex();
+        MiCloneBusSemaphore = xSemaphoreCreateMutex();
+
+        for (uint8_t i = 0; i < pumps; ++i) {
+            if (!_micloneScheduler.addPump(miclone_pump_address(i))) break;
         }
 
-        MiCloneData_t *micloneData = reinterpret_cast<MiCloneData_t *>(malloc(sizeof(MiCloneData_t)));
-        micloneData->rate = rate;
-        micloneData->time = time;
-        
         _MiCloneTaskHandler = xTaskCreateStatic(MiCloneTask,
                           "miclone-tsk",
                           MICLONE_STACK_SIZE,
-                          micloneData,
+                          nullptr,
                           1,
                           _MiCloneStack,
                           &_MiCloneTaskBuffer
         );
 
-        xSemaphoreGive(MiCloneHandlerSemaphore);
         return true;
     }
-    
-    bool miclone_stop()
+
+    uint8_t miclone_pump_count()
+    {
+        return _micloneScheduler.pumpCount();
+    }
+
+    // queues a start, the handler semaphore must be held
+    static bool miclone_request_start(uint8_t pump, uint16_t rate, uint32_t time, bool recorded)
+    {
+        MiCloneRequest_t &request = _micloneRequests[pump];
+        if (request.start || request.stop || _micloneScheduler.pump(pump).state != MICLONE_IDLE) return false;
+
+        request.run.rate = rate;
+        request.run.time = time;
+        request.recorded = recorded;
+        request.start = true;
+        xTaskNotify(_MiCloneTaskHandler, MICLONE_NOTIFY_REQUEST, eSetBits);
+        return true;
+    }
+
+    bool miclone_start(uint16_t rate, uint32_t time, uint8_t pump)
     {
-        // nothing for now
+        if (pump >= miclone_pump_count()) return false;
+
         xSemaphoreTake(MiCloneHandlerSemaphore, portMAX_DELAY);
 
-        if (_MiCloneTaskHandler) {
-            vTaskSuspend(_MiCloneTaskHandler);
-            vTaskDelete(_MiCloneTaskHandler);
-            _MiCloneTaskHandler = nullptr;
-            // miclone_send_stop(0);
-            miclone_send_stop(2);
+        // the run recorder follows manual runs of the first pump
+        bool started = miclone_request_start(pump, rate, time, pump == 0);
+        if (started && pump == 0) Diagnostics::recorder_start_run(rate);
+
+        xSemaphoreGive(MiCloneHandlerSemaphore);
+        return started;
+    }
+
+    uint8_t miclone_last_status(uint8_t pump)
+    {
+        if (pump >= miclone_pump_count()) return 0;
+        return _micloneScheduler.pump(pump).lastStatus;
+    }
+
+    const MiClonePump_t &miclone_pump(uint8_t pump)
+    {
+        return _micloneScheduler.pump(pump);
+    }
+
+    bool miclone_running(uint8_t pump)
+    {
+        return miclone_state(pump) != MICLONE_IDLE;
+    }
+
+    MiCloneState_t miclone_state(uint8_t pump)
+    {
+        if (pump >= miclone_pump_count()) return MICLONE_IDLE;
+
+        // a start not yet picked up by the run task is already starting
+        if (_micloneRequests[pump].start) return MICLONE_STARTING;
+        return _micloneScheduler.pump(pump).state;
+    }
+
+    uint32_t miclone_elapsed(uint8_t pump)
+    {
+        if (pump >= miclone_pump_count()) return 0;
+        return _micloneScheduler.elapsed(pump, millis());
+    }
+
+    uint32_t miclone_remaining(uint8_t pump)
+    {
+        if (pump >= miclone_pump_count()) return 0;
+        return _micloneScheduler.remaining(pump, millis());
+    }
+
+    bool miclone_wait_idle(TickType_t wait, uint8_t pump)
+    {
+        TickType_t start = xTaskGetTickCount();
+        while (miclone_state(pump) != MICLONE_IDLE || _micloneRequests[pump].stop) {
+            if (xTaskGetTickCount() - start >= wait) return false;
+            vTaskDelay(10 / portTICK_PERIOD_MS);
         }
-        else {
-            miclone_send_stop(2);
+
+        return true;
+    }
+
+    void miclone_stop_latency(uint32_t &last, uint32_t &max)
+    {
+        last = _micloneStopLatency;
+        max = _micloneStopLatencyMax;
+    }
+
+    // queues a stop, the handler semaphore must be held. Returns whether a run was in progress
+    static bool miclone_request_stop(uint8_t pump, uint8_t stopType)
+    {
+        MiCloneRequest_t &request = _micloneRequests[pump];
+        MiCloneState_t state = miclone_state(pump);
+        bool running = state == MICLONE_STARTING || state == MICLONE_RUNNING;
+
+        if (running && !request.stopRequested) request.stopRequested = esp_timer_get_time();
+
+        // when idle the scheduler sends a forced stop, when already stopping this does nothing
+        if (state != MICLONE_STOPPING && !request.stop) {
+            request.stopType = stopType;
+            request.stop = true;
+            xTaskNotify(_MiCloneTaskHandler, MICLONE_NOTIFY_REQUEST, eSetBits);
         }
-        
+
+        return running;
+    }
+
+    bool miclone_stop(uint8_t pump)
+    {
+        if (pump >= miclone_pump_count()) return false;
+
+        xSemaphoreTake(MiCloneHandlerSemaphore, portMAX_DELAY);
+        bool running = miclone_request_stop(pump, 2);
         xSemaphoreGive(MiCloneHandlerSemaphore);
+
+        return running;
     }
-    
-    void miclone_send_start(uint16_t rate)
+
+    MiCloneResult_t miclone_send_start(uint16_t rate, uint8_t pump)
     {
-        _micloneStream->printf(MICLONE_FORMAT, rate / 5);
+        if (pump >= miclone_pump_count()) return MICLONE_REJECTED;
+
         #ifdef DEV_DEBUG
-        Serial.printf("Starting milone with rate %d and val %d", rate, rate/5);
-        Serial.printf(MICLONE_FORMAT, rate / 5);
+        Driver::console.printf("Starting milone with rate %d and val %d\n", rate, rate/5);
         #endif
+
+        xSemaphoreTake(MiCloneHandlerSemaphore, portMAX_DELAY);
+        bool requested = miclone_request_start(pump, rate, 0, false);
+        xSemaphoreGive(MiCloneHandlerSemaphore);
+        if (!requested) return MICLONE_REJECTED;
+
+        while (miclone_state(pump) == MICLONE_STARTING) vTaskDelay(10 / portTICK_PERIOD_MS);
+        if (miclone_state(pump) == MICLONE_RUNNING) return MICLONE_OK;
+
+        // rejected, unanswered or cancelled by a stop
+        MiCloneResult_t result = _micloneScheduler.pump(pump).stopResult;
+        return result == MICLONE_OK ? MICLONE_REJECTED : result;
     }
-    
-    void miclone_send_stop(uint8_t stopType)
+
+    bool miclone_send_stop(uint8_t stopType, uint8_t pump)
     {
-        Serial.println("[MICLONE] Sending stop signal");
-        _micloneStream->print("/1TR\r\n/1J0R\r\n");
+        if (pump >= miclone_pump_count()) return false;
 
-        if (stopType == 2) {
-            _micloneStream->print("/1J0TR\r\n");
-            return;
-        }
+        Driver::console.println("[MICLONE] Sending stop signal");
 
-        switch (stopType) {
-        case 1:
-            _micloneStream->print("/1\r\n");    // todo: find out when this special case happens
-        case 0:                                 // looks like it happens when device is already stopped and you call this again
-        default:
-            _micloneStream->print("/1\r\n");     // todo: analyze when this is specifically called. Looks like
-            break;                              // looks like it happens only when the collector is already running
-        
-        }
+        xSemaphoreTake(MiCloneHandlerSemaphore, portMAX_DELAY);
+        miclone_request_stop(pump, stopType);
+        xSemaphoreGive(MiCloneHandlerSemaphore);
+
+        miclone_wait_idle(portMAX_DELAY, pump);
+        return _micloneScheduler.pump(pump).acknowledged;
     }
-    
+
+    MiCloneResult_t miclone_transact(const char *command, MiCloneResponse_t *response, uint32_t timeout, uint8_t attempts)
+    {
+        MiCloneResponse_t reply;
+
+        xSemaphoreTake(MiCloneBusSemaphore, portMAX_DELAY);
+        MiCloneResult_t result = miclone_exchange(_micloneTransport, miclone_timing(timeout), command, reply, attempts);
+        xSemaphoreGive(MiCloneBusSemaphore);
+
+        if (response) *response = reply;
+        return result;
+    }
+
+    MiCloneResult_t miclone_query_status(MiCloneResponse_t &response, uint8_t pump)
+    {
+        char command[MICLONE_COMMAND_SIZE];
+        miclone_format_command(command, sizeof(command), miclone_pump_address(pump), "Q");
+        return miclone_transact(command, &response);
+    }
+
+    void miclone_set_poll_interval(uint32_t interval)
+    {
+        _miclonePollInterval = interval ? interval : 1;
+        _micloneScheduler.setPollInterval(_miclonePollInterval);
+    }
+
+    uint32_t miclone_get_poll_interval()
+    {
+        return _miclonePollInterval;
+    }
+
     SemaphoreHandle_t MiCloneHandlerSemaphore = nullptr;
-    Stream *_micloneStream = nullptr;
+    SemaphoreHandle_t MiCloneBusSemaphore = nullptr;
 
     TaskHandle_t _MiCloneTaskHandler = nullptr;
     StaticTask_t _MiCloneTaskBuffer;
@@ -2,66 +2,161 @@
 
 #include <stdint.h>
 #include <FreeRTOS.h>
-#include <Stream.h>
-#include <HardwareSerial.h>
+#include "micloneprotocol.hpp"
+#include "micloneschedule.hpp"
+#include "collectorport.hpp"
 
-#define MICLONE_STACK_SIZE 2 * 1024
+#define MICLONE_STACK_SIZE 3 * 1024
+
+// pumps on the collector port, addressed from "/1". Set with -DMICLONE_PUMP_COUNT in build_flags
+#ifndef MICLONE_PUMP_COUNT
+#define MICLONE_PUMP_COUNT          1
+#endif
+
+// run task notification bits
+#define MICLONE_NOTIFY_REQUEST      (1 << 0)
 
 namespace Driver
 {
-    extern const char *MICLONE_FORMAT;
-
     extern SemaphoreHandle_t MiCloneHandlerSemaphore;
-    extern Stream *_micloneStream;
-    
+    extern SemaphoreHandle_t MiCloneBusSemaphore;      // serializes command/reply pairs on the collector port
+
     // task information
     extern TaskHandle_t _MiCloneTaskHandler;
     extern StaticTask_t _MiCloneTaskBuffer;
     extern StackType_t _MiCloneStack[ MICLONE_STACK_SIZE ];
-    
+
     typedef struct {
 
         uint16_t rate;
         uint32_t time;
     } MiCloneData_t;
 
+    /**
+     * @brief Runs the scheduler for every pump. All pump commands go out from
+     *          this one task, interleaved on the collector port
+     */
     void MiCloneTask(void *args);
 
-    bool miclone_begin(Stream *stream=&Serial2);
+    /**
+     * @brief Initializes the driver and starts the run task. The collector port
+     *          must already be started with collector_port_begin()
+     *
+     * @param pumps number of pumps, addressed "/1" upwards
+     */
+    bool miclone_begin(uint8_t pumps=MICLONE_PUMP_COUNT);
+
+    uint8_t miclone_pump_count();
+
+    /**
+     * @brief Requests a run and returns without waiting for the controller
+     *
+     * @param rate flow rate
+     * @param time run length in ms, 0 runs until stopped
+     * @param pump pump index, counting from 0
+     * @return false A run is already in progress on the pump
+     */
+    bool miclone_start(uint16_t rate=300, uint32_t time=0, uint8_t pump=0);
+
+    /**
+     * @brief Current run state. Reads a single variable, cheap enough to poll every frame
+     */
+    MiCloneState_t miclone_state(uint8_t pump=0);
+
+    /**
+     * @brief ms since the controller accepted the run, 0 unless running
+     */
+    uint32_t miclone_elapsed(uint8_t pump=0);
+
+    /**
+     * @brief ms left in a timed run, MICLONE_FOREVER for an untimed run and 0 unless running
+     */
+    uint32_t miclone_remaining(uint8_t pump=0);
+
+    /**
+     * @brief Waits for a pump to return to idle
+     *
+     * @return false Still not idle after wait
+     */
+    bool miclone_wait_idle(TickType_t wait, uint8_t pump=0);
+
+    /**
+     * @brief Time from a stop request to idle, for the last stop and the slowest
+     *          stop since boot, on any pump
+     */
+    void miclone_stop_latency(uint32_t &last, uint32_t &max);
+
+    /**
+     * @brief Status byte of the last reply from a pump's controller
+     */
+    uint8_t miclone_last_status(uint8_t pump=0);
+
+    /**
+     * @brief Scheduler view of a pump, for status displays
+     */
+    const MiClonePump_t &miclone_pump(uint8_t pump);
 
     /**
-     * @brief Starts the MiClone software
-     * 
-     * @param rate 
-     * @param time 
-     * @return true 
-     * @return false 
+     * @brief Whether a run is in progress on the pump
      */
-    bool miclone_start(uint16_t rate=300, uint32_t time=0);
+    bool miclone_running(uint8_t pump=0);
 
     /**
      * @brief High level function to stop bioaersol collector. Use this function tas
-     *          the primary method to stop the collector
-     * 
-     * @return true Stop successful
-     * @return false The driver did not see that the controller is running, but a force
+     *          the primary method to stop the collector. The run task cancels the run
+     *          after at most the command it is waiting on, so this returns immediately.
+     *          Use miclone_wait_idle() to wait for the stop to complete
+     *
+     * @return true A run was in progress and is stopping
+     * @return false The driver did not see that the controller is running. A force
      *              stop command is sent anyway
      */
-    bool miclone_stop();
-    
+    bool miclone_stop(uint8_t pump=0);
+
     /**
      * @brief Initializes bioaerosol collector
      */
     void miclone_initialize();
 
-    void miclone_send_start(uint16_t rate);
+    /**
+     * @brief Starts an untimed run and waits for the controller to accept it.
+     *          For callers that sequence runs themselves, such as programs
+     *
+     * @param rate flow rate
+     * @return MiCloneResult_t MICLONE_OK once the controller is running the program
+     */
+    MiCloneResult_t miclone_send_start(uint16_t rate, uint8_t pump=0);
 
     /**
-     * @brief Sends stop command to RS232. This should not normally called
-     *          and instead, you should rely on miclone_stop()
-     * 
-     * @param stopType stop type mode. Use stopType 1 when forcing a stop
+     * @brief Stops a pump and waits until it is idle. This should not normally
+     *          called and instead, you should rely on miclone_stop()
+     *
+     * @param stopType stop type mode. Use stopType 2 when forcing a stop
+     * @return true The controller acknowledged the stop and is idle
      */
-    void miclone_send_stop(uint8_t stopType=1);
+    bool miclone_send_stop(uint8_t stopType=1, uint8_t pump=0);
+
+    /**
+     * @brief Sends one command and waits for its reply, between the scheduler's
+     *          own commands. A command is only sent again when no valid reply
+     *          arrives in time or the controller reports a transient error
+     *
+     * @param command command without the line terminator, such as "/1TR"
+     * @param response optional, receives the last reply
+     * @param timeout ms to wait for each reply
+     * @param attempts maximum number of sends
+     */
+    MiCloneResult_t miclone_transact(const char *command,
+                                     MiCloneResponse_t *response=nullptr,
+                                     uint32_t timeout=MICLONE_RESPONSE_TIMEOUT,
+                                     uint8_t attempts=MICLONE_ATTEMPTS);
+
+    /**
+     * @brief Queries a pump's controller status ("/1Q")
+     */
+    MiCloneResult_t miclone_query_status(MiCloneResponse_t &response, uint8_t pump=0);
+
+    void miclone_set_poll_interval(uint32_t interval);
+    uint32_t miclone_get_poll_interval();
 
 }
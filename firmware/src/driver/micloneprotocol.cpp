@@ -0,0 +1,125 @@
+#include "micloneprotocol.hpp"
+#include <stdio.h>
+#include <string.h>
+
+namespace Driver
+{
+    bool miclone_parse_response(const char *buffer, size_t length, MiCloneResponse_t &response)
+    {
+        memset(&response, 0, sizeof(response));
+
+        // find the start of the frame addressed to the master
+        size_t start = 0;
+        while (start + 1 < length && !(buffer[start] == '/' && buffer[start + 1] == MICLONE_MASTER_ADDRESS)) {
+            ++start;
+        }
+
+        // need at least the address, status byte and ETX
+        if (start + 3 >= length) return false;
+
+        const char *etx = reinterpret_cast<const char *>(memchr(buffer + start, MICLONE_ETX, length - start));
+        if (!etx) return false;
+
+        size_t statusIndex = start + 2;
+        if (buffer + statusIndex >= etx) return false;
+
+        uint8_t status = static_cast<uint8_t>(buffer[statusIndex]);
+
+        // every status byte has bit 6 set, anything else is line noise
+        if (!(status & 0x40)) return false;
+
+        response.status = status;
+        response.ready = status & MICLONE_STATUS_READY_BIT;
+        response.error = static_cast<MiCloneError_t>(status & MICLONE_STATUS_ERROR_MASK);
+
+        size_t dataLength = etx - (buffer + statusIndex + 1);
+        if (dataLength >= MICLONE_RESPONSE_DATA_SIZE) dataLength = MICLONE_RESPONSE_DATA_SIZE - 1;
+
+        memcpy(response.data, buffer + statusIndex + 1, dataLength);
+        response.data[dataLength] = '\0';
+        response.dataLength = dataLength;
+
+        return true;
+    }
+
+    bool miclone_error_is_transient(MiCloneError_t error)
+    {
+        // the command buffer was full, it will accept the command once it drains
+        return error == MICLONE_ERROR_COMMAND_OVERFLOW;
+    }
+
+    const char *miclone_error_str(MiCloneError_t error)
+    {
+        switch (error) {
+        case MICLONE_ERROR_NONE:                return "no error";
+        case MICLONE_ERROR_INITIALIZATION:      return "initialization error";
+        case MICLONE_ERROR_INVALID_COMMAND:     return "invalid command";
+        case MICLONE_ERROR_INVALID_OPERAND:     return "invalid operand";
+        case MICLONE_ERROR_INVALID_SEQUENCE:    return "invalid command sequence";
+        case MICLONE_ERROR_EEPROM:              return "EEPROM failure";
+        case MICLONE_ERROR_NOT_INITIALIZED:     return "device not initialized";
+        case MICLONE_ERROR_PLUNGER_OVERLOAD:    return "plunger overload";
+        case MICLONE_ERROR_VALVE_OVERLOAD:      return "valve overload";
+        case MICLONE_ERROR_MOVE_NOT_ALLOWED:    return "plunger move not allowed";
+        case MICLONE_ERROR_COMMAND_OVERFLOW:    return "command overflow";
+        default:                                return "unknown error";
+        }
+    }
+
+    const char *miclone_result_str(MiCloneResult_t result)
+    {
+        switch (result) {
+        case MICLONE_OK:            return "ok";
+        case MICLONE_TIMEOUT:       return "no reply";
+        case MICLONE_REJECTED:      return "rejected";
+        case MICLONE_NOT_RUNNING:   return "not running";
+        default:                    return "unknown";
+        }
+    }
+
+    MiCloneResult_t miclone_exchange(const MiCloneTransport_t &transport,
+                                     const MiCloneTiming_t &timing,
+                                     const char *command,
+                                     MiCloneResponse_t &response,
+                                     uint8_t attempts)
+    {
+        MiCloneResult_t result = MICLONE_TIMEOUT;
+        char line[MICLONE_LINE_SIZE];
+        memset(&response, 0, sizeof(response));
+
+        for (uint8_t attempt = 0; attempt < attempts; ++attempt) {
+            // discard stale lines so they are not mistaken for this reply
+            transport.flush(transport.context);
+            if (!transport.send(transport.context, command)) break;
+
+            // skip lines that are not replies, such as noise, until the timeout
+            bool replied = false;
+            uint32_t start = transport.millis(transport.context);
+
+            while (!replied) {
+                uint32_t elapsed = transport.millis(transport.context) - start;
+                if (elapsed >= timing.timeout) break;
+                if (!transport.receive(transport.context, line, sizeof(line), timing.timeout - elapsed)) break;
+                replied = miclone_parse_response(line, strlen(line), response);
+            }
+
+            if (!replied) {
+                result = MICLONE_TIMEOUT;
+                continue;
+            }
+
+            if (transport.onReply) transport.onReply(transport.context, command, response);
+
+            if (response.error == MICLONE_ERROR_NONE) {
+                result = MICLONE_OK;
+                break;
+            }
+
+            result = MICLONE_REJECTED;
+            if (!miclone_error_is_transient(response.error)) break;
+            transport.sleep(transport.context, timing.pollInterval);
+        }
+
+        return result;
+    }
+}
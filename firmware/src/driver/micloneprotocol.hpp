@@ -0,0 +1,121 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Pump controller protocol: reply parsing and the command/reply exchange used by
+// the driver. Nothing here depends on the ESP32, so it also builds natively against
+// the simulator in tools/
+
+// pump controller reply framing: [0xFF] '/' '0' <status> [data...] ETX CR LF
+#define MICLONE_ETX                 0x03
+#define MICLONE_MASTER_ADDRESS      '0'
+#define MICLONE_RESPONSE_DATA_SIZE  32
+
+// status byte layout
+#define MICLONE_STATUS_READY_BIT    0x20
+#define MICLONE_STATUS_ERROR_MASK   0x0F
+
+#define MICLONE_COMMAND_SIZE        64
+#define MICLONE_LINE_SIZE           64      // longest received line the exchanges read
+#define MICLONE_RESPONSE_TIMEOUT    500     // ms to wait for a reply to a single command
+#define MICLONE_ATTEMPTS            3       // sends per command before giving up
+#define MICLONE_POLL_INTERVAL       100     // default ms between status polls
+#define MICLONE_READY_TIMEOUT       5000    // ms to wait for the controller to go idle after a stop
+
+#define MICLONE_START_FORMAT        "ZJ0J0J7gV3000IP3000OV%dD3000GJ3M30000J0R"     // after the address, takes rate / 5
+
+namespace Driver
+{
+    enum MiCloneError_t : uint8_t {
+        MICLONE_ERROR_NONE                  = 0,
+        MICLONE_ERROR_INITIALIZATION        = 1,
+        MICLONE_ERROR_INVALID_COMMAND       = 2,
+        MICLONE_ERROR_INVALID_OPERAND       = 3,
+        MICLONE_ERROR_INVALID_SEQUENCE      = 4,
+        MICLONE_ERROR_EEPROM                = 6,
+        MICLONE_ERROR_NOT_INITIALIZED       = 7,
+        MICLONE_ERROR_PLUNGER_OVERLOAD      = 9,
+        MICLONE_ERROR_VALVE_OVERLOAD        = 10,
+        MICLONE_ERROR_MOVE_NOT_ALLOWED      = 11,
+        MICLONE_ERROR_COMMAND_OVERFLOW      = 15
+    };
+
+    enum MiCloneResult_t : uint8_t {
+        MICLONE_OK = 0,
+        MICLONE_TIMEOUT,            // no well-formed reply within the timeout on any attempt
+        MICLONE_REJECTED,           // the controller replied with an error code
+        MICLONE_NOT_RUNNING         // the controller replied ready when it should be running a program
+    };
+
+    typedef struct {
+        uint8_t status;                             // raw status byte
+        bool ready;                                 // false while the controller is executing a command
+        MiCloneError_t error;
+        char data[MICLONE_RESPONSE_DATA_SIZE];      // null terminated reply data, if any
+        uint8_t dataLength;
+    } MiCloneResponse_t;
+
+    /**
+     * @brief Parses a reply from the pump controller. Bytes before the start
+     *          of the frame (such as the 0xFF line turnaround byte) are skipped
+     * 
+     * @param buffer received bytes, up to and including ETX
+     * @param length number of bytes in buffer
+     * @param response parsed reply
+     * @return true A complete, well-formed reply was found
+     * @return false The reply was incomplete or corrupted
+     */
+    bool miclone_parse_response(const char *buffer, size_t length, MiCloneResponse_t &response);
+
+    /**
+     * @brief Whether a command that failed with this error is worth sending again
+     */
+    bool miclone_error_is_transient(MiCloneError_t error);
+
+    const char *miclone_error_str(MiCloneError_t error);
+
+    const char *miclone_result_str(MiCloneResult_t result);
+
+    /**
+     * @brief How the exchanges reach the controller. Times are in ms
+     */
+    typedef struct {
+        void *context;
+
+        // queues a command without its terminator
+        bool (*send)(void *context, const char *command);
+
+        // waits up to timeout for the next received line, null terminated
+        bool (*receive)(void *context, char *line, size_t size, uint32_t timeout);
+
+        // discards lines received so far
+        void (*flush)(void *context);
+
+        void (*sleep)(void *context, uint32_t ms);
+        uint32_t (*millis)(void *context);
+
+        // optional, sees every well-formed reply
+        void (*onReply)(void *context, const char *command, const MiCloneResponse_t &response);
+    } MiCloneTransport_t;
+
+    typedef struct {
+        uint32_t timeout;           // ms to wait for each reply
+        uint8_t attempts;           // sends per command before giving up
+        uint32_t pollInterval;      // ms between status polls and between retries
+        uint32_t readyTimeout;      // ms to wait for the controller to go idle after a stop
+    } MiCloneTiming_t;
+
+    /**
+     * @brief Sends one command and waits for its reply. The command is only sent
+     *          again when no valid reply arrives in time or the controller
+     *          reports a transient error
+     * 
+     * @param response receives the last reply
+     */
+    MiCloneResult_t miclone_exchange(const MiCloneTransport_t &transport,
+                                     const MiCloneTiming_t &timing,
+                                     const char *command,
+                                     MiCloneResponse_t &response,
+                                     uint8_t attempts);
+}
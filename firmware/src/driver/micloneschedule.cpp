@@ -0,0 +1,314 @@
+#include "micloneschedule.hpp"
+#include <stdio.h>
+#include <string.h>
+
+namespace Driver
+{
+    // wrap-safe "now is at or after time" on the ms clock
+    static bool reached(uint32_t now, uint32_t time)
+    {
+        return (int32_t) (now - time) >= 0;
+    }
+
+    MiCloneScheduler::MiCloneScheduler(const MiCloneTransport_t &transport, const MiCloneTiming_t &timing,
+                                       MiCloneStateCallback onState, void *arg)
+        : transport(transport)
+        , timing(timing)
+        , onState(onState)
+        , onStateArg(arg)
+        , numPumps(0)
+        , next(0)
+    {
+        memset(pumps, 0, sizeof(pumps));
+    }
+
+    bool MiCloneScheduler::addPump(char address)
+    {
+        if (numPumps == MICLONE_MAX_PUMPS) return false;
+
+        MiClonePump_t &pump = pumps[numPumps++];
+        memset(&pump, 0, sizeof(pump));
+        pump.address = address;
+        pump.state = MICLONE_IDLE;
+        return true;
+    }
+
+    bool MiCloneScheduler::start(uint8_t index, uint16_t rate, uint32_t time)
+    {
+        if (index >= numPumps) return false;
+
+        MiClonePump_t &pump = pumps[index];
+        if (pump.state != MICLONE_IDLE) return false;
+
+        pump.rate = rate;
+        pump.runTime = time;
+        pump.runStart = 0;
+        pump.phase = MICLONE_PHASE_START;
+        pump.attempt = 0;
+        pump.due = transport.millis(transport.context);
+        setState(index, MICLONE_STARTING);
+        return true;
+    }
+
+    bool MiCloneScheduler::stop(uint8_t index, uint8_t stopType)
+    {
+        if (index >= numPumps) return false;
+
+        MiClonePump_t &pump = pumps[index];
+        bool running = pump.state == MICLONE_STARTING || pump.state == MICLONE_RUNNING;
+
+        // nothing to do when already stopping
+        if (pump.state != MICLONE_STOPPING) {
+            beginStop(index, MICLONE_STOP_MANUAL, stopType, transport.millis(transport.context));
+        }
+
+        return running;
+    }
+
+    bool MiCloneScheduler::hasWork(const MiClonePump_t &pump) const
+    {
+        return pump.state != MICLONE_IDLE;
+    }
+
+    void MiCloneScheduler::setState(uint8_t index, MiCloneState_t state)
+    {
+        MiCloneState_t from = pumps[index].state;
+        pumps[index].state = state;
+        if (onState && from != state) onState(onStateArg, index, from, state);
+    }
+
+    void MiCloneScheduler::beginStop(uint8_t index, MiCloneStopReason_t reason, uint8_t stopType, uint32_t now)
+    {
+        MiClonePump_t &pump = pumps[index];
+        pump.reason = reason;
+        pump.stopResult = reason == MICLONE_STOP_ERROR ? pump.lastResult : MICLONE_OK;
+        pump.stopType = stopType;
+        pump.phase = MICLONE_PHASE_TERMINATE;
+        pump.attempt = 0;
+        pump.due = now;
+        setState(index, MICLONE_STOPPING);
+    }
+
+    void MiCloneScheduler::finishStop(uint8_t index, bool acknowledged)
+    {
+        MiClonePump_t &pump = pumps[index];
+        pump.acknowledged = acknowledged;
+        pump.phase = MICLONE_PHASE_NONE;
+        pump.runStart = 0;
+        setState(index, MICLONE_IDLE);
+    }
+
+    MiCloneResult_t MiCloneScheduler::send(MiClonePump_t &pump, const char *body, MiCloneResponse_t &response)
+    {
+        char command[MICLONE_COMMAND_SIZE];
+        miclone_format_command(command, sizeof(command), pump.address, body);
+
+        // a single attempt, retries are rescheduled so other pumps get the line in between
+        MiCloneResult_t result = miclone_exchange(transport, timing, command, response, 1);
+
+        ++pump.commands;
+        pump.lastResult = result;
+        if (result != MICLONE_TIMEOUT) pump.lastStatus = response.status;
+        if (result != MICLONE_OK) ++pump.failures;
+
+        return result;
+    }
+
+    bool MiCloneScheduler::retry(MiClonePump_t &pump, uint32_t now)
+    {
+        if (++pump.attempt >= timing.attempts) return false;
+        pump.due = now + timing.pollInterval;
+        return true;
+    }
+
+    void MiCloneScheduler::run(uint8_t index, uint32_t now)
+    {
+        MiClonePump_t &pump = pumps[index];
+        MiCloneResponse_t response;
+        MiCloneResult_t result;
+
+        switch (pump.phase) {
+        case MICLONE_PHASE_START: {
+            char program[MICLONE_COMMAND_SIZE];
+            snprintf(program, sizeof(program), MICLONE_START_FORMAT, pump.rate / 5);
+
+            result = send(pump, program, response);
+            now = transport.millis(transport.context);
+            if (result == MICLONE_OK) break;
+
+            if (result == MICLONE_TIMEOUT) {
+                // the reply was lost, but the program may have started. Sending it again
+                // to a running controller would only be rejected, so ask first
+                pump.phase = MICLONE_PHASE_START_CONFIRM;
+                pump.due = now;
+                return;
+            }
+
+            if (!miclone_error_is_transient(response.error) || !retry(pump, now)) {
+                beginStop(index, MICLONE_STOP_ERROR, 1, now);
+            }
+            return;
+        }
+
+        case MICLONE_PHASE_START_CONFIRM:
+            result = send(pump, "Q", response);
+            now = transport.millis(transport.context);
+            if (result == MICLONE_OK && !response.ready) break;
+
+            // a ready controller never got the program, so it is sent again
+            if (result == MICLONE_OK) pump.lastResult = MICLONE_NOT_RUNNING;
+            pump.phase = MICLONE_PHASE_START;
+            if (!retry(pump, now)) beginStop(index, MICLONE_STOP_ERROR, 1, now);
+            return;
+
+        case MICLONE_PHASE_STATUS: {
+            if (pump.runTime && reached(now, pump.runStart + pump.runTime)) {
+                beginStop(index, MICLONE_STOP_COMPLETE, 1, now);
+                return;
+            }
+
+            result = send(pump, "Q", response);
+            now = transport.millis(transport.context);
+
+            // a running controller is busy, an idle or failed one has lost its program
+            if ((result == MICLONE_OK && response.ready) ||
+                (result == MICLONE_REJECTED && !miclone_error_is_transient(response.error))) {
+                if (result == MICLONE_OK) pump.lastResult = MICLONE_NOT_RUNNING;
+                beginStop(index, MICLONE_STOP_ERROR, 1, now);
+                return;
+            }
+
+            // an unanswered or overflowed poll is tried again at the next interval
+            pump.due = now + MICLONE_STATUS_INTERVAL;
+            if (pump.runTime && reached(pump.due, pump.runStart + pump.runTime)) pump.due = pump.runStart + pump.runTime;
+            return;
+        }
+
+        case MICLONE_PHASE_TERMINATE:
+            result = send(pump, "TR", response);
+            now = transport.millis(transport.context);
+
+            if (result == MICLONE_TIMEOUT || (result == MICLONE_REJECTED && miclone_error_is_transient(response.error))) {
+                // an unanswered terminate means the controller is not listening, don't wait on the rest
+                if (!retry(pump, now)) finishStop(index, false);
+                return;
+            }
+
+            // the controller overflows on any command sent before the plunger comes to rest
+            pump.phase = response.ready ? MICLONE_PHASE_VALVE : MICLONE_PHASE_SETTLE;
+            pump.attempt = 0;
+            pump.due = now;
+            pump.deadline = now + timing.readyTimeout;
+            return;
+
+        case MICLONE_PHASE_VALVE:
+        case MICLONE_PHASE_VALVE_TERMINATE:
+            result = send(pump, pump.phase == MICLONE_PHASE_VALVE ? "J0R" : "J0TR", response);
+            now = transport.millis(transport.context);
+
+            if (result != MICLONE_OK) {
+                bool transient = result == MICLONE_TIMEOUT || miclone_error_is_transient(response.error);
+                if (!transient || !retry(pump, now)) finishStop(index, false);
+                return;
+            }
+
+            pump.phase = pump.phase == MICLONE_PHASE_VALVE && pump.stopType == 2 ? MICLONE_PHASE_VALVE_TERMINATE : MICLONE_PHASE_READY;
+            pump.attempt = 0;
+            pump.due = now;
+            pump.deadline = now + timing.readyTimeout;
+            return;
+
+        case MICLONE_PHASE_SETTLE:
+        case MICLONE_PHASE_READY:
+            result = send(pump, "Q", response);
+            now = transport.millis(transport.context);
+
+            if (result == MICLONE_OK && response.ready) {
+                if (pump.phase == MICLONE_PHASE_READY) {
+                    finishStop(index, true);
+                }
+                else {
+                    pump.phase = MICLONE_PHASE_VALVE;
+                    pump.attempt = 0;
+                    pump.due = now;
+                }
+                return;
+            }
+
+            if (reached(now, pump.deadline)) finishStop(index, false);
+            else pump.due = now + timing.pollInterval;
+            return;
+
+        case MICLONE_PHASE_NONE:
+        default:
+            return;
+        }
+
+        /* the controller is running the program */
+        pump.runStart = now;
+        pump.phase = MICLONE_PHASE_STATUS;
+        pump.due = now + MICLONE_STATUS_INTERVAL;
+        if (pump.runTime && reached(pump.due, now + pump.runTime)) pump.due = now + pump.runTime;
+        setState(index, MICLONE_RUNNING);
+    }
+
+    uint32_t MiCloneScheduler::step(uint32_t now)
+    {
+        // the first due pump after the one served last, so a pump with a dead
+        // controller takes one timeout per turn and no more
+        for (uint8_t i = 0; i < numPumps; ++i) {
+            uint8_t index = (next + i) % numPumps;
+            const MiClonePump_t &pump = pumps[index];
+
+            if (hasWork(pump) && reached(now, pump.due)) {
+                next = (index + 1) % numPumps;
+                run(index, now);
+                now = transport.millis(transport.context);
+                break;
+            }
+        }
+
+        uint32_t wait = MICLONE_FOREVER;
+        for (uint8_t i = 0; i < numPumps; ++i) {
+            const MiClonePump_t &pump = pumps[i];
+            if (!hasWork(pump)) continue;
+            if (reached(now, pump.due)) return 0;
+            if (pump.due - now < wait) wait = pump.due - now;
+        }
+
+        return wait;
+    }
+
+    uint32_t MiCloneScheduler::elapsed(uint8_t index, uint32_t now) const
+    {
+        if (index >= numPumps || pumps[index].state != MICLONE_RUNNING) return 0;
+        const MiClonePump_t &pump = pumps[index];
+        return now - pump.runStart;
+    }
+
+    uint32_t MiCloneScheduler::remaining(uint8_t index, uint32_t now) const
+    {
+        if (index >= numPumps || pumps[index].state != MICLONE_RUNNING) return 0;
+        const MiClonePump_t &pump = pumps[index];
+        if (!pump.runTime) return MICLONE_FOREVER;
+
+        uint32_t elapsed = now - pump.runStart;
+        return elapsed < pump.runTime ? pump.runTime - elapsed : 0;
+    }
+
+    const char *miclone_state_str(MiCloneState_t state)
+    {
+        switch (state) {
+        case MICLONE_IDLE:      return "idle";
+        case MICLONE_STARTING:  return "starting";
+        case MICLONE_RUNNING:   return "running";
+        case MICLONE_STOPPING:  return "stopping";
+        default:                return "unknown";
+        }
+    }
+
+    void miclone_format_command(char *command, size_t size, char address, const char *body)
+    {
+        snprintf(command, size, "/%c%s", address, body);
+    }
+}
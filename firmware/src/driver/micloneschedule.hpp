@@ -0,0 +1,170 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include "micloneprotocol.hpp"
+
+// Runs any number of addressed pump controllers sharing one collector port.
+// Replies carry no pump address, so only one command can be on the line at a
+// time: instead of a task per pump waiting out its own sequence, one scheduler
+// steps every pump's state machine one command at a time, and the waits of one
+// pump (settling, polling, run timers) are spent on the others
+
+#define MICLONE_MAX_PUMPS           4
+#define MICLONE_STATUS_INTERVAL     1000    // ms between status polls of a running pump
+#define MICLONE_FOREVER             UINT32_MAX
+
+namespace Driver
+{
+    /**
+     * Run states, moved forward only by the scheduler:
+     *  Idle -> Starting    a start was requested, the start program is being sent
+     *  Starting -> Running the controller accepted the program
+     *  Running -> Stopping the run time ran out, a stop was requested or the controller reported an error
+     *  Starting -> Stopping the start was rejected or cancelled
+     *  Stopping -> Idle    the controller acknowledged the stop or stopped answering
+     */
+    enum MiCloneState_t : uint8_t {
+        MICLONE_IDLE = 0,
+        MICLONE_STARTING,
+        MICLONE_RUNNING,
+        MICLONE_STOPPING
+    };
+
+    enum MiCloneStopReason_t : uint8_t {
+        MICLONE_STOP_COMPLETE = 0,  // the run time ran out
+        MICLONE_STOP_MANUAL,        // stop() was called
+        MICLONE_STOP_ERROR          // the controller rejected the start or reported an error while running
+    };
+
+    // the command a pump sends next, within its state
+    enum MiClonePhase_t : uint8_t {
+        MICLONE_PHASE_NONE = 0,
+        MICLONE_PHASE_START,            // send the start program
+        MICLONE_PHASE_START_CONFIRM,    // a start reply was lost, check whether the controller is busy
+        MICLONE_PHASE_STATUS,           // poll a running controller
+        MICLONE_PHASE_TERMINATE,        // "T"
+        MICLONE_PHASE_SETTLE,           // poll until the plunger comes to rest
+        MICLONE_PHASE_VALVE,            // "J0"
+        MICLONE_PHASE_VALVE_TERMINATE,  // "J0T", forced stops only
+        MICLONE_PHASE_READY             // poll until idle
+    };
+
+    typedef struct {
+        char address;                   // '1' to '9'
+        volatile MiCloneState_t state;
+        MiClonePhase_t phase;
+        uint8_t attempt;                // attempts at the current command
+        uint32_t due;                   // ms, when the next command may be sent
+        uint32_t deadline;              // ms, end of the current poll phase
+
+        uint16_t rate;
+        uint32_t runTime;               // ms, 0 runs until stopped
+        volatile uint32_t runStart;     // ms, when the controller accepted the run
+
+        uint8_t stopType;               // 2 also closes the valve with a terminate
+        MiCloneStopReason_t reason;     // why the current or last run stopped
+        MiCloneResult_t stopResult;     // the failure behind a MICLONE_STOP_ERROR stop, MICLONE_OK otherwise
+        bool acknowledged;              // the last stop was acknowledged
+
+        volatile uint8_t lastStatus;    // status byte of the last reply
+        MiCloneResult_t lastResult;     // result of the last command
+        uint32_t commands;              // commands sent
+        uint32_t failures;              // commands that got no acceptable reply
+    } MiClonePump_t;
+
+    /**
+     * @brief Called on every state change, from within step()
+     */
+    typedef void (*MiCloneStateCallback)(void *arg, uint8_t pump, MiCloneState_t from, MiCloneState_t to);
+
+    class MiCloneScheduler
+    {
+    private:
+        MiCloneTransport_t transport;
+        MiCloneTiming_t timing;
+        MiCloneStateCallback onState;
+        void *onStateArg;
+
+        MiClonePump_t pumps[MICLONE_MAX_PUMPS];
+        uint8_t numPumps;
+        uint8_t next;                   // first pump considered by the next step, for round robin
+
+        bool hasWork(const MiClonePump_t &pump) const;
+        void setState(uint8_t index, MiCloneState_t state);
+        void beginStop(uint8_t index, MiCloneStopReason_t reason, uint8_t stopType, uint32_t now);
+        void finishStop(uint8_t index, bool acknowledged);
+        MiCloneResult_t send(MiClonePump_t &pump, const char *body, MiCloneResponse_t &response);
+        bool retry(MiClonePump_t &pump, uint32_t now);
+        void run(uint8_t index, uint32_t now);
+
+    public:
+        MiCloneScheduler(const MiCloneTransport_t &transport, const MiCloneTiming_t &timing,
+                         MiCloneStateCallback onState=nullptr, void *arg=nullptr);
+
+        /**
+         * @brief Adds a controller at an address
+         *
+         * @return false MICLONE_MAX_PUMPS are already added
+         */
+        bool addPump(char address);
+
+        uint8_t pumpCount() const { return numPumps; }
+        const MiClonePump_t &pump(uint8_t index) const { return pumps[index]; }
+
+        void setPollInterval(uint32_t interval) { timing.pollInterval = interval; }
+
+        /**
+         * @brief Starts a run on a pump
+         *
+         * @param time run length in ms, 0 runs until stopped
+         * @return false The pump is not idle
+         */
+        bool start(uint8_t index, uint16_t rate, uint32_t time);
+
+        /**
+         * @brief Stops a pump. A run being started is cancelled before its next
+         *          command. An idle pump is sent the stop anyway, in case it is
+         *          still running from before a reboot
+         *
+         * @param stopType 2 also closes the valve with a terminate, for forced stops
+         * @return true A run was in progress and is stopping
+         */
+        bool stop(uint8_t index, uint8_t stopType=2);
+
+        /**
+         * @brief Sends at most one command, for the next due pump in turn, and
+         *          returns how long until another command is due. Blocks for no
+         *          longer than the reply timeout
+         *
+         * @param now ms on the transport's clock
+         * @return uint32_t ms until the next command is due, 0 if one is due now
+         *          and MICLONE_FOREVER if all pumps are idle
+         */
+        uint32_t step(uint32_t now);
+
+        /**
+         * @brief ms since the controller accepted the run, 0 unless running
+         */
+        uint32_t elapsed(uint8_t index, uint32_t now) const;
+
+        /**
+         * @brief ms left in a timed run, MICLONE_FOREVER for an untimed run and 0 unless running
+         */
+        uint32_t remaining(uint8_t index, uint32_t now) const;
+    };
+
+    const char *miclone_state_str(MiCloneState_t state);
+
+    /**
+     * @brief Formats a command for the controller at address
+     *
+     * @param body command after the address, such as "TR"
+     */
+    void miclone_format_command(char *command, size_t size, char address, const char *body);
+
+    /**
+     * @brief Address character of the nth pump, counting from 0
+     */
+    inline char miclone_pump_address(uint8_t index) { return '1' + index; }
+}
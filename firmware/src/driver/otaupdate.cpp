@@ -0,0 +1,95 @@
+#include "otaupdate.hpp"
+
+#include <SPIFFS.h>
+#include <esp_ota_ops.h>
+#include <mbedtls/sha256.h>
+
+namespace Driver
+{
+    static bool (*_busy)() = nullptr;
+    static const esp_partition_t *_partition = nullptr;
+    static esp_ota_handle_t _handle = 0;
+    static mbedtls_sha256_context _sha;
+    static volatile bool _restart = false;
+    static volatile bool _started = false;
+
+    static BleTransferStatus_t ota_begin(void *)
+    {
+        _partition = esp_partition_find_first(ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_APP_OTA_0, nullptr);
+        const esp_partition_t *factory = esp_partition_find_first(ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_APP_FACTORY, nullptr);
+        if (!_partition || !factory) return BLETRANSFER_IO;
+
+        // running from ota_0, the factory firmware takes the image
+        if (esp_ota_get_running_partition() == _partition) {
+            if (_busy && _busy()) return BLETRANSFER_BUSY;
+
+            File marker = SPIFFS.open(OTAUPDATE_MARKER, FILE_WRITE);
+            if (!marker) return BLETRANSFER_IO;
+            marker.close();
+
+            if (esp_ota_set_boot_partition(factory) != ESP_OK) return BLETRANSFER_IO;
+            _restart = true;
+            return BLETRANSFER_RESTARTING;
+        }
+
+        if (esp_ota_begin(_partition, OTA_WITH_SEQUENTIAL_WRITES, &_handle) != ESP_OK) return BLETRANSFER_IO;
+
+        mbedtls_sha256_init(&_sha);
+        mbedtls_sha256_starts(&_sha, 0);
+        _started = true;
+        return BLETRANSFER_OK;
+    }
+
+    static bool ota_write(void *, const uint8_t *data, size_t length)
+    {
+        mbedtls_sha256_update(&_sha, data, length);
+        return esp_ota_write(_handle, data, length) == ESP_OK;
+    }
+
+    static bool ota_end(void *, const uint8_t *digest)
+    {
+        uint8_t actual[BLETRANSFER_DIGEST_SIZE];
+        mbedtls_sha256_finish(&_sha, actual);
+        mbedtls_sha256_free(&_sha);
+
+        if (memcmp(actual, digest, sizeof(actual))) {
+            esp_ota_abort(_handle);
+            return false;
+        }
+
+        // checks the image headers, segments and the hash esptool appends, and frees the handle either way
+        if (esp_ota_end(_handle) != ESP_OK) return false;
+        if (esp_ota_set_boot_partition(_partition) != ESP_OK) return false;
+
+        _restart = true;
+        return true;
+    }
+
+    static void ota_abort(void *)
+    {
+        mbedtls_sha256_free(&_sha);
+        esp_ota_abort(_handle);
+    }
+
+    static const BleTransferFirmware_t _firmware = { nullptr, ota_begin, ota_write, ota_end, ota_abort };
+
+    void otaupdate_begin(bool (*busy)())
+    {
+        _busy = busy;
+    }
+
+    const BleTransferFirmware_t &otaupdate_firmware()
+    {
+        return _firmware;
+    }
+
+    bool otaupdate_restart_pending()
+    {
+        return _restart;
+    }
+
+    bool otaupdate_started()
+    {
+        return _started;
+    }
+}
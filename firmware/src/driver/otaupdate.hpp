@@ -0,0 +1,42 @@
+#pragma once
+
+#include <Arduino.h>
+#include "bletransfer.hpp"
+
+#define OTAUPDATE_MARKER            "/bleota"   // in SPIFFS, the factory firmware was started for an update
+#define OTAUPDATE_FACTORY_WAIT      180000      // ms the factory firmware waits for the image before going back
+#define OTAUPDATE_RESTART_DELAY     1000        // ms for the last notification to go out before restarting
+
+/**
+ * Firmware images from BleTransfer, written straight into the ota_0 partition
+ * as they arrive with esp_ota_write (erased a sector at a time, not all up front)
+ * and hashed with SHA-256 on the way. Nothing is staged on the SD card. The boot
+ * partition only changes once the digest matches and esp_ota_end has checked
+ * the image; anything else is aborted and the running firmware stays.
+ *
+ * The ota firmware runs from ota_0, so it can't take the image itself. Asked to,
+ * it leaves OTAUPDATE_MARKER, sets the factory firmware to boot and restarts;
+ * the phone reconnects and sends the image there. Everything else on the device
+ * is the same either way.
+ */
+namespace Driver
+{
+    /**
+     * @brief Sets what stops the device restarting for an update, such as a run
+     *          in progress. Not needed in the factory firmware
+     */
+    void otaupdate_begin(bool (*busy)()=nullptr);
+
+    const BleTransferFirmware_t &otaupdate_firmware();
+
+    /**
+     * @brief An update finished or needs the factory firmware, restart once
+     *          the phone has been told
+     */
+    bool otaupdate_restart_pending();
+
+    /**
+     * @brief An image has started arriving since boot
+     */
+    bool otaupdate_started();
+}
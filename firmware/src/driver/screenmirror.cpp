@@ -0,0 +1,266 @@
+#include "screenmirror.hpp"
+#include <string.h>
+
+namespace Driver
+{
+    size_t screenmirror_rle_encode(const uint16_t *pixels, size_t count, uint8_t *out)
+    {
+        size_t length = 0;
+
+        for (size_t i = 0; i < count; ) {
+            size_t run = 1;
+            while (i + run < count && run < SCREENMIRROR_RLE_MAX && pixels[i + run] == pixels[i]) ++run;
+
+            if (run > 1) {
+                out[length++] = SCREENMIRROR_RLE_RUN | (run - 1);
+                memcpy(out + length, pixels + i, sizeof(uint16_t));
+                length += sizeof(uint16_t);
+                i += run;
+                continue;
+            }
+
+            // a literal goes on until the next two pixels that match, which start a run
+            size_t literal = 1;
+            while (i + literal < count && literal < SCREENMIRROR_RLE_MAX &&
+                   (i + literal + 1 == count || pixels[i + literal] != pixels[i + literal + 1])) {
+                ++literal;
+            }
+
+            out[length++] = literal - 1;
+            memcpy(out + length, pixels + i, literal * sizeof(uint16_t));
+            length += literal * sizeof(uint16_t);
+            i += literal;
+        }
+
+        return length;
+    }
+
+    size_t screenmirror_rle_decode(const uint8_t *in, size_t length, uint16_t *pixels, size_t count)
+    {
+        size_t used = 0;
+
+        for (size_t decoded = 0; decoded < count; ) {
+            if (used == length) return 0;
+            uint8_t header = in[used++];
+            size_t run = (header & ~SCREENMIRROR_RLE_RUN) + 1;
+            if (decoded + run > count) return 0;
+
+            if (header & SCREENMIRROR_RLE_RUN) {
+                if (length - used < sizeof(uint16_t)) return 0;
+                uint16_t colour;
+                memcpy(&colour, in + used, sizeof(colour));
+                used += sizeof(colour);
+                for (size_t i = 0; i < run; ++i) pixels[decoded++] = colour;
+            }
+            else {
+                if (length - used < run * sizeof(uint16_t)) return 0;
+                memcpy(pixels + decoded, in + used, run * sizeof(uint16_t));
+                used += run * sizeof(uint16_t);
+                decoded += run;
+            }
+        }
+
+        return used;
+    }
+
+    // FNV-1a, 0 is kept for a tile the host doesn't have
+    static uint32_t tile_hash(const uint16_t *pixels, size_t count)
+    {
+        const uint8_t *bytes = reinterpret_cast<const uint8_t *>(pixels);
+        uint32_t hash = 2166136261u;
+        for (size_t i = 0; i < count * sizeof(uint16_t); ++i) {
+            hash = (hash ^ bytes[i]) * 16777619u;
+        }
+        return hash ? hash : 1;
+    }
+
+    ScreenMirror::ScreenMirror(const ScreenMirrorDisplay_t &display)
+        : display(display)
+        , touchHandler(nullptr)
+        , touchArg(nullptr)
+        , running(false)
+        , width(0)
+        , height(0)
+        , columns(0)
+        , rows(0)
+        , cursor(0)
+        , tilesSent(0)
+        , tilesUnchanged(0)
+        , bytesSent(0)
+    {
+        memset(damaged, 0, sizeof(damaged));
+        memset(hashes, 0, sizeof(hashes));
+    }
+
+    bool ScreenMirror::begin(UsbLink &link)
+    {
+        return link.addHandler(USBFRAME_SCREEN_START, handleStart, this) &&
+               link.addHandler(USBFRAME_SCREEN_POLL, handlePoll, this) &&
+               link.addHandler(USBFRAME_SCREEN_TOUCH, handleTouch, this);
+    }
+
+    void ScreenMirror::onTouch(ScreenMirrorTouchHandler callback, void *arg)
+    {
+        touchHandler = callback;
+        touchArg = arg;
+    }
+
+    void ScreenMirror::stop()
+    {
+        running = false;
+    }
+
+    // the damage bits are set by whichever task draws, so they are only changed atomically
+    void ScreenMirror::markDamage(uint16_t tile)
+    {
+        __atomic_fetch_or(&damaged[tile / 32], 1u << (tile % 32), __ATOMIC_RELEASE);
+    }
+
+    bool ScreenMirror::takeDamage(uint16_t tile)
+    {
+        uint32_t bit = 1u << (tile % 32);
+        return __atomic_fetch_and(&damaged[tile / 32], ~bit, __ATOMIC_ACQUIRE) & bit;
+    }
+
+    uint16_t ScreenMirror::pendingTiles() const
+    {
+        uint16_t pending = 0;
+        for (uint32_t word : damaged) pending += __builtin_popcount(word);
+        return pending;
+    }
+
+    void ScreenMirror::tileRect(uint16_t tile, uint16_t &x, uint16_t &y, uint16_t &w, uint16_t &h) const
+    {
+        x = (tile % columns) * SCREENMIRROR_TILE_SIZE;
+        y = (tile / columns) * SCREENMIRROR_TILE_SIZE;
+        w = width - x < SCREENMIRROR_TILE_SIZE ? width - x : SCREENMIRROR_TILE_SIZE;
+        h = height - y < SCREENMIRROR_TILE_SIZE ? height - y : SCREENMIRROR_TILE_SIZE;
+    }
+
+    void ScreenMirror::damage(int32_t x, int32_t y, int32_t w, int32_t h)
+    {
+        if (!running || w <= 0 || h <= 0) return;
+
+        int32_t right = x + w;
+        int32_t bottom = y + h;
+        if (x < 0) x = 0;
+        if (y < 0) y = 0;
+        if (right > width) right = width;
+        if (bottom > height) bottom = height;
+        if (x >= right || y >= bottom) return;
+
+        for (int32_t row = y / SCREENMIRROR_TILE_SIZE; row <= (bottom - 1) / SCREENMIRROR_TILE_SIZE; ++row) {
+            for (int32_t column = x / SCREENMIRROR_TILE_SIZE; column <= (right - 1) / SCREENMIRROR_TILE_SIZE; ++column) {
+                markDamage(row * columns + column);
+            }
+        }
+    }
+
+    size_t ScreenMirror::handleStart(void *arg, const uint8_t *, size_t, uint8_t *reply, UsbFrameError_t &error)
+    {
+        ScreenMirror *mirror = static_cast<ScreenMirror *>(arg);
+
+        mirror->running = false;
+
+        uint16_t width, height;
+        mirror->display.size(mirror->display.context, width, height);
+        uint16_t columns = (width + SCREENMIRROR_TILE_SIZE - 1) / SCREENMIRROR_TILE_SIZE;
+        uint16_t rows = (height + SCREENMIRROR_TILE_SIZE - 1) / SCREENMIRROR_TILE_SIZE;
+        if (!columns || !rows || columns * rows > SCREENMIRROR_MAX_TILES) return error = USBFRAME_ERROR_IO, 0;
+
+        mirror->width = width;
+        mirror->height = height;
+        mirror->columns = columns;
+        mirror->rows = rows;
+        mirror->cursor = 0;
+
+        // the host starts from nothing, so every tile is sent once
+        memset(mirror->hashes, 0, sizeof(mirror->hashes));
+        for (uint16_t tile = 0; tile < columns * rows; ++tile) mirror->markDamage(tile);
+        mirror->running = true;
+
+        ScreenMirrorInfo_t info;
+        info.width = width;
+        info.height = height;
+        info.tileSize = SCREENMIRROR_TILE_SIZE;
+        info.format = SCREENMIRROR_RLE565;
+        memcpy(reply, &info, sizeof(info));
+        return sizeof(info);
+    }
+
+    size_t ScreenMirror::handlePoll(void *arg, const uint8_t *, size_t, uint8_t *reply, UsbFrameError_t &error)
+    {
+        ScreenMirror *mirror = static_cast<ScreenMirror *>(arg);
+        if (!mirror->running) return error = USBFRAME_ERROR_NOT_OPEN, 0;
+
+        ScreenMirrorPoll_t header = { 0, 0 };
+        size_t used = sizeof(header);
+        uint16_t tiles = mirror->columns * mirror->rows;
+        uint16_t read = 0;
+        uint8_t encoded[SCREENMIRROR_TILE_ENCODED_MAX];
+
+        for (uint16_t scanned = 0; scanned < tiles && read < SCREENMIRROR_POLL_TILES; ++scanned) {
+            uint16_t tile = mirror->cursor;
+            mirror->cursor = (tile + 1) % tiles;
+            if (!mirror->takeDamage(tile)) continue;
+            ++read;
+
+            uint16_t x, y, w, h;
+            mirror->tileRect(tile, x, y, w, h);
+            mirror->display.read(mirror->display.context, x, y, w, h, mirror->pixels);
+
+            // repainted with what was already there
+            uint32_t hash = tile_hash(mirror->pixels, w * h);
+            if (hash == mirror->hashes[tile]) {
+                ++mirror->tilesUnchanged;
+                continue;
+            }
+
+            size_t length = screenmirror_rle_encode(mirror->pixels, w * h, encoded);
+            if (used + sizeof(tile) + length > USBFRAME_MAX_PAYLOAD) {
+                // the next poll starts with this tile
+                mirror->markDamage(tile);
+                mirror->cursor = tile;
+                break;
+            }
+
+            memcpy(reply + used, &tile, sizeof(tile));
+            memcpy(reply + used + sizeof(tile), encoded, length);
+            used += sizeof(tile) + length;
+            mirror->hashes[tile] = hash;
+            ++header.tiles;
+            ++mirror->tilesSent;
+        }
+
+        header.pending = mirror->pendingTiles();
+        memcpy(reply, &header, sizeof(header));
+        mirror->bytesSent += used;
+        return used;
+    }
+
+    size_t ScreenMirror::handleTouch(void *arg, const uint8_t *payload, size_t length, uint8_t *, UsbFrameError_t &error)
+    {
+        ScreenMirror *mirror = static_cast<ScreenMirror *>(arg);
+        ScreenMirrorTouch_t touch;
+
+        if (length != sizeof(touch)) return error = USBFRAME_ERROR_BAD_PAYLOAD, 0;
+        memcpy(&touch, payload, sizeof(touch));
+        if (!mirror->running) return error = USBFRAME_ERROR_NOT_OPEN, 0;
+        if (touch.type > SCREENMIRROR_TOUCH_UP || touch.x >= mirror->width || touch.y >= mirror->height) {
+            return error = USBFRAME_ERROR_BAD_PAYLOAD, 0;
+        }
+
+        if (!mirror->touchHandler ||
+            !mirror->touchHandler(mirror->touchArg, (ScreenMirrorTouchType_t) touch.type, touch.x, touch.y)) {
+            return error = USBFRAME_ERROR_REFUSED, 0;
+        }
+        return 0;
+    }
+
+    void ScreenMirror::stats(uint32_t &tilesSent, uint32_t &tilesUnchanged, uint32_t &bytesSent) const
+    {
+        tilesSent = this->tilesSent;
+        tilesUnchanged = this->tilesUnchanged;
+        bytesSent = this->bytesSent;
+    }
+}
@@ -0,0 +1,162 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include "usblink.hpp"
+
+// Screen mirroring over the binary mode of the USB-C link, for seeing what is on
+// a unit in the field.
+//
+// The screen is split into SCREENMIRROR_TILE_SIZE square tiles. Each draw marks
+// the tiles it touched; the host polls, and the device reads the marked tiles
+// back from the display, skips those whose hash matches what the host was last
+// sent, and replies with the rest run-length encoded. Pages repaint whole areas
+// with the same content all the time, so most damaged tiles never go on the
+// wire, and flat UI colours compress to a few bytes a tile. The host sets the
+// pace, so a slow link only makes the mirror lag, it never backs up the UI.
+//
+// Touches from the host go to the touch handler, which may refuse them
+
+#define SCREENMIRROR_TILE_SIZE      16
+#define SCREENMIRROR_TILE_PIXELS    (SCREENMIRROR_TILE_SIZE * SCREENMIRROR_TILE_SIZE)
+#define SCREENMIRROR_MAX_TILES      600     // 480x320 in 16 pixel tiles
+#define SCREENMIRROR_POLL_TILES     64      // damaged tiles read back per poll, bounds the time a poll takes
+#define SCREENMIRROR_RLE_RUN        0x80    // set in a token header for a run of one colour
+#define SCREENMIRROR_RLE_MAX        128     // pixels in one token
+
+// one tile at worst: a literal token per SCREENMIRROR_RLE_MAX pixels
+#define SCREENMIRROR_TILE_ENCODED_MAX   (SCREENMIRROR_TILE_PIXELS * 2 + SCREENMIRROR_TILE_PIXELS / SCREENMIRROR_RLE_MAX)
+
+namespace Driver
+{
+    enum ScreenMirrorFrame_t : uint8_t {
+        USBFRAME_SCREEN_START = 0x20,   // empty, the reply is ScreenMirrorInfo_t. Every tile is sent again from here
+        USBFRAME_SCREEN_POLL,           // empty, the reply is ScreenMirrorPoll_t then that many tiles: uint16 index, RLE pixels
+        USBFRAME_SCREEN_TOUCH           // ScreenMirrorTouch_t, the reply is empty
+    };
+
+    enum ScreenMirrorFormat_t : uint8_t {
+        SCREENMIRROR_RLE565 = 0         // RGB565 pixels, row by row within a tile, run-length encoded
+    };
+
+    enum ScreenMirrorTouchType_t : uint8_t {
+        SCREENMIRROR_TOUCH_DOWN = 0,
+        SCREENMIRROR_TOUCH_MOVE,
+        SCREENMIRROR_TOUCH_UP
+    };
+
+    typedef struct __attribute__((packed)) {
+        uint16_t width;
+        uint16_t height;
+        uint8_t tileSize;
+        uint8_t format;             // ScreenMirrorFormat_t
+    } ScreenMirrorInfo_t;
+
+    typedef struct __attribute__((packed)) {
+        uint16_t tiles;             // tiles in this reply
+        uint16_t pending;           // damaged tiles left, poll again straight away while not 0
+    } ScreenMirrorPoll_t;
+
+    typedef struct __attribute__((packed)) {
+        uint8_t type;               // ScreenMirrorTouchType_t
+        uint16_t x;                 // screen pixels
+        uint16_t y;
+    } ScreenMirrorTouch_t;
+
+    typedef struct {
+        void *context;
+
+        void (*size)(void *context, uint16_t &width, uint16_t &height);
+
+        // reads a rectangle of RGB565 pixels, row by row
+        void (*read)(void *context, uint16_t x, uint16_t y, uint16_t width, uint16_t height, uint16_t *pixels);
+    } ScreenMirrorDisplay_t;
+
+    /**
+     * @brief Takes a touch from the host, in screen pixels
+     *
+     * @return false touches from the host are not accepted
+     */
+    typedef bool (*ScreenMirrorTouchHandler)(void *arg, ScreenMirrorTouchType_t type, uint16_t x, uint16_t y);
+
+    /**
+     * @brief Run-length encodes pixels. A token is a header byte and its pixels:
+     *          SCREENMIRROR_RLE_RUN | (n - 1) then one colour for a run of n, or
+     *          n - 1 then n colours as they are. Colours are little endian
+     *
+     * @param out room for SCREENMIRROR_TILE_ENCODED_MAX bytes per tile of pixels
+     * @return size_t encoded length
+     */
+    size_t screenmirror_rle_encode(const uint16_t *pixels, size_t count, uint8_t *out);
+
+    /**
+     * @brief Decodes exactly count pixels
+     *
+     * @return size_t bytes of in used, 0 if it ends early or a token runs past count
+     */
+    size_t screenmirror_rle_decode(const uint8_t *in, size_t length, uint16_t *pixels, size_t count);
+
+    class ScreenMirror
+    {
+    private:
+        ScreenMirrorDisplay_t display;
+        ScreenMirrorTouchHandler touchHandler;
+        void *touchArg;
+
+        volatile bool running;
+        uint16_t width;
+        uint16_t height;
+        uint16_t columns;
+        uint16_t rows;
+        uint16_t cursor;            // tile the next poll starts from, so one busy area can't starve the rest
+
+        // damaged tiles, set from any task and taken by the poll
+        uint32_t damaged[(SCREENMIRROR_MAX_TILES + 31) / 32];
+
+        // hash of each tile as the host last got it, 0 for never sent
+        uint32_t hashes[SCREENMIRROR_MAX_TILES];
+
+        uint16_t pixels[SCREENMIRROR_TILE_PIXELS];
+
+        uint32_t tilesSent;
+        uint32_t tilesUnchanged;
+        uint32_t bytesSent;
+
+        bool takeDamage(uint16_t tile);
+        void markDamage(uint16_t tile);
+        uint16_t pendingTiles() const;
+        void tileRect(uint16_t tile, uint16_t &x, uint16_t &y, uint16_t &w, uint16_t &h) const;
+
+        static size_t handleStart(void *arg, const uint8_t *payload, size_t length, uint8_t *reply, UsbFrameError_t &error);
+        static size_t handlePoll(void *arg, const uint8_t *payload, size_t length, uint8_t *reply, UsbFrameError_t &error);
+        static size_t handleTouch(void *arg, const uint8_t *payload, size_t length, uint8_t *reply, UsbFrameError_t &error);
+
+    public:
+        ScreenMirror(const ScreenMirrorDisplay_t &display);
+
+        /**
+         * @brief Registers the screen requests with the link
+         */
+        bool begin(UsbLink &link);
+
+        /**
+         * @brief Passes touches from the host to callback. Without one they are refused
+         */
+        void onTouch(ScreenMirrorTouchHandler callback, void *arg=nullptr);
+
+        /**
+         * @brief Marks a drawn rectangle to be sent. Safe from any task, and
+         *          returns straight away while no host is mirroring
+         */
+        void damage(int32_t x, int32_t y, int32_t w, int32_t h);
+
+        /**
+         * @brief Stops tracking damage, such as when the link goes back to the console
+         */
+        void stop();
+
+        bool active() const { return running; }
+
+        void stats(uint32_t &tilesSent, uint32_t &tilesUnchanged, uint32_t &bytesSent) const;
+    };
+}
@@ -4,7 +4,7 @@
 
 namespace Driver
 {
-    TFT_eSPI tft;
+    MirroredTFT tft;
     TaskHandle_t _tftTaskHandle;
     bool tftHorizontal;
 
@@ -35,6 +35,77 @@ namespace Driver
     {
         return Driver::tftHorizontal ? TFT_WIDTH : TFT_HEIGHT;
     }
-}
 
+    void MirroredTFT::drawPixel(int32_t x, int32_t y, uint32_t color)
+    {
+        TFT_eSPI::drawPixel(x, y, color);
+        if (mirror) mirror->damage(x, y, 1, 1);
+    }
+
+    // the GLCD character cell. A free font draws its glyph through the other
+    // primitives, which record its real extent
+    void MirroredTFT::drawChar(int32_t x, int32_t y, uint16_t c, uint32_t color, uint32_t bg, uint8_t size)
+    {
+        TFT_eSPI::drawChar(x, y, c, color, bg, size);
+        if (mirror) mirror->damage(x, y, 6 * size, 8 * size);
+    }
+
+    int16_t MirroredTFT::drawChar(uint16_t uniCode, int32_t x, int32_t y, uint8_t font)
+    {
+        int16_t width = TFT_eSPI::drawChar(uniCode, x, y, font);
+        if (mirror) mirror->damage(x, y, width, fontHeight(font));
+        return width;
+    }
+
+    void MirroredTFT::drawLine(int32_t xs, int32_t ys, int32_t xe, int32_t ye, uint32_t color)
+    {
+        TFT_eSPI::drawLine(xs, ys, xe, ye, color);
+        if (mirror) {
+            mirror->damage(xs < xe ? xs : xe, ys < ye ? ys : ye,
+                           (xs < xe ? xe - xs : xs - xe) + 1, (ys < ye ? ye - ys : ys - ye) + 1);
+        }
+    }
+
+    void MirroredTFT::drawFastVLine(int32_t x, int32_t y, int32_t h, uint32_t color)
+    {
+        TFT_eSPI::drawFastVLine(x, y, h, color);
+        if (mirror) mirror->damage(x, y, 1, h);
+    }
+
+    void MirroredTFT::drawFastHLine(int32_t x, int32_t y, int32_t w, uint32_t color)
+    {
+        TFT_eSPI::drawFastHLine(x, y, w, color);
+        if (mirror) mirror->damage(x, y, w, 1);
+    }
+
+    void MirroredTFT::fillRect(int32_t x, int32_t y, int32_t w, int32_t h, uint32_t color)
+    {
+        TFT_eSPI::fillRect(x, y, w, h, color);
+        if (mirror) mirror->damage(x, y, w, h);
+    }
+
+    static void tft_mirror_size(void *, uint16_t &width, uint16_t &height)
+    {
+        width = tft.width();
+        height = tft.height();
+    }
 
+    static void tft_mirror_read(void *, uint16_t x, uint16_t y, uint16_t width, uint16_t height, uint16_t *pixels)
+    {
+        tft_take();
+        tft.readRect(x, y, width, height, pixels);
+        tft_give();
+
+        // readRect gives the bytes swapped, the order pushRect() takes
+        for (size_t i = 0; i < (size_t) width * height; ++i) {
+            pixels[i] = pixels[i] << 8 | pixels[i] >> 8;
+        }
+    }
+
+    static const ScreenMirrorDisplay_t _tftMirrorDisplay = { nullptr, tft_mirror_size, tft_mirror_read };
+
+    const ScreenMirrorDisplay_t &tft_mirror_display()
+    {
+        return _tftMirrorDisplay;
+    }
+}
@@ -3,10 +3,40 @@
 #include <TFT_eSPI.h>
 #include <FreeRTOS.h>
 #include <stdint.h>
+#include "screenmirror.hpp"
 
 namespace Driver
 {
-    extern TFT_eSPI tft;
+    /**
+     * @brief TFT_eSPI that tells the screen mirror what each draw touched.
+     *          TFT_eSPI draws its shapes, fills and text through these virtual
+     *          primitives, so every draw the pages make passes through here
+     */
+    class MirroredTFT : public TFT_eSPI
+    {
+    private:
+        ScreenMirror *mirror;
+
+    public:
+        MirroredTFT() : mirror(nullptr) { }
+
+        /**
+         * @brief Reports damage to mirror from now on. Call before drawing starts
+         */
+        void setMirror(ScreenMirror *mirror) { this->mirror = mirror; }
+
+        using TFT_eSPI::drawChar;
+
+        void drawPixel(int32_t x, int32_t y, uint32_t color) override;
+        void drawChar(int32_t x, int32_t y, uint16_t c, uint32_t color, uint32_t bg, uint8_t size) override;
+        int16_t drawChar(uint16_t uniCode, int32_t x, int32_t y, uint8_t font) override;
+        void drawLine(int32_t xs, int32_t ys, int32_t xe, int32_t ye, uint32_t color) override;
+        void drawFastVLine(int32_t x, int32_t y, int32_t h, uint32_t color) override;
+        void drawFastHLine(int32_t x, int32_t y, int32_t w, uint32_t color) override;
+        void fillRect(int32_t x, int32_t y, int32_t w, int32_t h, uint32_t color) override;
+    };
+
+    extern MirroredTFT tft;
     extern TaskHandle_t _tftTaskHandle;
     extern bool tftHorizontal;
     
@@ -19,6 +49,11 @@ namespace Driver
 
     uint16_t tft_get_height();
 
+    /**
+     * @brief The display as the screen mirror reads it back, through TFT_MISO
+     */
+    const ScreenMirrorDisplay_t &tft_mirror_display();
+
     class TFTClaimMutex
     {
     public:
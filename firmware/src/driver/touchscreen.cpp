@@ -1,20 +1,24 @@
 #include "touchscreen.h"
+#include "console.hpp"
 
 #include <Arduino.h>
 #include <XPT2046_Touchscreen.h>
 #include "common.h"
+#include "../diagnostics/latency.h"
+#include <esp_timer.h>
 
 void Driver::touchscreen_init()
 {
     Touchscreen_cfg.state = Driver::TOUCHSCREEN_NONE;
     Touchscreen_cfg.onPress = nullptr;
     Touchscreen_cfg.onRelease = nullptr;
+    Touchscreen_cfg.onEvent = nullptr;
     Touchscreen_cfg.busyInterruptHandler = nullptr;
-    Touchscreen_cfg.point.x = 0;
-    Touchscreen_cfg.point.y = 0;
-    Touchscreen_cfg.point.z = 0;
-    Touchscreen_cfg.staged.onPress = nullptr;
-    Touchscreen_cfg.staged.onRelease = nullptr;
+    Touchscreen_cfg.eventConsumer = nullptr;
+    Touchscreen_cfg.reportedDrops = 0;
+    Touchscreen_cfg.injected = 0;
+    Touchscreen_cfg.staged.onEvent = nullptr;
+    memset(&Touchscreen_cfg.gesture, 0, sizeof(Touchscreen_cfg.gesture));
 }
 
 void Driver::touchscreen_begin(SPIClass &spi, uint8_t rotation, bool enableInterrupts, uint8_t interruptPin)
@@ -34,11 +38,56 @@ void Driver::touchscreen_begin(SPIClass &spi, uint8_t rotation, bool enableInter
     
 }
 
-void Driver::touchscreen_get_raw_points(const uint16_t **x, const uint16_t **y, const uint8_t **z)
+void Driver::touchscreen_set_event_consumer(TaskHandle_t task)
 {
-    *x = &Driver::Touchscreen_cfg.point.x;
-    *y = &Driver::Touchscreen_cfg.point.y;
-    *z = &Driver::Touchscreen_cfg.point.z;
+    Touchscreen_cfg.eventConsumer = task;
+}
+
+size_t Driver::touchscreen_dispatch_events()
+{
+    size_t dispatched = 0;
+    TouchscreenEvent_t event;
+
+    while (Touchscreen_cfg.events.pop(event)) {
+        Diagnostics::latency_touch_begin(event.timestamp);
+        if (Touchscreen_cfg.onEvent) Touchscreen_cfg.onEvent(event);
+
+        // a handler may have staged a page switch, which has to take effect
+        // before the next event so that event goes to the new page
+        if (postDigitizerAction) postDigitizerAction(postDigitizerArgs);
+        touchscreen_apply_staged();
+        Diagnostics::latency_touch_end();
+
+        ++dispatched;
+    }
+
+    if (!dispatched) {
+        if (postDigitizerAction) postDigitizerAction(postDigitizerArgs);
+        touchscreen_apply_staged();
+    }
+
+    uint32_t dropped = Touchscreen_cfg.events.droppedCount();
+    if (dropped != Touchscreen_cfg.reportedDrops) {
+        Driver::console.printf("-> [TS] Warning: %d touch events dropped (queue high water %d / %d)\n",
+                               dropped - Touchscreen_cfg.reportedDrops,
+                               Touchscreen_cfg.events.highWaterMark(),
+                               Touchscreen_cfg.events.capacity());
+        Touchscreen_cfg.reportedDrops = dropped;
+    }
+
+    return dispatched;
+}
+
+void Driver::touchscreen_inject(bool pressed, uint16_t x, uint16_t y)
+{
+    x = x > 0xFFF ? 0xFFF : x;
+    y = y > 0xFFF ? 0xFFF : y;
+    Touchscreen_cfg.injected = DRIVER_TS_INJECTED | (pressed ? DRIVER_TS_INJECTED_PRESSED : 0) | (uint32_t) y << 12 | x;
+}
+
+uint32_t Driver::touchscreen_dropped_events()
+{
+    return Touchscreen_cfg.events.droppedCount();
 }
 
 bool Driver::touchscreen_busy_check_interrupt(bool enable)
@@ -55,10 +104,11 @@ bool Driver::touchscreen_busy_check_interrupt(bool enable)
         //     1,
         //     &Touchscreen_cfg.busyInterruptHandler
         // );
+        // only samples and queues events, handlers run in the consumer task
         xTaskCreatePinnedToCore(
             busyInterruptFunction,
             "ts-inter",
-            7 * 1024,
+            3 * 1024,
             nullptr,
             1,
             &Touchscreen_cfg.busyInterruptHandler,
@@ -75,73 +125,217 @@ bool Driver::touchscreen_busy_check_interrupt(bool enable)
     return false;
 }
 
-void Driver::touchscreen_register_on_press(TouchscreenFunctionBehavior func)
+void Driver::touchscreen_register_on_event(TouchscreenEventBehavior func)
+{
+    Touchscreen_cfg.staged.onEvent = func;
+}
+
+void Driver::touchscreen_apply_staged()
 {
-    Touchscreen_cfg.staged.onPress = func;
+    if (Touchscreen_cfg.staged.onEvent) {
+        Touchscreen_cfg.onEvent = Touchscreen_cfg.staged.onEvent;
+        Touchscreen_cfg.staged.onEvent = nullptr;
+    }
 }
 
-void Driver::touchscreen_register_on_release(TouchscreenFunctionBehavior func)
+/**
+ * @brief Median of a small sample burst. Sorts the buffer in place
+ */
+static uint16_t touchscreen_median(uint16_t *samples, size_t count)
 {
-    Touchscreen_cfg.staged.onRelease = func;
+    for (size_t i = 1; i < count; ++i) {
+        uint16_t value = samples[i];
+        size_t j = i;
+        while (j > 0 && samples[j - 1] > value) {
+            samples[j] = samples[j - 1];
+            --j;
+        }
+        samples[j] = value;
+    }
+
+    return samples[count / 2];
 }
 
-void Driver::touchscreen_apply_staged()
+/**
+ * @brief Reads a burst of samples and median filters them. A new touch needs
+ *          DRIVER_TS_Z_PRESS_THRESHOLD pressure while an ongoing touch only needs
+ *          DRIVER_TS_Z_RELEASE_THRESHOLD, so light pressure does not chatter
+ * 
+ * @return true the screen is in contact and x, y, z are valid
+ */
+static bool touchscreen_read_filtered(uint16_t &x, uint16_t &y, uint16_t &z)
+{
+    using namespace Driver;
+
+    const int16_t threshold = Touchscreen_cfg.gesture.pressed ? DRIVER_TS_Z_RELEASE_THRESHOLD : DRIVER_TS_Z_PRESS_THRESHOLD;
+    uint16_t xs[DRIVER_TS_BURST_SAMPLES];
+    uint16_t ys[DRIVER_TS_BURST_SAMPLES];
+    uint16_t zs[DRIVER_TS_BURST_SAMPLES];
+
+    for (size_t i = 0; i < DRIVER_TS_BURST_SAMPLES; ++i) {
+        if (i) vTaskDelay(DRIVER_TS_BURST_SPACING / portTICK_PERIOD_MS);
+
+        TS_Point p = ts.getPoint();
+
+        // lifted or too light, don't bother with the rest of the burst
+        if (p.z < threshold) return false;
+
+        xs[i] = p.x;
+        ys[i] = p.y;
+        zs[i] = p.z;
+    }
+
+    x = touchscreen_median(xs, DRIVER_TS_BURST_SAMPLES);
+    y = touchscreen_median(ys, DRIVER_TS_BURST_SAMPLES);
+    z = touchscreen_median(zs, DRIVER_TS_BURST_SAMPLES);
+    return true;
+}
+
+static uint32_t touchscreen_distance_squared(int32_t x0, int32_t y0, int32_t x1, int32_t y1)
+{
+    return (x1 - x0) * (x1 - x0) + (y1 - y0) * (y1 - y0);
+}
+
+static void touchscreen_emit(Driver::TouchscreenEventType type, int64_t now)
 {
-    if (Touchscreen_cfg.staged.onPress) {
-        Touchscreen_cfg.onPress = Touchscreen_cfg.staged.onPress;
-        Touchscreen_cfg.staged.onPress = nullptr;
+    using namespace Driver;
+    auto &gesture = Touchscreen_cfg.gesture;
+
+    TouchscreenEvent_t event;
+    event.type = type;
+    event.x = gesture.x / 16;
+    event.y = gesture.y / 16;
+    event.z = gesture.z;
+    event.startX = gesture.startX;
+    event.startY = gesture.startY;
+    event.timestamp = now;
+    event.duration = (now - gesture.downTime) / 1000;
+    event.dragging = gesture.dragging;
+    event.longPressed = gesture.longPressed;
+
+    gesture.lastX = event.x;
+    gesture.lastY = event.y;
+
+    #ifdef DRIVER_TS_ENABLE_DEBUG_PRINT
+    Driver::console.printf("-> Touch event %d at (%d, %d, %d) after %dms\n", type, event.x, event.y, event.z, event.duration);
+    #endif
+
+    // the UI sees events in order with the exact sample that caused them
+    if (Touchscreen_cfg.events.push(event) && Touchscreen_cfg.eventConsumer) {
+        xTaskNotifyGive(Touchscreen_cfg.eventConsumer);
+    }
+}
+
+/**
+ * @brief Debounces a filtered sample and turns it into touch events
+ * 
+ * @param contact true if the sample is a valid touch
+ * @param now timestamp of the sample in us
+ */
+static void touchscreen_process(bool contact, uint16_t x, uint16_t y, uint16_t z, int64_t now)
+{
+    using namespace Driver;
+    auto &gesture = Touchscreen_cfg.gesture;
+
+    // a state change has to be seen DRIVER_TS_DEBOUNCE_COUNT times in a row
+    if (contact == gesture.pressed) {
+        gesture.debounce = 0;
+    }
+    else if (++gesture.debounce < DRIVER_TS_DEBOUNCE_COUNT) {
+        return;
+    }
+    else {
+        gesture.debounce = 0;
+        gesture.pressed = contact;
+
+        if (contact) {
+            gesture.x = x * 16;
+            gesture.y = y * 16;
+            gesture.z = z;
+            gesture.startX = x;
+            gesture.startY = y;
+            gesture.downTime = now;
+            gesture.dragging = false;
+            gesture.longPressed = false;
+
+            touchscreen_emit(TOUCHSCREEN_EVENT_DOWN, now);
+        }
+        else {
+            touchscreen_emit(TOUCHSCREEN_EVENT_UP, now);
+
+            if (!gesture.dragging && !gesture.longPressed && now - gesture.downTime <= DRIVER_TS_TAP_MAX_DURATION * 1000LL) {
+                touchscreen_emit(TOUCHSCREEN_EVENT_TAP, now);
+            }
+        }
+
+        return;
+    }
+
+    if (!gesture.pressed) return;
+
+    // a glitch sample inside an ongoing touch is dropped by the debounce above,
+    // so everything here is a valid sample of the current touch
+    gesture.x += (x * 16 - gesture.x) / (1 << DRIVER_TS_IIR_SHIFT);
+    gesture.y += (y * 16 - gesture.y) / (1 << DRIVER_TS_IIR_SHIFT);
+    gesture.z = z;
+
+    const int32_t fx = gesture.x / 16;
+    const int32_t fy = gesture.y / 16;
+
+    const bool moved = touchscreen_distance_squared(gesture.lastX, gesture.lastY, fx, fy) >= DRIVER_TS_MOVE_THRESHOLD * DRIVER_TS_MOVE_THRESHOLD;
+
+    if (!gesture.dragging && touchscreen_distance_squared(gesture.startX, gesture.startY, fx, fy) >= DRIVER_TS_DRAG_THRESHOLD * DRIVER_TS_DRAG_THRESHOLD) {
+        gesture.dragging = true;
+        touchscreen_emit(TOUCHSCREEN_EVENT_DRAG, now);
     }
-    if (Touchscreen_cfg.staged.onRelease) {
-        Touchscreen_cfg.onRelease = Touchscreen_cfg.staged.onRelease;
-        Touchscreen_cfg.staged.onRelease= nullptr;
+    else if (moved) {
+        touchscreen_emit(gesture.dragging ? TOUCHSCREEN_EVENT_DRAG : TOUCHSCREEN_EVENT_MOVE, now);
+    }
+
+    if (!gesture.dragging && !gesture.longPressed && now - gesture.downTime >= DRIVER_TS_LONG_PRESS_DURATION * 1000LL) {
+        gesture.longPressed = true;
+        touchscreen_emit(TOUCHSCREEN_EVENT_LONG_PRESS, now);
     }
 }
 
 void Driver::busyInterruptFunction(void *args)
 {
-    // TODO REDESIGN THIS FUNCTION SO THAT ON HOLD IS ALWAYS SENT!
-    bool touched = false;
-    
     while (true) {
-        bool currentState = ts.touched();
+        uint16_t x = 0, y = 0, z = 0;
+        int64_t sampleTime = esp_timer_get_time();
+        uint32_t injected = Touchscreen_cfg.injected;
+        bool contact;
+
+        if (injected & DRIVER_TS_INJECTED) {
+            contact = injected & DRIVER_TS_INJECTED_PRESSED;
+            x = injected & 0xFFF;
+            y = (injected >> 12) & 0xFFF;
+            z = DRIVER_TS_Z_PRESS_THRESHOLD;
+        }
+        else {
+            contact = touchscreen_read_filtered(x, y, z);
+        }
         
         #ifdef DRIVER_TS_ENABLE_DEBUG_PRINT
 
-        if (currentState) {
+        if (contact) {
             
-            Serial.println("-> I am so touched!");
+            Driver::console.println("-> I am so touched!");
         }
         else{
-            Serial.println("-> Nothing. I feel nothing at all...");
+            Driver::console.println("-> Nothing. I feel nothing at all...");
         }
 
         #endif
 
-        Driver::ts.readData(&Touchscreen_cfg.point.x,
-                            &Touchscreen_cfg.point.y,
-                            &Touchscreen_cfg.point.z
-                            );
-
-        if (currentState) {
-            if (Touchscreen_cfg.onPress) {
-                touched = true;
-                Touchscreen_cfg.onPress();
-            }
-        }
-        else {
-            if (touched) {
-                touched = false;
-                if (Touchscreen_cfg.onRelease) Touchscreen_cfg.onRelease();
-            }
-        }
+        touchscreen_process(contact, x, y, z, sampleTime);
 
-        // Run post digitizer action once
-        if (postDigitizerAction) {
-            postDigitizerAction(postDigitizerArgs);
+        // once the injected release has been seen, the digitizer takes over again
+        // unless another touch was injected in the meantime
+        if ((injected & DRIVER_TS_INJECTED) && !contact && !Touchscreen_cfg.gesture.pressed) {
+            __atomic_compare_exchange_n(&Touchscreen_cfg.injected, &injected, 0, false, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
         }
 
-        touchscreen_apply_staged();
-
         vTaskDelay(DRIVER_TS_CHECK_INTERVAL / portTICK_PERIOD_MS);
     }
 }
@@ -150,6 +344,8 @@ namespace Driver
 {
     XPT2046_Touchscreen ts(TCH_CS);
 
+    TouchscreenConfig_t Touchscreen_cfg;
+
     void (*postDigitizerAction)(void *) = nullptr;
     void *postDigitizerArgs = nullptr;
 }
@@ -4,11 +4,33 @@
 #include <XPT2046_Touchscreen.h>
 #include <SPI.h>
 #include <FreeRTOS.h>
+#include "../SPSCQueue.hpp"
 
 // #define DRIVER_TS_ENABLE_DEBUG_PRINT
 
 #define DRIVER_TS_CHECK_INTERVAL 17
 
+#define DRIVER_TS_EVENT_QUEUE_SIZE      32      // events buffered between the sampling task and the UI. Power of two
+#define DRIVER_TS_DISPATCH_INTERVAL     50      // ms the UI waits for an event before running the post digitizer action
+
+/* Sample filtering */
+#define DRIVER_TS_BURST_SAMPLES          3      // samples taken per poll, median filtered
+#define DRIVER_TS_BURST_SPACING          4      // ms between burst samples. XPT2046_Touchscreen caches a reading for 3ms
+#define DRIVER_TS_Z_PRESS_THRESHOLD    600      // pressure required to start a touch
+#define DRIVER_TS_Z_RELEASE_THRESHOLD  350      // pressure required to keep a touch (hysteresis)
+#define DRIVER_TS_DEBOUNCE_COUNT         2      // consecutive polls needed to change pressed state
+#define DRIVER_TS_IIR_SHIFT              1      // position smoothing: p += (sample - p) >> shift
+
+/* Gesture recognition. Distances are in raw digitizer units (~8 units per pixel) */
+#define DRIVER_TS_MOVE_THRESHOLD        24      // minimum travel before a MOVE is reported
+#define DRIVER_TS_DRAG_THRESHOLD       120      // travel from the touch origin that turns a touch into a drag
+#define DRIVER_TS_TAP_MAX_DURATION     300      // ms
+#define DRIVER_TS_LONG_PRESS_DURATION  700      // ms
+
+/* Touches injected from the screen mirror, packed in one word: flags, then 12-bit raw y and x */
+#define DRIVER_TS_INJECTED              0x80000000
+#define DRIVER_TS_INJECTED_PRESSED      0x40000000
+
 namespace Driver
 {
     extern XPT2046_Touchscreen ts;
@@ -24,30 +46,85 @@ namespace Driver
         TOUCHSCREEN_RELEASED = 1
     };
 
-    struct {
+    enum TouchscreenEventType : uint8_t {
+        TOUCHSCREEN_EVENT_DOWN = 0,         // touch started
+        TOUCHSCREEN_EVENT_MOVE,             // touch moved, but not far enough to be a drag
+        TOUCHSCREEN_EVENT_UP,               // touch ended. Always sent, even after a tap, long press or drag
+        TOUCHSCREEN_EVENT_TAP,              // short touch without a drag. Sent right after UP
+        TOUCHSCREEN_EVENT_LONG_PRESS,       // touch held in place. Sent once per touch
+        TOUCHSCREEN_EVENT_DRAG              // touch moved away from its origin. Sent on every move after that
+    };
+
+    /**
+     * @brief A filtered touch event. Coordinates are raw digitizer coordinates
+     *          until translated with Calibration.translateFromRaw(event)
+     */
+    typedef struct {
+        TouchscreenEventType type;
+
+        uint16_t x;
+        uint16_t y;
+        uint16_t z;
+
+        // position of the DOWN event that started this touch
+        uint16_t startX;
+        uint16_t startY;
+
+        int64_t  timestamp;     // esp_timer_get_time() in us when the sample was taken
+        uint32_t duration;      // ms since DOWN
+
+        bool dragging;
+        bool longPressed;
+    } TouchscreenEvent_t;
+
+    typedef void (*TouchscreenEventBehavior)(const TouchscreenEvent_t &event);
+
+    typedef struct {
         TouchscreenState state;
         int32_t interruptPin;
         bool GPIO_firstGroup;
 
-        struct {
-            uint16_t x;
-            uint16_t y;
-            uint8_t  z;
-        } point;
-
+        // used by the hardware interrupt path only
         TouchscreenFunctionBehavior onPress;
 
         TouchscreenFunctionBehavior onRelease;
+
+        TouchscreenEventBehavior onEvent;
         
         struct {
 
-            TouchscreenFunctionBehavior onPress;
-            TouchscreenFunctionBehavior onRelease;
+            TouchscreenEventBehavior onEvent;
         } staged;
+
+        // debounce and gesture state of the current touch
+        struct {
+            bool pressed;
+            uint8_t debounce;
+            int32_t x;              // IIR filtered position, scaled by 16
+            int32_t y;
+            uint16_t z;
+            uint16_t startX;
+            uint16_t startY;
+            uint16_t lastX;         // position of the last reported event
+            uint16_t lastY;
+            int64_t downTime;
+            bool dragging;
+            bool longPressed;
+        } gesture;
         
+        // events from the sampling task to the UI task, in order
+        SPSCQueue<TouchscreenEvent_t, DRIVER_TS_EVENT_QUEUE_SIZE> events;
+        TaskHandle_t eventConsumer;
+        uint32_t reportedDrops;
+
         TaskHandle_t busyInterruptHandler;
+
+        // stands in for the digitizer while set, DRIVER_TS_INJECTED packed
+        volatile uint32_t injected;
         
-    } Touchscreen_cfg;
+    } TouchscreenConfig_t;
+
+    extern TouchscreenConfig_t Touchscreen_cfg;
     
     static void IRAM_ATTR touchscreenISR()
     {
@@ -99,24 +176,37 @@ namespace Driver
                            );
 
     /**
-     * @brief Acquires the x, y, and z coordinate of the raw points from the screen
-     *          Because x, y, and z are pointers to a pointer to constant, these values
-     *          will always be the updated values from the driver once acquired.
-     * @example
-     *          const uint16_t *x, *y;
-     *          const uint8_t  *z;
-     *          touchscreen_get_raw_points(&x, &y, &z);
+     * @brief Sets the task that consumes touch events. The task is notified
+     *          (xTaskNotifyGive) whenever a new event is queued
      * 
-     *          while (1) {
-     *              // no need to call touchscreen_get_raw_points repeatedly
-     *              do_something_with_points(*x, *y, *z);
-     *          }
+     * @param task UI task that calls touchscreen_dispatch_events()
+     */
+    void touchscreen_set_event_consumer(TaskHandle_t task);
+
+    /**
+     * @brief Dispatches every queued touch event, oldest first, to the registered
+     *          event handler. Runs the post digitizer action and applies staged
+     *          handlers after each event. Call only from the consumer task
+     * 
+     * @return size_t number of events dispatched
+     */
+    size_t touchscreen_dispatch_events();
+
+    /**
+     * @brief Feeds a touch from elsewhere, such as a host mirroring the screen,
+     *          to the sampling task in place of the digitizer. It goes through the
+     *          same debouncing and gesture recognition, so a press has to be held
+     *          for DRIVER_TS_DEBOUNCE_COUNT polls to count
      * 
-     * @param x x point
-     * @param y y point
-     * @param z pressure
+     * @param pressed false to release the touch, handing back to the digitizer
+     * @param x raw digitizer coordinates, see Calibration.translateToRaw()
+     */
+    void touchscreen_inject(bool pressed, uint16_t x, uint16_t y);
+
+    /**
+     * @brief Number of touch events dropped because the UI fell behind
      */
-    void touchscreen_get_raw_points(const uint16_t **x, const uint16_t **y, const uint8_t **z);
+    uint32_t touchscreen_dropped_events();
 
     /**
      * @brief Enables a busy while loop to check if the touch screen is pressed or not
@@ -128,20 +218,13 @@ namespace Driver
     bool touchscreen_busy_check_interrupt(bool enable);
 
     /**
-     * @brief Registers a function to call when the touch screen is pressed
-     * @warning Don't use this. This is just a wrapper. Look at this function's definition
-     * 
-     * @param func Function called when touchscreen is pressed
-     */
-    void touchscreen_register_on_press(TouchscreenFunctionBehavior func);
-
-    /**
-     * @brief Registers a function to call when the touch screen is released
-     * @warning Don't use this. This is just a wrapper. Look at this function's definition
+     * @brief Registers a function to call for every filtered touch event. The
+     *          handler is swapped in after the current event is dispatched, so it
+     *          is safe to call from inside a handler (e.g. when switching pages)
      * 
-     * @param func Function called when touchscreen is released
+     * @param func Function called with each touch event
      */
-    void touchscreen_register_on_release(TouchscreenFunctionBehavior func);
+    void touchscreen_register_on_event(TouchscreenEventBehavior func);
 
     /**
      * @brief Apply touch screen handler if staged
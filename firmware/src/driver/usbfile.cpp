@@ -0,0 +1,255 @@
+#include "usbfile.hpp"
+#include <string.h>
+
+namespace Driver
+{
+    // four bits at a time, reflected polynomial 0xEDB88320
+    static const uint32_t _crcNibbles[16] = {
+        0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC, 0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+        0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C, 0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C
+    };
+
+    uint32_t usbfile_crc32(const uint8_t *data, size_t length, uint32_t crc)
+    {
+        crc = ~crc;
+        for (size_t i = 0; i < length; ++i) {
+            crc ^= data[i];
+            crc = (crc >> 4) ^ _crcNibbles[crc & 0x0F];
+            crc = (crc >> 4) ^ _crcNibbles[crc & 0x0F];
+        }
+        return ~crc;
+    }
+
+    bool usbfile_copy_path(const uint8_t *data, size_t length, char *path)
+    {
+        if (!length || length > USBFILE_PATH_SIZE) return false;
+        memcpy(path, data, length);
+        path[length] = '\0';
+        return path[0] == '/' && strlen(path) == length;
+    }
+
+    static bool valid_fs(uint8_t fs)
+    {
+        return fs == USBFILE_SD || fs == USBFILE_SPIFFS;
+    }
+
+    UsbFileServer::UsbFileServer(const UsbFileSystem_t &files)
+        : files(files)
+        , open(false)
+        , writing(false)
+        , size(0)
+        , checking(false)
+        , checkFs(0)
+        , checkWanted(0)
+        , checkEnd(0)
+        , checkCovered(0)
+        , checkCrc(0)
+        , chunksRead(0)
+        , chunksWritten(0)
+        , outOfOrder(0)
+    { }
+
+    bool UsbFileServer::begin(UsbLink &link)
+    {
+        return link.addHandler(USBFRAME_FILE_OPEN, handleOpen, this) &&
+               link.addHandler(USBFRAME_FILE_READ, handleRead, this) &&
+               link.addHandler(USBFRAME_FILE_WRITE, handleWrite, this) &&
+               link.addHandler(USBFRAME_FILE_CLOSE, handleClose, this) &&
+               link.addHandler(USBFRAME_FILE_LIST, handleList, this) &&
+               link.addHandler(USBFRAME_FILE_CRC, handleCrc, this);
+    }
+
+    bool UsbFileServer::busy() const
+    {
+        return files.busy && files.busy(files.context);
+    }
+
+    void UsbFileServer::close()
+    {
+        if (open || checking) files.close(files.context);
+        open = false;
+        checking = false;
+    }
+
+    size_t UsbFileServer::handleOpen(void *arg, const uint8_t *payload, size_t length, uint8_t *reply, UsbFrameError_t &error)
+    {
+        UsbFileServer *server = static_cast<UsbFileServer *>(arg);
+        UsbFileOpen_t request;
+        char path[USBFILE_PATH_SIZE + 1];
+
+        if (length <= sizeof(request)) return error = USBFRAME_ERROR_BAD_PAYLOAD, 0;
+        memcpy(&request, payload, sizeof(request));
+        if (!valid_fs(request.fs) || request.mode > USBFILE_APPEND ||
+            !usbfile_copy_path(payload + sizeof(request), length - sizeof(request), path)) {
+            return error = USBFRAME_ERROR_BAD_PAYLOAD, 0;
+        }
+
+        server->close();
+
+        uint32_t size = 0;
+        if (!server->files.open(server->files.context, (UsbFileSystemId_t) request.fs, path, (UsbFileMode_t) request.mode, size)) {
+            bool notFound = request.mode == USBFILE_READ && !server->busy();
+            return error = notFound ? USBFRAME_ERROR_NOT_FOUND : USBFRAME_ERROR_IO, 0;
+        }
+
+        server->open = true;
+        server->writing = request.mode != USBFILE_READ;
+        server->size = size;
+
+        UsbFileOpened_t opened;
+        opened.size = size;
+        opened.chunkSize = USBFILE_CHUNK_SIZE;
+        opened.window = server->writing ? USBFILE_WRITE_WINDOW : USBFILE_READ_WINDOW;
+        memcpy(reply, &opened, sizeof(opened));
+        return sizeof(opened);
+    }
+
+    size_t UsbFileServer::handleRead(void *arg, const uint8_t *payload, size_t length, uint8_t *reply, UsbFrameError_t &error)
+    {
+        UsbFileServer *server = static_cast<UsbFileServer *>(arg);
+        uint32_t offset;
+
+        if (length != sizeof(offset)) return error = USBFRAME_ERROR_BAD_PAYLOAD, 0;
+        if (!server->open || server->writing) return error = USBFRAME_ERROR_NOT_OPEN, 0;
+        memcpy(&offset, payload, sizeof(offset));
+
+        size_t chunk = 0;
+        if (offset < server->size) {
+            size_t wanted = server->size - offset < USBFILE_CHUNK_SIZE ? server->size - offset : USBFILE_CHUNK_SIZE;
+            chunk = server->files.read(server->files.context, offset, reply + sizeof(offset), wanted);
+            if (chunk != wanted) return error = USBFRAME_ERROR_IO, 0;
+            ++server->chunksRead;
+        }
+
+        memcpy(reply, &offset, sizeof(offset));
+        return sizeof(offset) + chunk;
+    }
+
+    size_t UsbFileServer::handleWrite(void *arg, const uint8_t *payload, size_t length, uint8_t *reply, UsbFrameError_t &error)
+    {
+        UsbFileServer *server = static_cast<UsbFileServer *>(arg);
+        uint32_t offset;
+
+        if (length < sizeof(offset)) return error = USBFRAME_ERROR_BAD_PAYLOAD, 0;
+        if (!server->open || !server->writing) return error = USBFRAME_ERROR_NOT_OPEN, 0;
+        memcpy(&offset, payload, sizeof(offset));
+
+        // a repeat of a chunk already written is acknowledged again, one after a
+        // gap is dropped and the host goes back to the expected offset
+        size_t chunk = length - sizeof(offset);
+        if (offset == server->size && chunk) {
+            if (server->files.write(server->files.context, payload + sizeof(offset), chunk) != chunk) {
+                return error = USBFRAME_ERROR_IO, 0;
+            }
+            server->size += chunk;
+            ++server->chunksWritten;
+        }
+        else if (offset > server->size) {
+            ++server->outOfOrder;
+        }
+
+        memcpy(reply, &server->size, sizeof(server->size));
+        return sizeof(server->size);
+    }
+
+    size_t UsbFileServer::handleClose(void *arg, const uint8_t *, size_t, uint8_t *, UsbFrameError_t &)
+    {
+        static_cast<UsbFileServer *>(arg)->close();
+        return 0;
+    }
+
+    size_t UsbFileServer::handleList(void *arg, const uint8_t *payload, size_t length, uint8_t *reply, UsbFrameError_t &error)
+    {
+        UsbFileServer *server = static_cast<UsbFileServer *>(arg);
+        char path[USBFILE_PATH_SIZE + 1];
+        char name[USBFILE_PATH_SIZE + 1];
+        uint16_t index;
+
+        if (length <= 1 + sizeof(index) || !valid_fs(payload[0]) ||
+            !usbfile_copy_path(payload + 1 + sizeof(index), length - 1 - sizeof(index), path)) {
+            return error = USBFRAME_ERROR_BAD_PAYLOAD, 0;
+        }
+        memcpy(&index, payload + 1, sizeof(index));
+
+        // as many entries as fit, an empty reply once past the last
+        size_t used = 0;
+        for (;; ++index) {
+            uint32_t size = 0;
+            bool directory = false;
+            int found = server->files.entry(server->files.context, (UsbFileSystemId_t) payload[0], path, index, name, size, directory);
+            if (found < 0 && !used) return error = USBFRAME_ERROR_NOT_FOUND, 0;
+            if (found <= 0) break;
+
+            UsbFileEntry_t entry;
+            entry.size = size;
+            entry.flags = directory ? USBFILE_DIRECTORY : 0;
+            entry.nameLength = strlen(name);
+            if (used + sizeof(entry) + entry.nameLength > USBFRAME_MAX_PAYLOAD) break;
+
+            memcpy(reply + used, &entry, sizeof(entry));
+            memcpy(reply + used + sizeof(entry), name, entry.nameLength);
+            used += sizeof(entry) + entry.nameLength;
+        }
+
+        return used;
+    }
+
+    size_t UsbFileServer::handleCrc(void *arg, const uint8_t *payload, size_t length, uint8_t *reply, UsbFrameError_t &error)
+    {
+        UsbFileServer *server = static_cast<UsbFileServer *>(arg);
+        char path[USBFILE_PATH_SIZE + 1];
+        uint32_t wanted;
+
+        if (length <= 1 + sizeof(wanted) || !valid_fs(payload[0]) ||
+            !usbfile_copy_path(payload + 1 + sizeof(wanted), length - 1 - sizeof(wanted), path)) {
+            return error = USBFRAME_ERROR_BAD_PAYLOAD, 0;
+        }
+        memcpy(&wanted, payload + 1, sizeof(wanted));
+
+        // the same request again carries on from where the last one stopped
+        bool carryOn = server->checking && server->checkFs == payload[0] &&
+                       server->checkWanted == wanted && !strcmp(server->checkPath, path);
+        if (!carryOn) {
+            // takes the place of any open file, the host opens it again to carry on
+            server->close();
+
+            uint32_t size = 0;
+            if (!server->files.open(server->files.context, (UsbFileSystemId_t) payload[0], path, USBFILE_READ, size)) {
+                return error = server->busy() ? USBFRAME_ERROR_IO : USBFRAME_ERROR_NOT_FOUND, 0;
+            }
+
+            server->checking = true;
+            server->checkFs = payload[0];
+            strcpy(server->checkPath, path);
+            server->checkWanted = wanted;
+            server->checkEnd = wanted < size ? wanted : size;
+            server->checkCovered = 0;
+            server->checkCrc = 0;
+        }
+
+        uint32_t stop = server->checkEnd - server->checkCovered > USBFILE_CRC_STEP ?
+                        server->checkCovered + USBFILE_CRC_STEP : server->checkEnd;
+        while (server->checkCovered < stop) {
+            size_t chunk = stop - server->checkCovered < sizeof(server->buffer) ? stop - server->checkCovered : sizeof(server->buffer);
+            if (server->files.read(server->files.context, server->checkCovered, server->buffer, chunk) != chunk) {
+                server->close();
+                return error = USBFRAME_ERROR_IO, 0;
+            }
+            server->checkCrc = usbfile_crc32(server->buffer, chunk, server->checkCrc);
+            server->checkCovered += chunk;
+        }
+
+        memcpy(reply, &server->checkCovered, sizeof(uint32_t));
+        memcpy(reply + sizeof(uint32_t), &server->checkCrc, sizeof(uint32_t));
+        memcpy(reply + 2 * sizeof(uint32_t), &server->checkEnd, sizeof(uint32_t));
+        if (server->checkCovered == server->checkEnd) server->close();
+        return 3 * sizeof(uint32_t);
+    }
+
+    void UsbFileServer::stats(uint32_t &chunksRead, uint32_t &chunksWritten, uint32_t &outOfOrder) const
+    {
+        chunksRead = this->chunksRead;
+        chunksWritten = this->chunksWritten;
+        outOfOrder = this->outOfOrder;
+    }
+}
@@ -0,0 +1,167 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include "usblink.hpp"
+
+// File transfer over the binary mode of the USB-C link, for SD and SPIFFS.
+//
+// One file is open at a time. Reads and writes are chunk requests carrying a
+// file offset, so the host keeps a window of them in flight instead of waiting
+// for each reply, and a lost or damaged chunk (caught by the frame CRC) is just
+// asked for again. Writes must arrive in order: a chunk past the expected offset
+// is not written and the reply tells the host where to go back to. Resuming is
+// opening again with USBFILE_APPEND and carrying on from the size it reports,
+// after checking the part already there with USBFRAME_FILE_CRC. The check
+// covers at most USBFILE_CRC_STEP bytes per request, so the link goes on
+// answering during a check of a large file
+
+#define USBFILE_CHUNK_SIZE          (USBFRAME_MAX_PAYLOAD - sizeof(uint32_t))
+#define USBFILE_PATH_SIZE           96
+#define USBFILE_READ_WINDOW         8       // chunk reads the host may have in flight
+#define USBFILE_WRITE_WINDOW        3       // chunk writes, bounded by the UART receive buffer
+#define USBFILE_CRC_STEP            (16 * USBFILE_CHUNK_SIZE)   // bytes checksummed per USBFRAME_FILE_CRC request
+
+namespace Driver
+{
+    enum UsbFileFrame_t : uint8_t {
+        USBFRAME_FILE_OPEN = 0x10,  // UsbFileOpen_t then the path, the reply is UsbFileOpened_t
+        USBFRAME_FILE_READ,         // uint32 offset, the reply is the offset then up to USBFILE_CHUNK_SIZE bytes, none at the end
+        USBFRAME_FILE_WRITE,        // uint32 offset then the data, the reply is the uint32 offset expected next
+        USBFRAME_FILE_CLOSE,        // empty
+        USBFRAME_FILE_LIST,         // uint8 file system, uint16 first entry, path. The reply is packed UsbFileEntry_t
+        USBFRAME_FILE_CRC           // uint8 file system, uint32 length, path. The reply is uint32 length covered so far, uint32 CRC-32
+                                    // of that, uint32 length it ends at. Send the same request again until the two lengths match
+    };
+
+    enum UsbFileSystemId_t : uint8_t {
+        USBFILE_SD = 0,
+        USBFILE_SPIFFS
+    };
+
+    enum UsbFileMode_t : uint8_t {
+        USBFILE_READ = 0,
+        USBFILE_WRITE,              // truncates
+        USBFILE_APPEND              // keeps what is there, for resuming an upload
+    };
+
+    typedef struct __attribute__((packed)) {
+        uint8_t fs;                 // UsbFileSystemId_t
+        uint8_t mode;               // UsbFileMode_t
+    } UsbFileOpen_t;
+
+    typedef struct __attribute__((packed)) {
+        uint32_t size;              // file size, where writing carries on from
+        uint16_t chunkSize;
+        uint8_t window;             // requests to keep in flight
+    } UsbFileOpened_t;
+
+    // one directory entry in a list reply: size, flags, name length then the name
+    typedef struct __attribute__((packed)) {
+        uint32_t size;
+        uint8_t flags;              // USBFILE_DIRECTORY
+        uint8_t nameLength;
+    } UsbFileEntry_t;
+
+    #define USBFILE_DIRECTORY       0x01
+
+    typedef struct {
+        void *context;
+
+        /**
+         * @brief Opens the one file, closing any other this context had. Fails
+         *          while another context has a file open, see busy
+         *
+         * @param size set to the file size
+         */
+        bool (*open)(void *context, UsbFileSystemId_t fs, const char *path, UsbFileMode_t mode, uint32_t &size);
+
+        // reads from the open file, 0 at the end or on an error
+        size_t (*read)(void *context, uint32_t offset, uint8_t *data, size_t length);
+
+        // appends to the open file, returns bytes written
+        size_t (*write)(void *context, const uint8_t *data, size_t length);
+
+        void (*close)(void *context);
+
+        /**
+         * @brief Looks up entry index of a directory
+         *
+         * @param name room for USBFILE_PATH_SIZE characters
+         * @return int 1 entry found, 0 past the last entry, -1 no such directory
+         */
+        int (*entry)(void *context, UsbFileSystemId_t fs, const char *path, uint16_t index,
+                     char *name, uint32_t &size, bool &directory);
+
+        /**
+         * @brief Looks up one path without disturbing the open file
+         *
+         * @return false no such file or directory
+         */
+        bool (*stat)(void *context, UsbFileSystemId_t fs, const char *path, uint32_t &size, bool &directory);
+
+        // another transport sharing the file system has a file open, optional
+        bool (*busy)(void *context);
+    } UsbFileSystem_t;
+
+    /**
+     * @brief CRC-32 (IEEE 802.3, as zlib and crc32_le), continued from crc
+     */
+    uint32_t usbfile_crc32(const uint8_t *data, size_t length, uint32_t crc=0);
+
+    /**
+     * @brief Copies a path that is not null terminated in a request
+     *
+     * @param path room for USBFILE_PATH_SIZE characters
+     * @return false empty, too long, not absolute or holding a null
+     */
+    bool usbfile_copy_path(const uint8_t *data, size_t length, char *path);
+
+    class UsbFileServer
+    {
+    private:
+        UsbFileSystem_t files;
+        bool open;
+        bool writing;
+        uint32_t size;              // read: file size, write: offset expected next
+        uint8_t buffer[USBFILE_CHUNK_SIZE];
+
+        // the USBFRAME_FILE_CRC in progress, holding the file open between its requests
+        bool checking;
+        uint8_t checkFs;
+        char checkPath[USBFILE_PATH_SIZE + 1];
+        uint32_t checkWanted;
+        uint32_t checkEnd;
+        uint32_t checkCovered;
+        uint32_t checkCrc;
+
+        uint32_t chunksRead;
+        uint32_t chunksWritten;
+        uint32_t outOfOrder;
+
+        static size_t handleOpen(void *arg, const uint8_t *payload, size_t length, uint8_t *reply, UsbFrameError_t &error);
+        static size_t handleRead(void *arg, const uint8_t *payload, size_t length, uint8_t *reply, UsbFrameError_t &error);
+        static size_t handleWrite(void *arg, const uint8_t *payload, size_t length, uint8_t *reply, UsbFrameError_t &error);
+        static size_t handleClose(void *arg, const uint8_t *payload, size_t length, uint8_t *reply, UsbFrameError_t &error);
+        static size_t handleList(void *arg, const uint8_t *payload, size_t length, uint8_t *reply, UsbFrameError_t &error);
+        static size_t handleCrc(void *arg, const uint8_t *payload, size_t length, uint8_t *reply, UsbFrameError_t &error);
+
+        // the file system is held by another transport, opens fail with USBFRAME_ERROR_IO
+        bool busy() const;
+
+    public:
+        UsbFileServer(const UsbFileSystem_t &files);
+
+        /**
+         * @brief Registers the file requests with the link
+         */
+        bool begin(UsbLink &link);
+
+        /**
+         * @brief Closes the open file or ends a check, such as when the link goes back to the console
+         */
+        void close();
+
+        void stats(uint32_t &chunksRead, uint32_t &chunksWritten, uint32_t &outOfOrder) const;
+    };
+}
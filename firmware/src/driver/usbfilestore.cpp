@@ -0,0 +1,297 @@
+#include "usbfilestore.hpp"
+
+#include <FS.h>
+#include <SD.h>
+#include <SPIFFS.h>
+#include <FreeRTOS.h>
+#include "SPSCQueue.hpp"
+
+namespace Driver
+{
+    typedef struct {
+        uint32_t generation;        // read-ahead run the chunk belongs to
+        uint32_t offset;
+        size_t length;              // 0 at the end of the file or on an error
+        uint8_t data[USBFILE_CHUNK_SIZE];
+    } ReadSlot_t;
+
+    static ReadSlot_t _slots[USBFILESTORE_READ_SLOTS];
+    static SPSCQueue<uint8_t, USBFILESTORE_READ_SLOTS> _freeSlots;     // owner to reader
+    static SPSCQueue<uint8_t, USBFILESTORE_READ_SLOTS> _readySlots;    // reader to owner
+    static SemaphoreHandle_t _readyEvent = nullptr;
+    static TaskHandle_t _readerTask = nullptr;
+
+    // the open file, guarded by _fileMutex as both tasks seek it
+    static SemaphoreHandle_t _fileMutex = nullptr;
+    static volatile int _owner = -1;    // UsbFileStoreUser_t with the file open, the only one to use the queues
+    static File _file;
+    static uint32_t _size = 0;
+    static bool _reading = false;
+    static uint32_t _generation = 0;
+    static uint32_t _aheadOffset = 0;   // next offset the reader reads
+
+    // owner only
+    static uint32_t _expectOffset = 0;  // offset of the next chunk the read-ahead delivers
+
+    // directory listing, kept open between pages and shared, so one lookup at a time
+    static SemaphoreHandle_t _dirMutex = nullptr;
+    static File _dir;
+    static UsbFileSystemId_t _dirFs;
+    static char _dirPath[USBFILE_PATH_SIZE + 1];
+    static uint16_t _dirIndex = 0;
+
+    static fs::FS &file_system(UsbFileSystemId_t fs)
+    {
+        if (fs == USBFILE_SPIFFS) return SPIFFS;
+        return SD;
+    }
+
+    static void ReaderTask(void *)
+    {
+        int parked = -1;            // a slot with nothing to read into it yet
+
+        while (true) {
+            ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+
+            uint8_t index;
+            while (parked >= 0 || _freeSlots.pop(index)) {
+                if (parked >= 0) index = parked;
+                ReadSlot_t &slot = _slots[index];
+
+                xSemaphoreTake(_fileMutex, portMAX_DELAY);
+                bool reading = _reading && _aheadOffset < _size;
+                if (reading) {
+                    slot.generation = _generation;
+                    slot.offset = _aheadOffset;
+                    slot.length = _file.seek(_aheadOffset) ? _file.read(slot.data, sizeof(slot.data)) : 0;
+                    _aheadOffset = slot.length ? _aheadOffset + slot.length : _size;     // a failed read ends the run
+                }
+                xSemaphoreGive(_fileMutex);
+
+                if (!reading) {
+                    parked = index;
+                    break;
+                }
+
+                parked = -1;
+                _readySlots.push(index);
+                xSemaphoreGive(_readyEvent);
+            }
+        }
+    }
+
+    // hands every read-ahead chunk back to the reader and starts it at offset
+    static void restart_read_ahead(bool reading, uint32_t offset)
+    {
+        uint8_t index;
+        while (_readySlots.pop(index)) _freeSlots.push(index);
+
+        xSemaphoreTake(_fileMutex, portMAX_DELAY);
+        ++_generation;
+        _reading = reading;
+        _aheadOffset = offset;
+        xSemaphoreGive(_fileMutex);
+
+        _expectOffset = offset;
+        xTaskNotifyGive(_readerTask);
+    }
+
+    static int user_of(void *context)
+    {
+        return *static_cast<const uint8_t *>(context);
+    }
+
+    // only the owner's own open and close change _owner from its value
+    static bool owns(void *context)
+    {
+        return _owner == user_of(context);
+    }
+
+    static void close_file(bool release)
+    {
+        restart_read_ahead(false, 0);
+
+        xSemaphoreTake(_fileMutex, portMAX_DELAY);
+        if (_file) _file.close();
+        if (release) _owner = -1;
+        xSemaphoreGive(_fileMutex);
+    }
+
+    static void files_close(void *context)
+    {
+        if (owns(context)) close_file(true);
+    }
+
+    static bool files_busy(void *context)
+    {
+        int owner = _owner;
+        return owner >= 0 && owner != user_of(context);
+    }
+
+    static bool files_open(void *context, UsbFileSystemId_t fs, const char *path, UsbFileMode_t mode, uint32_t &size)
+    {
+        // taken, or kept from a file this user already had open
+        xSemaphoreTake(_fileMutex, portMAX_DELAY);
+        bool free = _owner < 0 || _owner == user_of(context);
+        if (free) _owner = user_of(context);
+        xSemaphoreGive(_fileMutex);
+        if (!free) return false;
+
+        close_file(false);
+
+        const char *modes[] = { FILE_READ, FILE_WRITE, FILE_APPEND };
+        File file = file_system(fs).open(path, modes[mode]);
+        if (!file || file.isDirectory()) {
+            close_file(true);
+            return false;
+        }
+
+        xSemaphoreTake(_fileMutex, portMAX_DELAY);
+        _file = file;
+        _size = size = file.size();
+        xSemaphoreGive(_fileMutex);
+
+        if (mode == USBFILE_READ) restart_read_ahead(true, 0);
+        return true;
+    }
+
+    static size_t read_direct(uint32_t offset, uint8_t *data, size_t length)
+    {
+        xSemaphoreTake(_fileMutex, portMAX_DELAY);
+        size_t read = _file.seek(offset) ? _file.read(data, length) : 0;
+        xSemaphoreGive(_fileMutex);
+        return read;
+    }
+
+    static size_t files_read(void *context, uint32_t offset, uint8_t *data, size_t length)
+    {
+        if (!owns(context)) return 0;
+
+        // a chunk the host lost, the read-ahead is already past it
+        if (offset < _expectOffset) return read_direct(offset, data, length);
+
+        // the host skipped ahead, such as resuming a download
+        if (offset > _expectOffset) restart_read_ahead(true, offset);
+
+        while (true) {
+            uint8_t index;
+            if (!_readySlots.pop(index)) {
+                if (xSemaphoreTake(_readyEvent, USBFILESTORE_READ_TIMEOUT / portTICK_PERIOD_MS) != pdTRUE) return 0;
+                continue;
+            }
+
+            ReadSlot_t &slot = _slots[index];
+            bool current = slot.generation == _generation && slot.offset == offset;
+            size_t read = slot.length < length ? slot.length : length;
+            if (current) memcpy(data, slot.data, read);
+
+            _freeSlots.push(index);
+            xTaskNotifyGive(_readerTask);
+
+            // chunks from before a restart are dropped
+            if (!current) continue;
+
+            _expectOffset = offset + slot.length;
+            return read;
+        }
+    }
+
+    static size_t files_write(void *context, const uint8_t *data, size_t length)
+    {
+        if (!owns(context)) return 0;
+
+        xSemaphoreTake(_fileMutex, portMAX_DELAY);
+        size_t written = _file.write(data, length);
+        xSemaphoreGive(_fileMutex);
+        return written;
+    }
+
+    static int entry_locked(UsbFileSystemId_t fs, const char *path, uint16_t index,
+                            char *name, uint32_t &size, bool &directory)
+    {
+        // carries on from the last page, or starts over and skips to index
+        if (!_dir || _dirFs != fs || strcmp(_dirPath, path) || index != _dirIndex) {
+            if (_dir) _dir.close();
+            _dir = file_system(fs).open(path);
+            if (!_dir || !_dir.isDirectory()) {
+                if (_dir) _dir.close();
+                return -1;
+            }
+
+            _dirFs = fs;
+            strncpy(_dirPath, path, sizeof(_dirPath) - 1);
+            _dirPath[sizeof(_dirPath) - 1] = '\0';
+            _dirIndex = 0;
+
+            for (; _dirIndex < index; ++_dirIndex) {
+                File skipped = _dir.openNextFile();
+                if (!skipped) return 0;
+                skipped.close();
+            }
+        }
+
+        File f = _dir.openNextFile();
+        if (!f) return 0;
+        ++_dirIndex;
+
+        // depending on the core version name() is either the full path or the file name
+        const char *base = strrchr(f.name(), '/');
+        base = base ? base + 1 : f.name();
+        strncpy(name, base, USBFILE_PATH_SIZE);
+        name[USBFILE_PATH_SIZE] = '\0';
+
+        directory = f.isDirectory();
+        size = directory ? 0 : f.size();
+        f.close();
+        return 1;
+    }
+
+    static int files_entry(void *, UsbFileSystemId_t fs, const char *path, uint16_t index,
+                           char *name, uint32_t &size, bool &directory)
+    {
+        xSemaphoreTake(_dirMutex, portMAX_DELAY);
+        int found = entry_locked(fs, path, index, name, size, directory);
+        xSemaphoreGive(_dirMutex);
+        return found;
+    }
+
+    static bool files_stat(void *, UsbFileSystemId_t fs, const char *path, uint32_t &size, bool &directory)
+    {
+        File f = file_system(fs).open(path);
+        if (!f) return false;
+
+        directory = f.isDirectory();
+        size = directory ? 0 : f.size();
+        f.close();
+        return true;
+    }
+
+    static uint8_t _users[USBFILESTORE_USERS] = { USBFILESTORE_USB, USBFILESTORE_BLE };
+
+    static const UsbFileSystem_t _files[USBFILESTORE_USERS] = {
+        { &_users[USBFILESTORE_USB], files_open, files_read, files_write, files_close, files_entry, files_stat, files_busy },
+        { &_users[USBFILESTORE_BLE], files_open, files_read, files_write, files_close, files_entry, files_stat, files_busy }
+    };
+
+    bool usbfilestore_begin()
+    {
+        _fileMutex = xSemaphoreCreateMutex();
+        _readyEvent = xSemaphoreCreateBinary();
+        _dirMutex = xSemaphoreCreateMutex();
+        if (!_fileMutex || !_readyEvent || !_dirMutex) return false;
+
+        for (uint8_t i = 0; i < USBFILESTORE_READ_SLOTS; ++i) _freeSlots.push(i);
+
+        return xTaskCreate(ReaderTask,
+                           "usbfile_read",
+                           USBFILESTORE_STACK_SIZE,
+                           nullptr,
+                           1,
+                           &_readerTask) == pdPASS;
+    }
+
+    const UsbFileSystem_t &usbfilestore_files(UsbFileStoreUser_t user)
+    {
+        return _files[user];
+    }
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <Arduino.h>
+#include "usbfile.hpp"
+
+#define USBFILESTORE_READ_SLOTS     4       // chunks read ahead of the host, a power of two
+#define USBFILESTORE_READ_TIMEOUT   1000    // ms to wait for the read-ahead before failing a chunk
+#define USBFILESTORE_STACK_SIZE     3 * 1024
+
+/**
+ * SD and SPIFFS behind UsbFileServer. Reads run ahead in their own task: while
+ * the USB-C task is blocked sending one chunk, the next ones are being read from
+ * the card, so the link never waits on the file system during a sequential
+ * download. A chunk asked for again after a loss is read directly without
+ * disturbing the read-ahead; a jump forward restarts it from the new offset
+ *
+ * The USB-C link and BLE each get a view of their own. There is still one
+ * open file and one read-ahead, so the view that opens it holds it until it
+ * closes; the other's opens fail meanwhile and its busy() says why
+ */
+namespace Driver
+{
+    enum UsbFileStoreUser_t : uint8_t {
+        USBFILESTORE_USB = 0,
+        USBFILESTORE_BLE,
+        USBFILESTORE_USERS
+    };
+
+    /**
+     * @brief Starts the read-ahead task. SD and SPIFFS must already be mounted
+     */
+    bool usbfilestore_begin();
+
+    const UsbFileSystem_t &usbfilestore_files(UsbFileStoreUser_t user);
+}
@@ -0,0 +1,130 @@
+#include "usbframe.hpp"
+#include <string.h>
+
+namespace Driver
+{
+    uint16_t usbframe_crc16(const uint8_t *data, size_t length, uint16_t crc)
+    {
+        for (size_t i = 0; i < length; ++i) {
+            crc ^= (uint16_t) data[i] << 8;
+            for (uint8_t bit = 0; bit < 8; ++bit) {
+                crc = crc & 0x8000 ? (crc << 1) ^ 0x1021 : crc << 1;
+            }
+        }
+        return crc;
+    }
+
+    size_t usbframe_cobs_encode(const uint8_t *in, size_t length, uint8_t *out)
+    {
+        size_t code = 0;            // position of the current block's length byte
+        size_t written = 1;
+        uint8_t run = 1;
+
+        for (size_t i = 0; i < length; ++i) {
+            if (in[i]) {
+                out[written++] = in[i];
+                ++run;
+            }
+
+            // a zero, or a full block of 254 non-zero bytes, closes the block
+            if (!in[i] || run == 0xFF) {
+                out[code] = run;
+                code = written++;
+                run = 1;
+            }
+        }
+
+        out[code] = run;
+        return written;
+    }
+
+    size_t usbframe_cobs_decode(const uint8_t *in, size_t length, uint8_t *out, size_t size)
+    {
+        size_t read = 0;
+        size_t written = 0;
+
+        while (read < length) {
+            uint8_t code = in[read++];
+            if (!code || read + code - 1 > length) return 0;
+
+            for (uint8_t i = 1; i < code; ++i) {
+                if (!in[read] || written == size) return 0;
+                out[written++] = in[read++];
+            }
+
+            // every block but a full one or the last stands for a zero
+            if (code != 0xFF && read < length) {
+                if (written == size) return 0;
+                out[written++] = 0;
+            }
+        }
+
+        return written;
+    }
+
+    size_t usbframe_encode(uint8_t type, uint8_t sequence, const uint8_t *payload, size_t length, uint8_t *out)
+    {
+        if (length > USBFRAME_MAX_PAYLOAD) return 0;
+
+        uint8_t frame[USBFRAME_MAX_DECODED];
+        frame[0] = type;
+        frame[1] = sequence;
+        if (length) memcpy(frame + USBFRAME_HEADER_SIZE, payload, length);
+
+        size_t size = USBFRAME_HEADER_SIZE + length;
+        uint16_t crc = usbframe_crc16(frame, size);
+        frame[size++] = crc & 0xFF;
+        frame[size++] = crc >> 8;
+
+        out[0] = USBFRAME_DELIMITER;
+        size_t encoded = usbframe_cobs_encode(frame, size, out + 1);
+        out[1 + encoded] = USBFRAME_DELIMITER;
+        return encoded + 2;
+    }
+
+    UsbFrameDecoder::UsbFrameDecoder()
+        : encodedLength(0)
+        , decodedLength(0)
+        , discarding(false)
+        , frames(0)
+        , errors(0)
+    {
+        memset(decoded, 0, sizeof(decoded));
+    }
+
+    void UsbFrameDecoder::reset()
+    {
+        encodedLength = 0;
+        discarding = false;
+    }
+
+    UsbFrameDecoder::Result UsbFrameDecoder::feed(uint8_t byte)
+    {
+        if (byte != USBFRAME_DELIMITER) {
+            if (encodedLength < sizeof(encoded)) encoded[encodedLength++] = byte;
+            else discarding = true;
+            return FRAME_NONE;
+        }
+
+        // back to back delimiters, such as the leading one of each frame
+        if (!encodedLength && !discarding) return FRAME_NONE;
+
+        size_t length = discarding ? 0 : usbframe_cobs_decode(encoded, encodedLength, decoded, sizeof(decoded));
+        reset();
+
+        if (length < USBFRAME_HEADER_SIZE + USBFRAME_CRC_SIZE) {
+            ++errors;
+            return FRAME_ERROR;
+        }
+
+        uint16_t crc = decoded[length - 2] | (uint16_t) decoded[length - 1] << 8;
+        if (crc != usbframe_crc16(decoded, length - USBFRAME_CRC_SIZE)) {
+            ++errors;
+            return FRAME_ERROR;
+        }
+
+        decodedLength = length;
+        ++frames;
+        return FRAME_READY;
+    }
+}
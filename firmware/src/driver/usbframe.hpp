@@ -0,0 +1,118 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+// Binary framing for the USB-C link, shared with the host tools.
+//
+// A frame is type, sequence number, payload and a CRC-16/CCITT-FALSE over the
+// three (little endian), COBS encoded and sent between two 0x00 delimiters.
+// The leading delimiter ends any console text that was written in between, so a
+// receiver only ever loses that text and never the frame after it
+
+#define USBFRAME_VERSION            1
+#define USBFRAME_MAX_PAYLOAD        1024
+#define USBFRAME_HEADER_SIZE        2       // type, sequence
+#define USBFRAME_CRC_SIZE           2
+#define USBFRAME_MAX_DECODED        (USBFRAME_HEADER_SIZE + USBFRAME_MAX_PAYLOAD + USBFRAME_CRC_SIZE)
+#define USBFRAME_MAX_ENCODED        (USBFRAME_MAX_DECODED + USBFRAME_MAX_DECODED / 254 + 1 + 2)   // COBS overhead and both delimiters
+#define USBFRAME_DELIMITER          0x00
+
+#define USBFRAME_REPLY              0x80    // set in the type of every device reply
+
+namespace Driver
+{
+    enum UsbFrameType_t : uint8_t {
+        USBFRAME_HELLO = 0x01,      // empty, the reply carries UsbFrameHello_t
+        USBFRAME_BAUD,              // uint32 baud, the reply echoes it before the device switches
+        USBFRAME_ECHO,              // any payload, returned unchanged
+        USBFRAME_EXIT,              // empty, the device returns to the text console at the base baud
+        USBFRAME_NAK = 0x7F         // reply only, payload is a UsbFrameError_t
+    };
+
+    enum UsbFrameError_t : uint8_t {
+        USBFRAME_ERROR_NONE = 0,
+        USBFRAME_ERROR_UNKNOWN_TYPE,
+        USBFRAME_ERROR_BAD_PAYLOAD,
+        USBFRAME_ERROR_BAUD_UNSUPPORTED,
+        USBFRAME_ERROR_NOT_FOUND,       // no such file or directory
+        USBFRAME_ERROR_NOT_OPEN,        // no file open for the request
+        USBFRAME_ERROR_IO,              // the file system failed a read or write
+        USBFRAME_ERROR_REFUSED          // the device is set not to accept the request
+    };
+
+    typedef struct __attribute__((packed)) {
+        uint16_t version;
+        uint16_t maxPayload;
+        uint32_t baud;              // current baud
+    } UsbFrameHello_t;
+
+    /**
+     * @brief CRC-16/CCITT-FALSE: polynomial 0x1021, initial value 0xFFFF
+     */
+    uint16_t usbframe_crc16(const uint8_t *data, size_t length, uint16_t crc=0xFFFF);
+
+    /**
+     * @brief COBS encodes length bytes. out needs length + length / 254 + 1 bytes
+     *
+     * @return size_t encoded length, which never contains a zero byte
+     */
+    size_t usbframe_cobs_encode(const uint8_t *in, size_t length, uint8_t *out);
+
+    /**
+     * @brief Decodes a COBS block without its delimiter
+     *
+     * @param size room in out
+     * @return size_t decoded length, 0 if the block is malformed or does not fit
+     */
+    size_t usbframe_cobs_decode(const uint8_t *in, size_t length, uint8_t *out, size_t size);
+
+    /**
+     * @brief Builds a complete frame, delimiters included
+     *
+     * @param out at least USBFRAME_MAX_ENCODED bytes
+     * @return size_t bytes to send, 0 if the payload is too long
+     */
+    size_t usbframe_encode(uint8_t type, uint8_t sequence, const uint8_t *payload, size_t length, uint8_t *out);
+
+    /**
+     * @brief Reassembles frames from received bytes, one byte at a time
+     */
+    class UsbFrameDecoder
+    {
+    public:
+        enum Result : uint8_t {
+            FRAME_NONE = 0,         // no complete frame yet
+            FRAME_READY,            // type(), sequence() and payload() hold a frame until the next feed()
+            FRAME_ERROR             // a block between delimiters was malformed, too long or failed its CRC
+        };
+
+    private:
+        uint8_t encoded[USBFRAME_MAX_ENCODED];
+        uint8_t decoded[USBFRAME_MAX_DECODED];
+        size_t encodedLength;
+        size_t decodedLength;
+        bool discarding;            // the current block overflowed, dropped up to the next delimiter
+
+        uint32_t frames;
+        uint32_t errors;
+
+    public:
+        UsbFrameDecoder();
+
+        Result feed(uint8_t byte);
+
+        uint8_t type() const { return decoded[0]; }
+        uint8_t sequence() const { return decoded[1]; }
+        const uint8_t *payload() const { return decoded + USBFRAME_HEADER_SIZE; }
+        size_t payloadLength() const { return decodedLength - USBFRAME_HEADER_SIZE - USBFRAME_CRC_SIZE; }
+
+        /**
+         * @brief Drops a partly received block
+         */
+        void reset();
+
+        uint32_t frameCount() const { return frames; }
+        uint32_t errorCount() const { return errors; }
+    };
+}
@@ -0,0 +1,217 @@
+#include "usblink.hpp"
+#include <string.h>
+
+namespace Driver
+{
+    static const uint32_t _usbLinkBauds[] = { 9600, 115200, 230400, 460800, 921600 };
+
+    // wrap-safe "now is at or after time" on the ms clock
+    static bool reached(uint32_t now, uint32_t time)
+    {
+        return (int32_t) (now - time) >= 0;
+    }
+
+    UsbLink::UsbLink(const UsbLinkTransport_t &transport)
+        : transport(transport)
+        , numHandlers(0)
+        , endHandler(nullptr)
+        , endArg(nullptr)
+        , binary(false)
+        , baud(USBLINK_BASE_BAUD)
+        , previousBaud(USBLINK_BASE_BAUD)
+        , confirming(false)
+        , confirmDeadline(0)
+        , badFrames(0)
+        , lastFrame(0)
+        , replyFrameLength(0)
+        , replyType(0)
+        , replySequence(0)
+        , requests(0)
+        , duplicates(0)
+        , fallbacks(0)
+    { }
+
+    bool UsbLink::supportedBaud(uint32_t baud)
+    {
+        for (uint32_t supported : _usbLinkBauds) {
+            if (baud == supported) return true;
+        }
+        return false;
+    }
+
+    bool UsbLink::addHandler(uint8_t type, UsbLinkHandler handler, void *arg)
+    {
+        if (numHandlers == USBLINK_MAX_HANDLERS || type <= USBFRAME_EXIT || type >= USBFRAME_NAK) return false;
+
+        handlers[numHandlers].type = type;
+        handlers[numHandlers].handler = handler;
+        handlers[numHandlers].arg = arg;
+        ++numHandlers;
+        return true;
+    }
+
+    void UsbLink::onEnd(UsbLinkEndHandler callback, void *arg)
+    {
+        endHandler = callback;
+        endArg = arg;
+    }
+
+    void UsbLink::setBaud(uint32_t rate)
+    {
+        if (rate == baud) return;
+        baud = rate;
+        transport.setBaud(transport.context, rate);
+    }
+
+    void UsbLink::begin(uint32_t now)
+    {
+        decoder.reset();
+        badFrames = 0;
+        confirming = false;
+        replyFrameLength = 0;
+        lastFrame = now;
+        setBaud(USBLINK_BASE_BAUD);
+        binary = true;
+    }
+
+    void UsbLink::end()
+    {
+        binary = false;
+        confirming = false;
+        transport.flush(transport.context);
+        setBaud(USBLINK_BASE_BAUD);
+        if (endHandler) endHandler(endArg);
+    }
+
+    void UsbLink::reply(uint8_t request, uint8_t sequence, uint8_t type, const uint8_t *payload, size_t length)
+    {
+        replyFrameLength = usbframe_encode(type | USBFRAME_REPLY, sequence, payload, length, replyFrame);
+        replyType = request;
+        replySequence = sequence;
+        transport.write(transport.context, replyFrame, replyFrameLength);
+    }
+
+    void UsbLink::nak(uint8_t request, uint8_t sequence, UsbFrameError_t error)
+    {
+        uint8_t payload = error;
+        reply(request, sequence, USBFRAME_NAK, &payload, 1);
+    }
+
+    void UsbLink::handleFrame(uint32_t now)
+    {
+        uint8_t type = decoder.type();
+        uint8_t sequence = decoder.sequence();
+        const uint8_t *payload = decoder.payload();
+        size_t length = decoder.payloadLength();
+
+        badFrames = 0;
+        lastFrame = now;
+        confirming = false;         // the host is heard at this rate
+
+        // a request repeated because its reply was lost is answered again, not run twice.
+        // A repeated baud change runs again, the device may have fallen back since
+        if (replyFrameLength && type == replyType && sequence == replySequence && type != USBFRAME_BAUD) {
+            ++duplicates;
+            transport.write(transport.context, replyFrame, replyFrameLength);
+            return;
+        }
+        ++requests;
+
+        switch (type) {
+        case USBFRAME_HELLO: {
+            UsbFrameHello_t hello;
+            hello.version = USBFRAME_VERSION;
+            hello.maxPayload = USBFRAME_MAX_PAYLOAD;
+            hello.baud = baud;
+            reply(type, sequence, type, reinterpret_cast<const uint8_t *>(&hello), sizeof(hello));
+            return;
+        }
+
+        case USBFRAME_BAUD: {
+            uint32_t rate;
+            if (length != sizeof(rate)) return nak(type, sequence, USBFRAME_ERROR_BAD_PAYLOAD);
+            memcpy(&rate, payload, sizeof(rate));
+            if (!supportedBaud(rate)) return nak(type, sequence, USBFRAME_ERROR_BAUD_UNSUPPORTED);
+
+            // the reply goes out at the old rate
+            reply(type, sequence, type, payload, length);
+            transport.flush(transport.context);
+
+            previousBaud = baud;
+            setBaud(rate);
+            confirming = rate != previousBaud;
+            confirmDeadline = now + USBLINK_CONFIRM_TIMEOUT;
+            return;
+        }
+
+        case USBFRAME_ECHO:
+            reply(type, sequence, type, payload, length);
+            return;
+
+        case USBFRAME_EXIT:
+            reply(type, sequence, type, nullptr, 0);
+            end();
+            return;
+
+        default:
+            break;
+        }
+
+        for (uint8_t i = 0; i < numHandlers; ++i) {
+            if (handlers[i].type != type) continue;
+
+            UsbFrameError_t error = USBFRAME_ERROR_NONE;
+            size_t replyLength = handlers[i].handler(handlers[i].arg, payload, length, replyPayload, error);
+            if (error != USBFRAME_ERROR_NONE) return nak(type, sequence, error);
+            return reply(type, sequence, type, replyPayload, replyLength);
+        }
+
+        nak(type, sequence, USBFRAME_ERROR_UNKNOWN_TYPE);
+    }
+
+    void UsbLink::feed(uint8_t byte, uint32_t now)
+    {
+        if (!binary) return;
+
+        switch (decoder.feed(byte)) {
+        case UsbFrameDecoder::FRAME_READY:
+            handleFrame(now);
+            break;
+
+        case UsbFrameDecoder::FRAME_ERROR:
+            // a noisy line, or the host already gave up on this rate
+            if (++badFrames >= USBLINK_FALLBACK_ERRORS && baud != USBLINK_BASE_BAUD) {
+                ++fallbacks;
+                confirming = false;
+                badFrames = 0;
+                setBaud(USBLINK_BASE_BAUD);
+            }
+            break;
+
+        default:
+            break;
+        }
+    }
+
+    void UsbLink::poll(uint32_t now)
+    {
+        if (!binary) return;
+
+        if (confirming && reached(now, confirmDeadline)) {
+            ++fallbacks;
+            confirming = false;
+            decoder.reset();
+            setBaud(previousBaud);
+        }
+
+        if (reached(now, lastFrame + USBLINK_IDLE_TIMEOUT)) end();
+    }
+
+    void UsbLink::stats(uint32_t &requests, uint32_t &badFrames, uint32_t &duplicates, uint32_t &fallbacks) const
+    {
+        requests = this->requests;
+        badFrames = decoder.errorCount();
+        duplicates = this->duplicates;
+        fallbacks = this->fallbacks;
+    }
+}
@@ -0,0 +1,136 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include "usbframe.hpp"
+
+// Device side of the binary mode of the USB-C link. The text console hands
+// bytes over once "!binary" is received; from then on requests are answered
+// frame by frame until the host sends USBFRAME_EXIT or goes quiet.
+//
+// Baud negotiation: the device answers USBFRAME_BAUD at the current rate,
+// waits for the reply to go out and switches. The host must be heard at the new
+// rate within USBLINK_CONFIRM_TIMEOUT or the device goes back to the old one.
+// USBLINK_FALLBACK_ERRORS bad frames in a row drop the device to the base rate,
+// which is where the host goes when its own requests keep failing, so the two
+// always meet again at USBLINK_BASE_BAUD
+
+#define USBLINK_BASE_BAUD           9600
+#define USBLINK_CONFIRM_TIMEOUT     1000    // ms for the host to be heard at a new baud
+#define USBLINK_FALLBACK_ERRORS     3       // bad frames in a row before dropping to the base baud
+#define USBLINK_IDLE_TIMEOUT        60000   // ms without a good frame before returning to the text console
+#define USBLINK_MAX_HANDLERS        12
+
+namespace Driver
+{
+    typedef struct {
+        void *context;
+
+        // queues bytes for transmit
+        void (*write)(void *context, const uint8_t *data, size_t length);
+
+        // waits until queued bytes have gone out
+        void (*flush)(void *context);
+
+        void (*setBaud)(void *context, uint32_t baud);
+
+        uint32_t (*millis)(void *context);
+    } UsbLinkTransport_t;
+
+    /**
+     * @brief Answers one request type
+     *
+     * @param reply room for USBFRAME_MAX_PAYLOAD bytes
+     * @param error set to reply with a NAK instead
+     * @return size_t reply payload length
+     */
+    typedef size_t (*UsbLinkHandler)(void *arg, const uint8_t *payload, size_t length, uint8_t *reply, UsbFrameError_t &error);
+
+    // called when the link returns to the text console
+    typedef void (*UsbLinkEndHandler)(void *arg);
+
+    class UsbLink
+    {
+    private:
+        typedef struct {
+            uint8_t type;
+            UsbLinkHandler handler;
+            void *arg;
+        } Handler_t;
+
+        UsbLinkTransport_t transport;
+        UsbFrameDecoder decoder;
+        Handler_t handlers[USBLINK_MAX_HANDLERS];
+        uint8_t numHandlers;
+        UsbLinkEndHandler endHandler;
+        void *endArg;
+
+        volatile bool binary;
+        uint32_t baud;
+        uint32_t previousBaud;      // rate to go back to when a switch is not confirmed
+        bool confirming;
+        uint32_t confirmDeadline;
+        uint8_t badFrames;          // in a row
+        uint32_t lastFrame;         // ms, last good frame
+
+        // the last reply, sent again when the host repeats a request it got no answer to
+        uint8_t replyFrame[USBFRAME_MAX_ENCODED];
+        size_t replyFrameLength;
+        uint8_t replyType;
+        uint8_t replySequence;
+        uint8_t replyPayload[USBFRAME_MAX_PAYLOAD];
+
+        uint32_t requests;
+        uint32_t duplicates;
+        uint32_t fallbacks;
+
+        void setBaud(uint32_t rate);
+        void reply(uint8_t request, uint8_t sequence, uint8_t type, const uint8_t *payload, size_t length);
+        void nak(uint8_t request, uint8_t sequence, UsbFrameError_t error);
+        void handleFrame(uint32_t now);
+
+    public:
+        UsbLink(const UsbLinkTransport_t &transport);
+
+        static bool supportedBaud(uint32_t baud);
+
+        /**
+         * @brief Answers another request type. Call before begin()
+         *
+         * @return false USBLINK_MAX_HANDLERS are already registered or the type is built in
+         */
+        bool addHandler(uint8_t type, UsbLinkHandler handler, void *arg=nullptr);
+
+        /**
+         * @brief Runs callback each time binary mode ends, to let go of what the handlers hold
+         */
+        void onEnd(UsbLinkEndHandler callback, void *arg=nullptr);
+
+        /**
+         * @brief Switches from the text console to binary mode, at the base baud
+         */
+        void begin(uint32_t now);
+
+        /**
+         * @brief Back to the text console at the base baud
+         */
+        void end();
+
+        bool active() const { return binary; }
+
+        /**
+         * @brief Handles a received byte, answering a request once its frame is complete
+         */
+        void feed(uint8_t byte, uint32_t now);
+
+        /**
+         * @brief Falls back from an unconfirmed baud switch and leaves binary mode
+         *          when the host has gone quiet. Call at least every 100ms
+         */
+        void poll(uint32_t now);
+
+        uint32_t currentBaud() const { return baud; }
+
+        void stats(uint32_t &requests, uint32_t &badFrames, uint32_t &duplicates, uint32_t &fallbacks) const;
+    };
+}
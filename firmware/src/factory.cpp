@@ -16,6 +16,22 @@
 #include <Update.h>
 #include <esp_ota_ops.h>
 
+#ifdef ENABLE_BLE
+#include <BLEDevice.h>
+#include <BLE2902.h>
+#include "BLE_UUID.h"
+#include "BLE_Callback_Transfer.h"
+#include "driver/usbfilestore.hpp"
+#include "driver/otaupdate.hpp"
+
+#define FACTORY_BLE_NAME "MiOrigin Update"
+
+BLE_Callback_Transfer callbackTransfer;
+
+// the ota firmware restarted into this one for an update over BLE, 0 otherwise
+static uint32_t bleUpdateDeadline = 0;
+#endif
+
 
 /**
  * @brief Writes a file in SPIFFS so ota app knows factory firmware handed it control
@@ -43,6 +59,36 @@ void handOff()
     }
 }
 
+#ifdef ENABLE_BLE
+/**
+ * @brief Takes firmware images over BLE straight into ota_0, the same
+ *          characteristic as in the ota firmware
+ * 
+ */
+void startBluetooth()
+{
+    BLEDevice::init(FACTORY_BLE_NAME);
+    BLEDevice::setMTU(BLETRANSFER_MAX_MTU);
+    BLEServer *server = BLEDevice::createServer();
+    BLEService *service = server->createService(SERVICE_DEVICE_INFO_UUID);
+
+    BLECharacteristic *transfer = service->createCharacteristic(BLETC_CHARACTERISTIC_UUID,
+                                                                BLECharacteristic::PROPERTY_WRITE    |
+                                                                BLECharacteristic::PROPERTY_WRITE_NR |
+                                                                BLECharacteristic::PROPERTY_NOTIFY);
+    transfer->addDescriptor(new BLE2902);
+    if (!Driver::usbfilestore_begin() || !callbackTransfer.begin(transfer)) {
+        Serial.println("Error: Cannot start BLE transfer");
+    }
+    service->start();
+
+    BLEAdvertising *advertising = BLEDevice::getAdvertising();
+    advertising->addServiceUUID(SERVICE_DEVICE_INFO_UUID);
+    advertising->setScanResponse(true);
+    BLEDevice::startAdvertising();
+}
+#endif
+
 void setup() {
     Serial.begin(9600);
     Serial.println("Starting Factory Firmware");
@@ -165,6 +211,16 @@ void setup() {
     }
 
     firmware_flash_abort:
+
+#ifdef ENABLE_BLE
+    // an update the ota firmware handed over, or one to recover a unit with
+    if (SPIFFS.exists(OTAUPDATE_MARKER)) {
+        SPIFFS.remove(OTAUPDATE_MARKER);
+        bleUpdateDeadline = millis() + OTAUPDATE_FACTORY_WAIT;
+        Serial.println("-> Waiting for firmware over BLE");
+    }
+    startBluetooth();
+#endif
     
     // handOff();
     Serial.println("End of factory app, restarting in 2 seconds");
@@ -174,6 +230,15 @@ void setup() {
 }
 
 void loop() {
+#ifdef ENABLE_BLE
+    // the phone never came back with the image, so ota_0 is untouched
+    if (bleUpdateDeadline && (int32_t) (millis() - bleUpdateDeadline) >= 0 && !Driver::otaupdate_started()) {
+        Serial.println("-> No firmware over BLE, going back to the main firmware");
+        handOff();
+        ESP.restart();
+    }
+#endif
+
     if (Serial.available()) {
         String message = Serial.readStringUntil('\n');
 
@@ -1,6 +1,7 @@
 #include "Button.hpp"
 #include <string.h>
 #include "DrawingWrapper.hpp"
+#include "../diagnostics/latency.h"
 #include <stdexcept>
 
 Button::Button(bool initialize)
@@ -43,6 +44,12 @@ void Button::setButtonSize(uint8_t size)
     this->buttonSize = size;
 }
 
+void Button::setName(name_t name)
+{
+    strncpy(this->name, name, sizeof(this->name) - 1);
+    this->name[sizeof(this->name) - 1] = '\0';
+}
+
 void Button::draw()
 {
     uint16_t xmid = (2 * x + width)  / 2;
@@ -55,20 +62,37 @@ void Button::draw()
     drw.drawString(name, xmid, ymid);
 }
 
-void Button::performAction(uint16_t x, uint16_t y, uint8_t z,bool pressed)
+void Button::performAction(const Driver::TouchscreenEvent_t &event)
 {
-    static bool previousClickState = false;
-    static bool previousInBoundsState = false;
-
+    const uint16_t x = event.x;
+    const uint16_t y = event.y;
+    const uint8_t  z = event.z > 0xFF ? 0xFF : event.z;
     bool hit = inBounds(x, y);
+    if (hit) Diagnostics::latency_mark_dispatch();
 
-    if (onPress         && pressed  && hit  && previousClickState  ) onPress(x, y, z);
-    if (onHoverEnter    && pressed  && hit                                ) onHoverEnter(x, y, z);
-    if (onHoverExit     && pressed  && !hit && previousInBoundsState) onHoverExit(x, y, z);
-    if (onRelease       && !pressed && hit                                ) onRelease(x, y, z);
+    switch (event.type) {
+        case Driver::TOUCHSCREEN_EVENT_DOWN:
+            hovering = hit;
+            if (onPress      && hit) onPress(x, y, z);
+            if (onHoverEnter && hit) onHoverEnter(x, y, z);
+            break;
 
-    previousClickState = pressed;
-    previousInBoundsState = hit;
+        case Driver::TOUCHSCREEN_EVENT_MOVE:
+        case Driver::TOUCHSCREEN_EVENT_DRAG:
+            if (onHoverEnter && hit  && !hovering) onHoverEnter(x, y, z);
+            if (onHoverExit  && !hit && hovering ) onHoverExit(x, y, z);
+            hovering = hit;
+            break;
+
+        case Driver::TOUCHSCREEN_EVENT_UP:
+            // only a touch that started on this button can release it
+            if (onRelease && hit && inBounds(event.startX, event.startY)) onRelease(x, y, z);
+            hovering = false;
+            break;
+
+        default:
+            break;
+    }
 }
 
 // Button& Button::operator=(const Button &other)
@@ -8,6 +8,7 @@
 #include <stdint.h>
 #include "GraphicsConfig.hpp"
 #include "DrawingWrapper.hpp"
+#include "../driver/touchscreen.h"
 
 #ifdef GRAPHICS_BUTTON_DYNAMIC_MEMORY
 #include <string>
@@ -35,6 +36,7 @@ protected:
     Color textColor;
     Color buttonColor;
     uint8_t buttonSize = 1;
+    bool hovering = false;
 
     DrawingWrapper &drw;
 
@@ -47,10 +49,16 @@ public:
     void setButtonColor(Color buttonColor);
     
     void setButtonSize(uint8_t size);
+    void setName(name_t name);
     
     void draw();
 
-    void performAction(uint16_t x, uint16_t y, uint8_t z, bool pressed);
+    /**
+     * @brief Dispatches a touch event to the button's handlers
+     * 
+     * @param event touch event in screen coordinates
+     */
+    void performAction(const Driver::TouchscreenEvent_t &event);
 
     void (*onPress)(uint16_t x, uint16_t y, uint8_t z);
     
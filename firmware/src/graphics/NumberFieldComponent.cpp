@@ -3,13 +3,11 @@
 #include "NumberFieldDefs.hpp"
 #include "../pages/AppPageConfig.hpp"
 #include "../driver/touchscreen.h"
+#include "../diagnostics/latency.h"
+#include "../driver/console.hpp"
 #include <stdio.h>
 #include <string.h>
 
-#ifdef DEV_DEBUG
-#include <HardwareSerial.h>
-#endif
-
 NumberFieldComponent::NumberFieldComponent()
 { }
 
@@ -66,9 +64,7 @@ void NumberFieldComponent::setReturnPageName(const char *name, size_t size)
     // error: fix this
     // strncpy(returnPageName, name, std::min(size, sizeof(returnPageName) - 1));
     returnPageName = name;
-    delay(80);
-    Serial.printf("Page name is: %s and the returnPageName is: %s\n", name, returnPageName);
-    delay(80);
+    Driver::console.printf("Page name is: %s and the returnPageName is: %s\n", name, returnPageName);
 }
 
 void NumberFieldComponent::draw()
@@ -99,25 +95,18 @@ void NumberFieldComponent::draw()
     }
 }
 
-void NumberFieldComponent::performAction(uint16_t x, uint16_t y, uint8_t z,bool pressed)
+void NumberFieldComponent::performAction(const Driver::TouchscreenEvent_t &event)
 {
-    // static bool previousClickState = false;
-    // static bool previousInBoundsState = false;
-
-    bool hit = inBounds(x, y);
-
-    // if (onPress         && pressed  && hit  && previousClickState  ) onPress(x, y, z);
-    // if (onHoverEnter    && pressed  && hit                                ) onHoverEnter(x, y, z);
-    // if (onHoverExit     && pressed  && !hit && previousInBoundsState) onHoverExit(x, y, z);
-    if (!pressed && hit                                ) onRelease(x, y, z);
-
-    // previousClickState = pressed;
-    // previousInBoundsState = hit;
+    // only a touch that started and ended on the field opens the keypad
+    if (event.type == Driver::TOUCHSCREEN_EVENT_UP && inBounds(event.x, event.y) && inBounds(event.startX, event.startY)) {
+        Diagnostics::latency_mark_dispatch();
+        onRelease(event.x, event.y, 0);
+    }
 }
 
 void NumberFieldComponent::onRelease(uint16_t x, uint16_t y, uint8_t z)
 {
-    Serial.println("-> I am pressed from the NumberFieldComponent");
+    Driver::console.println("-> I am pressed from the NumberFieldComponent");
     NumberFieldDefs::Props_t *props = new NumberFieldDefs::Props_t;
     setPropsFromCurrent(*props);
     
@@ -138,7 +127,7 @@ void NumberFieldComponent::onRelease(uint16_t x, uint16_t y, uint8_t z)
     //     delete[] args;
     // };
     
-    Serial.println("-> Number Field Component Released!");
+    Driver::console.println("-> Number Field Component Released!");
 }
 
 void NumberFieldComponent::setPropsFromCurrent(NumberFieldDefs::Props_t &props)
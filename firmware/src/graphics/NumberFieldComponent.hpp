@@ -6,6 +6,7 @@
 #include "NumberFieldDefs.hpp"
 #include "BoundedArea.hpp"
 #include "DrawingWrapper.hpp"
+#include "../driver/touchscreen.h"
 #include "../pagesystem/page.h"
 #include <stdint.h>
 #include <string>
@@ -50,7 +51,7 @@ public:
     
     void draw();
 
-    void performAction(uint16_t x, uint16_t y, uint8_t z, bool pressed);
+    void performAction(const Driver::TouchscreenEvent_t &event);
 
     // void (*onPress)(uint16_t x, uint16_t y, uint8_t z);
     
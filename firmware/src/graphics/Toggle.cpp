@@ -1,5 +1,7 @@
 #include "Toggle.hpp"
 #include <Arduino.h>
+#include "../driver/console.hpp"
+#include "../diagnostics/latency.h"
 
 Toggle::Toggle()
     : BoundedArea(0, 0, 0, 0)
@@ -37,15 +39,17 @@ void Toggle::draw()
     drw->drawCircle(x + outerRadius, y + outerRadius, innerRadius, c);
 }
 
-void Toggle::performAction(uint16_t x, uint16_t y, uint8_t z, bool pressed)
+void Toggle::performAction(const Driver::TouchscreenEvent_t &event)
 {
-    bool hit = inBounds(x, y);
-    if (!pressed && hit                                ) onRelease(x, y, z);
+    if (event.type == Driver::TOUCHSCREEN_EVENT_UP && inBounds(event.x, event.y) && inBounds(event.startX, event.startY)) {
+        Diagnostics::latency_mark_dispatch();
+        onRelease(event.x, event.y, 0);
+    }
 }
 
 void Toggle::onRelease(uint16_t x, uint16_t y, uint8_t z)
 {
-    Serial.println("-> Toggle toggled!");
+    Driver::console.println("-> Toggle toggled!");
     state = !state;
     draw();
 }
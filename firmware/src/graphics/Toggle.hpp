@@ -3,6 +3,7 @@
 #include "BoundedArea.hpp"
 #include "GraphicsConfig.hpp"
 #include "DrawingWrapper.hpp"
+#include "../driver/touchscreen.h"
 #include <stdint.h>
 
 class Toggle : public BoundedArea
@@ -33,7 +34,7 @@ public:
 
     void draw();    
 
-    void performAction(uint16_t x, uint16_t y, uint8_t z, bool pressed);
+    void performAction(const Driver::TouchscreenEvent_t &event);
 
 protected:
     void onRelease(uint16_t x, uint16_t y, uint8_t z);
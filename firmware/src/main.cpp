@@ -19,6 +19,7 @@ extern void loop();
 #include <SD.h>
 #include <esp_ota_ops.h>
 #include <esp_task_wdt.h>
+#include <esp_heap_caps.h>
 #include <BLE2902.h>
 #ifdef WIFI_CONNECTIVITY_ENABLE
     #include <WiFi.h>
@@ -36,8 +37,23 @@ extern void loop();
 #include "driver/touchscreen.h"
 #include "driver/lipo.h"
 #include "driver/miclone.hpp"
+#include "driver/usblink.hpp"
+#include "driver/console.hpp"
+#include "driver/usbfile.hpp"
+#include "driver/usbfilestore.hpp"
+#include "driver/otaupdate.hpp"
+#include "driver/screenmirror.hpp"
+#include "diagnostics/latency.h"
+#include "diagnostics/runrecorder.h"
+#include "diagnostics/sdlog.h"
+#include "diagnostics/trace.h"
+#include "diagnostics/usage.h"
 #include "MutexRAII.hpp"
+#include "LineReader.hpp"
+#include "CommandTable.hpp"
 #include "BLE_Callback_Coms.h"
+#include "BLE_Callback_Transfer.h"
+#include "BLE_Callback_Telemetry.h"
 #include "BLE_UUID.h"
 #include "utils.h"
 #include "DisplaySetup.h"       // this line must be after including TFT_eSPI.h
@@ -52,6 +68,7 @@ extern void loop();
 #include "pagesystem/pagesystem.h"
 #include "pagesystem/pageoptions.h"
 #include "pages/Calibration.h"
+#include "program/ProgramScheduler.hpp"
 #include "pages/Debug.hpp"
 #include "pages/Home.hpp"
 
@@ -68,11 +85,19 @@ extern void loop();
 #define MAJOR_FIRMWARE_VERSION 0
 #define MINOR_FIRMWAR_VERSION  6
 
-QueueHandle_t tsQueue;
+#define USBC_LINE_SIZE          256     // longest command line, with its null terminator
+#define USBC_POLL_INTERVAL      100     // ms, in case a receive notification is missed
+#define USBC_RX_BUFFER_SIZE     4096    // holds USBFILE_WRITE_WINDOW file chunks while one is written
+
+#define TRACE_HEAP_INTERVAL     60000   // ms between heap records with TRACE_HEAP
 
 TaskHandle_t usbcHandler = nullptr;
 
+#ifdef ENABLE_BLE
 BLE_Callback_Coms callbackComs;
+BLE_Callback_Transfer callbackTransfer;
+BLE_Callback_Telemetry callbackTelemetry;
+#endif
 
 PageSystem_t devicePageManager;
 
@@ -104,6 +129,8 @@ struct {
         BLEService *pService;
         BLECharacteristic *pDeviceName;
         BLECharacteristic *pComs;
+        BLECharacteristic *pTransfer;
+        BLECharacteristic *pTelemetry;
         
     } device;
     
@@ -135,267 +162,608 @@ struct {
 } BLE_Props;
 #endif
 
+#ifdef ENABLE_BLE
 /**
- * @brief Parses command from a given string that starts with an exclamation mark
- * 
- * @param buffer 
- * @param buffer_length 
- * @param command 
- * @param command_length 
- * @return size_t 
+ * @brief A firmware update over BLE restarts the unit, so not during a run
+ */
+static bool updateBusy()
+{
+    if (ProgramScheduler.isRunning()) return true;
+    for (uint8_t pump = 0; pump < Driver::miclone_pump_count(); ++pump) {
+        if (Driver::miclone_running(pump)) return true;
+    }
+    return false;
+}
+#endif
+
+/* binary mode of the USB-C link, entered with !binary */
+
+static void usbLinkWrite(void *, const uint8_t *data, size_t length)
+{
+    Serial.write(data, length);
+}
+
+static void usbLinkFlush(void *)
+{
+    Serial.flush();
+}
+
+static void usbLinkSetBaud(void *, uint32_t baud)
+{
+    Serial.updateBaudRate(baud);
+}
+
+static uint32_t usbLinkMillis(void *)
+{
+    return millis();
+}
+
+static const Driver::UsbLinkTransport_t _usbLinkTransport = { nullptr, usbLinkWrite, usbLinkFlush, usbLinkSetBaud, usbLinkMillis };
+static Driver::UsbLink _usbLink(_usbLinkTransport);
+
+// SD and SPIFFS transfers in binary mode, see tools/usbfile
+static Driver::UsbFileServer _usbFiles(Driver::usbfilestore_files(Driver::USBFILESTORE_USB));
+
+// the display mirrored in binary mode, see tools/screenview
+static Driver::ScreenMirror _screenMirror(Driver::tft_mirror_display());
+
+// touches from the mirroring host, off until !screen-touch on
+static volatile bool _screenTouch = false;
+
+static bool screenMirrorTouch(void *, Driver::ScreenMirrorTouchType_t type, uint16_t x, uint16_t y)
+{
+    uint16_t xRaw, yRaw;
+    if (!_screenTouch || !Calibration.translateToRaw(xRaw, yRaw, x, y)) return false;
+
+    Driver::touchscreen_inject(type != Driver::SCREENMIRROR_TOUCH_UP, xRaw, yRaw);
+    return true;
+}
+
+static void usbLinkEnd(void *)
+{
+    _usbFiles.close();
+    _screenMirror.stop();
+}
+
+/* serial commands, "!name args" and "$name args", one table row each */
+
+/**
+ * @brief Lists a directory. Files are read and written in binary mode, with tools/usbfile
+ */
+static void commandFile(fs::FS &fs, const char *name, const CommandValue *args)
+{
+    if (args[0].present && !args[0].token.equals("ls")) {
+        Serial.printf("-> Files are transferred in binary mode, use tools/usbfile. Usage: !%s ls [path]\n", name);
+        return;
+    }
+
+    char path[USBFILE_PATH_SIZE + 1] = "/";
+    if (args[1].present) args[1].token.copy(path, sizeof(path));
+
+    File dir = fs.open(path);
+    if (!dir || !dir.isDirectory()) {
+        Serial.printf("Error: No directory \"%s\"\n", path);
+        return;
+    }
+
+    for (File f = dir.openNextFile(); f; f = dir.openNextFile()) {
+        if (f.isDirectory()) Serial.printf("%10s  %s/\n", "", f.name());
+        else Serial.printf("%10u  %s\n", (uint32_t) f.size(), f.name());
+        f.close();
+    }
+    dir.close();
+}
+
+static void commandSd(const CommandValue *args)
+{
+    commandFile(SD, "sd", args);
+}
+
+static void commandSpiffs(const CommandValue *args)
+{
+    commandFile(SPIFFS, "spiffs", args);
+}
+
+static void commandPing(const CommandValue *args)
+{
+    Serial.println("pong!");
+}
+
+static void commandBootFactory(const CommandValue *args)
+{
+    const esp_partition_t *currentParition = esp_ota_get_running_partition();
+    const esp_partition_t *factoryPartition = esp_partition_find_first(ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_APP_FACTORY, nullptr);
+    ESP_ERROR_CHECK(esp_ota_set_boot_partition(factoryPartition));
+
+    const esp_partition_t *newBootParition = esp_ota_get_boot_partition();
+
+    if (newBootParition == factoryPartition) {
+        Serial.print("Booting to factory partition in");
+        for (int i = 3; i > 0; --i) {
+            Serial.print(i);
+            Serial.print(" ...");
+            Serial.println("This does not work. Maybe that to trigget ESP.restart() correctly, we have to restart immediately after partition select or use CPU1 to perform the reset");
+            assert(false);
+            delay(1000);
+        }
+
+        ESP.restart();
+    }
+    else if (newBootParition == currentParition) {
+        Serial.println("Error: Failed to select factory partition. Next boot will be current partition");
+    }
+    else {
+        Serial.println("Error: Partition is booting to something else! It is neither factory or firmware (ota0)");
+    }
+}
+
+static void commandTouchscreen(const CommandValue *args)
+{
+    // rotate is the only sub command for now
+    if (!args[0].token.equals("rotate")) {
+        Serial.println("-> Cannot process request because the arguments passed is invalid");
+        return;
+    }
+
+    Driver::ts.setRotation(args[1].number);
+    Serial.printf("-> Rotation set to %d\n", args[1].number);
+}
+
+static void commandScreenTouch(const CommandValue *args)
+{
+    if (!args[0].token.equals("on") && !args[0].token.equals("off")) {
+        Serial.println("-> Usage: !screen-touch <on|off>");
+        return;
+    }
+
+    _screenTouch = args[0].token.equals("on");
+    Serial.printf("-> Touches from the screen mirror are %s\n", _screenTouch ? "accepted" : "refused");
+}
+
+static void commandDeviceName(const CommandValue *args)
+{
+    Serial.print("-> Device Name: ");
+    Serial.println(DevinceInfo.deviceName);
+}
+
+static void commandDeviceRaw(const CommandValue *args)
+{
+    if (SPIFFS.exists("/device_info")) {
+        File f = SPIFFS.open("/device_info", "r");
+
+        char sendBuffer[256] = { 0 };
+        sprintf(sendBuffer, "name %s size %08X", f.name(), f.size());
+        Serial.print(sendBuffer);
+        Serial.write(f);
+        f.close();
+    }
+    else {
+        Serial.println("Error: Cannot find device info file. Flash new filesystem image");
+    }
+}
+
+static void commandStopAll(const CommandValue *args)
+{
+    for (uint8_t i = 0; i < Driver::miclone_pump_count(); ++i) Driver::miclone_stop(i);
+}
+
+static void commandTouchStats(const CommandValue *args)
+{
+    Serial.printf("-> Touch events dropped: %d\n", Driver::touchscreen_dropped_events());
+}
+
+static void commandPumpStatus(const CommandValue *args)
+{
+    uint32_t lastStop, maxStop;
+    Driver::miclone_stop_latency(lastStop, maxStop);
+    Serial.printf("-> %d pumps, stop latency %dms last, %dms max\n", Driver::miclone_pump_count(), lastStop, maxStop);
+
+    for (uint8_t i = 0; i < Driver::miclone_pump_count(); ++i) {
+        const Driver::MiClonePump_t &pump = Driver::miclone_pump(i);
+        Serial.printf("-> Pump %c: %s, %dms elapsed, status 0x%02X, %d commands, %d failed\n",
+                      pump.address,
+                      Driver::miclone_state_str(Driver::miclone_state(i)),
+                      Driver::miclone_elapsed(i),
+                      pump.lastStatus,
+                      pump.commands,
+                      pump.failures);
+    }
+}
+
+static void commandPortStats(const CommandValue *args)
+{
+    uint32_t frames, dropped, overflows;
+    Driver::collector_port_stats(frames, dropped, overflows);
+    Serial.printf("-> Collector port: %d frames, %d dropped, %d overflows\n", frames, dropped, overflows);
+}
+
+static void commandRecorder(const CommandValue *args)
+{
+    Diagnostics::recorder_report(Serial);
+}
+
+static void commandLogStats(const CommandValue *args)
+{
+    Driver::console.report(Serial);
+    Diagnostics::sdlog_report(Serial);
+    Diagnostics::trace_report(Serial);
+}
+
+static void commandUsage(const CommandValue *args)
+{
+    Diagnostics::usage_report(Serial);
+}
+
+static void commandUsageCommit(const CommandValue *args)
+{
+    if (Diagnostics::usage_commit()) Serial.println("-> Usage counters committed");
+}
+
+static void commandLatency(const CommandValue *args)
+{
+    Diagnostics::latency_report(Serial);
+}
+
+static void commandLatencyReset(const CommandValue *args)
+{
+    Diagnostics::latency_reset();
+    Serial.println("-> Touch latency statistics cleared");
+}
+
+static void commandBinary(const CommandValue *args)
+{
+    Serial.printf("-> Binary mode at %d baud, frames only until exit\n", USBLINK_BASE_BAUD);
+    Serial.flush();
+    _usbLink.begin(millis());
+}
+
+static void commandUsbStats(const CommandValue *args)
+{
+    uint32_t requests, badFrames, duplicates, fallbacks;
+    _usbLink.stats(requests, badFrames, duplicates, fallbacks);
+    Serial.printf("-> Binary link: %d requests, %d bad frames, %d repeated, %d baud fallbacks\n",
+                  requests, badFrames, duplicates, fallbacks);
+
+    uint32_t chunksRead, chunksWritten, outOfOrder;
+    _usbFiles.stats(chunksRead, chunksWritten, outOfOrder);
+    Serial.printf("-> File transfer: %d chunks read, %d chunks written, %d out of order\n",
+                  chunksRead, chunksWritten, outOfOrder);
+
+    uint32_t tilesSent, tilesUnchanged, bytesSent;
+    _screenMirror.stats(tilesSent, tilesUnchanged, bytesSent);
+    Serial.printf("-> Screen mirror: %d tiles sent in %d bytes, %d repainted unchanged\n",
+                  tilesSent, bytesSent, tilesUnchanged);
+}
+
+static void commandBleStats(const CommandValue *args)
+{
+#ifdef ENABLE_BLE
+    uint32_t handled, dropped, callbackLast, callbackMax, callbackOver;
+    callbackComs.stats(handled, dropped, callbackLast, callbackMax, callbackOver);
+    Serial.printf("-> Commands: %d run, %d dropped, callback %d us last, %d us max, %d over %d us\n",
+                  handled, dropped, callbackLast, callbackMax, callbackOver, BLECC_CALLBACK_BUDGET);
+
+    uint32_t bytes;
+    uint32_t rate = callbackComs.appendRate(bytes);
+    Serial.printf("-> Command upload: %d bytes at %d.%d KB/s\n", bytes, rate / 1024, rate % 1024 * 10 / 1024);
+
+    uint32_t lastBytes, lastElapsed, totalBytes, gaps;
+    const Driver::BleTransfer &transfer = callbackTransfer.getTransfer();
+    transfer.stats(lastBytes, lastElapsed, totalBytes, gaps);
+    rate = transfer.lastRate();
+    Serial.printf("-> Bulk upload: %d bytes in %d ms at %d.%d KB/s, %d bytes in all, %d gaps, %d packets dropped\n",
+                  lastBytes, lastElapsed, rate / 1024, rate % 1024 * 10 / 1024, totalBytes, gaps,
+                  callbackTransfer.droppedPackets());
+
+    uint32_t bytesSent, chunksResent;
+    transfer.readStats(bytesSent, chunksResent);
+    Serial.printf("-> Download: %d bytes in all, %d chunks resent\n", bytesSent, chunksResent);
+
+    uint32_t notifications, late;
+    const Driver::BleTelemetry &telemetry = callbackTelemetry.getTelemetry();
+    telemetry.stats(notifications, late);
+    Serial.printf("-> Telemetry: every %d ms, %d records a notification, %d notifications, %d samples late\n",
+                  telemetry.getInterval(), telemetry.recordsPerBatch(), notifications, late);
+#else
+    Serial.println("-> BLE is not enabled in this build");
+#endif
+}
+
+static void commandHelp(const CommandValue *args)
+{
+    if (!SPIFFS.exists("/help.txt")) {
+        Serial.println("Error: Cannot find \"help.txt\" in SPIFFS");
+        return;
+    }
+
+    File f = SPIFFS.open("/help.txt");
+    if (f.isDirectory()) {
+        Serial.println("Error: \"help.txt\" is a directory and not a file");
+        f.close();
+        return;
+    }
+
+    Serial.println(f);
+    f.close();
+}
+
+static void commandStop(const CommandValue *args)
+{
+    ProgramScheduler.stop();
+    Driver::miclone_stop();
+    dev_println("Sending stop signal to miclone driver");
+}
+
+static void commandRun(const CommandValue *args)
+{
+    if (ProgramScheduler.isRunning()) {
+        Serial.println("Error: A program is running. Stop it first");
+        return;
+    }
+
+    // no time runs until stopped
+    Driver::miclone_start(args[0].number, args[1].present ? args[1].number : 0);
+}
+
+/**
+ * @brief Copies a program name argument, printing an error when it is too long
  */
-size_t parseCommandFromString(const char *buffer, size_t buffer_length, char *command, size_t command_length)
+static bool programName(const CommandValue &arg, char (&name)[PROGRAM_NAME_SIZE + 1])
+{
+    if (arg.token.copy(name, sizeof(name))) return true;
+    Serial.printf("Error: Program names are at most %d characters\n", PROGRAM_NAME_SIZE);
+    return false;
+}
+
+static void commandProgramStatus(const CommandValue *args)
+{
+    ProgramScheduler.printStatus(Serial);
+}
+
+static void commandProgramList(const CommandValue *args)
 {
-    if (buffer_length && buffer[0] == '!') {
-        size_t i;
-        for (i = 1; i < buffer_length && i < command_length && (buffer[i] != '\0' || buffer[i] != '\r' || buffer[i] != ' '); ++i) {
-            command[i - 1] = buffer[i];
+    char names[8][PROGRAM_NAME_SIZE + 1];
+    size_t count = ProgramScheduler.list(names, 8);
+    Serial.printf("-> %d program(s)\n", count);
+    for (size_t i = 0; i < count; ++i) Serial.printf("   %s\n", names[i]);
+}
+
+static void commandProgramStop(const CommandValue *args)
+{
+    ProgramScheduler.stop();
+}
+
+static void commandProgramStart(const CommandValue *args)
+{
+    char name[PROGRAM_NAME_SIZE + 1];
+    if (!programName(args[0], name)) return;
+    if (ProgramScheduler.start(name)) Serial.printf("-> Program \"%s\" started\n", name);
+}
+
+static void commandProgramShow(const CommandValue *args)
+{
+    char name[PROGRAM_NAME_SIZE + 1];
+    if (!programName(args[0], name)) return;
+
+    _ProgramScheduler::Program program;
+    if (ProgramScheduler.load(name, program)) {
+        Serial.printf("-> Program \"%s\", repeat %d\n", program.name, program.repeat);
+        for (uint8_t i = 0; i < program.numSteps; ++i) {
+            Serial.printf("   %d: %d ul/min for %ds\n", i + 1, program.steps[i].rate, program.steps[i].duration);
         }
+    }
+}
+
+static void commandProgramDelete(const CommandValue *args)
+{
+    char name[PROGRAM_NAME_SIZE + 1];
+    if (!programName(args[0], name)) return;
+    Serial.println(ProgramScheduler.remove(name) ? "-> Program deleted" : "Error: Cannot delete program");
+}
+
+static void commandProgramSave(const CommandValue *args)
+{
+    char name[PROGRAM_NAME_SIZE + 1];
+    if (!programName(args[0], name)) return;
+
+    // the JSON runs to the end of the line, so it is null terminated
+    if (ProgramScheduler.save(name, args[1].token.data)) Serial.printf("-> Program \"%s\" saved\n", name);
+}
 
-        return i;
+static void commandProgram(const CommandValue *args);
+
+static constexpr Command _bangCommands[] = {
+    { "sd",             commandSd,              "!sd [ls [path]]",                  { COMMAND_WORD_OPT, COMMAND_WORD_OPT } },
+    { "spiffs",         commandSpiffs,          "!spiffs [ls [path]]",              { COMMAND_WORD_OPT, COMMAND_WORD_OPT } },
+    { "ping",           commandPing,            "!ping",                            { } },
+    { "boot-factory",   commandBootFactory,     "!boot-factory",                    { } },
+    { "touchscreen",    commandTouchscreen,     "!touchscreen rotate <0-3>",        { COMMAND_WORD, COMMAND_INT(0, 3) } },
+    { "screen-touch",   commandScreenTouch,     "!screen-touch <on|off>",           { COMMAND_WORD } },
+    { "device-name",    commandDeviceName,      "!device-name",                     { } },
+    { "device-raw",     commandDeviceRaw,       "!device-raw",                      { } },
+    { "stop",           commandStopAll,         "!stop",                            { } },
+    { "touch-stats",    commandTouchStats,      "!touch-stats",                     { } },
+    { "pump-status",    commandPumpStatus,      "!pump-status",                     { } },
+    { "port-stats",     commandPortStats,       "!port-stats",                      { } },
+    { "recorder",       commandRecorder,        "!recorder",                        { } },
+    { "log-stats",      commandLogStats,        "!log-stats",                       { } },
+    { "usage",          commandUsage,           "!usage",                           { } },
+    { "usage-commit",   commandUsageCommit,     "!usage-commit",                    { } },
+    { "latency",        commandLatency,         "!latency",                         { } },
+    { "latency-reset",  commandLatencyReset,    "!latency-reset",                   { } },
+    { "binary",         commandBinary,          "!binary",                          { } },
+    { "usb-stats",      commandUsbStats,        "!usb-stats",                       { } },
+    { "ble-stats",      commandBleStats,        "!ble-stats",                       { } },
+    { "help",           commandHelp,            "!help",                            { } },
+};
+
+static constexpr Command _dollarCommands[] = {
+    { "stop",           commandStop,            "$stop",                            { } },
+    { "run",            commandRun,             "$run <rate> [ms]",                 { COMMAND_INT(5, 30000), COMMAND_INT_OPT(0, INT32_MAX) } },
+    { "program",        commandProgram,         "$program [list | status | stop | start name | show name | delete name | save name json]", { COMMAND_REST_OPT } },
+};
+
+static constexpr Command _programCommands[] = {
+    { "status",         commandProgramStatus,   "$program status",                  { } },
+    { "list",           commandProgramList,     "$program list",                    { } },
+    { "stop",           commandProgramStop,     "$program stop",                    { } },
+    { "start",          commandProgramStart,    "$program start <name>",            { COMMAND_WORD } },
+    { "show",           commandProgramShow,     "$program show <name>",             { COMMAND_WORD } },
+    { "delete",         commandProgramDelete,   "$program delete <name>",           { COMMAND_WORD } },
+    { "save",           commandProgramSave,     "$program save <name> <json>",      { COMMAND_WORD, COMMAND_REST } },
+};
+
+#define BANG_COMMAND_BITS       6
+#define DOLLAR_COMMAND_BITS     3
+#define PROGRAM_COMMAND_BITS    4
+
+static constexpr uint32_t _bangSeed = command_find_seed(_bangCommands, BANG_COMMAND_BITS);
+static constexpr uint32_t _dollarSeed = command_find_seed(_dollarCommands, DOLLAR_COMMAND_BITS);
+static constexpr uint32_t _programSeed = command_find_seed(_programCommands, PROGRAM_COMMAND_BITS);
+static_assert(_bangSeed != COMMAND_NO_SEED, "No perfect hash for the ! commands, increase BANG_COMMAND_BITS");
+static_assert(_dollarSeed != COMMAND_NO_SEED, "No perfect hash for the $ commands, increase DOLLAR_COMMAND_BITS");
+static_assert(_programSeed != COMMAND_NO_SEED, "No perfect hash for the $program commands, increase PROGRAM_COMMAND_BITS");
+
+static const CommandDispatcher<sizeof(_bangCommands) / sizeof(Command), BANG_COMMAND_BITS> _bangDispatcher(_bangCommands, _bangSeed);
+static const CommandDispatcher<sizeof(_dollarCommands) / sizeof(Command), DOLLAR_COMMAND_BITS> _dollarDispatcher(_dollarCommands, _dollarSeed);
+static const CommandDispatcher<sizeof(_programCommands) / sizeof(Command), PROGRAM_COMMAND_BITS> _programDispatcher(_programCommands, _programSeed);
+
+/**
+ * @brief Runs a command from a table, printing its usage when the arguments are wrong
+ */
+template <size_t N, uint8_t Bits>
+static void runCommand(const CommandDispatcher<N, Bits> &dispatcher, Tokenizer &tokens)
+{
+    const Command *command;
+    uint8_t arg;
+
+    switch (dispatcher.dispatch(tokens, command, arg)) {
+    case COMMAND_OK:
+        break;
+    case COMMAND_UNKNOWN:
+        Serial.println("Error: Unknown command. Send !help for the list");
+        break;
+    case COMMAND_MISSING_ARG:
+        Serial.printf("Error: Missing argument %d. Usage: %s\n", arg + 1, command->usage);
+        break;
+    case COMMAND_BAD_ARG:
+        Serial.printf("Error: Argument %d must be a number from %d to %d. Usage: %s\n",
+                      arg + 1, command->args[arg].min, command->args[arg].max, command->usage);
+        break;
+    case COMMAND_EXTRA_ARGS:
+        Serial.printf("Error: Too many arguments. Usage: %s\n", command->usage);
+        break;
+    }
+}
+
+static void commandProgram(const CommandValue *args)
+{
+    if (!args[0].present) {
+        ProgramScheduler.printStatus(Serial);
+        return;
     }
 
-    return 0;
+    Tokenizer tokens(args[0].token);
+    runCommand(_programDispatcher, tokens);
 }
 
 /**
- * @brief Handles responses to UART from USB-C
+ * @brief Runs one command line from USB-C, without its terminator
+ * 
+ * @param message null terminated line
+ */
+void handleUSBCommand(const char *message)
+{
+    #ifdef DEV_DEBUG
+    {
+        Serial.printf("\nDebug hex raw: %s\n", message);
+        for (const char *c = message; *c; ++c) {
+            Serial.printf("%02X ", *c);
+        }
+    }
+    #endif
+    
+    size_t messageLen = strlen(message);
+    if (!messageLen) return;
+
+    if (message[0] == '/') {
+        // this is a command from MiClone
+        
+        // bypass mode, sent once and the controller's reply is echoed back
+        char micloneCommand[MICLONE_COMMAND_SIZE];
+        strncpy(micloneCommand, message, sizeof(micloneCommand) - 1);
+        micloneCommand[sizeof(micloneCommand) - 1] = '\0';
+
+        Driver::MiCloneResponse_t micloneResponse;
+        Driver::MiCloneResult_t micloneResult = Driver::miclone_transact(micloneCommand, &micloneResponse, MICLONE_RESPONSE_TIMEOUT, 1);
+        if (micloneResult == Driver::MICLONE_TIMEOUT) {
+            Serial.println("-> [MICLONE] No reply");
+        }
+        else {
+            Serial.printf("-> [MICLONE] status 0x%02X %s, %s, data \"%s\"\n",
+                          micloneResponse.status,
+                          micloneResponse.ready ? "ready" : "busy",
+                          Driver::miclone_error_str(micloneResponse.error),
+                          micloneResponse.data);
+        }
+        
+        Diagnostics::sdlog_printf(Diagnostics::SDLOG_MICLONE, "-> %s\n", message);
+    }
+    else if (message[0] == '!') {
+        // command from my helper program
+        Tokenizer tokens(message + 1, messageLen - 1);
+        runCommand(_bangDispatcher, tokens);
+    }
+    else if (message[0] == '$') {
+        Tokenizer tokens(message + 1, messageLen - 1);
+        runCommand(_dollarDispatcher, tokens);
+    }
+}
+
+/**
+ * @brief Handles responses to UART from USB-C. Bytes are read as they arrive
+ *          and each line is run as soon as its terminator is seen
  * 
  * @param parameters 
  */
 void handleUSBC(void *parameters = nullptr)
 {
-    const TickType_t waitDelay = 1000 / portTICK_PERIOD_MS;
+    static LineReader<USBC_LINE_SIZE> reader;
 
     delay(200);
     Serial.flush();
     delay(200);
+
+    // woken by the UART driver when bytes arrive, polled as a fallback
+    Serial.onReceive([]() { if (usbcHandler) xTaskNotifyGive(usbcHandler); });
     
     while (true) {
-        
-        if (Serial.available()) {
-            String message = Serial.readString();
-            
-            #ifdef DEV_DEBUG
-            {
-                Serial.print("\nDebug hex raw: ");
-                Serial.printf("\nDebug hex raw: %s\n", message.c_str());
-                for(const char c : message) {
-                    Serial.printf("%02X ", c);
-                }
-            }
-            #endif
-            
-            size_t messageLen = message.length();
+        ulTaskNotifyTake(pdTRUE, USBC_POLL_INTERVAL / portTICK_PERIOD_MS);
 
-            if (messageLen && messageLen < 256) {
-                // can perform string checks
+        while (Serial.available()) {
+            uint8_t byte = Serial.read();
 
-                
-                if (message[0] == '/') {
-                    // this is a command from MiClone
-                    
-                    // bypass mode
-                    Serial2.write(reinterpret_cast<const uint8_t *>(message.c_str()), message.length());
-                    
-                    File miCloneEmulationLog = SD.open(MICLONE_LOG_FILENAME, "w+");
-                    if (miCloneEmulationLog) {
-                        
-                        Serial.printf("File is valid, printing \"%s\"", message.c_str());
-                        const char printBuffer[] = "-> ";
-                        miCloneEmulationLog.seek(miCloneEmulationLog.size());
-                        miCloneEmulationLog.write(reinterpret_cast<const uint8_t *>(printBuffer), strlen(printBuffer));
-                        miCloneEmulationLog.write(reinterpret_cast<const uint8_t *>(message.c_str()), message.length());
-                    }
-
-                    miCloneEmulationLog.close();
-                    delay(10);
-                }
-                else if (message[0] == '!') {
-                    // command from my helper program
-                    // todo
-                    char command[17] = { 0 };
-                    size_t offset = 0;
-                    offset = parseCommandFromString(message.c_str(), message.length(), command, sizeof(command));
-
-                    // Serial.print("  Result of command: ");
-                    // Serial.println(command);
-                    // Serial.print("  Result of strcmp(command, \"ping\"): ");
-                    // Serial.println(!strcmp(command, "ping"), DEC);
-
-                    if (!strcmp(command, "sd") || !strcmp(command, "spiffs")) {
-
-                        // FS &fs = !strcmp(command, "!sd") ? *(dynamic_cast<fs::FS *>)(&SD) : *(dynamic_cast<fs::FS *>)(&SPIFFS);
-                        
-                        offset = nextSubString(message.c_str(), offset, message.length(), command, sizeof(command));
-                        bool commandError = false;      // true when there is an invalid input to the command
-                        
-                        if (offset) {
-                            if (!strcmp(command, "read")) {
-                                // File f = SD.open()
-                                
-                            }
-                            else if (!strcmp(command, "write")) {
-
-                            }
-                            else {
-                                commandError = true;
-                            }
-                        }
-                        else {
-                            commandError = true;
-                        }
-
-                        utilsPrint("~Invalid '!file' command. Options are: ~file [write | read] [filename] ");
-                    }
-                    else if (!strcmp(command, "ping")) {
-                        Serial.println("pong!");
-                    }
-                    else if (!strcmp(command, "boot-factory")) {
-                        const esp_partition_t *currentParition = esp_ota_get_running_partition();
-                        const esp_partition_t *factoryPartition = esp_partition_find_first(ESP_PARTITION_TYPE_APP, ESP_PARTITION_SUBTYPE_APP_FACTORY, nullptr);
-                        ESP_ERROR_CHECK(esp_ota_set_boot_partition(factoryPartition));
-
-                        const esp_partition_t *newBootParition = esp_ota_get_boot_partition();
-
-                        if (newBootParition == factoryPartition) {
-                            Serial.print("Booting to factory partition in");
-                            for (int i = 3; i > 0; --i) {
-                                Serial.print(i);
-                                Serial.print(" ...");
-                                Serial.println("This does not work. Maybe that to trigget ESP.restart() correctly, we have to restart immediately after partition select or use CPU1 to perform the reset");
-                                assert(false);
-                                delay(1000);
-                            }
-
-                            ESP.restart();
-                        }
-                        else if (newBootParition == currentParition) {
-                            Serial.println("Error: Failed to select factory partition. Next boot will be current partition");
-                        }
-                        else {
-                            Serial.println("Error: Partition is booting to something else! It is neither factory or firmware (ota0)");
-                        }
-                    }
-                    else if (!strcmp(command, "touchscreen")) {
-                        assert(false && "This command is not working.");    // possible causes is a bug in the nextSubstring function
-                        dev_println("=> Processing touchscreen command...");
-                        offset = nextSubString(message.c_str(), offset, message.length(), command, sizeof(command));
-                        if (!offset) continue;
-                        if (strcmp(command, "rotate")) continue;        // this is in a separate if statement for future reference
-
-                        dev_println("=> Processing rotation sub command...");
-                        offset = nextSubString(message.c_str(), offset, message.length(), command, sizeof(command));
-                        if (!offset) continue;
-
-                        if (command[0] >= '0' && command[0] < '9') {
-                            int rotation = atoi(command);
-                            Driver::ts.setRotation(rotation);
-                            Serial.printf("-> Rotation set to %d\n", rotation % 4);
-                        }
-                        else {
-                            Serial.println("-> Cannot process request because the arguments passed is invalid");
-                        }
-                    }
-                    else if (!strcmp(command, "device-name")) {
-                        Serial.print("-> Device Name: ");
-                        Serial.println(DevinceInfo.deviceName);
-                    }
-                    else if (!strcmp(command, "device-raw")) {
-                        if (SPIFFS.exists("/device_info")) {
-                            File f = SPIFFS.open("/device_info", "r");
-
-                            char sendBuffer[256] = { 0 };
-                            sprintf(sendBuffer, "name %s size %08X", f.name(), f.size());
-                            Serial.print(sendBuffer);
-                            Serial.write(f);
-                            f.close();
-                        }
-                        else {
-                            Serial.println("Error: Cannot find device info file. Flash new filesystem image");
-                        }
-                    }
-                    else if (!strcmp(command, "stop")) {
-                        Driver::miclone_stop();
-                    }
-                    else if (!strcmp(command, "help")) {
-                        
-                        if (!SPIFFS.exists("/help.txt")) {
-                            Serial.println("Error: Cannot find \"help.txt\" in SPIFFS");
-                            continue;
-                        }
-
-                        File f = SPIFFS.open("/help.txt");
-                        if (f.isDirectory()) {
-                            Serial.println("Error: \"help.txt\" is a directory and not a file");
-                            f.close();
-                            continue;
-                        }
-
-                        Serial.println(f);
-                        f.close();
-                    }
-                }
-                else if (message[0] == '$') {
-
-                    char msgCpy[64];
-                    strncpy(msgCpy, message.c_str(), sizeof(msgCpy) - 1);
-
-                    // string cleanup - removes ending terminators
-                    size_t msgSize = strlen(msgCpy);
-                    if (msgSize >= 2 && msgCpy[msgSize - 2] == '\r' && msgCpy[msgSize - 1] == '\n') {
-                        msgCpy[msgSize - 1] = '\0';
-                        msgCpy[msgSize - 2] = '\0';
-                        msgSize -= 2;
-                    }
-                    
-                    const char delim[] = " ";
-                    auto tag = strtok(msgCpy + 1, delim);
-
-                    if (tag) {
-
-                        if (strcmp(tag, "stop") == 0) {
-                            Driver::miclone_stop();
-                            dev_println("Sending stop signal to miclone driver");
-                        }
-                        else if (strcmp(tag, "run") == 0) {
-
-                            tag = strtok(NULL, delim);
-                            if (!tag || !isdigit(*tag)) continue;   // if tag is empty or first character of tag is not a number, cont.
-
-                            unsigned int flowRate = atoi(tag);
-                            if (flowRate < 5) continue;             // check if flow rate is not negative or not too low
-
-                            tag = strtok(NULL, delim);
-                            unsigned int timer = 0;
-                            if (tag) {
-                                if (!isdigit(*tag)) continue;
-
-                                int _timer = atoi(tag);
-                                if (_timer < 0) {
-                                    continue;
-                                }
-                                else {
-                                    timer = _timer;
-                                }
-                            }
-                            else {
-                                timer = 0; // 0 means run forever
-                            }
-
-                            Driver::miclone_start(flowRate, timer);
-                        }
-                    }
-                }
+            // frames go to the binary link until it hands back to the console
+            if (_usbLink.active()) {
+                _usbLink.feed(byte, millis());
+                continue;
             }
-            else {
-                // should I do something here?
+
+            switch (reader.feed(byte)) {
+            case LineReader<USBC_LINE_SIZE>::LINE_READY:
+                handleUSBCommand(reader.line());
+                break;
+
+            case LineReader<USBC_LINE_SIZE>::LINE_OVERFLOW:
+                Serial.printf("Error: Command longer than %d characters was discarded\n", USBC_LINE_SIZE - 1);
+                break;
+
+            default:
+                break;
             }
         }
-        else
-        {
-            vTaskDelay(waitDelay);
-        }
+
+        _usbLink.poll(millis());
     }
 }
 
@@ -554,22 +922,15 @@ void firmwareUpdateCheckerTask(void *params)
 
 void writeToMiCloneLog(const char *str, size_t lineno=0)
 {
-    File f = SD.open("/miclone.log", "w+");
-    f.seek(f.size());
-
-    if (lineno) {
-
-        const char separator[] =": ";
-        f.write(lineno);
-        f.write((const uint8_t *)separator, sizeof(separator));
-    }
-    f.write((const uint8_t *)str, strlen(str));
-    f.close();
+    if (lineno) Diagnostics::sdlog_printf(Diagnostics::SDLOG_MICLONE, "%u: %s\n", (unsigned) lineno, str);
+    else Diagnostics::sdlog_printf(Diagnostics::SDLOG_MICLONE, "%s\n", str);
 }
 
 void setup()
 {
+    Serial.setRxBufferSize(USBC_RX_BUFFER_SIZE);
     Serial.begin(9600);
+    Driver::console.begin();
     Serial.println("\n                  ====== MiOrigin - Bioaersol Collector Controller ======                   ");
     Serial.println(" --- Aersol Technology Lab at the Department of Biological and Agricultural Engineering --- \n");
     Serial.println("\t-> Software and PCB Designed By:     Charlemagne Wong - CECN 21'");
@@ -612,6 +973,7 @@ void setup()
     Driver::postDigitizerAction = [](void *args) -> void {
 
         PageSystem_execute_switch(&devicePageManager);
+        PageSystem_update(&devicePageManager);
     };
     Driver::touchscreen_init();
     Driver::touchscreen_begin(*hspi, 3);
@@ -621,37 +983,26 @@ void setup()
     }
     // ts.begin(*hspi);
     // ts.setRotation()
-    Driver::Touchscreen_cfg.onPress = []() -> void {
-        BaseType_t xHigherPriorityTaskWoken = pdFALSE;
-        int response = Driver::Touchscreen_cfg.state;
-        xQueueSendFromISR(tsQueue, &response, &xHigherPriorityTaskWoken);
-
-        if (xHigherPriorityTaskWoken) portYIELD_FROM_ISR();
-    };
-    Driver::Touchscreen_cfg.onRelease = Driver::Touchscreen_cfg.onPress;
     
-    tsQueue = xQueueCreate(10, sizeof(int));
-    
-    TaskFunction_t touchScreenStateChange = [](void *) -> void {
+    // UI task: consumes touch events in order and runs the page handlers
+    TaskFunction_t touchScreenDispatch = [](void *) -> void {
         Serial.println("Starting touch screen");
-        while (true) {
-            Serial.print("Touch screen touch loop");
-            int response;
-            if (xQueueReceive(tsQueue, (void *)&response, portMAX_DELAY) == pdTRUE) {
-
-                Serial.printf("Got message from ISR: %d", response);
-            }
+        Driver::touchscreen_set_event_consumer(xTaskGetCurrentTaskHandle());
 
+        while (true) {
+            ulTaskNotifyTake(pdTRUE, DRIVER_TS_DISPATCH_INTERVAL / portTICK_PERIOD_MS);
+            Driver::touchscreen_dispatch_events();
         }
     };
     
-    xTaskCreate(touchScreenStateChange,
-                "ts-state",
-                1024,
-                nullptr,
-                1,
-                nullptr
-                );
+    xTaskCreatePinnedToCore(touchScreenDispatch,
+                            "ts-ui",
+                            7 * 1024,
+                            nullptr,
+                            1,
+                            nullptr,
+                            1
+                            );
     
     tft.setCursor(30, 0, 2);
     tft.setTextColor(TFT_YELLOW);
@@ -777,6 +1128,38 @@ void setup()
                                 !ARDUINO_RUNNING_CORE);
     }
     
+    // run telemetry goes to the SD card, started before anything that can start a run
+    Diagnostics::recorder_begin(SD);
+
+    // log files, written behind the tasks that log to them
+    Diagnostics::sdlog_begin(SD);
+
+    // lifetime counters, restored from RTC memory or NVS before a run can start
+    Diagnostics::usage_begin();
+
+    // setup RS-232 before the usb c handler, which can pass commands through to it
+    tft.print("-> Initializing collector port... ");
+    Driver::collector_port_begin(9600, RS232_RX2, RS232_TX2);
+    Driver::miclone_begin();
+    tft.println("SUCCESS");
+
+    // resumes a program interrupted by a reboot, so the collector port must be up
+    ProgramScheduler.begin(SPIFFS);
+
+    // file transfers over the USB-C link, reading ahead of the link in their own task
+    if (Driver::usbfilestore_begin()) {
+        _usbFiles.begin(_usbLink);
+    }
+    else {
+        Serial.println("Error: Cannot start USB file transfers");
+    }
+
+    // the screen mirror, tracking what is drawn only while a host is watching
+    _screenMirror.begin(_usbLink);
+    _screenMirror.onTouch(screenMirrorTouch);
+    tft.setMirror(&_screenMirror);
+    _usbLink.onEnd(usbLinkEnd);
+
     // setup usb c handler
     xTaskCreatePinnedToCore(handleUSBC,
                             "usbc_handler",
@@ -796,12 +1179,6 @@ void setup()
                 );
 #endif
         
-    // setup RS-232
-    tft.print("-> Initializing collector port... ");
-    Serial2.begin(9600, SERIAL_8N1, RS232_RX2, RS232_TX2);
-    Driver::miclone_begin();
-    tft.println("SUCCESS");
-
     
 #ifdef WIFI_CONNECTIVITY_ENABLE
     /* Start WiFi */
@@ -821,6 +1198,7 @@ void setup()
     // Initialize and Server Info
     tft.println("-> Initializing Bluetooth (BLE)...");
     BLEDevice::init(DevinceInfo.deviceName);
+    BLEDevice::setMTU(BLETRANSFER_MAX_MTU);         // the phone asks, this is the most it gets
     BLE_Props.pServer = BLEDevice::createServer();
     
     // Service creation
@@ -834,7 +1212,30 @@ void setup()
                                                                              BLECharacteristic::PROPERTY_INDICATE);
     BLE_Props.device.pComs->setValue("Initialized");          
     BLE_Props.device.pComs->addDescriptor(new BLE2902);          
-    BLE_Props.device.pComs->setCallbacks(&callbackComs);
+    if (!callbackComs.begin(BLE_Props.device.pComs)) {
+        Serial.println("FAIL TO START BLE COMMANDS!");
+    }
+
+    // bulk upload and firmware updates, see driver/bletransfer.hpp
+    BLE_Props.device.pTransfer = BLE_Props.device.pService->createCharacteristic(BLETC_CHARACTERISTIC_UUID,
+                                                                                 BLECharacteristic::PROPERTY_WRITE    |
+                                                                                 BLECharacteristic::PROPERTY_WRITE_NR |
+                                                                                 BLECharacteristic::PROPERTY_NOTIFY);
+    BLE_Props.device.pTransfer->addDescriptor(new BLE2902);
+    Driver::otaupdate_begin(updateBusy);
+    if (!callbackTransfer.begin(BLE_Props.device.pTransfer)) {
+        Serial.println("FAIL TO START BLE TRANSFER!");
+    }
+
+    // live run and battery state, see driver/bletelemetry.hpp
+    BLE_Props.device.pTelemetry = BLE_Props.device.pService->createCharacteristic(BLETM_CHARACTERISTIC_UUID,
+                                                                                  BLECharacteristic::PROPERTY_READ  |
+                                                                                  BLECharacteristic::PROPERTY_WRITE |
+                                                                                  BLECharacteristic::PROPERTY_NOTIFY);
+    BLE_Props.device.pTelemetry->addDescriptor(new BLE2902);
+    if (!callbackTelemetry.begin(BLE_Props.device.pTelemetry)) {
+        Serial.println("FAIL TO START BLE TELEMETRY!");
+    }
     
     
     BLE_Props.device.pService->start();
@@ -859,20 +1260,36 @@ void setup()
     graphicsMutex = xSemaphoreCreateMutex();
     assert(graphicsMutex);
     drawingWrapper.drawPixel = [](uint16_t x, uint16_t y, Color color) {
-        MutexRAII m(graphicsMutex);
-        tft.drawPixel(x, y, color);
+        Diagnostics::latency_mark_draw_submit();
+        {
+            MutexRAII m(graphicsMutex);
+            tft.drawPixel(x, y, color);
+        }
+        Diagnostics::latency_mark_draw_complete();
     };
     drawingWrapper.drawRect = [](uint16_t x, uint16_t y, uint16_t width, uint16_t height, uint16_t radius, Color color) {
-        MutexRAII m(graphicsMutex);
-        tft.fillRect(x, y, width, height, color);
+        Diagnostics::latency_mark_draw_submit();
+        {
+            MutexRAII m(graphicsMutex);
+            tft.fillRect(x, y, width, height, color);
+        }
+        Diagnostics::latency_mark_draw_complete();
     };
     drawingWrapper.print = [](const char *str) {
-        MutexRAII m(graphicsMutex);
-        tft.print(str);
+        Diagnostics::latency_mark_draw_submit();
+        {
+            MutexRAII m(graphicsMutex);
+            tft.print(str);
+        }
+        Diagnostics::latency_mark_draw_complete();
     };
     drawingWrapper.println = [](const char *str) {
-        MutexRAII m(graphicsMutex);
-        tft.println(str);
+        Diagnostics::latency_mark_draw_submit();
+        {
+            MutexRAII m(graphicsMutex);
+            tft.println(str);
+        }
+        Diagnostics::latency_mark_draw_complete();
     };
     drawingWrapper.setCursor = [](uint16_t x, uint16_t y, uint8_t font) {
         MutexRAII m(graphicsMutex);
@@ -887,24 +1304,36 @@ void setup()
         tft.setTextColor(foreground, background);
     };
     drawingWrapper.fillScreen = [](Color color) {
-        MutexRAII m(graphicsMutex);
-        tft.fillScreen(color);
+        Diagnostics::latency_mark_draw_submit();
+        {
+            MutexRAII m(graphicsMutex);
+            tft.fillScreen(color);
+        }
+        Diagnostics::latency_mark_draw_complete();
     };
     drawingWrapper.setTextSize = [](uint8_t size) {
         MutexRAII m(graphicsMutex);
         tft.setTextSize(size);
     };
     drawingWrapper.drawString = [](const char *str, uint32_t x, uint32_t y) {
-        MutexRAII m(graphicsMutex);
-        tft.drawString(str, x, y);
+        Diagnostics::latency_mark_draw_submit();
+        {
+            MutexRAII m(graphicsMutex);
+            tft.drawString(str, x, y);
+        }
+        Diagnostics::latency_mark_draw_complete();
     };
     drawingWrapper.setTextFont = [](uint8_t font) {
         MutexRAII m(graphicsMutex);
         tft.setTextFont(font);
     };
     drawingWrapper.drawCircle = [](uint16_t x, uint16_t y, uint16_t r, Color color) {
-        MutexRAII m(graphicsMutex);
-        tft.fillCircle(x, y, r, color);
+        Diagnostics::latency_mark_draw_submit();
+        {
+            MutexRAII m(graphicsMutex);
+            tft.fillCircle(x, y, r, color);
+        }
+        Diagnostics::latency_mark_draw_complete();
     };
 
     Page_t tmpPage;
@@ -985,16 +1414,22 @@ void loop()
     #endif
     #endif
 
-    #ifdef DEV_DEBUG
+    #ifdef TRACE_HEAP
+    static uint32_t lastHeapTrace = 0;
+    if (!lastHeapTrace || millis() - lastHeapTrace >= TRACE_HEAP_INTERVAL) {
+        lastHeapTrace = millis();
+
+        multi_heap_info_t info;
+        heap_caps_get_info(&info, MALLOC_CAP_INTERNAL);
+        TRACE("RAM: %u of %u bytes used, largest free block %u",
+              info.total_allocated_bytes,
+              info.total_allocated_bytes + info.total_free_bytes,
+              info.largest_free_block);
+    }
+    #endif
 
-    multi_heap_info_t info;
-    
-    heap_caps_get_info(&info, MALLOC_CAP_INTERNAL);
-    float totalRam = (info.total_allocated_bytes + info.total_free_bytes) / 1024.0f;
-    float usedRam = info.total_allocated_bytes / 1024.0f;
-    dev_printf("Percent RAM: %.0f (%.3fKB / %.3fKB)\n", usedRam / totalRam * 100.0f, usedRam, totalRam);
+    #ifdef DEV_DEBUG
     vTaskDelay(3000 / portTICK_PERIOD_MS);
-    
     #endif
 }
 
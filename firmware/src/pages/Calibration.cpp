@@ -3,110 +3,248 @@
 #include <ArduinoJson.h>
 #include "driver/tftdisplay.h"
 #include "driver/touchscreen.h"
+#include "driver/console.hpp"
 #include "utils.h"
+#include "diagnostics/trace.h"
+#include <rom/crc.h>
+#include <math.h>
 
 _Calibration::_Calibration()
 {
-    mx = 0;
-    bx = 0;
-    my = 0;
-    by = 0;
-    // raw_x = nullptr;
-    // raw_y = nullptr;
-    // raw_z = nullptr;
+    memset(&transform, 0, sizeof(transform));
+    residualRMS = 0;
+    residualMax = 0;
+    numCollected = 0;
+    fs = nullptr;
     isCalibrated = true;
-    Driver::touchscreen_get_raw_points(&Calibration.raw_x, &Calibration.raw_y, &Calibration.raw_z);
+}
+
+uint32_t _Calibration::recordCRC(const Record &record)
+{
+    return crc32_le(0, reinterpret_cast<const uint8_t *>(&record), offsetof(Record, crc));
 }
 
 void _Calibration::begin(FS &fs)
 {
     this->fs = &fs;
-    float rawCalData[4] = { 0 };
 
     if (!fs.exists(CALIBRATION_CFG_FILENAME)) {
-        File f = fs.open(CALIBRATION_CFG_FILENAME, "w");
-        f.write(reinterpret_cast<uint8_t *>(rawCalData), sizeof(rawCalData));
-        f.close();
+        Driver::console.println("-> No touch screen calibration found. Calibrate the digitizer");
+        return;
     }
-    else {
-        File f = fs.open(CALIBRATION_CFG_FILENAME, "r+");
-        size_t bytesRead = f.read(reinterpret_cast<uint8_t *>(rawCalData), sizeof(rawCalData));
-        f.close();
-
-        // checking errors. If bytesRead < sizeof(rawCalData), then config file is invalid and must be erased
-        if (bytesRead < sizeof(rawCalData)) {
-            fs.remove(CALIBRATION_CFG_FILENAME);
-            begin(fs);          // call this function again, creating a calibration file with no contents
-            return;
-        }
 
-        mx = rawCalData[0];
-        bx = rawCalData[1];
-        my = rawCalData[2];
-        by = rawCalData[3];
+    Record record;
+    File f = fs.open(CALIBRATION_CFG_FILENAME, "r");
+    size_t fileSize = f.size();
+    size_t bytesRead = f.read(reinterpret_cast<uint8_t *>(&record), sizeof(record));
+    f.close();
+
+    // version 1 files are four raw floats: x and y line fits from two points
+    if (fileSize == 4 * sizeof(float) && bytesRead == fileSize) {
+        const float *legacy = reinterpret_cast<const float *>(&record);
+        const float scale = 1 << CALIBRATION_FIXED_SHIFT;
+        transform.a = lroundf(legacy[0] * scale);
+        transform.b = 0;
+        transform.c = lroundf(legacy[1] * scale);
+        transform.d = 0;
+        transform.e = lroundf(legacy[2] * scale);
+        transform.f = lroundf(legacy[3] * scale);
+
+        Driver::console.println("-> Converted version 1 touch screen calibration");
+        save(2);
+        return;
+    }
+
+    // checking errors. A short, foreign or corrupted file is erased so it can't be used
+    if (bytesRead < sizeof(record)            ||
+        record.magic != CALIBRATION_CFG_MAGIC ||
+        record.version != CALIBRATION_CFG_VERSION ||
+        record.crc != recordCRC(record)) {
+
+        Driver::console.println("Error: Touch screen calibration is invalid. Calibrate the digitizer");
+        fs.remove(CALIBRATION_CFG_FILENAME);
+        return;
     }
+
+    transform = record.transform;
+    residualRMS = record.residualRMS;
+    residualMax = record.residualMax;
+    Driver::console.printf("-> Touch screen calibration loaded (%d points, error %.1fpx rms, %.1fpx max)\n", record.numPoints, residualRMS, residualMax);
 }
 
-void _Calibration::translateFromRaw(uint16_t &x, uint16_t &y)
+void _Calibration::save(uint8_t numPoints)
 {
-    x = uint16_t(mx * *Calibration.raw_x + bx + 0.5f);
-    y = uint16_t(my * *Calibration.raw_y + by + 0.5f);
+    #if defined(DEV_DEBUG) || defined(SAFE_CODE)
+    assert(fs && "File system is null! fs should not be null");
+    #endif
+
+    Record record;
+    memset(&record, 0, sizeof(record));
+    record.magic = CALIBRATION_CFG_MAGIC;
+    record.version = CALIBRATION_CFG_VERSION;
+    record.numPoints = numPoints;
+    record.transform = transform;
+    record.residualRMS = residualRMS;
+    record.residualMax = residualMax;
+    record.crc = recordCRC(record);
+
+    dev_println("-> Writing calibration file...");
+    File f = fs->open(CALIBRATION_CFG_FILENAME, "w");
+    f.write(reinterpret_cast<uint8_t *>(&record), sizeof(record));
+    f.close();
+    dev_println("-> Closed");
 }
+
 void _Calibration::translateFromRaw(uint16_t &x, uint16_t &y, uint16_t xRaw, uint16_t yRaw)
 {
-    x = uint16_t(mx * xRaw + bx + 0.5f);
-    y = uint16_t(my * yRaw + by + 0.5f);
+    const int32_t round = 1 << (CALIBRATION_FIXED_SHIFT - 1);
+    int32_t sx = (transform.a * xRaw + transform.b * yRaw + transform.c + round) >> CALIBRATION_FIXED_SHIFT;
+    int32_t sy = (transform.d * xRaw + transform.e * yRaw + transform.f + round) >> CALIBRATION_FIXED_SHIFT;
+
+    // off screen to the top or left, keep it from wrapping onto the screen
+    x = sx < 0 ? 0 : sx;
+    y = sy < 0 ? 0 : sy;
 }
 
-void _Calibration::calibrate(float mx, float bx, float my, float by)
+bool _Calibration::translateToRaw(uint16_t &xRaw, uint16_t &yRaw, uint16_t x, uint16_t y)
 {
-    this->mx = mx;
-    this->bx = bx;
-    this->my = my;
-    this->by = by;
+    const int64_t det = (int64_t) transform.a * transform.e - (int64_t) transform.b * transform.d;
+    if (!det) return false;
 
-    #if defined(DEV_DEBUG) || defined(SAFE_CODE)
-    assert(fs && "File system is null! fs should not be null");
-    #endif
-    
-    dev_println("-> Creating a file...");
-    File f = fs->open(CALIBRATION_CFG_FILENAME, "w");
-    dev_println("-> Opened filed successfully");
-    float rawData[4] = {
-        this->mx,
-        this->bx,
-        this->my,
-        this->by
+    // the inverse of the 2x2 part, applied to the position less the offset
+    const int64_t sx = ((int64_t) x << CALIBRATION_FIXED_SHIFT) - transform.c;
+    const int64_t sy = ((int64_t) y << CALIBRATION_FIXED_SHIFT) - transform.f;
+    int64_t rx = (transform.e * sx - transform.b * sy) / det;
+    int64_t ry = (transform.a * sy - transform.d * sx) / det;
+
+    xRaw = rx < 0 ? 0 : rx > 0xFFF ? 0xFFF : rx;
+    yRaw = ry < 0 ? 0 : ry > 0xFFF ? 0xFFF : ry;
+    return true;
+}
+
+void _Calibration::translateFromRaw(Driver::TouchscreenEvent_t &event)
+{
+    translateFromRaw(event.x, event.y, event.x, event.y);
+    translateFromRaw(event.startX, event.startY, event.startX, event.startY);
+}
+
+/**
+ * @brief Solves the 3x3 normal equations of a least squares plane fit with Cramer's rule
+ * 
+ * @return false if the system is singular (points are collinear)
+ */
+static bool solveNormalEquations(const double m[3][3], const double v[3], double result[3])
+{
+    auto det3 = [](const double a[3][3]) -> double {
+        return a[0][0] * (a[1][1] * a[2][2] - a[1][2] * a[2][1])
+             - a[0][1] * (a[1][0] * a[2][2] - a[1][2] * a[2][0])
+             + a[0][2] * (a[1][0] * a[2][1] - a[1][1] * a[2][0]);
     };
-    dev_println("-> Writing to file...");
-    f.write(reinterpret_cast<uint8_t *>(rawData), sizeof(rawData));
-    dev_println("-> Writing done, closing...");
-    f.close();
-    dev_println("-> Closed");
+
+    const double det = det3(m);
+    if (fabs(det) < 1e-6) return false;
+
+    for (int col = 0; col < 3; ++col) {
+        double replaced[3][3];
+        memcpy(replaced, m, sizeof(replaced));
+        for (int row = 0; row < 3; ++row) replaced[row][col] = v[row];
+        result[col] = det3(replaced) / det;
+    }
+
+    return true;
+}
+
+bool _Calibration::calibrate(const Point *screen, const Point *raw, size_t count)
+{
+    if (count < 3) return false;
+
+    // normal equations for screen = p * raw_x + q * raw_y + r, shared by both axes
+    double m[3][3] = { { 0 } };
+    double vx[3] = { 0 };
+    double vy[3] = { 0 };
+
+    for (size_t i = 0; i < count; ++i) {
+        const double basis[3] = { (double) raw[i].x, (double) raw[i].y, 1.0 };
+        for (int row = 0; row < 3; ++row) {
+            for (int col = 0; col < 3; ++col) m[row][col] += basis[row] * basis[col];
+            vx[row] += basis[row] * screen[i].x;
+            vy[row] += basis[row] * screen[i].y;
+        }
+    }
+
+    double cx[3], cy[3];
+    if (!solveNormalEquations(m, vx, cx) || !solveNormalEquations(m, vy, cy)) {
+        Driver::console.println("Error: Calibration points are collinear. Try again");
+        return false;
+    }
+
+    const double scale = 1 << CALIBRATION_FIXED_SHIFT;
+    transform.a = lround(cx[0] * scale);
+    transform.b = lround(cx[1] * scale);
+    transform.c = lround(cx[2] * scale);
+    transform.d = lround(cy[0] * scale);
+    transform.e = lround(cy[1] * scale);
+    transform.f = lround(cy[2] * scale);
+
+    // residual error of the fixed-point transform at the calibration targets
+    double sumSquares = 0;
+    residualMax = 0;
+    for (size_t i = 0; i < count; ++i) {
+        uint16_t x, y;
+        translateFromRaw(x, y, raw[i].x, raw[i].y);
+        const float dx = (float) x - screen[i].x;
+        const float dy = (float) y - screen[i].y;
+        const float error = sqrtf(dx * dx + dy * dy);
+        sumSquares += error * error;
+        if (error > residualMax) residualMax = error;
+    }
+    residualRMS = sqrt(sumSquares / count);
+
+    Driver::console.printf("-> Calibrated with %u points: error %.1fpx rms, %.1fpx max\n", (unsigned) count, residualRMS, residualMax);
+    TRACE("calibration x = (%d * xr + %d * yr + %d) >> %d", transform.a, transform.b, transform.c, CALIBRATION_FIXED_SHIFT);
+    TRACE("calibration y = (%d * xr + %d * yr + %d) >> %d", transform.d, transform.e, transform.f, CALIBRATION_FIXED_SHIFT);
+
+    save(count);
+    return true;
+}
+
+_Calibration::Point _Calibration::targetPoint(size_t i)
+{
+    const uint16_t tGap   = 20;
+    const uint16_t width  = Driver::tft_get_width();
+    const uint16_t height = Driver::tft_get_height();
+
+    // corners first so any 3 of the first targets are not collinear
+    switch (i) {
+        case 0:  return { tGap,          tGap           };
+        case 1:  return { (uint16_t)(width - tGap), tGap };
+        case 2:  return { (uint16_t)(width - tGap), (uint16_t)(height - tGap) };
+        case 3:  return { tGap,          (uint16_t)(height - tGap) };
+        default: return { (uint16_t)(width / 2), (uint16_t)(height / 2) };
+    }
 }
 
 void _Calibration::onStart(void *pageArgs)
 {
-    Serial.println("-> Calibration page started");
+    Driver::console.println("-> Calibration page started");
     Calibration.pageArgs = pageArgs;
 }
 
 void _Calibration::onLoad(void *, void *toCalibrate)
 {
     Calibration.isCalibrated = !((size_t) toCalibrate);
+    Calibration.numCollected = 0;
     
-    Driver::touchscreen_register_on_press(ts_onPress);
-    Driver::touchscreen_register_on_release(ts_onRelease);
+    Driver::touchscreen_register_on_event(ts_onEvent);
 
-    Serial.println("-> Calibration page loaded");
+    Driver::console.println("-> Calibration page loaded");
     Calibration.drawScreen();
 }
 
 void _Calibration::onExit()
 {
-    Serial.println("-> Calibration page exit");
-    Driver::touchscreen_register_on_press(nullptr);
-    Driver::touchscreen_register_on_release(nullptr);
+    Driver::console.println("-> Calibration page exit");
+    Driver::touchscreen_register_on_event(nullptr);
 }
 
 void _Calibration::drawGrid()
@@ -127,100 +265,60 @@ void _Calibration::drawGrid()
 
 void _Calibration::drawTarget(uint16_t x, uint16_t y, uint32_t color, uint16_t gap)
 {
-    Serial.printf("-> Line drawn information: x[%d, %d] , y[%d, %d]", x, Driver::tft_get_width(), y, Driver::tft_get_height());
+    Driver::console.printf("-> Line drawn information: x[%d, %d] , y[%d, %d]", x, Driver::tft_get_width(), y, Driver::tft_get_height());
     Driver::tft.drawLine(x, 0, x, Driver::tft_get_height(), color);
     Driver::tft.drawLine(0, y, Driver::tft_get_width(), y, color);
 }
 
-void _Calibration::drawScreen(bool touched)
+void _Calibration::drawScreen(const Driver::TouchscreenEvent_t *event)
 {
     Driver::TFTClaimMutex();
-    Serial.println("-> I am in the draw screen");
-    const static uint16_t tGap = 20;
-    static Point *points[2] = { nullptr, nullptr };
-    const uint16_t width  = Driver::tft_get_width();
-    const uint16_t height = Driver::tft_get_height();
-    // static bool isCalibrated = false;
-    const uint16_t &x = *Calibration.raw_x;
-    const uint16_t &y = *Calibration.raw_y;
-    const uint8_t  &z = *Calibration.raw_z;
+    TRACE("calibration draw, %d of %d points", numCollected, CALIBRATION_NUM_POINTS);
 
-    Serial.println("-> Stage 1");
-
-    if (!isCalibrated && touched) {
-        Serial.println("-> Stage 2");
-
-        if (!points[0]) {
-            Serial.println("-> Stage 3a");
-            points[0] = new Point;
-            points[0]->x = x;
-            points[0]->y = y;
-        }
-        else if (!points[1]) {
-            Serial.println("-> Stage 3b");
-            points[1] = new Point;
-            points[1]->x = x;
-            points[1]->y = y;
-        }
+    if (!isCalibrated && event && numCollected < CALIBRATION_NUM_POINTS) {
+        rawPoints[numCollected].x = event->x;
+        rawPoints[numCollected].y = event->y;
+        ++numCollected;
     }
 
-    Serial.println("-> Stage 4");
     drawGrid();
     
-    // draw first target    
     if (!isCalibrated) {
 
-        if (!points[0]) {
-            Serial.println("-> Stage 5a");
-            drawTarget(tGap, tGap);
-        }
-        // draw second target
-        else if (!points[1]) {
-            Serial.println("-> Stage 5b");
-            drawTarget(width - tGap, height - tGap);
+        if (numCollected < CALIBRATION_NUM_POINTS) {
+            Point target = targetPoint(numCollected);
+            drawTarget(target.x, target.y);
         }
         else {
-            Serial.println("-> Stage 5c");
-            // do calibration magic here
-            // do x calibration
-            float mx = 1.0f * (width - tGap - tGap) / (points[1]->x - points[0]->x);
-            float bx = tGap - mx * points[0]->x;
-            
-            dev_println("-> calibrated x");
-            
-            // do y calibration
-            float my = 1.0f * (height - tGap - tGap) / (points[1]->y - points[0]->y);
-            float by = tGap - my * points[0]->y;
-            
-            dev_println("-> calibrated y");
-            
-            calibrate(mx, bx, my, by);
-            isCalibrated = true;
-            
-            dev_println("-> Done calibrating");
-            
-            // cleanup
-            delete points[0];
-            delete points[1];
-            points[0] = nullptr;
-            points[1] = nullptr;
-
-            dev_println("-> Cleanup");
+            Point targets[CALIBRATION_NUM_POINTS];
+            for (size_t i = 0; i < CALIBRATION_NUM_POINTS; ++i) targets[i] = targetPoint(i);
+
+            isCalibrated = calibrate(targets, rawPoints, CALIBRATION_NUM_POINTS);
+            numCollected = 0;
+
+            if (!isCalibrated) {
+                // start over
+                Point target = targetPoint(0);
+                drawTarget(target.x, target.y);
+                return;
+            }
+
+            char buffer[48];
+            sprintf(buffer, "Error: %.1fpx rms, %.1fpx max", residualRMS, residualMax);
+            Driver::tft.setTextColor(TFT_WHITE, TFT_BLACK);
+            Driver::tft.setTextDatum(MC_DATUM);
+            Driver::tft.drawString(buffer, Driver::tft_get_width() / 2, Driver::tft_get_height() / 2 + 30, 2);
+
+            TRACE("calibrated, error %.1fpx rms, %.1fpx max", residualRMS, residualMax);
         }
     }
 
-    if (touched && isCalibrated) {
-        dev_println("-> Drawing here...");
+    if (event && isCalibrated) {
         uint16_t xT, yT;
-        translateFromRaw(xT, yT, x, y);
+        translateFromRaw(xT, yT, event->x, event->y);
         drawTarget(xT, yT, TFT_RED);
-        dev_printf("-> x-equation: xn = %fx + %f --- y-equation yn = %fy + %f", mx, bx, my, by);
-        dev_printf("-> Raw is: (%d, %d)", x, y);
-        dev_printf("-> Target is: (%d, %d)", xT, yT);
-        dev_println("-> Drawing done...");
+        TRACE("calibration touch raw (%d, %d) at (%d, %d)", event->x, event->y, xT, yT);
     }
-    Serial.println("-> Stage 6");
-
 }
 
 void _Calibration::generatePage(Page_t &page)
@@ -230,6 +328,7 @@ void _Calibration::generatePage(Page_t &page)
     page.onStart = Calibration.onStart;
     page.onLoad = Calibration.onLoad;
     page.onExit = Calibration.onExit;
+    page.onUpdate = nullptr;
 }
 
 Page_t _Calibration::generatePage()
@@ -239,15 +338,12 @@ Page_t _Calibration::generatePage()
     return page;
 }
 
-void _Calibration::ts_onPress()
-{ 
-    dev_println("This is the touch screen on press handler");
-}
-
-void _Calibration::ts_onRelease()
+void _Calibration::ts_onEvent(const Driver::TouchscreenEvent_t &event)
 {
-    dev_println("This is the touch screen on release handler");
-    Calibration.drawScreen(true);
+    if (event.type == Driver::TOUCHSCREEN_EVENT_UP) {
+        dev_println("This is the touch screen on release handler");
+        Calibration.drawScreen(&event);
+    }
 }
 
 _Calibration Calibration;
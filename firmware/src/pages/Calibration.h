@@ -2,6 +2,7 @@
 
 #include <Arduino.h>
 #include "pagesystem/page.h"
+#include "driver/touchscreen.h"
 #include <stdint.h>
 #include <FS.h>
 #include <SPIFFS.h>
@@ -9,42 +10,115 @@
 
 #define CALIBRATION_CFG_FILENAME "/ts_calib.cfg"
 
+#define CALIBRATION_CFG_MAGIC    0x41435354      // "TSCA"
+#define CALIBRATION_CFG_VERSION  2
+
+#define CALIBRATION_NUM_POINTS   5               // 3 to 5 targets: 4 corners, then the center
+#define CALIBRATION_FIXED_SHIFT  16              // coefficients are Q16 fixed-point
+
 class _Calibration
 {
+public:
+
+    struct Point {
+        uint16_t x;
+        uint16_t y;
+    };
+
+    /**
+     * @brief Affine transform from raw digitizer to screen coordinates in Q16 fixed-point.
+     *          screen_x = (a * raw_x + b * raw_y + c) >> 16
+     *          screen_y = (d * raw_x + e * raw_y + f) >> 16
+     *          Raw coordinates are 12-bit, so every product fits in 32 bits
+     */
+    struct Transform {
+        int32_t a;
+        int32_t b;
+        int32_t c;
+        int32_t d;
+        int32_t e;
+        int32_t f;
+    };
+
+    /**
+     * @brief Layout of CALIBRATION_CFG_FILENAME. crc covers every byte before it
+     */
+    struct Record {
+        uint32_t magic;
+        uint16_t version;
+        uint8_t  numPoints;
+        uint8_t  reserved;
+        Transform transform;
+        float residualRMS;      // px
+        float residualMax;      // px
+        uint32_t crc;
+    };
+
 private:
     bool isCalibrated;
-    float mx;
-    float bx;
-    float my;
-    float by;
-    
-    const uint16_t *raw_x;
-    const uint16_t *raw_y;
-    const uint8_t  *raw_z;
+    Transform transform;
+    float residualRMS;
+    float residualMax;
+
+    // raw samples collected so far during a calibration
+    Point rawPoints[CALIBRATION_NUM_POINTS];
+    uint8_t numCollected;
     
     FS *fs;
 
     void *pageArgs;
+
+    static uint32_t recordCRC(const Record &record);
+
+    void save(uint8_t numPoints);
     
 public:
 
-    struct Point {
-        uint16_t x;
-        uint16_t y;
-    };
-
     _Calibration();
 
     void begin(FS &fs = SPIFFS);
 
-    void translateFromRaw(uint16_t &x, uint16_t &y);
     void translateFromRaw(uint16_t &x, uint16_t &y, uint16_t xRaw, uint16_t yRaw);
 
-    void calibrate(float mx, float bx, float my, float by);
+    /**
+     * @brief Translates the position and start position of a touch event
+     *          from raw digitizer coordinates to screen coordinates
+     * 
+     * @param event event to translate in place
+     */
+    void translateFromRaw(Driver::TouchscreenEvent_t &event);
+
+    /**
+     * @brief The raw digitizer reading that translates to a screen position,
+     *          for touches that don't come from the digitizer
+     * 
+     * @return false no usable transform
+     */
+    bool translateToRaw(uint16_t &xRaw, uint16_t &yRaw, uint16_t x, uint16_t y);
+
+    /**
+     * @brief Fits an affine transform to the given point pairs with least squares,
+     *          then saves it to the file system
+     * 
+     * @param screen target positions in screen coordinates
+     * @param raw raw digitizer readings for each target
+     * @param count number of point pairs. Must be at least 3
+     * @return true transform fitted and saved
+     * @return false too few points or the points are collinear
+     */
+    bool calibrate(const Point *screen, const Point *raw, size_t count);
+
+    /**
+     * @brief Screen position of calibration target i
+     */
+    static Point targetPoint(size_t i);
+
+    float getResidualRMS() const { return residualRMS; }
+    float getResidualMax() const { return residualMax; }
     
     void drawGrid();
     void drawTarget(uint16_t x, uint16_t y, uint32_t color = TFT_BLUE, uint16_t gap = 10);
-    void drawScreen(bool touched=false);
+    void drawScreen(const Driver::TouchscreenEvent_t *event = nullptr);
 
     void calibrationScreen();
     
@@ -55,8 +129,7 @@ public:
     static void generatePage(Page_t &page);
     static Page_t generatePage();
 
-    static void ts_onPress();
-    static void ts_onRelease();
+    static void ts_onEvent(const Driver::TouchscreenEvent_t &event);
 
 };
 
@@ -1,6 +1,9 @@
 #include "Debug.hpp"
 #include <memory>
 #include "../driver/miclone.hpp"
+#include "../driver/console.hpp"
+#include "../diagnostics/usage.h"
+#include "../program/ProgramScheduler.hpp"
 #include "../utils.h"
 #include "Calibration.h"
 #include "../driver/touchscreen.h"
@@ -14,6 +17,28 @@ _Debug::_Debug()
         button = nullptr;
     }
     // buttonsSize;
+    drawnUsage[0] = '\0';
+}
+
+void _Debug::drawUsage(bool force)
+{
+    Diagnostics::UsageTotals_t totals;
+    Diagnostics::usage_totals(totals);
+
+    char line[sizeof(drawnUsage)];
+    snprintf(line, sizeof(line), "Lifetime: %d runs, %.2f pump-h, %.1f ml",
+             totals.runs, totals.pumpMs / 3600000.0, totals.volumeNl / 1000000.0);
+
+    // redrawn only when the shown digits change
+    if (!force && !strcmp(line, drawnUsage)) return;
+    strcpy(drawnUsage, line);
+
+    drawingWrapper.setTextSize(1);
+    drawingWrapper.setTextFont(2);
+    drawingWrapper.setTextDatum(CMXG_CL_DATUM);
+    drawingWrapper.drawRect(10, DEBUG_USAGE_Y - 10, DEBUG_USAGE_WIDTH, 20, 0, DEBUG_BACKGROUND_COLOR);
+    drawingWrapper.setTextColor(CMXG_WHITE, CMXG_WHITE);
+    drawingWrapper.drawString(line, 10, DEBUG_USAGE_Y);
 }
 
 void _Debug::onStart(void *pageArgs)
@@ -25,7 +50,7 @@ void _Debug::onLoad(void *, void *args) {
 
     size_t counter = 0;
 
-    Serial.println("Not done loading debug");
+    Driver::console.println("Not done loading debug");
 
     // limits possible flow rates
     if      (DebugPage.flowRateValue > DEBUG_MAX_FLOW_RATE) DebugPage.flowRateValue = DEBUG_MAX_FLOW_RATE;
@@ -43,6 +68,8 @@ void _Debug::onLoad(void *, void *args) {
     DebugPage.buttons[counter]->onHoverExit = [](uint16_t x, uint16_t y, uint8_t z) {
     };
     DebugPage.buttons[counter]->onRelease = [](uint16_t x, uint16_t y, uint8_t z) {
+        if (ProgramScheduler.isRunning()) return;
+
         uint32_t time = (DebugPage.timerMinValue * 60 + DebugPage.timerSecValue) * 1000;
         Driver::miclone_start(DebugPage.flowRateValue, time);
     };
@@ -59,6 +86,7 @@ void _Debug::onLoad(void *, void *args) {
     DebugPage.buttons[counter]->onHoverExit = [](uint16_t x, uint16_t y, uint8_t z) {
     };
     DebugPage.buttons[counter]->onRelease = [](uint16_t x, uint16_t y, uint8_t z) {
+        ProgramScheduler.stop();
         Driver::miclone_stop();
     };
     ++counter;
@@ -207,7 +235,7 @@ void _Debug::onLoad(void *, void *args) {
         );
 
 
-    drawingWrapper.fillScreen(CMXG_BL_DATUM);
+    drawingWrapper.fillScreen(DEBUG_BACKGROUND_COLOR);
     // Driver::tft.setCursor(10, 10);
     // Driver::tft.setTextSize(2);
     // Driver::tft.setTextColor(TFT_CYAN);
@@ -227,10 +255,9 @@ void _Debug::onLoad(void *, void *args) {
     DebugPage.flowRate->draw();
     DebugPage.timerMinComponent->draw();
     DebugPage.timerSecComponent->draw();
+    DebugPage.drawUsage(true);
 
-
-    Driver::touchscreen_register_on_press(DebugPage.ts_onPress);
-    Driver::touchscreen_register_on_release(DebugPage.ts_onRelease);
+    Driver::touchscreen_register_on_event(DebugPage.ts_onEvent);
 }
 
 void _Debug::generatePage(Page_t &page)
@@ -240,6 +267,7 @@ void _Debug::generatePage(Page_t &page)
     page.onStart = DebugPage.onStart;
     page.onLoad = DebugPage.onLoad;
     page.onExit = DebugPage.onExit;
+    page.onUpdate = DebugPage.onUpdate;
 }
 
 Page_t _Debug::generatePage()
@@ -249,47 +277,31 @@ Page_t _Debug::generatePage()
     return page;
 }
 
-void _Debug::ts_onPress()
-{ 
-    uint16_t x, y;
-    Calibration.translateFromRaw(x, y);
-    if (DebugPage.buttons) {
-
-        for (size_t i = 0; i < DEBUG_NUM_BUTTONS; ++i) {
-            DebugPage.buttons[i]->performAction(x, y, 0, true);
-        }
-    }
-    if (DebugPage.flowRate) DebugPage.flowRate->performAction(x, y, 0, true);
-    if (DebugPage.timerMinComponent) DebugPage.timerMinComponent->performAction(x, y, 0, true);
-    if (DebugPage.timerSecComponent) DebugPage.timerSecComponent->performAction(x, y, 0, true);
-    
-    dev_println("DEBUG on press handler");
-}
-
-void _Debug::ts_onRelease()
+void _Debug::ts_onEvent(const Driver::TouchscreenEvent_t &rawEvent)
 {
-    uint16_t x, y;
-    Calibration.translateFromRaw(x, y);
+    Driver::TouchscreenEvent_t event = rawEvent;
+    Calibration.translateFromRaw(event);
 
     drawingWrapper.setTextSize(1);
-    if (DebugPage.buttons) {
-
-        for (size_t i = 0; i < DEBUG_NUM_BUTTONS; ++i) {
-            DebugPage.buttons[i]->performAction(x, y, 0, false);     // todo fix this!!
-        }
+    for (size_t i = 0; i < DEBUG_NUM_BUTTONS; ++i) {
+        if (DebugPage.buttons[i]) DebugPage.buttons[i]->performAction(event);
     }
 
-    if (DebugPage.flowRate) DebugPage.flowRate->performAction(x, y, 0, false);
-    if (DebugPage.timerSecComponent) DebugPage.timerSecComponent->performAction(x, y, 0, false);
-    if (DebugPage.timerMinComponent) DebugPage.timerMinComponent->performAction(x, y, 0, false);
+    if (DebugPage.flowRate) DebugPage.flowRate->performAction(event);
+    if (DebugPage.timerMinComponent) DebugPage.timerMinComponent->performAction(event);
+    if (DebugPage.timerSecComponent) DebugPage.timerSecComponent->performAction(event);
     
-    dev_println("DEBUG on release handler");
+    dev_println("DEBUG on event handler");
+}
+
+void _Debug::onUpdate()
+{
+    DebugPage.drawUsage(false);
 }
 
 void _Debug::onExit()
 {
-    Driver::touchscreen_register_on_press(nullptr);
-    Driver::touchscreen_register_on_release(nullptr);
+    Driver::touchscreen_register_on_event(nullptr);
     
     // for (Button *&button : DebugPage.buttons) {
 
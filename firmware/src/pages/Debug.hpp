@@ -10,6 +10,10 @@
 
 #define DEBUG_NUM_BUTTONS      3
 
+#define DEBUG_BACKGROUND_COLOR  CMXG_BL_DATUM
+#define DEBUG_USAGE_Y           290
+#define DEBUG_USAGE_WIDTH       340
+
 class _Debug
 {
 private:
@@ -21,6 +25,9 @@ private:
     static int32_t flowRateValue;
     static int32_t timerMinValue;
     static int32_t timerSecValue;
+    char drawnUsage[64];
+
+    void drawUsage(bool force);
 
 public:
     _Debug();
@@ -28,12 +35,12 @@ public:
     static void onStart(void *);
     static void onLoad(void *, void *);
     static void onExit();
+    static void onUpdate();
 
     static void generatePage(Page_t &page);
     static Page_t generatePage();
 
-    static void ts_onPress();
-    static void ts_onRelease();
+    static void ts_onEvent(const Driver::TouchscreenEvent_t &event);
 };
 
 extern _Debug DebugPage;
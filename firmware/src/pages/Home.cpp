@@ -2,7 +2,9 @@
 
 #include "Calibration.h"
 #include "../driver/miclone.hpp"
+#include "../driver/console.hpp"
 #include "../driver/touchscreen.h"
+#include "../diagnostics/runrecorder.h"
 #include "utils.h"
 
 _Home::_Home()
@@ -11,11 +13,19 @@ _Home::_Home()
     flowRateValue = 300;
     timerMinValue = 15;
     timerSecValue = 0;
+    numPrograms = 0;
+    selectedProgram = -1;
+    drawnSeconds = 0;
+    drawnState = Driver::MICLONE_IDLE;
+    selectedPump = 0;
+    memset(drawnPumps, 0, sizeof(drawnPumps));
     
     // assign the functions
     button_start = reinterpret_cast<Button *>(buttons);
     button_stop = button_start + 1;
     button_initialize = button_stop + 1;
+    button_program = button_initialize + 1;
+    button_pump = button_program + 1;
 
     new (button_start) Button(drawingWrapper, "START", 360, 10, 100, 100);
     button_start->setButtonSize(2);
@@ -28,8 +38,19 @@ _Home::_Home()
     button_start->onHoverExit = [](uint16_t x, uint16_t y, uint8_t z) {
     };
     button_start->onRelease = [](uint16_t x, uint16_t y, uint8_t z) {
-        uint32_t time = (Home.timerMinValue * 60 + Home.timerSecValue) * 1000;
-        Driver::miclone_start(Home.flowRateValue, time);
+        if (ProgramScheduler.isRunning()) return;
+
+        bool started;
+        if (Home.selectedProgram >= 0) {
+            started = ProgramScheduler.start(Home.programNames[Home.selectedProgram]);
+        }
+        else {
+            uint32_t time = (Home.timerMinValue * 60 + Home.timerSecValue) * 1000;
+            started = Driver::miclone_start(Home.flowRateValue, time, Home.selectedPump);
+        }
+
+        // logged after the start so it lands in the new run's record
+        if (started) Diagnostics::recorder_touch(Diagnostics::RUN_TOUCH_START);
     };
 
     new (button_stop) Button(drawingWrapper, "STOP", 360, 120, 100, 100);
@@ -43,7 +64,9 @@ _Home::_Home()
     button_stop->onHoverExit = [](uint16_t x, uint16_t y, uint8_t z) {
     };
     button_stop->onRelease = [](uint16_t x, uint16_t y, uint8_t z) {
-        Driver::miclone_stop();
+        Diagnostics::recorder_touch(Diagnostics::RUN_TOUCH_STOP);
+        ProgramScheduler.stop();
+        Driver::miclone_stop(Home.selectedPump);
     };
 
     new (button_initialize) Button(drawingWrapper, "Initialize", 360, 230, 100, 50);
@@ -60,6 +83,43 @@ _Home::_Home()
         // todo: implement this
     };
 
+    /* Program selection, each tap moves to the next stored program, then back to a manual run */
+    new (button_program) Button(drawingWrapper, "Manual", 160, 80, 180, 40);
+    button_program->setTextColor(CMXG_BLACK);
+    button_program->setButtonColor(CMXG_YELLOW);
+    button_program->onPress = [](uint16_t x, uint16_t y, uint8_t z) {
+    };
+    button_program->onHoverEnter = [](uint16_t x, uint16_t y, uint8_t z) {
+    };
+    button_program->onHoverExit = [](uint16_t x, uint16_t y, uint8_t z) {
+    };
+    button_program->onRelease = [](uint16_t x, uint16_t y, uint8_t z) {
+        if (ProgramScheduler.isRunning()) return;
+
+        if (++Home.selectedProgram >= Home.numPrograms) Home.selectedProgram = -1;
+        Home.updateProgramLabel();
+        Home.button_program->draw();
+    };
+
+    /* Pump selection, each tap moves to the next pump. Only shown with more than one pump */
+    new (button_pump) Button(drawingWrapper, "Pump 1", 160, 160, 180, 40);
+    button_pump->setTextColor(CMXG_BLACK);
+    button_pump->setButtonColor(CMXG_CYAN);
+    button_pump->onPress = [](uint16_t x, uint16_t y, uint8_t z) {
+    };
+    button_pump->onHoverEnter = [](uint16_t x, uint16_t y, uint8_t z) {
+    };
+    button_pump->onHoverExit = [](uint16_t x, uint16_t y, uint8_t z) {
+    };
+    button_pump->onRelease = [](uint16_t x, uint16_t y, uint8_t z) {
+        if (Driver::miclone_pump_count() < 2) return;
+
+        if (++Home.selectedPump >= Driver::miclone_pump_count()) Home.selectedPump = 0;
+        Home.updatePumpLabel();
+        Home.button_pump->draw();
+        Home.drawProgress(true);
+    };
+
     /* Flow Rate Timer */
     new (&component_flowRate) NumberFieldComponent(drawingWrapper, &Home.flowRateValue, 20, 80, 120, 40, "Flow Rate", "ul/min");
     component_flowRate.setReturnPageName(HOME_PAGE_NAME, 10);
@@ -163,6 +223,101 @@ _Home::_Home()
 #endif
 }
 
+void _Home::updateProgramLabel()
+{
+    if (selectedProgram < 0) {
+        strncpy(programLabel, "Manual", sizeof(programLabel));
+    }
+    else {
+        snprintf(programLabel, sizeof(programLabel), "Program: %s", programNames[selectedProgram]);
+    }
+
+    button_program->setName(programLabel);
+}
+
+void _Home::updatePumpLabel()
+{
+    snprintf(pumpLabel, sizeof(pumpLabel), "Pump %d", selectedPump + 1);
+    button_pump->setName(pumpLabel);
+}
+
+void _Home::drawProgress(bool force)
+{
+    // a program runs on the first pump, so it's only shown while that pump is selected
+    _ProgramScheduler::Progress progress = ProgramScheduler.getProgress();
+    progress.running &= selectedPump == 0;
+
+    Driver::MiCloneState_t runState = Driver::miclone_state(selectedPump);
+    uint32_t remaining = Driver::miclone_remaining(selectedPump);
+
+    // a program, else a manual run's time left, or time elapsed when it is untimed
+    uint8_t state = progress.running ? HOME_PROGRESS_PROGRAM : runState;
+    uint32_t seconds = progress.running              ? progress.totalRemaining
+                     : remaining == MICLONE_FOREVER ? Driver::miclone_elapsed(selectedPump) / 1000
+                     : (remaining + 999) / 1000;
+
+    if (!force && state == drawnState && seconds == drawnSeconds) return;
+
+    drawnState = state;
+    drawnSeconds = seconds;
+
+    drawingWrapper.drawRect(10, 285, 340, 30, 0, HOME_BACKGROUND_COLOR);
+    if (state == Driver::MICLONE_IDLE) return;
+
+    char line[64];
+    if (progress.running) {
+        snprintf(line, sizeof(line), "%s  cycle %d/%d  step %d/%d  %02d:%02d:%02d",
+                 progress.name,
+                 progress.cycle + 1, progress.cycles,
+                 progress.step + 1, progress.numSteps,
+                 seconds / 3600, seconds / 60 % 60, seconds % 60);
+    }
+    else if (runState == Driver::MICLONE_RUNNING) {
+        snprintf(line, sizeof(line), "Manual  running  %02d:%02d:%02d %s",
+                 seconds / 3600, seconds / 60 % 60, seconds % 60,
+                 remaining == MICLONE_FOREVER ? "elapsed" : "left");
+    }
+    else {
+        snprintf(line, sizeof(line), "Manual  %s", Driver::miclone_state_str(runState));
+    }
+
+    drawingWrapper.setTextSize(1);
+    drawingWrapper.setTextFont(2);
+    drawingWrapper.setTextDatum(CMXG_CL_DATUM);
+    drawingWrapper.setTextColor(CMXG_WHITE, CMXG_WHITE);
+    drawingWrapper.drawString(line, 10, 300);
+}
+
+void _Home::drawPumps(bool force)
+{
+    uint8_t count = Driver::miclone_pump_count();
+    if (count < 2) return;
+
+    drawingWrapper.setTextSize(1);
+    drawingWrapper.setTextFont(2);
+    drawingWrapper.setTextDatum(CMXG_CL_DATUM);
+
+    // one cell per pump, each redrawn only when its state changes
+    for (uint8_t i = 0; i < count; ++i) {
+        const Driver::MiClonePump_t &pump = Driver::miclone_pump(i);
+        Driver::MiCloneState_t state = Driver::miclone_state(i);
+        bool fault = state == Driver::MICLONE_IDLE && (pump.reason == Driver::MICLONE_STOP_ERROR || !pump.acknowledged) && pump.commands;
+        uint8_t drawn = state | (fault ? HOME_PUMP_FAULT : 0);
+
+        if (!force && drawn == drawnPumps[i]) continue;
+        drawnPumps[i] = drawn;
+
+        char cell[16];
+        snprintf(cell, sizeof(cell), "%d: %s", i + 1, fault ? "fault" : Driver::miclone_state_str(state));
+
+        uint16_t x = 10 + i * HOME_PUMP_STATUS_WIDTH;
+        drawingWrapper.drawRect(x, HOME_PUMP_STATUS_Y - 10, HOME_PUMP_STATUS_WIDTH, 20, 0, HOME_BACKGROUND_COLOR);
+        Color color = fault ? CMXG_RED : state == Driver::MICLONE_RUNNING ? CMXG_GREEN : CMXG_WHITE;
+        drawingWrapper.setTextColor(color, color);
+        drawingWrapper.drawString(cell, x, HOME_PUMP_STATUS_Y);
+    }
+}
+
 void _Home::onStart(void *pageArgs)
 {
     Home.pageArgs = pageArgs;
@@ -170,12 +325,12 @@ void _Home::onStart(void *pageArgs)
 
 void _Home::onLoad(void *, void *args)
 {
-    Serial.println("-> Switched to home page");
+    Driver::console.println("-> Switched to home page");
     
     if      (Home.flowRateValue > HOME_MAX_FLOW_RATE) Home.flowRateValue = HOME_MAX_FLOW_RATE;
     else if (Home.flowRateValue < HOME_MIN_FLOW_RATE) Home.flowRateValue = HOME_MIN_FLOW_RATE;
 
-    drawingWrapper.fillScreen(CMXG_BL_DATUM);
+    drawingWrapper.fillScreen(HOME_BACKGROUND_COLOR);
     // Driver::tft.setCursor(10, 10);
     // Driver::tft.setTextSize(2);
     // Driver::tft.setTextColor(TFT_CYAN);
@@ -197,25 +352,47 @@ void _Home::onLoad(void *, void *args)
     drawingWrapper.drawString("Sample / Waste", 80, 248);
 #endif
 
+    // pick up programs added over serial, keeping the selection if it still exists
+    char selected[PROGRAM_NAME_SIZE + 1] = { 0 };
+    if (Home.selectedProgram >= 0) strncpy(selected, Home.programNames[Home.selectedProgram], PROGRAM_NAME_SIZE);
+
+    Home.numPrograms = ProgramScheduler.list(Home.programNames, HOME_MAX_PROGRAMS);
+    Home.selectedProgram = -1;
+    for (uint8_t i = 0; i < Home.numPrograms; ++i) {
+        if (!strcmp(selected, Home.programNames[i])) Home.selectedProgram = i;
+    }
+    Home.updateProgramLabel();
+
+    if (Home.selectedPump >= Driver::miclone_pump_count()) Home.selectedPump = 0;
+    Home.updatePumpLabel();
+
     drawingWrapper.setTextSize(1);
     Home.button_start->draw();
     Home.button_stop->draw();
     Home.button_initialize->draw();
+    Home.button_program->draw();
+    if (Driver::miclone_pump_count() > 1) Home.button_pump->draw();
     Home.component_flowRate.draw();
     Home.component_timerMinComponent.draw();
     Home.component_timerSecComponent.draw();
 #ifdef ENABLE_SAMPLE_WASTE_TOGGLE
     Home.sampleWasteToggle.draw();
 #endif
+    Home.drawProgress(true);
+    Home.drawPumps(true);
 
-    Driver::touchscreen_register_on_press(Home.ts_onPress);
-    Driver::touchscreen_register_on_release(Home.ts_onRelease);
+    Driver::touchscreen_register_on_event(Home.ts_onEvent);
 }
 
 void _Home::onExit()
 {
-    Driver::touchscreen_register_on_press(nullptr);
-    Driver::touchscreen_register_on_release(nullptr);
+    Driver::touchscreen_register_on_event(nullptr);
+}
+
+void _Home::onUpdate()
+{
+    Home.drawProgress(false);
+    Home.drawPumps(false);
 }
 
 void _Home::generatePage(Page_t &page)
@@ -225,6 +402,7 @@ void _Home::generatePage(Page_t &page)
     page.onStart = Home.onStart;
     page.onLoad = Home.onLoad;
     page.onExit = Home.onExit;
+    page.onUpdate = Home.onUpdate;
 }
 
 Page_t _Home::generatePage()
@@ -234,40 +412,24 @@ Page_t _Home::generatePage()
     return page;
 }
 
-void _Home::ts_onPress()
-{
-    uint16_t x, y;
-    Calibration.translateFromRaw(x, y);
-    
-    Home.button_start->performAction(x, y, 0, true);
-    Home.button_stop->performAction(x, y, 0, true);
-    Home.button_initialize->performAction(x, y, 0, true);
-    Home.component_flowRate.performAction(x, y, 0, true);
-    Home.component_timerMinComponent.performAction(x, y, 0, true);
-    Home.component_timerSecComponent.performAction(x, y, 0, true);
-#ifdef ENABLE_SAMPLE_WASTE_TOGGLE
-    Home.sampleWasteToggle.performAction(x, y, 0, true);
-#endif
-
-    dev_println("MAIN on press handler");
-}
-
-void _Home::ts_onRelease()
+void _Home::ts_onEvent(const Driver::TouchscreenEvent_t &rawEvent)
 {
-    uint16_t x, y;
-    Calibration.translateFromRaw(x, y);
+    Driver::TouchscreenEvent_t event = rawEvent;
+    Calibration.translateFromRaw(event);
     
-    Home.button_start->performAction(x, y, 0, false);
-    Home.button_stop->performAction(x, y, 0, false);
-    Home.button_initialize->performAction(x, y, 0, false);
-    Home.component_flowRate.performAction(x, y, 0, false);
-    Home.component_timerMinComponent.performAction(x, y, 0, false);
-    Home.component_timerSecComponent.performAction(x, y, 0, false);
+    Home.button_start->performAction(event);
+    Home.button_stop->performAction(event);
+    Home.button_initialize->performAction(event);
+    Home.button_program->performAction(event);
+    Home.button_pump->performAction(event);
+    Home.component_flowRate.performAction(event);
+    Home.component_timerMinComponent.performAction(event);
+    Home.component_timerSecComponent.performAction(event);
 #ifdef ENABLE_SAMPLE_WASTE_TOGGLE
-    Home.sampleWasteToggle.performAction(x, y, 0, false);
+    Home.sampleWasteToggle.performAction(event);
 #endif
 
-    dev_println("MAIN on release handler");
+    dev_println("MAIN on event handler");
 }
 
 _Home Home;
@@ -2,6 +2,8 @@
 
 #include "../graphics/Toggle.hpp"
 #include "AppPageConfig.hpp"
+#include "../program/ProgramScheduler.hpp"
+#include "../driver/micloneschedule.hpp"
 #include <memory>
 
 #define HOME_PAGE_NAME "home-page"
@@ -9,6 +11,13 @@
 #define HOME_MAX_FLOW_RATE 1000
 #define HOME_MIN_FLOW_RATE  100
 
+#define HOME_MAX_PROGRAMS     8
+#define HOME_BACKGROUND_COLOR CMXG_BL_DATUM
+#define HOME_PROGRESS_PROGRAM 0xFF          // drawnState for a program, otherwise the manual run's state
+#define HOME_PUMP_STATUS_Y    262           // per pump status row, only shown with more than one pump
+#define HOME_PUMP_STATUS_WIDTH 85
+#define HOME_PUMP_FAULT       0x80          // drawnPumps flag for a pump whose last run ended in an error
+
 class _Home
 {
 private:
@@ -18,10 +27,12 @@ private:
     NumberFieldComponent component_timerSecComponent;
 
     // buttons
-    uint8_t buttons[3 * sizeof(Button)];
+    uint8_t buttons[5 * sizeof(Button)];
     Button *button_start;
     Button *button_stop;
     Button *button_initialize;
+    Button *button_program;
+    Button *button_pump;
 
     // toggles
 #ifdef ENABLE_SAMPLE_WASTE_TOGGLE
@@ -32,18 +43,38 @@ private:
     int32_t timerMinValue;
     int32_t timerSecValue;
 
+    // stored programs, selectedProgram is -1 for a manual run
+    char programNames[HOME_MAX_PROGRAMS][PROGRAM_NAME_SIZE + 1];
+    uint8_t numPrograms;
+    int8_t selectedProgram;
+    char programLabel[GRAPHICS_BUTTON_MAX_NAME_LENGTH];
+
+    // pump that manual runs and STOP act on, programs always run on the first pump
+    uint8_t selectedPump;
+    char pumpLabel[GRAPHICS_BUTTON_MAX_NAME_LENGTH];
+
+    // last progress drawn, so it's only redrawn when it changes
+    uint32_t drawnSeconds;
+    uint8_t drawnState;
+    uint8_t drawnPumps[MICLONE_MAX_PUMPS];
+
+    void updateProgramLabel();
+    void updatePumpLabel();
+    void drawProgress(bool force);
+    void drawPumps(bool force);
+
 public:
     _Home();
 
     static void onStart(void *);
     static void onLoad(void *, void *);
     static void onExit();
+    static void onUpdate();
 
     static void generatePage(Page_t &page);
     static Page_t generatePage();
 
-    static void ts_onPress();
-    static void ts_onRelease();
+    static void ts_onEvent(const Driver::TouchscreenEvent_t &event);
 };
 
 extern _Home Home;
@@ -3,6 +3,7 @@
 #include "Calibration.h"
 #include "AppPageConfig.hpp"
 #include "../driver/touchscreen.h"
+#include "../driver/console.hpp"
 #include "../graphics/Button.hpp"
 #include "../config.h"
 #include <assert.h>
@@ -36,17 +37,17 @@ void _NumberFieldPage::onLoad(void *, void *args)
     }
     #endif // SAFE_CODE
 
-    Serial.println("-> Stage 1");
+    Driver::console.println("-> Stage 1");
 
     NumberFieldPage.props = reinterpret_cast<NumberFieldDefs::Props_t *>(args);
-    Serial.printf("Name of return page is: %s", NumberFieldPage.props->returnPageName);
+    Driver::console.printf("Name of return page is: %s", NumberFieldPage.props->returnPageName);
     drawingWrapper.fillScreen(CMXG_BLACK);
 
     // create buttons
     
     // assert(false && "There is no clean up for this and this has not been initialized.");
 
-    Serial.println("-> Stage 2");
+    Driver::console.println("-> Stage 2");
 
 
     const uint16_t x = 250;
@@ -62,7 +63,7 @@ void _NumberFieldPage::onLoad(void *, void *args)
         NumberFieldPage.buttons[i] = new Button(drawingWrapper, buffer, nX, nY, width, width);
     }
 
-    Serial.println("-> Stage 3");
+    Driver::console.println("-> Stage 3");
 
 
     // I know this is ugly but this removes complex data passing
@@ -81,7 +82,7 @@ void _NumberFieldPage::onLoad(void *, void *args)
         NumberFieldPage.draw();                                                             \
     };
 
-    Serial.println("-> Stage 4");
+    Driver::console.println("-> Stage 4");
 
 
     NUMBERFIELDPAGE_GENERATE_BUTTONS(1);
@@ -153,7 +154,7 @@ void _NumberFieldPage::onLoad(void *, void *args)
                 // 
                 // char buffer[64] = { 0 };
                 // strncpy(buffer, reinterpret_cast<char *>(args[1]), sizeof(buffer) - 1);
-                // Serial.printf("The page name switch is: %s", buffer);
+                // Driver::console.printf("The page name switch is: %s", buffer);
                 // 
                 // PageSystem_findSwitch(reinterpret_cast<PageSystem_t *>(args[0]), reinterpret_cast<char *>(args[1]), args[2]);
                 // delete[] args;
@@ -180,18 +181,16 @@ void _NumberFieldPage::onLoad(void *, void *args)
         };
     }
     
-    Serial.println("-> Stage 5");
+    Driver::console.println("-> Stage 5");
 
     draw();
 
-    Driver::touchscreen_register_on_press(ts_onPress);
-    Driver::touchscreen_register_on_release(ts_onRelease);
+    Driver::touchscreen_register_on_event(ts_onEvent);
 }
 
 void _NumberFieldPage::onExit()
 {
-    Driver::touchscreen_register_on_press(nullptr);
-    Driver::touchscreen_register_on_release(nullptr);
+    Driver::touchscreen_register_on_event(nullptr);
     
     // delete buttons
     for (size_t i = 0; i < sizeof(buttons) / sizeof(buttons[0]); ++i) {
@@ -214,6 +213,7 @@ void _NumberFieldPage::generatePage(Page_t &page)
     page.onStart = onStart;
     page.onLoad = onLoad;
     page.onExit = onExit;
+    page.onUpdate = nullptr;
 }
 
 Page_t _NumberFieldPage::generatePage()
@@ -223,26 +223,18 @@ Page_t _NumberFieldPage::generatePage()
     return page;
 }
 
-void _NumberFieldPage::ts_onPress()
+void _NumberFieldPage::ts_onEvent(const Driver::TouchscreenEvent_t &rawEvent)
 {
-    uint16_t x, y;
-    Calibration.translateFromRaw(x, y);
+    // the keypad only reacts to releases, so intermediate moves don't redraw it
+    if (rawEvent.type != Driver::TOUCHSCREEN_EVENT_UP) return;
 
-        for (size_t i = 0; i < sizeof(NumberFieldPage.buttons) / sizeof(NumberFieldPage.buttons[0]); ++i) {
-        NumberFieldPage.buttons[i]->performAction(x, y, 0, true);
-        NumberFieldPage.buttons[i]->draw();
-    }
-}
-
-void _NumberFieldPage::ts_onRelease()
-{
-    uint16_t x, y;
-    Calibration.translateFromRaw(x, y);
+    Driver::TouchscreenEvent_t event = rawEvent;
+    Calibration.translateFromRaw(event);
 
     for (size_t i = 0; i < sizeof(NumberFieldPage.buttons) / sizeof(NumberFieldPage.buttons[0]); ++i) {
         if (NumberFieldPage.buttons[i]) {
 
-            NumberFieldPage.buttons[i]->performAction(x, y, 0, false);
+            NumberFieldPage.buttons[i]->performAction(event);
             NumberFieldPage.buttons[i]->draw();
         }
     }
@@ -3,6 +3,7 @@
 #include "../graphics/NumberFieldDefs.hpp"
 #include "../pagesystem/page.h"
 #include "../graphics/Button.hpp"
+#include "../driver/touchscreen.h"
 #include <stdint.h>
 
 #define PAGES_NUMBERFIELDPAGE_NAME "numfield"
@@ -27,8 +28,7 @@ public:
     static void generatePage(Page_t &page);
     static Page_t generatePage();
 
-    static void ts_onPress();
-    static void ts_onRelease();
+    static void ts_onEvent(const Driver::TouchscreenEvent_t &event);
     // static void generatePage(Page_t &page)
 
 
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "../graphics/Button.hpp"
+#include "../driver/touchscreen.h"
 #include "AppPageConfig.hpp"
 #include <memory>
 
@@ -23,8 +24,7 @@ public:
     static void generatePage(Page_t &page);
     static Page_t generatePage();
 
-    static void ts_onPress();
-    static void ts_onRelease();
+    static void ts_onEvent(const Driver::TouchscreenEvent_t &event);
 };
 
 extern _PageTimer PageTimer;
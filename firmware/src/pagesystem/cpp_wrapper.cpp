@@ -1,5 +1,5 @@
 #include "cpp_wrapper.h"
-#include <Arduino.h>
+#include "../driver/console.hpp"
 
 #ifdef __cplusplus
 extern "C"
@@ -8,7 +8,7 @@ extern "C"
 
 void cprintln(const char *str)
 {
-    Serial.println(str);
+    Driver::console.println(str);
 }
 
 
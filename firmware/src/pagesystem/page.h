@@ -11,6 +11,7 @@ typedef void (*PageOperationFunction) (void *, void *);
 typedef PageOperationFunction Page_onLoadFunction;
 typedef void (*Page_onExitFunction)();
 typedef void (*Page_onStartFunction)(void *);
+typedef void (*Page_onUpdateFunction)();
 
 typedef struct {
     char name[PAGE_NAME_SIZE];
@@ -20,6 +21,7 @@ typedef struct {
     Page_onStartFunction onStart;
     Page_onLoadFunction onLoad;
     Page_onExitFunction onExit;
+    Page_onUpdateFunction onUpdate;     // optional, called periodically while the page is active
 } Page_t;
 
 static void Page_init(Page_t *page)
@@ -29,6 +31,7 @@ static void Page_init(Page_t *page)
     page->onStart = NULL;
     page->onLoad = NULL;
     page->onExit = NULL;
+    page->onUpdate = NULL;
 }
 
 #endif
@@ -135,6 +135,13 @@ void PageSystem_execute_switch(PageSystem_t *pgt)
     }
 }
 
+void PageSystem_update(PageSystem_t *pgt)
+{
+    if (pgt->activePage && !pgt->stagedPage && pgt->activePage->onUpdate) {
+        pgt->activePage->onUpdate();
+    }
+}
+
 void PageSystem_end(PageSystem_t *pgt)
 {
 #ifdef DYNAMIC_PAGES
@@ -90,6 +90,13 @@ extern bool PageSystem_switch(PageSystem_t *pgt, Page_t *page, void *args);
 
 extern void PageSystem_execute_switch(PageSystem_t *pgt);
 
+/**
+ * @brief Calls the active page's onUpdate, if it has one and no switch is staged
+ * 
+ * @param pgt 
+ */
+extern void PageSystem_update(PageSystem_t *pgt);
+
 /**
  * @brief Cleans up PageSystem_t resources. Once this is is called, the PageSystem
  *          passed will no longer be valid until it is re-initialized
@@ -0,0 +1,422 @@
+#include "ProgramScheduler.hpp"
+#include "../driver/miclone.hpp"
+#include "../driver/console.hpp"
+#include "../diagnostics/runrecorder.h"
+#include "utils.h"
+#include <rom/crc.h>
+
+_ProgramScheduler::_ProgramScheduler()
+{
+    fs = nullptr;
+    mutex = nullptr;
+    task = nullptr;
+    timer = nullptr;
+    memset(&program, 0, sizeof(program));
+    cycle = 0;
+    step = 0;
+    stepStart = 0;
+    stepDeadline = 0;
+    stopRequested = false;
+}
+
+uint32_t _ProgramScheduler::stateCRC(const StateRecord &record)
+{
+    return crc32_le(0, reinterpret_cast<const uint8_t *>(&record), offsetof(StateRecord, crc));
+}
+
+void _ProgramScheduler::programPath(char *path, size_t size, const char *name)
+{
+    snprintf(path, size, PROGRAM_DIRECTORY "/%s" PROGRAM_EXTENSION, name);
+}
+
+void _ProgramScheduler::begin(FS &fs)
+{
+    this->fs = &fs;
+    mutex = xSemaphoreCreateMutex();
+    assert(mutex);
+
+    esp_timer_create_args_t timerArgs = {};
+    timerArgs.callback = timerCallback;
+    timerArgs.name = "program";
+    ESP_ERROR_CHECK(esp_timer_create(&timerArgs, &timer));
+
+    if (!fs.exists(PROGRAM_STATE_FILENAME)) return;
+
+    StateRecord record;
+    File f = fs.open(PROGRAM_STATE_FILENAME, "r");
+    size_t bytesRead = f.read(reinterpret_cast<uint8_t *>(&record), sizeof(record));
+    f.close();
+
+    if (bytesRead < sizeof(record)            ||
+        record.magic != PROGRAM_STATE_MAGIC   ||
+        record.version != PROGRAM_STATE_VERSION ||
+        record.crc != stateCRC(record)) {
+
+        Serial.println("Error: Saved program progress is invalid and was discarded");
+        fs.remove(PROGRAM_STATE_FILENAME);
+        return;
+    }
+
+    record.name[PROGRAM_NAME_SIZE] = '\0';
+    if (!load(record.name, program)           ||
+        record.cycle >= program.repeat        ||
+        record.step >= program.numSteps) {
+
+        Serial.printf("Error: Cannot resume program \"%s\", it was changed or removed\n", record.name);
+        fs.remove(PROGRAM_STATE_FILENAME);
+        return;
+    }
+
+    Serial.printf("-> Resuming program \"%s\" at cycle %d step %d (%ds in)\n", record.name, record.cycle + 1, record.step + 1, record.stepElapsed);
+    launch(record.cycle, record.step, record.stepElapsed);
+}
+
+bool _ProgramScheduler::parse(const char *name, JsonDocument &doc, Program &program)
+{
+    memset(&program, 0, sizeof(program));
+    strncpy(program.name, name, PROGRAM_NAME_SIZE);
+
+    program.repeat = doc["repeat"] | 1;
+    JsonArrayConst steps = doc["steps"];
+
+    if (!program.repeat || steps.isNull() || !steps.size() || steps.size() > PROGRAM_MAX_STEPS) {
+        Serial.printf("Error: Program \"%s\" needs 1 to %d steps and a repeat count above 0\n", name, PROGRAM_MAX_STEPS);
+        return false;
+    }
+
+    for (JsonVariantConst stepVariant : steps) {
+        JsonObjectConst stepJson = stepVariant.as<JsonObjectConst>();
+        Step &step = program.steps[program.numSteps];
+
+        if (stepJson.containsKey("pause")) {
+            step.rate = 0;
+            step.duration = stepJson["pause"] | 0;
+        }
+        else {
+            step.rate = stepJson["rate"] | 0;
+            step.duration = stepJson["duration"] | 0;
+        }
+
+        if (!step.duration || (step.rate && (step.rate < PROGRAM_MIN_RATE || step.rate > PROGRAM_MAX_RATE))) {
+            Serial.printf("Error: Program \"%s\" step %d needs a duration and a rate between %d and %d ul/min\n",
+                          name, program.numSteps + 1, PROGRAM_MIN_RATE, PROGRAM_MAX_RATE);
+            return false;
+        }
+
+        ++program.numSteps;
+    }
+
+    return true;
+}
+
+size_t _ProgramScheduler::list(char names[][PROGRAM_NAME_SIZE + 1], size_t max)
+{
+    size_t count = 0;
+    File dir = fs->open(PROGRAM_DIRECTORY);
+    if (!dir) return 0;
+
+    for (File f = dir.openNextFile(); f && count < max; f = dir.openNextFile()) {
+        // depending on the core version name() is either the full path or the file name
+        const char *name = strrchr(f.name(), '/');
+        name = name ? name + 1 : f.name();
+
+        const char *extension = strstr(name, PROGRAM_EXTENSION);
+        size_t length = extension ? extension - name : strlen(name);
+        if (length > PROGRAM_NAME_SIZE) length = PROGRAM_NAME_SIZE;
+
+        memcpy(names[count], name, length);
+        names[count][length] = '\0';
+        ++count;
+        f.close();
+    }
+
+    dir.close();
+    return count;
+}
+
+bool _ProgramScheduler::load(const char *name, Program &program)
+{
+    char path[48];
+    programPath(path, sizeof(path), name);
+
+    File f = fs->open(path, "r");
+    if (!f) {
+        Serial.printf("Error: Cannot find program \"%s\"\n", name);
+        return false;
+    }
+
+    DynamicJsonDocument doc(PROGRAM_MAX_FILE_SIZE);
+    DeserializationError error = deserializeJson(doc, f);
+    f.close();
+
+    if (error) {
+        Serial.printf("Error: Program \"%s\" is not valid JSON (%s)\n", name, error.c_str());
+        return false;
+    }
+
+    return parse(name, doc, program);
+}
+
+bool _ProgramScheduler::save(const char *name, const char *json)
+{
+    if (!*name || strlen(name) > PROGRAM_NAME_SIZE || strchr(name, '/')) {
+        Serial.printf("Error: Program names are 1 to %d characters without '/'\n", PROGRAM_NAME_SIZE);
+        return false;
+    }
+
+    DynamicJsonDocument doc(PROGRAM_MAX_FILE_SIZE);
+    DeserializationError error = deserializeJson(doc, json);
+    if (error) {
+        Serial.printf("Error: Program is not valid JSON (%s)\n", error.c_str());
+        return false;
+    }
+
+    Program validated;
+    if (!parse(name, doc, validated)) return false;
+
+    char path[48];
+    programPath(path, sizeof(path), name);
+
+    File f = fs->open(path, "w");
+    if (!f) return false;
+    serializeJson(doc, f);
+    f.close();
+
+    return true;
+}
+
+bool _ProgramScheduler::remove(const char *name)
+{
+    char path[48];
+    programPath(path, sizeof(path), name);
+    return fs->remove(path);
+}
+
+bool _ProgramScheduler::start(const char *name)
+{
+    if (isRunning() || Driver::miclone_running()) {
+        Serial.println("Error: The collector is already running");
+        return false;
+    }
+
+    Program loaded;
+    if (!load(name, loaded)) return false;
+
+    xSemaphoreTake(mutex, portMAX_DELAY);
+    program = loaded;
+    xSemaphoreGive(mutex);
+
+    return launch(0, 0, 0);
+}
+
+bool _ProgramScheduler::launch(uint16_t cycle, uint8_t step, uint32_t stepElapsed)
+{
+    xSemaphoreTake(mutex, portMAX_DELAY);
+
+    if (task) {
+        xSemaphoreGive(mutex);
+        return false;
+    }
+
+    this->cycle = cycle;
+    this->step = step;
+    stepStart = esp_timer_get_time() - (int64_t) stepElapsed * 1000000;
+    stepDeadline = stepStart + (int64_t) program.steps[step].duration * 1000000;
+    stopRequested = false;
+
+    BaseType_t created = xTaskCreate(programTask,
+                                     "program-tsk",
+                                     PROGRAM_STACK_SIZE,
+                                     nullptr,
+                                     1,
+                                     &task);
+
+    xSemaphoreGive(mutex);
+    return created == pdPASS;
+}
+
+void _ProgramScheduler::stop()
+{
+    xSemaphoreTake(mutex, portMAX_DELAY);
+
+    if (task) {
+        stopRequested = true;
+        xTaskNotifyGive(task);
+    }
+
+    xSemaphoreGive(mutex);
+}
+
+bool _ProgramScheduler::isRunning()
+{
+    xSemaphoreTake(mutex, portMAX_DELAY);
+    bool running = task;
+    xSemaphoreGive(mutex);
+    return running;
+}
+
+void _ProgramScheduler::timerCallback(void *)
+{
+    // the timer is only armed by the program task while it waits
+    xTaskNotifyGive(ProgramScheduler.task);
+}
+
+bool _ProgramScheduler::waitUntil(int64_t deadline)
+{
+    const int64_t checkpoint = (int64_t) PROGRAM_CHECKPOINT_INTERVAL * 1000000;
+
+    while (!stopRequested) {
+        int64_t now = esp_timer_get_time();
+        if (now >= deadline) return true;
+
+        int64_t wait = deadline - now;
+        esp_timer_start_once(timer, wait < checkpoint ? wait : checkpoint);
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        esp_timer_stop(timer);
+
+        if (!stopRequested && esp_timer_get_time() < deadline) saveState();
+    }
+
+    return false;
+}
+
+void _ProgramScheduler::programTask(void *)
+{
+    _ProgramScheduler &scheduler = ProgramScheduler;
+    const Program &program = scheduler.program;
+    
+    // the pump may still be running from before a reboot, so its rate is unknown
+    int32_t pumpRate = -1;
+    bool completed = false;
+    bool failed = false;
+
+    Driver::console.printf("-> [PROGRAM] Starting \"%s\"\n", program.name);
+    Diagnostics::recorder_start_run(0);
+
+    while (!scheduler.stopRequested) {
+        const Step &step = program.steps[scheduler.step];
+        
+        if (step.rate != pumpRate) {
+            if (pumpRate) Driver::miclone_send_stop();
+            Diagnostics::recorder_set_rate(step.rate);
+
+            if (step.rate) {
+                bool accepted = Driver::miclone_send_start(step.rate) == Driver::MICLONE_OK;
+                Diagnostics::recorder_pump_ack(accepted);
+
+                if (!accepted) {
+                    Driver::console.printf("-> [PROGRAM] Pump did not accept step %d, stopping the program\n", scheduler.step + 1);
+                    failed = true;
+                    break;
+                }
+            }
+
+            pumpRate = step.rate;
+        }
+
+        scheduler.saveState();
+        if (!scheduler.waitUntil(scheduler.stepDeadline)) break;
+
+        xSemaphoreTake(scheduler.mutex, portMAX_DELAY);
+        if (++scheduler.step == program.numSteps) {
+            scheduler.step = 0;
+            ++scheduler.cycle;
+        }
+
+        completed = scheduler.cycle == program.repeat;
+        if (!completed) {
+            // chain from the previous deadline, not from now, so the steps don't drift
+            scheduler.stepStart = scheduler.stepDeadline;
+            scheduler.stepDeadline += (int64_t) program.steps[scheduler.step].duration * 1000000;
+        }
+        xSemaphoreGive(scheduler.mutex);
+
+        if (completed) break;
+    }
+
+    if (pumpRate) Driver::miclone_send_stop();
+    scheduler.clearState();
+    Diagnostics::recorder_stop_run(completed ? Diagnostics::RUN_STOP_COMPLETE : failed ? Diagnostics::RUN_STOP_ERROR : Diagnostics::RUN_STOP_MANUAL);
+
+    Driver::console.printf("-> [PROGRAM] \"%s\" %s\n", program.name, completed ? "completed" : "stopped");
+
+    xSemaphoreTake(scheduler.mutex, portMAX_DELAY);
+    scheduler.task = nullptr;
+    xSemaphoreGive(scheduler.mutex);
+
+    vTaskDelete(nullptr);
+}
+
+void _ProgramScheduler::saveState()
+{
+    StateRecord record;
+    memset(&record, 0, sizeof(record));
+    record.magic = PROGRAM_STATE_MAGIC;
+    record.version = PROGRAM_STATE_VERSION;
+    record.cycle = cycle;
+    record.step = step;
+    record.stepElapsed = (esp_timer_get_time() - stepStart) / 1000000;
+    strncpy(record.name, program.name, PROGRAM_NAME_SIZE);
+    record.crc = stateCRC(record);
+
+    File f = fs->open(PROGRAM_STATE_FILENAME, "w");
+    f.write(reinterpret_cast<uint8_t *>(&record), sizeof(record));
+    f.close();
+}
+
+void _ProgramScheduler::clearState()
+{
+    if (fs->exists(PROGRAM_STATE_FILENAME)) fs->remove(PROGRAM_STATE_FILENAME);
+}
+
+_ProgramScheduler::Progress _ProgramScheduler::getProgress()
+{
+    Progress progress;
+    memset(&progress, 0, sizeof(progress));
+
+    xSemaphoreTake(mutex, portMAX_DELAY);
+
+    progress.running = task;
+    if (progress.running) {
+        strncpy(progress.name, program.name, PROGRAM_NAME_SIZE);
+        progress.cycle = cycle;
+        progress.cycles = program.repeat;
+        progress.step = step;
+        progress.numSteps = program.numSteps;
+        progress.rate = program.steps[step].rate;
+
+        int64_t remaining = (stepDeadline - esp_timer_get_time()) / 1000000;
+        progress.stepRemaining = remaining > 0 ? remaining : 0;
+
+        uint32_t cycleDuration = 0;
+        uint32_t restOfCycle = 0;
+        for (uint8_t i = 0; i < program.numSteps; ++i) {
+            cycleDuration += program.steps[i].duration;
+            if (i > step) restOfCycle += program.steps[i].duration;
+        }
+
+        progress.totalRemaining = progress.stepRemaining + restOfCycle + (program.repeat - cycle - 1) * cycleDuration;
+    }
+
+    xSemaphoreGive(mutex);
+    return progress;
+}
+
+void _ProgramScheduler::printStatus(Stream &stream)
+{
+    Progress progress = getProgress();
+    if (!progress.running) {
+        stream.println("-> No program running");
+        return;
+    }
+
+    stream.printf("-> Program \"%s\": cycle %d/%d, step %d/%d, %s, %ds left in step, %ds left in program\n",
+                  progress.name,
+                  progress.cycle + 1, progress.cycles,
+                  progress.step + 1, progress.numSteps,
+                  progress.rate ? "pumping" : "paused",
+                  progress.stepRemaining,
+                  progress.totalRemaining);
+}
+
+_ProgramScheduler ProgramScheduler;
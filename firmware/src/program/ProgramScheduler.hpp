@@ -0,0 +1,157 @@
+#pragma once
+
+#include <Arduino.h>
+#include <stdint.h>
+#include <FreeRTOS.h>
+#include <esp_timer.h>
+#include <FS.h>
+#include <SPIFFS.h>
+#include <ArduinoJson.h>
+
+#define PROGRAM_DIRECTORY           "/programs"
+#define PROGRAM_EXTENSION           ".json"
+#define PROGRAM_STATE_FILENAME      "/program_state.bin"
+
+#define PROGRAM_STATE_MAGIC         0x47525050      // "PPRG"
+#define PROGRAM_STATE_VERSION       1
+
+#define PROGRAM_NAME_SIZE           16              // SPIFFS paths are limited to 32 characters
+#define PROGRAM_MAX_STEPS           16
+#define PROGRAM_MAX_FILE_SIZE       2048
+#define PROGRAM_MIN_RATE            100             // ul/min
+#define PROGRAM_MAX_RATE            1000            // ul/min
+
+#define PROGRAM_CHECKPOINT_INTERVAL 60              // s between progress saves within a step
+#define PROGRAM_STACK_SIZE          4 * 1024
+
+/**
+ * Runs multi-step sampling programs stored in SPIFFS as PROGRAM_DIRECTORY/<name>.json:
+ * 
+ *      { "repeat": 4, "steps": [ { "rate": 300, "duration": 900 },
+ *                                { "pause": 120 },
+ *                                { "rate": 600, "duration": 1800 } ] }
+ * 
+ * Durations are in seconds. Step deadlines are absolute esp_timer times chained
+ * from the program start, so time spent talking to the pump doesn't accumulate.
+ * Progress is saved at every step and every PROGRAM_CHECKPOINT_INTERVAL so a
+ * program interrupted by a reboot resumes where it left off.
+ */
+class _ProgramScheduler
+{
+public:
+
+    struct Step {
+        uint16_t rate;          // ul/min, 0 pauses the pump
+        uint32_t duration;      // s
+    };
+
+    struct Program {
+        char name[PROGRAM_NAME_SIZE + 1];
+        uint16_t repeat;
+        uint8_t numSteps;
+        Step steps[PROGRAM_MAX_STEPS];
+    };
+
+    struct Progress {
+        bool running;
+        char name[PROGRAM_NAME_SIZE + 1];
+        uint16_t cycle;             // 0 based
+        uint16_t cycles;
+        uint8_t step;               // 0 based
+        uint8_t numSteps;
+        uint16_t rate;
+        uint32_t stepRemaining;     // s
+        uint32_t totalRemaining;    // s
+    };
+
+    /**
+     * @brief Layout of PROGRAM_STATE_FILENAME. crc covers every byte before it
+     */
+    struct StateRecord {
+        uint32_t magic;
+        uint16_t version;
+        uint16_t cycle;
+        uint8_t  step;
+        uint8_t  reserved[3];
+        uint32_t stepElapsed;       // s
+        char name[PROGRAM_NAME_SIZE + 1];
+        uint32_t crc;
+    };
+
+private:
+    FS *fs;
+    SemaphoreHandle_t mutex;
+    TaskHandle_t task;
+    esp_timer_handle_t timer;
+
+    Program program;
+    uint16_t cycle;
+    uint8_t step;
+    int64_t stepStart;          // esp_timer time the current step started
+    int64_t stepDeadline;       // esp_timer time the current step ends
+    volatile bool stopRequested;
+
+    static void programTask(void *);
+    static void timerCallback(void *);
+    static uint32_t stateCRC(const StateRecord &record);
+    static void programPath(char *path, size_t size, const char *name);
+    static bool parse(const char *name, JsonDocument &doc, Program &program);
+
+    bool launch(uint16_t cycle, uint8_t step, uint32_t stepElapsed);
+    bool waitUntil(int64_t deadline);
+    void saveState();
+    void clearState();
+
+public:
+    _ProgramScheduler();
+
+    /**
+     * @brief Loads saved progress and resumes an interrupted program
+     */
+    void begin(FS &fs = SPIFFS);
+
+    /**
+     * @brief Lists stored programs
+     * 
+     * @param names receives up to max program names
+     * @return size_t number of programs found
+     */
+    size_t list(char names[][PROGRAM_NAME_SIZE + 1], size_t max);
+
+    /**
+     * @brief Reads and validates a stored program
+     */
+    bool load(const char *name, Program &program);
+
+    /**
+     * @brief Validates and stores a program
+     * 
+     * @param json program in the format described above
+     */
+    bool save(const char *name, const char *json);
+
+    bool remove(const char *name);
+
+    /**
+     * @brief Starts a stored program from the first step
+     * 
+     * @return false The program is invalid, or a program or a manual run is already running
+     */
+    bool start(const char *name);
+
+    /**
+     * @brief Stops the running program after its current pump command and stops the pump
+     */
+    void stop();
+
+    bool isRunning();
+
+    Progress getProgress();
+
+    /**
+     * @brief Prints the running program's progress
+     */
+    void printStatus(Stream &stream = Serial);
+};
+
+extern _ProgramScheduler ProgramScheduler;
@@ -3,7 +3,7 @@
 #include <Arduino.h>
 #include <string>
 #ifdef DEV_DEBUG
-#include <SD.h>
+#include "diagnostics/sdlog.h"
 #endif
 
 #ifdef __cplusplus
@@ -26,14 +26,7 @@ extern "C"
     #define dev_print(mess)         Serial.print(mess)
     #define dev_println(mess)       Serial.println(mess)
     #define dev_printf(mess, ...)   Serial.printf(mess, ##__VA_ARGS__)
-    #define dev_file(mess)          {                                           \
-                                        File f = SD.open("debug.log", "a+");    \
-                                        f.seek(f.size());                       \
-                                        const char separator[] = "[LOG]: ";     \
-                                        f.write(separator, sizeof(separator));  \
-                                        f.write(mess, strlen(mess));            \
-                                        f.close();                              \
-                                    }                                           
+    #define dev_file(mess)          Diagnostics::sdlog_printf(Diagnostics::SDLOG_DEBUG, "[LOG]: %s\n", mess)
 #else
     #define dev_print(mess)
     #define dev_println(mess)
@@ -45,47 +38,6 @@ extern "C"
 
 #define generateIV(buffer, length) esp_fill_random((uint8_t *) buffer, length)
 
-/**
- * @brief substring from a c-string
- * @credit https://www.programmingsimplified.com/c/source-code/c-substring
- * 
- * @param s source
- * @param sub target
- * @param p offset index
- * @param l number of characters to copy
- */
-static void substr(const char s[], char sub[], int p, int l) {
-   int c = 0;
-   
-   while (c < l) {
-      sub[c] = s[p+c-1];
-      c++;
-   }
-   sub[c] = '\0';
-}
-
-static size_t nextSubString(const char *buffer, size_t offset, size_t buffer_length, char *command, size_t command_length)
-{
-    auto isEnd = [](char c) { return c == ' ' || c == '\r' || c == '\n' || c == '\0'; };
-
-    while (isEnd(buffer[offset]) && offset < buffer_length) offset++;
-
-    // find terminating char
-    size_t endIdx = 0;
-    for (size_t i = offset + 1; i < buffer_length && i - offset < command_length - 1; ++i) {
-        if (isEnd(buffer[i])) {
-            endIdx = i;
-            break;
-        }
-    }
-    
-    if (!endIdx) return 0;
-
-    substr(buffer, command, offset, endIdx - offset);
-
-    return endIdx;
-}
-
 static void utilsPrint(const char *buffer, Stream &stream = Serial)
 {
     stream.print(buffer);
@@ -1,5 +1,6 @@
 #include "WiFiController.h"
 #include <FreeRTOS.h>
+#include "../driver/console.hpp"
 
 _WiFiController::_WiFiController()
 {
@@ -35,22 +36,22 @@ bool _WiFiController::begin()
 
 bool _WiFiController::addConnection(WiFiConnection *newConnection) {
 
-    Serial.println("Take!");
+    Driver::console.println("Take!");
     xSemaphoreTake(mutexConnections, portMAX_DELAY);
-    Serial.println("Got it!");
+    Driver::console.println("Got it!");
 
     for (WiFiConnection *&connection : WiFiController.connections) {
 
         if (!connection) {
             connection = newConnection;
             xSemaphoreGive(mutexConnections);
-            Serial.println("Done!");
+            Driver::console.println("Done!");
             return true;
         }
     }
 
     xSemaphoreGive(mutexConnections);
-    Serial.println("Done!");
+    Driver::console.println("Done!");
     
     return false;
 }
@@ -112,13 +113,13 @@ void _WiFiController::enableWiFiSleep(bool state)
 
 void _WiFiController::keepWiFiAliveTask(void *)
 {
-    Serial.println("Wifi Here");
+    Driver::console.println("Wifi Here");
     while (true) {
 
         xSemaphoreTake(WiFiController.binSemaphoreWiFiAlive, portMAX_DELAY);
-        Serial.println("LOOP WIFI");
+        Driver::console.println("LOOP WIFI");
         if (WiFi.status() == WL_CONNECTED) {
-            Serial.println("WiFi is connected! Nothing to do...");
+            Driver::console.println("WiFi is connected! Nothing to do...");
             const static int nextCheckTimeMS = 3 * 60 * 1000;
             delay(nextCheckTimeMS);
             continue;
@@ -133,17 +134,17 @@ void _WiFiController::keepWiFiAliveTask(void *)
         for (uint16_t i = 0; i < numAailableNetworks; ++i) {
             
             String ssid = WiFi.SSID(i);
-            Serial.printf("SSID check: %s\n", ssid.c_str());
+            Driver::console.printf("SSID check: %s\n", ssid.c_str());
             bool connectionEstablished = false;
-            Serial.println("Over here 1");
+            Driver::console.println("Over here 1");
             xSemaphoreTake(WiFiController.mutexConnections, portMAX_DELAY);
             for (WiFiConnection *&connection : WiFiController.connections) {
                 if (!connection || !connection->active) continue;      // if null, then there is no wifi connection
 
-                Serial.printf("This connection attempt is valid. The ssid is %s\n", connection->ssid);
+                Driver::console.printf("This connection attempt is valid. The ssid is %s\n", connection->ssid);
                 if (!strcmp(connection->ssid, ssid.c_str())) {
                     // found ssis matches in possible connections
-                    Serial.println("SSID FOUND!");
+                    Driver::console.println("SSID FOUND!");
                     
                     connection->connect();
 
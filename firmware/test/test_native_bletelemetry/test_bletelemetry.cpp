@@ -0,0 +1,150 @@
+#include <unity.h>
+#include <string.h>
+#include <vector>
+#include "driver/bletelemetry.hpp"
+
+using namespace Driver;
+
+// samples count up so the records can be told apart
+static uint32_t samples;
+
+static void sample(void *, BleTelemetryRecord_t &record)
+{
+    record.state = 2;
+    record.elapsed = ++samples;
+    record.rate = 300;
+    record.batteryMillivolts = 3900;
+    record.batterySOC = 80;
+}
+
+static std::vector<std::vector<uint8_t>> notified;
+
+static void notify(void *, const uint8_t *data, size_t length)
+{
+    notified.push_back(std::vector<uint8_t>(data, data + length));
+}
+
+static BleTelemetryHeader_t header(size_t index)
+{
+    BleTelemetryHeader_t value;
+    memcpy(&value, notified[index].data(), sizeof(value));
+    TEST_ASSERT_EQUAL(sizeof(value) + value.count * sizeof(BleTelemetryRecord_t), notified[index].size());
+    return value;
+}
+
+static BleTelemetryRecord_t record(size_t index, size_t n)
+{
+    BleTelemetryRecord_t value;
+    memcpy(&value, notified[index].data() + sizeof(BleTelemetryHeader_t) + n * sizeof(value), sizeof(value));
+    return value;
+}
+
+// polls the way the task does, sleeping until each sample is due
+static uint32_t run(BleTelemetry &telemetry, uint32_t from, uint32_t until)
+{
+    uint32_t polls = 0;
+    for (uint32_t now = from; now < until; ++polls) now += telemetry.poll(now);
+    return polls;
+}
+
+void setUp()
+{
+    samples = 0;
+    notified.clear();
+}
+
+void tearDown()
+{ }
+
+void testDefaultSendsOneRecordASecond()
+{
+    BleTelemetry telemetry(sample, notify);
+
+    TEST_ASSERT_EQUAL(BLETELEMETRY_DEFAULT_INTERVAL, telemetry.getInterval());
+    TEST_ASSERT_EQUAL(1, telemetry.recordsPerBatch());
+
+    run(telemetry, 0, 3000);
+    TEST_ASSERT_EQUAL(3, notified.size());
+    TEST_ASSERT_EQUAL(1, header(0).count);
+    TEST_ASSERT_EQUAL(20, notified[0].size());
+    TEST_ASSERT_EQUAL(3900, record(2, 0).batteryMillivolts);
+}
+
+void testBatchesFillTheMtuWithOneNotificationAnInterval()
+{
+    BleTelemetry telemetry(sample, notify);
+
+    // 10 a second is the most, whatever fits
+    TEST_ASSERT_TRUE(telemetry.configure(1000, 247));
+    TEST_ASSERT_EQUAL(10, telemetry.recordsPerBatch());
+    TEST_ASSERT_EQUAL(100, telemetry.samplePeriod());
+
+    uint32_t polls = run(telemetry, 0, 5000);
+    TEST_ASSERT_EQUAL(5, notified.size());
+    TEST_ASSERT_EQUAL(50, polls);
+    for (size_t i = 0; i < notified.size(); ++i) {
+        BleTelemetryHeader_t batch = header(i);
+        TEST_ASSERT_EQUAL(10, batch.count);
+        TEST_ASSERT_EQUAL(100, batch.period);
+        for (size_t n = 0; n < batch.count; ++n) TEST_ASSERT_EQUAL(i * 10 + n + 1, record(i, n).elapsed);
+    }
+
+    // a long interval samples less often rather than send more
+    TEST_ASSERT_TRUE(telemetry.configure(BLETELEMETRY_MAX_INTERVAL, 247));
+    size_t fit = (247 - 3 - sizeof(BleTelemetryHeader_t)) / sizeof(BleTelemetryRecord_t);
+    TEST_ASSERT_EQUAL(fit, telemetry.recordsPerBatch());
+    TEST_ASSERT_EQUAL(BLETELEMETRY_MAX_INTERVAL / fit, telemetry.samplePeriod());
+
+    notified.clear();
+    polls = run(telemetry, 5000, 5000 + 3 * BLETELEMETRY_MAX_INTERVAL);
+    TEST_ASSERT_EQUAL(3, notified.size());
+    TEST_ASSERT_TRUE(polls <= 3 * fit + 1);     // the period is rounded down
+    TEST_ASSERT_TRUE(notified[0].size() <= 247 - 3u);
+}
+
+void testBadConfigIsRefused()
+{
+    BleTelemetry telemetry(sample, notify);
+
+    TEST_ASSERT_FALSE(telemetry.configure(BLETELEMETRY_MIN_INTERVAL - 1, 247));
+    TEST_ASSERT_FALSE(telemetry.configure(BLETELEMETRY_MAX_INTERVAL + 1, 247));
+    TEST_ASSERT_FALSE(telemetry.configure(500, BLETELEMETRY_MIN_MTU - 1));
+    TEST_ASSERT_EQUAL(BLETELEMETRY_DEFAULT_INTERVAL, telemetry.getInterval());
+
+    // the largest MTU is bounded by the attribute size
+    TEST_ASSERT_TRUE(telemetry.configure(BLETELEMETRY_MAX_INTERVAL, 517));
+    TEST_ASSERT_EQUAL((BLETELEMETRY_MAX_PACKET - sizeof(BleTelemetryHeader_t)) / sizeof(BleTelemetryRecord_t),
+                      telemetry.recordsPerBatch());
+}
+
+void testLateTaskCarriesOnWithoutCatchingUp()
+{
+    BleTelemetry telemetry(sample, notify);
+    telemetry.configure(500, 247);
+
+    TEST_ASSERT_EQUAL(100, telemetry.poll(0));
+
+    // held up for a second, one sample then back on the period
+    TEST_ASSERT_EQUAL(100, telemetry.poll(1000));
+    TEST_ASSERT_EQUAL(2, samples);
+
+    uint32_t notifications, late;
+    telemetry.stats(notifications, late);
+    TEST_ASSERT_EQUAL(1, late);
+
+    // unsubscribing drops the partial batch
+    telemetry.reset();
+    run(telemetry, 5000, 5500);
+    TEST_ASSERT_EQUAL(1, notified.size());
+    TEST_ASSERT_EQUAL(3, record(0, 0).elapsed);
+}
+
+int main(int argc, char **argv)
+{
+    UNITY_BEGIN();
+    RUN_TEST(testDefaultSendsOneRecordASecond);
+    RUN_TEST(testBatchesFillTheMtuWithOneNotificationAnInterval);
+    RUN_TEST(testBadConfigIsRefused);
+    RUN_TEST(testLateTaskCarriesOnWithoutCatchingUp);
+    return UNITY_END();
+}
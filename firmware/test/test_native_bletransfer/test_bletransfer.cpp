@@ -0,0 +1,674 @@
+#include <unity.h>
+#include <string.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include "driver/bletransfer.hpp"
+
+using namespace Driver;
+
+// one file in memory, counting the writes and reads that reach it
+static std::vector<uint8_t> file;
+static bool fileOpen;
+static size_t fileWrites;
+static size_t fileReads;
+static bool failWrites;
+static bool failReads;
+static bool filesBusy;             // USB-C has a file open
+
+static bool fakeOpen(void *, UsbFileSystemId_t, const char *path, UsbFileMode_t mode, uint32_t &size)
+{
+    if (filesBusy) return false;
+    if (strcmp(path, "/upload.bin")) return false;
+    if (mode == USBFILE_WRITE) file.clear();
+    fileOpen = true;
+    size = file.size();
+    return true;
+}
+
+static size_t fakeRead(void *, uint32_t offset, uint8_t *data, size_t length)
+{
+    if (failReads || !fileOpen || offset >= file.size()) return 0;
+    ++fileReads;
+    if (length > file.size() - offset) length = file.size() - offset;
+    memcpy(data, file.data() + offset, length);
+    return length;
+}
+
+static size_t fakeWrite(void *, const uint8_t *data, size_t length)
+{
+    if (failWrites) return 0;
+    ++fileWrites;
+    file.insert(file.end(), data, data + length);
+    return length;
+}
+
+static void fakeClose(void *) { fileOpen = false; }
+
+// /logs holds run0.csv to run9.csv and a directory
+static int fakeEntry(void *, UsbFileSystemId_t, const char *path, uint16_t index, char *name, uint32_t &size, bool &directory)
+{
+    if (strcmp(path, "/logs")) return -1;
+    if (index > 10) return 0;
+    if (index == 10) strcpy(name, "archive");
+    else sprintf(name, "run%u.csv", index);
+    size = index == 10 ? 0 : 1000 * index;
+    directory = index == 10;
+    return 1;
+}
+
+static bool fakeStat(void *, UsbFileSystemId_t, const char *path, uint32_t &size, bool &directory)
+{
+    directory = !strcmp(path, "/logs");
+    if (!directory && strcmp(path, "/upload.bin")) return false;
+    size = directory ? 0 : file.size();
+    return true;
+}
+
+static bool fakeBusy(void *) { return filesBusy; }
+
+static const UsbFileSystem_t files = { nullptr, fakeOpen, fakeRead, fakeWrite, fakeClose, fakeEntry, fakeStat, fakeBusy };
+
+// the update partition
+static std::vector<uint8_t> image;
+static BleTransferStatus_t imageBegin;
+static bool imageWriting;
+static bool imageBooted;
+static bool imageAborted;
+static uint8_t imageDigest[BLETRANSFER_DIGEST_SIZE];
+
+static BleTransferStatus_t fakeBegin(void *)
+{
+    image.clear();
+    imageWriting = imageBegin == BLETRANSFER_OK;
+    return imageBegin;
+}
+
+static bool fakeImageWrite(void *, const uint8_t *data, size_t length)
+{
+    image.insert(image.end(), data, data + length);
+    return true;
+}
+
+static bool fakeEnd(void *, const uint8_t *digest)
+{
+    imageWriting = false;
+    imageBooted = !memcmp(digest, imageDigest, sizeof(imageDigest));
+    return imageBooted;
+}
+
+static void fakeAbort(void *)
+{
+    imageWriting = false;
+    imageAborted = true;
+}
+
+static const BleTransferFirmware_t firmware = { nullptr, fakeBegin, fakeImageWrite, fakeEnd, fakeAbort };
+
+// notifications to the phone
+static std::vector<std::vector<uint8_t>> notified;
+
+static void notify(void *, const uint8_t *data, size_t length)
+{
+    notified.push_back(std::vector<uint8_t>(data, data + length));
+}
+
+static std::vector<uint8_t> payload;
+
+static void openUpload(BleTransfer &transfer, UsbFileMode_t mode, uint16_t mtu)
+{
+    std::vector<uint8_t> packet = { BLETRANSFER_OPEN, USBFILE_SD, mode, (uint8_t) mtu, (uint8_t) (mtu >> 8) };
+    const char *path = "/upload.bin";
+    packet.insert(packet.end(), path, path + strlen(path));
+    transfer.receive(packet.data(), packet.size(), 0);
+}
+
+static void sendData(BleTransfer &transfer, uint16_t sequence, size_t offset, size_t length, uint32_t now=0)
+{
+    std::vector<uint8_t> packet = { BLETRANSFER_DATA, (uint8_t) sequence, (uint8_t) (sequence >> 8) };
+    packet.insert(packet.end(), payload.begin() + offset, payload.begin() + offset + length);
+    transfer.receive(packet.data(), packet.size(), now);
+}
+
+static void openFirmware(BleTransfer &transfer)
+{
+    const uint8_t packet[] = { BLETRANSFER_OPEN, BLETRANSFER_FIRMWARE, USBFILE_WRITE, 247, 0 };
+    transfer.receive(packet, sizeof(packet), 0);
+}
+
+static void sendClose(BleTransfer &transfer, uint32_t length, uint32_t crc, uint32_t now, const uint8_t *digest=nullptr)
+{
+    uint8_t packet[1 + 2 * sizeof(uint32_t) + BLETRANSFER_DIGEST_SIZE] = { BLETRANSFER_CLOSE };
+    memcpy(packet + 1, &length, sizeof(length));
+    memcpy(packet + 1 + sizeof(length), &crc, sizeof(crc));
+    if (digest) memcpy(packet + 1 + 2 * sizeof(uint32_t), digest, BLETRANSFER_DIGEST_SIZE);
+    transfer.receive(packet, sizeof(packet) - (digest ? 0 : BLETRANSFER_DIGEST_SIZE), now);
+}
+
+static void openDownload(BleTransfer &transfer, uint16_t mtu, uint32_t offset, const char *path="/upload.bin")
+{
+    std::vector<uint8_t> packet = { BLETRANSFER_READ, USBFILE_SD, (uint8_t) mtu, (uint8_t) (mtu >> 8) };
+    packet.insert(packet.end(), (const uint8_t *) &offset, (const uint8_t *) &offset + sizeof(offset));
+    packet.insert(packet.end(), path, path + strlen(path));
+    transfer.receive(packet.data(), packet.size(), 0);
+}
+
+static void sendReadAck(BleTransfer &transfer, uint16_t next, uint8_t flags=0)
+{
+    const uint8_t packet[] = { BLETRANSFER_READ_ACK, flags, (uint8_t) next, (uint8_t) (next >> 8) };
+    transfer.receive(packet, sizeof(packet), 0);
+}
+
+// takes the chunks notified since the last call, in order from sequence
+static size_t takeChunks(std::vector<uint8_t> &received, uint16_t sequence)
+{
+    size_t chunks = 0;
+    for (const std::vector<uint8_t> &packet : notified) {
+        if (packet[0] != BLETRANSFER_CHUNK) continue;
+        TEST_ASSERT_EQUAL(sequence, packet[1] | packet[2] << 8);
+        received.insert(received.end(), packet.begin() + BLETRANSFER_DATA_HEADER, packet.end());
+        ++sequence;
+        ++chunks;
+    }
+    notified.clear();
+    return chunks;
+}
+
+template <typename T>
+static T lastNotified(uint8_t op)
+{
+    T value;
+    TEST_ASSERT_FALSE(notified.empty());
+    TEST_ASSERT_EQUAL(op, notified.back()[0]);
+    TEST_ASSERT_EQUAL(1 + sizeof(T), notified.back().size());
+    memcpy(&value, notified.back().data() + 1, sizeof(value));
+    return value;
+}
+
+void setUp()
+{
+    file.clear();
+    fileOpen = false;
+    fileWrites = 0;
+    fileReads = 0;
+    failWrites = false;
+    failReads = false;
+    filesBusy = false;
+    notified.clear();
+    payload.clear();
+    for (size_t i = 0; i < 20000; ++i) payload.push_back(i * 7 + (i >> 8));
+
+    image.clear();
+    imageBegin = BLETRANSFER_OK;
+    imageWriting = false;
+    imageBooted = false;
+    imageAborted = false;
+    for (size_t i = 0; i < sizeof(imageDigest); ++i) imageDigest[i] = i * 3;
+}
+
+void tearDown()
+{ }
+
+void testOpenSizesPacketsToTheMtu()
+{
+    BleTransfer transfer(files, notify);
+
+    openUpload(transfer, USBFILE_WRITE, 247);
+    BleTransferOpened_t opened = lastNotified<BleTransferOpened_t>(BLETRANSFER_OPENED);
+    TEST_ASSERT_EQUAL(BLETRANSFER_OK, opened.status);
+    TEST_ASSERT_EQUAL(247 - 3 - BLETRANSFER_DATA_HEADER, opened.dataSize);
+    TEST_ASSERT_EQUAL(BLETRANSFER_ACK_EVERY, opened.ackEvery);
+    TEST_ASSERT_TRUE(fileOpen);
+
+    // an attribute value stops at 512 bytes whatever the MTU
+    openUpload(transfer, USBFILE_WRITE, BLETRANSFER_MAX_MTU);
+    opened = lastNotified<BleTransferOpened_t>(BLETRANSFER_OPENED);
+    TEST_ASSERT_EQUAL(BLETRANSFER_MAX_DATA, opened.dataSize);
+}
+
+void testStreamedUploadIsAckedAndCheckedOnClose()
+{
+    BleTransfer transfer(files, notify);
+    const size_t chunk = BLETRANSFER_MAX_DATA;
+
+    openUpload(transfer, USBFILE_WRITE, BLETRANSFER_MAX_MTU);
+    notified.clear();
+
+    uint16_t sequence = 0;
+    size_t offset = 0;
+    for (; offset + chunk <= payload.size(); offset += chunk) sendData(transfer, sequence++, offset, chunk);
+    sendData(transfer, sequence++, offset, payload.size() - offset);
+
+    // one cumulative ack per BLETRANSFER_ACK_EVERY packets, none for the rest
+    TEST_ASSERT_EQUAL(sequence / BLETRANSFER_ACK_EVERY, notified.size());
+    BleTransferAck_t ack = lastNotified<BleTransferAck_t>(BLETRANSFER_ACK);
+    TEST_ASSERT_EQUAL(BLETRANSFER_OK, ack.status);
+    TEST_ASSERT_EQUAL(sequence - sequence % BLETRANSFER_ACK_EVERY, ack.next);
+
+    // gathered into buffer sized writes, the file held open throughout
+    TEST_ASSERT_EQUAL(payload.size() / BLETRANSFER_WRITE_BUFFER, fileWrites);
+    TEST_ASSERT_TRUE(fileOpen);
+
+    sendClose(transfer, payload.size(), usbfile_crc32(payload.data(), payload.size()), 400);
+    BleTransferClosed_t closed = lastNotified<BleTransferClosed_t>(BLETRANSFER_CLOSED);
+    TEST_ASSERT_EQUAL(BLETRANSFER_OK, closed.status);
+    TEST_ASSERT_EQUAL(sequence, closed.ack.next);
+    TEST_ASSERT_EQUAL(400, closed.elapsed);
+    TEST_ASSERT_FALSE(fileOpen);
+    TEST_ASSERT_EQUAL(payload.size(), file.size());
+    TEST_ASSERT_EQUAL_MEMORY(payload.data(), file.data(), payload.size());
+
+    TEST_ASSERT_EQUAL(payload.size() * 1000 / 400, transfer.lastRate());
+}
+
+void testGapIsReportedOnceAndResentFromThere()
+{
+    BleTransfer transfer(files, notify);
+    const size_t chunk = 100;
+
+    openUpload(transfer, USBFILE_WRITE, BLETRANSFER_MAX_MTU);
+    notified.clear();
+
+    // packet 2 is lost, 3 and 4 arrive
+    sendData(transfer, 0, 0, chunk);
+    sendData(transfer, 1, chunk, chunk);
+    sendData(transfer, 3, 3 * chunk, chunk);
+    sendData(transfer, 4, 4 * chunk, chunk);
+
+    TEST_ASSERT_EQUAL(1, notified.size());
+    BleTransferAck_t ack = lastNotified<BleTransferAck_t>(BLETRANSFER_ACK);
+    TEST_ASSERT_EQUAL(BLETRANSFER_ACK_GAP, ack.flags);
+    TEST_ASSERT_EQUAL(2, ack.next);
+    TEST_ASSERT_EQUAL(2 * chunk, ack.received);
+
+    // the phone goes back to 2; a straggler from before the go-back is ignored
+    sendData(transfer, 2, 2 * chunk, chunk);
+    sendData(transfer, 1, chunk, chunk);
+    sendData(transfer, 3, 3 * chunk, chunk);
+    sendData(transfer, 4, 4 * chunk, chunk);
+
+    // closing early says where to carry on from, and keeps the file open
+    sendClose(transfer, 6 * chunk, 0, 0);
+    BleTransferClosed_t closed = lastNotified<BleTransferClosed_t>(BLETRANSFER_CLOSED);
+    TEST_ASSERT_EQUAL(BLETRANSFER_SHORT, closed.status);
+    TEST_ASSERT_EQUAL(5, closed.ack.next);
+    TEST_ASSERT_TRUE(fileOpen);
+
+    sendData(transfer, 5, 5 * chunk, chunk);
+    sendClose(transfer, 6 * chunk, usbfile_crc32(payload.data(), 6 * chunk), 0);
+    closed = lastNotified<BleTransferClosed_t>(BLETRANSFER_CLOSED);
+    TEST_ASSERT_EQUAL(BLETRANSFER_OK, closed.status);
+    TEST_ASSERT_EQUAL(6 * chunk, file.size());
+    TEST_ASSERT_EQUAL_MEMORY(payload.data(), file.data(), 6 * chunk);
+
+    uint32_t lastBytes, lastElapsed, totalBytes, gaps;
+    transfer.stats(lastBytes, lastElapsed, totalBytes, gaps);
+    TEST_ASSERT_EQUAL(1, gaps);
+}
+
+void testCrcMismatchAndWriteFailureAreReported()
+{
+    BleTransfer transfer(files, notify);
+
+    openUpload(transfer, USBFILE_WRITE, 185);
+    sendData(transfer, 0, 0, 50);
+    sendClose(transfer, 50, 0x12345678, 0);
+    TEST_ASSERT_EQUAL(BLETRANSFER_CRC, lastNotified<BleTransferClosed_t>(BLETRANSFER_CLOSED).status);
+    TEST_ASSERT_FALSE(fileOpen);
+    TEST_ASSERT_EQUAL(0, transfer.lastRate());
+
+    failWrites = true;
+    openUpload(transfer, USBFILE_WRITE, 185);
+    sendData(transfer, 0, 0, 50);
+    const uint8_t sync = BLETRANSFER_SYNC;
+    transfer.receive(&sync, 1, 0);
+    TEST_ASSERT_EQUAL(BLETRANSFER_IO, lastNotified<BleTransferAck_t>(BLETRANSFER_ACK).status);
+
+    sendClose(transfer, 50, usbfile_crc32(payload.data(), 50), 0);
+    TEST_ASSERT_EQUAL(BLETRANSFER_IO, lastNotified<BleTransferClosed_t>(BLETRANSFER_CLOSED).status);
+}
+
+void testWriteFailureDropsTheWindowInFlight()
+{
+    BleTransfer transfer(files, notify);
+    const size_t chunk = BLETRANSFER_MAX_DATA;
+
+    failWrites = true;
+    openUpload(transfer, USBFILE_WRITE, BLETRANSFER_MAX_MTU);
+    notified.clear();
+
+    // more than two write buffers arrive after the first write has failed
+    size_t offset = 0;
+    uint16_t sequence = 0;
+    for (; offset + chunk <= 2 * BLETRANSFER_WRITE_BUFFER + chunk; offset += chunk) sendData(transfer, sequence++, offset, chunk);
+
+    TEST_ASSERT_EQUAL(BLETRANSFER_IO, lastNotified<BleTransferAck_t>(BLETRANSFER_ACK).status);
+    TEST_ASSERT_EQUAL(0, fileWrites);
+    TEST_ASSERT_TRUE(offset > 2 * BLETRANSFER_WRITE_BUFFER);
+
+    sendClose(transfer, offset, usbfile_crc32(payload.data(), offset), 0);
+    TEST_ASSERT_EQUAL(BLETRANSFER_IO, lastNotified<BleTransferClosed_t>(BLETRANSFER_CLOSED).status);
+    TEST_ASSERT_FALSE(transfer.active());
+}
+
+void testIdleUploadIsClosedWithItsData()
+{
+    BleTransfer transfer(files, notify);
+
+    openUpload(transfer, USBFILE_WRITE, 185);
+    sendData(transfer, 0, 0, 60, 1000);
+
+    transfer.poll(1000 + BLETRANSFER_IDLE_TIMEOUT - 1);
+    TEST_ASSERT_TRUE(transfer.active());
+
+    transfer.poll(1000 + BLETRANSFER_IDLE_TIMEOUT);
+    TEST_ASSERT_FALSE(transfer.active());
+    TEST_ASSERT_FALSE(fileOpen);
+    TEST_ASSERT_EQUAL(60, file.size());
+}
+
+void testBadOpenIsRefused()
+{
+    BleTransfer transfer(files, notify);
+
+    openUpload(transfer, USBFILE_READ, 185);
+    TEST_ASSERT_EQUAL(BLETRANSFER_BAD_PACKET, lastNotified<BleTransferOpened_t>(BLETRANSFER_OPENED).status);
+
+    std::vector<uint8_t> packet = { BLETRANSFER_OPEN, USBFILE_SD, USBFILE_WRITE, 185, 0 };
+    const char *path = "/missing/file.bin";
+    packet.insert(packet.end(), path, path + strlen(path));
+    transfer.receive(packet.data(), packet.size(), 0);
+    TEST_ASSERT_EQUAL(BLETRANSFER_IO, lastNotified<BleTransferOpened_t>(BLETRANSFER_OPENED).status);
+    TEST_ASSERT_FALSE(transfer.active());
+
+    // data with nothing open goes nowhere
+    sendData(transfer, 0, 0, 10);
+    TEST_ASSERT_EQUAL(0, fileWrites);
+
+    // USB-C holding the file system
+    filesBusy = true;
+    openUpload(transfer, USBFILE_WRITE, 185);
+    TEST_ASSERT_EQUAL(BLETRANSFER_BUSY, lastNotified<BleTransferOpened_t>(BLETRANSFER_OPENED).status);
+    TEST_ASSERT_FALSE(transfer.active());
+}
+
+void testFirmwareIsStreamedAndBootedOnceVerified()
+{
+    BleTransfer transfer(files, notify);
+    const size_t chunk = 247 - 3 - BLETRANSFER_DATA_HEADER;
+
+    // refused until the firmware side is given
+    openFirmware(transfer);
+    TEST_ASSERT_EQUAL(BLETRANSFER_BAD_PACKET, lastNotified<BleTransferOpened_t>(BLETRANSFER_OPENED).status);
+
+    transfer.setFirmware(&firmware);
+    openFirmware(transfer);
+    TEST_ASSERT_EQUAL(BLETRANSFER_OK, lastNotified<BleTransferOpened_t>(BLETRANSFER_OPENED).status);
+    TEST_ASSERT_TRUE(imageWriting);
+    TEST_ASSERT_FALSE(fileOpen);
+
+    uint16_t sequence = 0;
+    for (size_t offset = 0; offset < payload.size(); offset += chunk) {
+        sendData(transfer, sequence++, offset, offset + chunk < payload.size() ? chunk : payload.size() - offset);
+    }
+    uint32_t crc = usbfile_crc32(payload.data(), payload.size());
+
+    // a file close without the digest isn't enough
+    sendClose(transfer, payload.size(), crc, 0);
+    TEST_ASSERT_EQUAL(BLETRANSFER_BAD_PACKET, lastNotified<BleTransferClosed_t>(BLETRANSFER_CLOSED).status);
+    TEST_ASSERT_TRUE(transfer.active());
+
+    sendClose(transfer, payload.size(), crc, 0, imageDigest);
+    TEST_ASSERT_EQUAL(BLETRANSFER_OK, lastNotified<BleTransferClosed_t>(BLETRANSFER_CLOSED).status);
+    TEST_ASSERT_TRUE(imageBooted);
+    TEST_ASSERT_FALSE(imageAborted);
+    TEST_ASSERT_FALSE(transfer.active());
+    TEST_ASSERT_EQUAL(payload.size(), image.size());
+    TEST_ASSERT_EQUAL_MEMORY(payload.data(), image.data(), payload.size());
+}
+
+void testFirmwareNotVerifiedIsThrownAway()
+{
+    BleTransfer transfer(files, notify);
+    transfer.setFirmware(&firmware);
+
+    uint8_t wrongDigest[BLETRANSFER_DIGEST_SIZE] = { 0 };
+    openFirmware(transfer);
+    sendData(transfer, 0, 0, 100);
+    sendClose(transfer, 100, usbfile_crc32(payload.data(), 100), 0, wrongDigest);
+    TEST_ASSERT_EQUAL(BLETRANSFER_VERIFY, lastNotified<BleTransferClosed_t>(BLETRANSFER_CLOSED).status);
+    TEST_ASSERT_FALSE(imageBooted);
+    TEST_ASSERT_FALSE(transfer.active());
+
+    // a CRC mismatch never gets as far as the image checks
+    openFirmware(transfer);
+    sendData(transfer, 0, 0, 100);
+    sendClose(transfer, 100, 0, 0, imageDigest);
+    TEST_ASSERT_EQUAL(BLETRANSFER_CRC, lastNotified<BleTransferClosed_t>(BLETRANSFER_CLOSED).status);
+    TEST_ASSERT_TRUE(imageAborted);
+    TEST_ASSERT_FALSE(imageBooted);
+
+    // nor does an image the phone stopped sending
+    imageAborted = false;
+    openFirmware(transfer);
+    sendData(transfer, 0, 0, 100);
+    transfer.poll(BLETRANSFER_IDLE_TIMEOUT);
+    TEST_ASSERT_TRUE(imageAborted);
+    TEST_ASSERT_FALSE(transfer.active());
+}
+
+void testFirmwareOpenPassesOnRestart()
+{
+    BleTransfer transfer(files, notify);
+    transfer.setFirmware(&firmware);
+
+    imageBegin = BLETRANSFER_RESTARTING;
+    openFirmware(transfer);
+    TEST_ASSERT_EQUAL(BLETRANSFER_RESTARTING, lastNotified<BleTransferOpened_t>(BLETRANSFER_OPENED).status);
+    TEST_ASSERT_FALSE(transfer.active());
+}
+
+void testDownloadIsWindowedAndCheckedOnClose()
+{
+    BleTransfer transfer(files, notify);
+    file = payload;
+
+    openDownload(transfer, 247, 0);
+    BleTransferOpened_t opened = lastNotified<BleTransferOpened_t>(BLETRANSFER_OPENED);
+    TEST_ASSERT_EQUAL(BLETRANSFER_OK, opened.status);
+    TEST_ASSERT_EQUAL(payload.size(), opened.size);
+    TEST_ASSERT_EQUAL(247 - 3 - BLETRANSFER_DATA_HEADER, opened.dataSize);
+    TEST_ASSERT_EQUAL(BLETRANSFER_READ_WINDOW, opened.window);
+    notified.clear();
+
+    // no more than a window goes out ahead of the acks
+    std::vector<uint8_t> received;
+    uint16_t sequence = 0;
+    transfer.poll(0);
+    TEST_ASSERT_EQUAL(BLETRANSFER_READ_WINDOW, takeChunks(received, sequence));
+    sequence += BLETRANSFER_READ_WINDOW;
+    transfer.poll(0);
+    TEST_ASSERT_EQUAL(0, takeChunks(received, sequence));
+
+    while (transfer.sending() || received.size() < payload.size()) {
+        sendReadAck(transfer, sequence);
+        transfer.poll(0);
+        size_t chunks = takeChunks(received, sequence);
+        TEST_ASSERT_TRUE(chunks > 0);
+        sequence += chunks;
+    }
+    TEST_ASSERT_EQUAL(payload.size(), received.size());
+    TEST_ASSERT_EQUAL_MEMORY(payload.data(), received.data(), payload.size());
+
+    // read in whole pieces, not a card read per chunk
+    TEST_ASSERT_EQUAL((payload.size() + USBFILE_CHUNK_SIZE - 1) / USBFILE_CHUNK_SIZE, fileReads);
+
+    sendClose(transfer, payload.size(), usbfile_crc32(payload.data(), payload.size()), 300);
+    BleTransferClosed_t closed = lastNotified<BleTransferClosed_t>(BLETRANSFER_CLOSED);
+    TEST_ASSERT_EQUAL(BLETRANSFER_OK, closed.status);
+    TEST_ASSERT_EQUAL(300, closed.elapsed);
+    TEST_ASSERT_FALSE(transfer.active());
+    TEST_ASSERT_FALSE(fileOpen);
+}
+
+void testDownloadGapIsResentAndResumeStartsAtTheOffset()
+{
+    BleTransfer transfer(files, notify);
+    const uint32_t offset = 5000;
+    file = payload;
+
+    openDownload(transfer, BLETRANSFER_MAX_MTU, offset);
+    TEST_ASSERT_EQUAL(BLETRANSFER_OK, lastNotified<BleTransferOpened_t>(BLETRANSFER_OPENED).status);
+    notified.clear();
+
+    // chunk 2 never reached the phone
+    std::vector<uint8_t> received;
+    transfer.poll(0);
+    TEST_ASSERT_EQUAL(BLETRANSFER_READ_WINDOW, notified.size());
+    for (size_t i = 0; i < 2; ++i) {
+        received.insert(received.end(), notified[i].begin() + BLETRANSFER_DATA_HEADER, notified[i].end());
+    }
+    notified.clear();
+
+    sendReadAck(transfer, 2, BLETRANSFER_ACK_GAP);
+    transfer.poll(0);
+    uint16_t sequence = 2;
+    sequence += takeChunks(received, sequence);
+
+    while (transfer.sending() || received.size() < payload.size() - offset) {
+        sendReadAck(transfer, sequence);
+        transfer.poll(0);
+        sequence += takeChunks(received, sequence);
+    }
+    TEST_ASSERT_EQUAL(payload.size() - offset, received.size());
+    TEST_ASSERT_EQUAL_MEMORY(payload.data() + offset, received.data(), received.size());
+
+    uint32_t bytesSent, chunksResent;
+    transfer.readStats(bytesSent, chunksResent);
+    TEST_ASSERT_EQUAL(payload.size() - offset, bytesSent);
+    TEST_ASSERT_EQUAL(BLETRANSFER_READ_WINDOW - 2, chunksResent);
+
+    sendClose(transfer, received.size(), usbfile_crc32(received.data(), received.size()), 0);
+    TEST_ASSERT_EQUAL(BLETRANSFER_OK, lastNotified<BleTransferClosed_t>(BLETRANSFER_CLOSED).status);
+}
+
+void testDownloadFailuresAreReported()
+{
+    BleTransfer transfer(files, notify);
+    file = payload;
+
+    openDownload(transfer, 185, 0, "/missing.bin");
+    TEST_ASSERT_EQUAL(BLETRANSFER_NOT_FOUND, lastNotified<BleTransferOpened_t>(BLETRANSFER_OPENED).status);
+
+    filesBusy = true;
+    openDownload(transfer, 185, 0);
+    TEST_ASSERT_EQUAL(BLETRANSFER_BUSY, lastNotified<BleTransferOpened_t>(BLETRANSFER_OPENED).status);
+    filesBusy = false;
+
+    openDownload(transfer, 185, payload.size() + 1);
+    TEST_ASSERT_EQUAL(BLETRANSFER_BAD_PACKET, lastNotified<BleTransferOpened_t>(BLETRANSFER_OPENED).status);
+    TEST_ASSERT_FALSE(fileOpen);
+
+    // closing before the end
+    openDownload(transfer, 185, 0);
+    transfer.poll(0);
+    sendClose(transfer, 100, 0, 0);
+    TEST_ASSERT_EQUAL(BLETRANSFER_SHORT, lastNotified<BleTransferClosed_t>(BLETRANSFER_CLOSED).status);
+    TEST_ASSERT_FALSE(transfer.active());
+
+    // the card failing ends the download
+    openDownload(transfer, 185, 0);
+    failReads = true;
+    transfer.poll(0);
+    TEST_ASSERT_EQUAL(BLETRANSFER_IO, lastNotified<BleTransferClosed_t>(BLETRANSFER_CLOSED).status);
+    TEST_ASSERT_FALSE(transfer.active());
+    TEST_ASSERT_FALSE(fileOpen);
+
+    // and so does the phone going quiet
+    failReads = false;
+    openDownload(transfer, 185, 0);
+    transfer.poll(BLETRANSFER_IDLE_TIMEOUT);
+    TEST_ASSERT_FALSE(transfer.active());
+}
+
+void testListIsPagedToTheMtu()
+{
+    BleTransfer transfer(files, notify);
+    const uint16_t mtu = BLETRANSFER_MIN_LIST_MTU;
+    std::vector<std::string> names;
+
+    for (uint16_t first = 0; ; ) {
+        std::vector<uint8_t> packet = { BLETRANSFER_LIST, USBFILE_SD, (uint8_t) mtu, (uint8_t) (mtu >> 8),
+                                        (uint8_t) first, (uint8_t) (first >> 8) };
+        const char *path = "/logs";
+        packet.insert(packet.end(), path, path + strlen(path));
+        transfer.receive(packet.data(), packet.size(), 0);
+
+        const std::vector<uint8_t> &reply = notified.back();
+        TEST_ASSERT_EQUAL(BLETRANSFER_LISTED, reply[0]);
+        TEST_ASSERT_EQUAL(BLETRANSFER_OK, reply[1]);
+        TEST_ASSERT_TRUE(reply.size() <= mtu - 3u);
+        if (reply.size() == 2) break;
+
+        for (size_t used = 2; used < reply.size(); ++first) {
+            UsbFileEntry_t entry;
+            memcpy(&entry, reply.data() + used, sizeof(entry));
+            names.push_back(std::string((const char *) reply.data() + used + sizeof(entry), entry.nameLength));
+            used += sizeof(entry) + entry.nameLength;
+        }
+    }
+
+    TEST_ASSERT_EQUAL(11, names.size());
+    TEST_ASSERT_EQUAL_STRING("run0.csv", names[0].c_str());
+    TEST_ASSERT_EQUAL_STRING("archive", names[10].c_str());
+
+    // too small an MTU to be sure of fitting a name
+    const uint8_t small[] = { BLETRANSFER_LIST, USBFILE_SD, 23, 0, 0, 0, '/' };
+    transfer.receive(small, sizeof(small), 0);
+    TEST_ASSERT_EQUAL(BLETRANSFER_BAD_PACKET, notified.back()[1]);
+}
+
+void testStatDoesNotDisturbATransfer()
+{
+    BleTransfer transfer(files, notify);
+    file = payload;
+
+    openUpload(transfer, USBFILE_APPEND, 185);
+    const char *paths[] = { "/upload.bin", "/logs", "/missing.bin" };
+    const BleTransferStatus_t statuses[] = { BLETRANSFER_OK, BLETRANSFER_OK, BLETRANSFER_NOT_FOUND };
+
+    for (size_t i = 0; i < 3; ++i) {
+        std::vector<uint8_t> packet = { BLETRANSFER_STAT, USBFILE_SD };
+        packet.insert(packet.end(), paths[i], paths[i] + strlen(paths[i]));
+        transfer.receive(packet.data(), packet.size(), 0);
+
+        BleTransferStat_t stat = lastNotified<BleTransferStat_t>(BLETRANSFER_STATED);
+        TEST_ASSERT_EQUAL(statuses[i], stat.status);
+        if (i == 0) TEST_ASSERT_EQUAL(payload.size(), stat.size);
+        TEST_ASSERT_EQUAL(i == 1 ? USBFILE_DIRECTORY : 0, stat.flags);
+    }
+
+    TEST_ASSERT_TRUE(transfer.active());
+    TEST_ASSERT_TRUE(fileOpen);
+}
+
+int main(int argc, char **argv)
+{
+    UNITY_BEGIN();
+    RUN_TEST(testOpenSizesPacketsToTheMtu);
+    RUN_TEST(testStreamedUploadIsAckedAndCheckedOnClose);
+    RUN_TEST(testGapIsReportedOnceAndResentFromThere);
+    RUN_TEST(testCrcMismatchAndWriteFailureAreReported);
+    RUN_TEST(testWriteFailureDropsTheWindowInFlight);
+    RUN_TEST(testIdleUploadIsClosedWithItsData);
+    RUN_TEST(testBadOpenIsRefused);
+    RUN_TEST(testFirmwareIsStreamedAndBootedOnceVerified);
+    RUN_TEST(testFirmwareNotVerifiedIsThrownAway);
+    RUN_TEST(testFirmwareOpenPassesOnRestart);
+    RUN_TEST(testDownloadIsWindowedAndCheckedOnClose);
+    RUN_TEST(testDownloadGapIsResentAndResumeStartsAtTheOffset);
+    RUN_TEST(testDownloadFailuresAreReported);
+    RUN_TEST(testListIsPagedToTheMtu);
+    RUN_TEST(testStatDoesNotDisturbATransfer);
+    return UNITY_END();
+}
@@ -0,0 +1,208 @@
+#include <unity.h>
+#include <string.h>
+#include <vector>
+#include <string>
+#include "driver/collectorlink.hpp"
+#include "driver/micloneprotocol.hpp"
+
+using namespace Driver;
+
+/**
+ * Fake UART with the behaviour of the IDF driver that CollectorLink depends on:
+ * received bytes wait in a buffer, terminator positions are queued relative to
+ * the read position and shift as bytes are read, and writes land in a bounded
+ * transmit buffer
+ */
+struct FakeUart {
+    std::string rx;
+    std::vector<int> patterns;
+    std::string tx;
+    size_t txCapacity = 128;
+
+    void receive(const std::string &bytes)
+    {
+        for (char c : bytes) {
+            rx.push_back(c);
+            if (c == COLLECTOR_LINE_TERMINATOR) patterns.push_back(rx.size() - 1);
+        }
+    }
+
+    static int read(void *context, uint8_t *data, size_t length)
+    {
+        FakeUart &uart = *static_cast<FakeUart *>(context);
+        size_t count = std::min(length, uart.rx.size());
+        memcpy(data, uart.rx.data(), count);
+        uart.rx.erase(0, count);
+        for (int &position : uart.patterns) position -= count;
+        return count;
+    }
+
+    static int write(void *context, const uint8_t *data, size_t length)
+    {
+        FakeUart &uart = *static_cast<FakeUart *>(context);
+        size_t count = std::min(length, uart.txCapacity - uart.tx.size());
+        uart.tx.append(reinterpret_cast<const char *>(data), count);
+        return count;
+    }
+
+    static int popPattern(void *context)
+    {
+        FakeUart &uart = *static_cast<FakeUart *>(context);
+        if (uart.patterns.empty()) return -1;
+        int position = uart.patterns.front();
+        uart.patterns.erase(uart.patterns.begin());
+        return position;
+    }
+
+    static void flushInput(void *context)
+    {
+        FakeUart &uart = *static_cast<FakeUart *>(context);
+        uart.rx.clear();
+        uart.patterns.clear();
+    }
+
+    CollectorUartOps_t ops()
+    {
+        return { this, read, write, popPattern, flushInput };
+    }
+};
+
+static std::vector<std::string> frames;
+
+static void collectFrame(const char *frame, size_t length, void *)
+{
+    TEST_ASSERT_EQUAL(strlen(frame), length);
+    frames.push_back(std::string(frame, length));
+}
+
+void setUp()
+{
+    frames.clear();
+}
+
+void tearDown()
+{ }
+
+void testCRLFIsStripped()
+{
+    FakeUart uart;
+    CollectorLink link(uart.ops(), collectFrame);
+
+    uart.receive("/0`\x03\r\n");
+    link.handleEvent(COLLECTOR_UART_PATTERN);
+
+    TEST_ASSERT_EQUAL(1, frames.size());
+    TEST_ASSERT_EQUAL_STRING("/0`\x03", frames[0].c_str());
+}
+
+void testPartialLineWaitsForTerminator()
+{
+    FakeUart uart;
+    CollectorLink link(uart.ops(), collectFrame);
+
+    uart.receive("/0@12");
+    link.handleEvent(COLLECTOR_UART_DATA);
+    TEST_ASSERT_EQUAL(0, frames.size());
+
+    uart.receive("3\x03\r\n/0`");
+    link.handleEvent(COLLECTOR_UART_PATTERN);
+    TEST_ASSERT_EQUAL(1, frames.size());
+    TEST_ASSERT_EQUAL_STRING("/0@123\x03", frames[0].c_str());
+
+    // the bytes after the terminator stay buffered for the next line
+    TEST_ASSERT_EQUAL_STRING("/0`", uart.rx.c_str());
+}
+
+void testSeveralLinesInOneEvent()
+{
+    FakeUart uart;
+    CollectorLink link(uart.ops(), collectFrame);
+
+    uart.receive("/0`\x03\r\n\r\n/0b\x03\n");
+    link.handleEvent(COLLECTOR_UART_PATTERN);
+
+    // the empty line is skipped and a bare LF also ends a line
+    TEST_ASSERT_EQUAL(2, frames.size());
+    TEST_ASSERT_EQUAL_STRING("/0`\x03", frames[0].c_str());
+    TEST_ASSERT_EQUAL_STRING("/0b\x03", frames[1].c_str());
+    TEST_ASSERT_EQUAL(2, link.frameCount());
+}
+
+void testLongLineIsDropped()
+{
+    FakeUart uart;
+    CollectorLink link(uart.ops(), collectFrame);
+
+    uart.receive(std::string(COLLECTOR_FRAME_SIZE * 2, 'x') + "\r\n/0`\x03\r\n");
+    link.handleEvent(COLLECTOR_UART_PATTERN);
+
+    TEST_ASSERT_EQUAL(1, frames.size());
+    TEST_ASSERT_EQUAL_STRING("/0`\x03", frames[0].c_str());
+    TEST_ASSERT_EQUAL(1, link.droppedFrameCount());
+}
+
+void testOverflowResetsLine()
+{
+    FakeUart uart;
+    CollectorLink link(uart.ops(), collectFrame);
+
+    uart.receive("/0@partial");
+    link.handleEvent(COLLECTOR_UART_OVERFLOW);
+    TEST_ASSERT_EQUAL(0, uart.rx.size());
+    TEST_ASSERT_EQUAL(1, link.overflowCount());
+
+    uart.receive("/0`\x03\r\n");
+    link.handleEvent(COLLECTOR_UART_PATTERN);
+    TEST_ASSERT_EQUAL(1, frames.size());
+    TEST_ASSERT_EQUAL_STRING("/0`\x03", frames[0].c_str());
+}
+
+void testSendAppendsTerminator()
+{
+    FakeUart uart;
+    CollectorLink link(uart.ops(), collectFrame);
+
+    TEST_ASSERT_TRUE(link.send("/1TR"));
+    TEST_ASSERT_TRUE(link.send("/1Q"));
+    TEST_ASSERT_EQUAL_STRING("/1TR\r/1Q\r", uart.tx.c_str());
+}
+
+void testSendFailsWhenNotQueued()
+{
+    FakeUart uart;
+    uart.txCapacity = 4;
+    CollectorLink link(uart.ops(), collectFrame);
+
+    TEST_ASSERT_FALSE(link.send("/1TR"));
+    TEST_ASSERT_FALSE(link.send(std::string(COLLECTOR_COMMAND_SIZE, 'x').c_str()));
+}
+
+void testFrameParsesAsReply()
+{
+    FakeUart uart;
+    CollectorLink link(uart.ops(), collectFrame);
+
+    uart.receive("\xff/0@42\x03\r\n");
+    link.handleEvent(COLLECTOR_UART_PATTERN);
+    TEST_ASSERT_EQUAL(1, frames.size());
+
+    MiCloneResponse_t response;
+    TEST_ASSERT_TRUE(miclone_parse_response(frames[0].c_str(), frames[0].size(), response));
+    TEST_ASSERT_FALSE(response.ready);
+    TEST_ASSERT_EQUAL(MICLONE_ERROR_NONE, response.error);
+    TEST_ASSERT_EQUAL_STRING("42", response.data);
+}
+
+int main(int argc, char **argv)
+{
+    UNITY_BEGIN();
+    RUN_TEST(testCRLFIsStripped);
+    RUN_TEST(testPartialLineWaitsForTerminator);
+    RUN_TEST(testSeveralLinesInOneEvent);
+    RUN_TEST(testLongLineIsDropped);
+    RUN_TEST(testOverflowResetsLine);
+    RUN_TEST(testSendAppendsTerminator);
+    RUN_TEST(testSendFailsWhenNotQueued);
+    RUN_TEST(testFrameParsesAsReply);
+    return UNITY_END();
+}
@@ -0,0 +1,137 @@
+#include <unity.h>
+#include <string.h>
+#include <string>
+#include "CommandTable.hpp"
+
+static std::string called;
+static CommandValue received[COMMAND_MAX_ARGS];
+
+static void record(const char *name, const CommandValue *args)
+{
+    called = name;
+    for (size_t i = 0; i < COMMAND_MAX_ARGS; ++i) received[i] = args[i];
+}
+
+static void handlePing(const CommandValue *args) { record("ping", args); }
+static void handleRun(const CommandValue *args) { record("run", args); }
+static void handleSave(const CommandValue *args) { record("save", args); }
+
+static constexpr Command _commands[] = {
+    { "ping",   handlePing,     "ping",                 { } },
+    { "run",    handleRun,      "run <rate> [ms]",      { COMMAND_INT(5, 30000), COMMAND_INT_OPT(0, INT32_MAX) } },
+    { "save",   handleSave,     "save <name> <json>",   { COMMAND_WORD, COMMAND_REST } },
+};
+
+#define TEST_COMMAND_BITS 3
+
+static constexpr uint32_t _seed = command_find_seed(_commands, TEST_COMMAND_BITS);
+static_assert(_seed != COMMAND_NO_SEED, "The test table must have a perfect hash");
+static_assert(command_seed_perfect(_commands, _seed, TEST_COMMAND_BITS), "The seed found must be perfect");
+
+static const CommandDispatcher<3, TEST_COMMAND_BITS> _dispatcher(_commands, _seed);
+
+static CommandResult dispatch(const char *line, uint8_t *failedArg=nullptr)
+{
+    Tokenizer tokens(line);
+    const Command *command;
+    uint8_t arg;
+    CommandResult result = _dispatcher.dispatch(tokens, command, arg);
+    if (failedArg) *failedArg = arg;
+    return result;
+}
+
+void setUp()
+{
+    called.clear();
+    for (CommandValue &value : received) value = CommandValue();
+}
+
+void tearDown()
+{ }
+
+void testTokenizerSplitsWords()
+{
+    Tokenizer tokens("  run   300\r\n");
+    TEST_ASSERT_TRUE(tokens.next().equals("run"));
+    TEST_ASSERT_TRUE(tokens.next().equals("300"));
+    TEST_ASSERT_TRUE(tokens.next().empty());
+    TEST_ASSERT_TRUE(tokens.done());
+}
+
+void testTokenizerRestKeepsSpaces()
+{
+    Tokenizer tokens("save a {\"repeat\": 1}");
+    tokens.next();
+    tokens.next();
+    Token rest = tokens.rest();
+    TEST_ASSERT_EQUAL_STRING("{\"repeat\": 1}", rest.data);
+    TEST_ASSERT_EQUAL(13, rest.length);
+}
+
+void testTokenToInt()
+{
+    int32_t value;
+    TEST_ASSERT_TRUE(Token("-42", 3).toInt(value));
+    TEST_ASSERT_EQUAL(-42, value);
+    TEST_ASSERT_TRUE(Token("2147483647", 10).toInt(value));
+    TEST_ASSERT_EQUAL(INT32_MAX, value);
+    TEST_ASSERT_FALSE(Token("2147483648", 10).toInt(value));
+    TEST_ASSERT_FALSE(Token("12a", 3).toInt(value));
+    TEST_ASSERT_FALSE(Token("-", 1).toInt(value));
+}
+
+void testEveryRowIsFound()
+{
+    for (const Command &command : _commands) {
+        const Command *found = _dispatcher.find(Token(command.name, strlen(command.name)));
+        TEST_ASSERT_TRUE(found == &command);
+    }
+    TEST_ASSERT_NULL(_dispatcher.find(Token("pin", 3)));
+    TEST_ASSERT_NULL(_dispatcher.find(Token("", 0)));
+}
+
+void testDispatchParsesArguments()
+{
+    TEST_ASSERT_EQUAL(COMMAND_OK, dispatch("run 300 60000"));
+    TEST_ASSERT_EQUAL_STRING("run", called.c_str());
+    TEST_ASSERT_EQUAL(300, received[0].number);
+    TEST_ASSERT_TRUE(received[1].present);
+    TEST_ASSERT_EQUAL(60000, received[1].number);
+
+    TEST_ASSERT_EQUAL(COMMAND_OK, dispatch("run 300"));
+    TEST_ASSERT_FALSE(received[1].present);
+}
+
+void testDispatchRejectsBadArguments()
+{
+    uint8_t arg;
+    TEST_ASSERT_EQUAL(COMMAND_UNKNOWN, dispatch("walk"));
+    TEST_ASSERT_EQUAL(COMMAND_MISSING_ARG, dispatch("run", &arg));
+    TEST_ASSERT_EQUAL(0, arg);
+    TEST_ASSERT_EQUAL(COMMAND_BAD_ARG, dispatch("run 4", &arg));
+    TEST_ASSERT_EQUAL(COMMAND_BAD_ARG, dispatch("run 300 x", &arg));
+    TEST_ASSERT_EQUAL(1, arg);
+    TEST_ASSERT_EQUAL(COMMAND_EXTRA_ARGS, dispatch("ping now"));
+    TEST_ASSERT_TRUE(called.empty());
+}
+
+void testRestArgumentTakesTheLine()
+{
+    TEST_ASSERT_EQUAL(COMMAND_OK, dispatch("save p {\"steps\": [1, 2]}"));
+    TEST_ASSERT_EQUAL_STRING("save", called.c_str());
+    TEST_ASSERT_TRUE(received[0].token.equals("p"));
+    TEST_ASSERT_TRUE(received[1].token.equals("{\"steps\": [1, 2]}"));
+}
+
+int main(int argc, char **argv)
+{
+    UNITY_BEGIN();
+    RUN_TEST(testTokenizerSplitsWords);
+    RUN_TEST(testTokenizerRestKeepsSpaces);
+    RUN_TEST(testTokenToInt);
+    RUN_TEST(testEveryRowIsFound);
+    RUN_TEST(testDispatchParsesArguments);
+    RUN_TEST(testDispatchRejectsBadArguments);
+    RUN_TEST(testRestArgumentTakesTheLine);
+    return UNITY_END();
+}
@@ -0,0 +1,89 @@
+#include <unity.h>
+#include <string.h>
+#include <string>
+#include "ConsoleRing.hpp"
+
+typedef ConsoleRing<16> Ring;
+
+static size_t put(Ring &ring, const std::string &text)
+{
+    return ring.write(reinterpret_cast<const uint8_t *>(text.data()), text.size());
+}
+
+static std::string take(Ring &ring, size_t length=64)
+{
+    uint8_t data[64];
+    return std::string(reinterpret_cast<char *>(data), ring.read(data, length));
+}
+
+void setUp()
+{ }
+
+void tearDown()
+{ }
+
+void testKeepsOrderAcrossTheWrap()
+{
+    Ring ring;
+    put(ring, "0123456789");
+    TEST_ASSERT_EQUAL_STRING("012345", take(ring, 6).c_str());
+
+    // wraps past the end of the buffer
+    TEST_ASSERT_EQUAL(10, put(ring, "abcdefghij"));
+    TEST_ASSERT_EQUAL(14, ring.size());
+    TEST_ASSERT_EQUAL_STRING("6789abcdefghij", take(ring).c_str());
+    TEST_ASSERT_EQUAL(0, ring.droppedBytes());
+    TEST_ASSERT_EQUAL(14, ring.highWaterMark());
+}
+
+void testDropOldestDiscardsWholeLines()
+{
+    Ring ring(CONSOLE_DROP_OLDEST);
+    put(ring, "one\ntwo\nthree\n");
+    TEST_ASSERT_EQUAL(5, put(ring, "four\n"));
+
+    // three bytes were needed, the rest of "one\n" went with them
+    TEST_ASSERT_EQUAL(4, ring.droppedBytes());
+    TEST_ASSERT_EQUAL(5, put(ring, "five\n"));
+    TEST_ASSERT_EQUAL(8, ring.droppedBytes());
+    TEST_ASSERT_EQUAL_STRING("three\nfour\nfive\n", take(ring).c_str());
+}
+
+void testDropOldestCanEmptyTheRing()
+{
+    Ring ring(CONSOLE_DROP_OLDEST);
+    put(ring, "no line ends");
+    TEST_ASSERT_EQUAL(6, put(ring, "next\n\n"));
+    TEST_ASSERT_EQUAL(12, ring.droppedBytes());
+    TEST_ASSERT_EQUAL_STRING("next\n\n", take(ring).c_str());
+}
+
+void testDropOldestKeepsEndOfLongText()
+{
+    Ring ring(CONSOLE_DROP_OLDEST);
+    put(ring, "old\n");
+    TEST_ASSERT_EQUAL(16, put(ring, "0123456789abcdefXYZ"));
+    TEST_ASSERT_EQUAL(3 + 4, ring.droppedBytes());
+    TEST_ASSERT_EQUAL_STRING("3456789abcdefXYZ", take(ring).c_str());
+}
+
+void testDropNewestRefusesWhatDoesNotFit()
+{
+    Ring ring(CONSOLE_DROP_NEWEST);
+    put(ring, "one\ntwo\nthree\n");
+    TEST_ASSERT_EQUAL(0, put(ring, "four\n"));
+    TEST_ASSERT_EQUAL(2, put(ring, "4\n"));
+    TEST_ASSERT_EQUAL(5, ring.droppedBytes());
+    TEST_ASSERT_EQUAL_STRING("one\ntwo\nthree\n4\n", take(ring).c_str());
+}
+
+int main(int argc, char **argv)
+{
+    UNITY_BEGIN();
+    RUN_TEST(testKeepsOrderAcrossTheWrap);
+    RUN_TEST(testDropOldestDiscardsWholeLines);
+    RUN_TEST(testDropOldestCanEmptyTheRing);
+    RUN_TEST(testDropOldestKeepsEndOfLongText);
+    RUN_TEST(testDropNewestRefusesWhatDoesNotFit);
+    return UNITY_END();
+}
@@ -0,0 +1,100 @@
+#include <unity.h>
+#include <string.h>
+#include <vector>
+#include <string>
+#include "LineReader.hpp"
+
+typedef LineReader<16> Reader;
+
+static std::vector<std::string> lines;
+static int overflows;
+
+/**
+ * Feeds bytes one at a time, as the USB-C handler does, collecting the
+ * lines and overflows they produce
+ */
+static void feed(Reader &reader, const std::string &bytes)
+{
+    for (char c : bytes) {
+        switch (reader.feed(c)) {
+        case Reader::LINE_READY:    lines.push_back(reader.line()); break;
+        case Reader::LINE_OVERFLOW: ++overflows; break;
+        default:                    break;
+        }
+    }
+}
+
+void setUp()
+{
+    lines.clear();
+    overflows = 0;
+}
+
+void tearDown()
+{ }
+
+void testTerminatorsAreEquivalent()
+{
+    Reader reader;
+    feed(reader, "!ping\r!ping\n!ping\r\n");
+    TEST_ASSERT_EQUAL(3, lines.size());
+    for (const std::string &line : lines) TEST_ASSERT_EQUAL_STRING("!ping", line.c_str());
+}
+
+void testCRLFMakesOneLine()
+{
+    Reader reader;
+    feed(reader, "!a\r");
+    feed(reader, "\n!b\r\n");
+    TEST_ASSERT_EQUAL(2, lines.size());
+    TEST_ASSERT_EQUAL_STRING("!b", lines[1].c_str());
+}
+
+void testEmptyLinesAreSkipped()
+{
+    Reader reader;
+    feed(reader, "\n\r\n\r\r!a\n\n");
+    TEST_ASSERT_EQUAL(1, lines.size());
+    TEST_ASSERT_EQUAL_STRING("!a", lines[0].c_str());
+}
+
+void testLineWaitsForTerminator()
+{
+    Reader reader;
+    feed(reader, "$run 300");
+    TEST_ASSERT_EQUAL(0, lines.size());
+    feed(reader, " 60\r");
+    TEST_ASSERT_EQUAL(1, lines.size());
+    TEST_ASSERT_EQUAL_STRING("$run 300 60", lines[0].c_str());
+}
+
+void testLongestLineFits()
+{
+    Reader reader;
+    feed(reader, "123456789012345\n");
+    TEST_ASSERT_EQUAL(1, lines.size());
+    TEST_ASSERT_EQUAL_STRING("123456789012345", lines[0].c_str());
+    TEST_ASSERT_EQUAL(0, overflows);
+}
+
+void testOverlongLineIsDiscarded()
+{
+    Reader reader;
+    feed(reader, "1234567890123456789\r\n!ok\n");
+    TEST_ASSERT_EQUAL(1, overflows);
+    TEST_ASSERT_EQUAL(1, reader.overflowCount());
+    TEST_ASSERT_EQUAL(1, lines.size());
+    TEST_ASSERT_EQUAL_STRING("!ok", lines[0].c_str());
+}
+
+int main(int argc, char **argv)
+{
+    UNITY_BEGIN();
+    RUN_TEST(testTerminatorsAreEquivalent);
+    RUN_TEST(testCRLFMakesOneLine);
+    RUN_TEST(testEmptyLinesAreSkipped);
+    RUN_TEST(testLineWaitsForTerminator);
+    RUN_TEST(testLongestLineFits);
+    RUN_TEST(testOverlongLineIsDiscarded);
+    return UNITY_END();
+}
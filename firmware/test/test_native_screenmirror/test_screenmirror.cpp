@@ -0,0 +1,279 @@
+#include <unity.h>
+#include <string.h>
+#include <vector>
+#include "driver/screenmirror.hpp"
+
+using namespace Driver;
+
+#define WIDTH   480
+#define HEIGHT  320
+#define TILES   ((WIDTH / SCREENMIRROR_TILE_SIZE) * (HEIGHT / SCREENMIRROR_TILE_SIZE))
+
+// the display, in memory
+static std::vector<uint16_t> screen;
+static uint32_t tilesRead;
+
+static void fakeSize(void *, uint16_t &width, uint16_t &height)
+{
+    width = WIDTH;
+    height = HEIGHT;
+}
+
+static void fakeRead(void *, uint16_t x, uint16_t y, uint16_t width, uint16_t height, uint16_t *pixels)
+{
+    for (uint16_t row = 0; row < height; ++row) {
+        memcpy(pixels + row * width, screen.data() + (y + row) * WIDTH + x, width * sizeof(uint16_t));
+    }
+    ++tilesRead;
+}
+
+static const ScreenMirrorDisplay_t display = { nullptr, fakeSize, fakeRead };
+
+// the link's replies, decoded
+static std::vector<uint8_t> sent;
+
+static void linkWrite(void *, const uint8_t *data, size_t length) { sent.insert(sent.end(), data, data + length); }
+static void linkFlush(void *) { }
+static void linkSetBaud(void *, uint32_t) { }
+static uint32_t linkMillis(void *) { return 0; }
+
+static const UsbLinkTransport_t transport = { nullptr, linkWrite, linkFlush, linkSetBaud, linkMillis };
+
+static uint8_t sequence;
+
+/**
+ * Sends one request through a link and returns the reply type and payload
+ */
+static uint8_t request(UsbLink &link, uint8_t type, const std::vector<uint8_t> &payload, std::vector<uint8_t> &reply)
+{
+    sent.clear();
+    uint8_t frame[USBFRAME_MAX_ENCODED];
+    size_t size = usbframe_encode(type, ++sequence, payload.data(), payload.size(), frame);
+    for (size_t i = 0; i < size; ++i) link.feed(frame[i], 0);
+
+    UsbFrameDecoder decoder;
+    for (uint8_t byte : sent) {
+        if (decoder.feed(byte) != UsbFrameDecoder::FRAME_READY) continue;
+        reply.assign(decoder.payload(), decoder.payload() + decoder.payloadLength());
+        return decoder.type();
+    }
+    return 0;
+}
+
+/**
+ * Polls once and paints the tiles into copy, as the host viewer does
+ *
+ * @return the poll header
+ */
+static ScreenMirrorPoll_t poll(UsbLink &link, std::vector<uint16_t> &copy)
+{
+    std::vector<uint8_t> reply;
+    ScreenMirrorPoll_t header = { 0, 0 };
+    if (request(link, USBFRAME_SCREEN_POLL, {}, reply) != (USBFRAME_SCREEN_POLL | USBFRAME_REPLY)) return header;
+    TEST_ASSERT_TRUE(reply.size() <= USBFRAME_MAX_PAYLOAD);
+
+    memcpy(&header, reply.data(), sizeof(header));
+    size_t offset = sizeof(header);
+    for (uint16_t i = 0; i < header.tiles; ++i) {
+        uint16_t tile;
+        memcpy(&tile, reply.data() + offset, sizeof(tile));
+        offset += sizeof(tile);
+
+        uint16_t pixels[SCREENMIRROR_TILE_PIXELS];
+        size_t used = screenmirror_rle_decode(reply.data() + offset, reply.size() - offset, pixels, SCREENMIRROR_TILE_PIXELS);
+        TEST_ASSERT_NOT_EQUAL(0, used);
+        offset += used;
+
+        uint16_t x = (tile % (WIDTH / SCREENMIRROR_TILE_SIZE)) * SCREENMIRROR_TILE_SIZE;
+        uint16_t y = (tile / (WIDTH / SCREENMIRROR_TILE_SIZE)) * SCREENMIRROR_TILE_SIZE;
+        for (uint16_t row = 0; row < SCREENMIRROR_TILE_SIZE; ++row) {
+            memcpy(copy.data() + (y + row) * WIDTH + x, pixels + row * SCREENMIRROR_TILE_SIZE, SCREENMIRROR_TILE_SIZE * sizeof(uint16_t));
+        }
+    }
+    TEST_ASSERT_EQUAL(reply.size(), offset);
+    return header;
+}
+
+static void fill(int32_t x, int32_t y, int32_t w, int32_t h, uint16_t colour)
+{
+    for (int32_t row = y; row < y + h; ++row) {
+        for (int32_t column = x; column < x + w; ++column) screen[row * WIDTH + column] = colour;
+    }
+}
+
+// what a page looks like: flat panels and a few lines of noisy "text"
+static void drawPage()
+{
+    fill(0, 0, WIDTH, HEIGHT, 0x18E3);
+    fill(20, 20, 440, 60, 0xFFFF);
+    for (int32_t row = 100; row < 140; ++row) {
+        for (int32_t column = 20; column < 300; ++column) {
+            screen[row * WIDTH + column] = (row * 7 + column * 13) % 5 ? 0x0000 : 0xF800;
+        }
+    }
+}
+
+void setUp()
+{
+    screen.assign(WIDTH * HEIGHT, 0);
+    tilesRead = 0;
+}
+
+void tearDown()
+{ }
+
+void testRleRoundTrips()
+{
+    uint16_t pixels[SCREENMIRROR_TILE_PIXELS];
+    for (size_t i = 0; i < SCREENMIRROR_TILE_PIXELS; ++i) pixels[i] = i < 40 ? 0x1234 : i < 45 ? i : i < 200 ? 0xFFFF : i * 977;
+
+    uint8_t encoded[SCREENMIRROR_TILE_ENCODED_MAX];
+    size_t length = screenmirror_rle_encode(pixels, SCREENMIRROR_TILE_PIXELS, encoded);
+
+    uint16_t decoded[SCREENMIRROR_TILE_PIXELS];
+    TEST_ASSERT_EQUAL(length, screenmirror_rle_decode(encoded, length, decoded, SCREENMIRROR_TILE_PIXELS));
+    TEST_ASSERT_EQUAL_MEMORY(pixels, decoded, sizeof(pixels));
+
+    // cut short, or more pixels than asked for
+    TEST_ASSERT_EQUAL(0, screenmirror_rle_decode(encoded, length - 1, decoded, SCREENMIRROR_TILE_PIXELS));
+    TEST_ASSERT_EQUAL(0, screenmirror_rle_decode(encoded, length, decoded, 100));
+}
+
+void testRleSizes()
+{
+    uint16_t pixels[SCREENMIRROR_TILE_PIXELS];
+    uint8_t encoded[SCREENMIRROR_TILE_ENCODED_MAX];
+
+    // a flat tile is two runs
+    for (size_t i = 0; i < SCREENMIRROR_TILE_PIXELS; ++i) pixels[i] = 0x07E0;
+    TEST_ASSERT_EQUAL(6, screenmirror_rle_encode(pixels, SCREENMIRROR_TILE_PIXELS, encoded));
+
+    // no two pixels alike is the worst case
+    for (size_t i = 0; i < SCREENMIRROR_TILE_PIXELS; ++i) pixels[i] = i;
+    TEST_ASSERT_EQUAL(SCREENMIRROR_TILE_ENCODED_MAX, screenmirror_rle_encode(pixels, SCREENMIRROR_TILE_PIXELS, encoded));
+}
+
+void testMirrorCopiesTheScreenThenOnlyChanges()
+{
+    UsbLink link(transport);
+    ScreenMirror mirror(display);
+    TEST_ASSERT_TRUE(mirror.begin(link));
+    link.begin(0);
+    drawPage();
+
+    // nothing is tracked until a host starts mirroring
+    std::vector<uint8_t> reply;
+    TEST_ASSERT_EQUAL(USBFRAME_NAK | USBFRAME_REPLY, request(link, USBFRAME_SCREEN_POLL, {}, reply));
+    mirror.damage(0, 0, WIDTH, HEIGHT);
+
+    TEST_ASSERT_EQUAL(USBFRAME_SCREEN_START | USBFRAME_REPLY, request(link, USBFRAME_SCREEN_START, {}, reply));
+    ScreenMirrorInfo_t info;
+    memcpy(&info, reply.data(), sizeof(info));
+    TEST_ASSERT_EQUAL(WIDTH, info.width);
+    TEST_ASSERT_EQUAL(HEIGHT, info.height);
+    TEST_ASSERT_EQUAL(SCREENMIRROR_TILE_SIZE, info.tileSize);
+
+    std::vector<uint16_t> copy(WIDTH * HEIGHT, 0xAAAA);
+    uint32_t tiles = 0;
+    int polls = 0;
+    for (ScreenMirrorPoll_t header = { 0, 1 }; header.pending; ++polls) {
+        header = poll(link, copy);
+        tiles += header.tiles;
+        TEST_ASSERT_TRUE(polls < 100);
+    }
+    TEST_ASSERT_EQUAL(TILES, tiles);
+    TEST_ASSERT_TRUE(copy == screen);
+
+    // the page repainted as it was: read back, but nothing sent
+    tilesRead = 0;
+    drawPage();
+    mirror.damage(0, 0, WIDTH, HEIGHT);
+    ScreenMirrorPoll_t header = { 0, 1 };
+    while (header.pending) header = poll(link, copy);
+    TEST_ASSERT_EQUAL(TILES, tilesRead);
+    TEST_ASSERT_EQUAL(0, header.tiles);
+
+    // one pixel changed in a rectangle over four tiles
+    screen[40 * WIDTH + 30] = 0x001F;
+    mirror.damage(10, 20, 21, 21);
+    header = poll(link, copy);
+    TEST_ASSERT_EQUAL(1, header.tiles);
+    TEST_ASSERT_EQUAL(0, header.pending);
+    TEST_ASSERT_TRUE(copy == screen);
+
+    uint32_t tilesSent, tilesUnchanged, bytesSent;
+    mirror.stats(tilesSent, tilesUnchanged, bytesSent);
+    TEST_ASSERT_EQUAL(TILES + 1, tilesSent);
+    TEST_ASSERT_EQUAL(TILES + 3, tilesUnchanged);
+}
+
+void testDamageOffScreenIsClipped()
+{
+    UsbLink link(transport);
+    ScreenMirror mirror(display);
+    mirror.begin(link);
+    link.begin(0);
+
+    std::vector<uint8_t> reply;
+    std::vector<uint16_t> copy(WIDTH * HEIGHT);
+    request(link, USBFRAME_SCREEN_START, {}, reply);
+    while (poll(link, copy).pending) { }
+
+    fill(WIDTH - 8, HEIGHT - 8, 8, 8, 0xFFFF);
+    mirror.damage(WIDTH - 8, HEIGHT - 8, 100, 100);
+    mirror.damage(-50, -50, 10, 10);
+    mirror.damage(10, 10, 0, 5);
+
+    ScreenMirrorPoll_t header = poll(link, copy);
+    TEST_ASSERT_EQUAL(1, header.tiles);
+    TEST_ASSERT_TRUE(copy == screen);
+}
+
+static std::vector<ScreenMirrorTouch_t> touches;
+
+static bool acceptTouch(void *, ScreenMirrorTouchType_t type, uint16_t x, uint16_t y)
+{
+    touches.push_back({ type, x, y });
+    return true;
+}
+
+void testTouchesNeedAHandler()
+{
+    UsbLink link(transport);
+    ScreenMirror mirror(display);
+    mirror.begin(link);
+    link.begin(0);
+
+    std::vector<uint8_t> reply;
+    request(link, USBFRAME_SCREEN_START, {}, reply);
+
+    ScreenMirrorTouch_t touch = { SCREENMIRROR_TOUCH_DOWN, 100, 200 };
+    std::vector<uint8_t> payload((uint8_t *) &touch, (uint8_t *) &touch + sizeof(touch));
+    TEST_ASSERT_EQUAL(USBFRAME_NAK | USBFRAME_REPLY, request(link, USBFRAME_SCREEN_TOUCH, payload, reply));
+    TEST_ASSERT_EQUAL(USBFRAME_ERROR_REFUSED, reply.at(0));
+
+    touches.clear();
+    mirror.onTouch(acceptTouch);
+    TEST_ASSERT_EQUAL(USBFRAME_SCREEN_TOUCH | USBFRAME_REPLY, request(link, USBFRAME_SCREEN_TOUCH, payload, reply));
+    TEST_ASSERT_EQUAL(1, touches.size());
+    TEST_ASSERT_EQUAL(100, touches[0].x);
+    TEST_ASSERT_EQUAL(200, touches[0].y);
+
+    // off the screen
+    touch.y = HEIGHT;
+    payload.assign((uint8_t *) &touch, (uint8_t *) &touch + sizeof(touch));
+    TEST_ASSERT_EQUAL(USBFRAME_NAK | USBFRAME_REPLY, request(link, USBFRAME_SCREEN_TOUCH, payload, reply));
+    TEST_ASSERT_EQUAL(USBFRAME_ERROR_BAD_PAYLOAD, reply.at(0));
+    TEST_ASSERT_EQUAL(1, touches.size());
+}
+
+int main(int argc, char **argv)
+{
+    UNITY_BEGIN();
+    RUN_TEST(testRleRoundTrips);
+    RUN_TEST(testRleSizes);
+    RUN_TEST(testMirrorCopiesTheScreenThenOnlyChanges);
+    RUN_TEST(testDamageOffScreenIsClipped);
+    RUN_TEST(testTouchesNeedAHandler);
+    return UNITY_END();
+}
@@ -0,0 +1,100 @@
+#include <unity.h>
+#include <string.h>
+#include <vector>
+#include "diagnostics/trace.h"
+
+using namespace Diagnostics;
+
+static_assert(trace_count_args("no arguments") == 0, "plain text");
+static_assert(trace_count_args("100%% done") == 0, "%% is not an argument");
+static_assert(trace_count_args("(%d, %u) %5.1f %-8s %llu %%") == 5, "one per conversion");
+static_assert(trace_count_args("%*d|%.*s") == 4, "a * takes an argument");
+
+// the records written and dropped
+static std::vector<std::vector<uint8_t>> records;
+static int dropped;
+
+namespace Diagnostics
+{
+    uint32_t trace_time() { return 0x01020304; }
+    void trace_write(const uint8_t *record, size_t length) { records.push_back(std::vector<uint8_t>(record, record + length)); }
+    void trace_dropped() { ++dropped; }
+}
+
+void setUp()
+{
+    records.clear();
+    dropped = 0;
+}
+
+void tearDown()
+{ }
+
+void testRecordHasLengthIdAndTime()
+{
+    trace_record<0>(0x1234);
+
+    TEST_ASSERT_EQUAL(1, records.size());
+    const uint8_t expected[] = { 6, 0x34, 0x12, 0x04, 0x03, 0x02, 0x01 };
+    TEST_ASSERT_EQUAL(sizeof(expected), records[0].size());
+    TEST_ASSERT_EQUAL_MEMORY(expected, records[0].data(), sizeof(expected));
+}
+
+void testArgumentsAreRawLittleEndian()
+{
+    int16_t negative = -2;
+    uint64_t wide = 0x1122334455667788ULL;
+    trace_record<4>(8, negative, 2.5, wide, 'A');
+
+    const std::vector<uint8_t> &record = records.at(0);
+    TEST_ASSERT_EQUAL(1 + 6 + 4 + 4 + 8 + 4, record.size());
+    TEST_ASSERT_EQUAL(record.size() - 1, record[0]);
+
+    int32_t value;
+    memcpy(&value, record.data() + 7, sizeof(value));
+    TEST_ASSERT_EQUAL(-2, value);
+
+    float single;
+    memcpy(&single, record.data() + 11, sizeof(single));
+    TEST_ASSERT_EQUAL_FLOAT(2.5f, single);
+
+    uint64_t copy;
+    memcpy(&copy, record.data() + 15, sizeof(copy));
+    TEST_ASSERT_TRUE(copy == wide);
+    TEST_ASSERT_EQUAL('A', record[23]);
+}
+
+void testStringsAreCopiedAndCut()
+{
+    char name[] = "home";
+    trace_record<2>(0, name, "0123456789012345678901234567890123456789");
+
+    const std::vector<uint8_t> &record = records.at(0);
+    TEST_ASSERT_EQUAL(4, record[7]);
+    TEST_ASSERT_EQUAL_MEMORY("home", record.data() + 8, 4);
+    TEST_ASSERT_EQUAL(TRACE_STRING_SIZE, record[12]);
+    TEST_ASSERT_EQUAL(13 + TRACE_STRING_SIZE, record.size());
+}
+
+void testOversizedRecordIsDropped()
+{
+    const char *text = "012345678901234567890123";
+    trace_record<3>(0, text, text, text);
+    TEST_ASSERT_EQUAL(0, records.size());
+    TEST_ASSERT_EQUAL(1, dropped);
+
+    // an ID past the section limit can't be recorded either
+    trace_record<0>(TRACE_MAX_ID + 1);
+    TEST_ASSERT_EQUAL(0, records.size());
+    TEST_ASSERT_EQUAL(2, dropped);
+}
+
+int main(int argc, char **argv)
+{
+    UNITY_BEGIN();
+    RUN_TEST(testRecordHasLengthIdAndTime);
+    RUN_TEST(testArgumentsAreRawLittleEndian);
+    RUN_TEST(testStringsAreCopiedAndCut);
+    RUN_TEST(testOversizedRecordIsDropped);
+    return UNITY_END();
+}
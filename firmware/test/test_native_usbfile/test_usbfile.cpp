@@ -0,0 +1,348 @@
+#include <unity.h>
+#include <string.h>
+#include <string>
+#include <vector>
+#include "driver/usbfile.hpp"
+
+using namespace Driver;
+
+// one file and one directory of three entries, in memory
+static std::vector<uint8_t> file;
+static bool fileOpen;
+static bool filesBusy;             // BLE has a file open
+static const char *entries[] = { "a.csv", "b.csv", "logs" };
+
+static bool fakeOpen(void *, UsbFileSystemId_t, const char *path, UsbFileMode_t mode, uint32_t &size)
+{
+    if (filesBusy) return false;
+    if (strcmp(path, "/run.csv")) return false;
+    if (mode == USBFILE_WRITE) file.clear();
+    fileOpen = true;
+    size = file.size();
+    return true;
+}
+
+static size_t fakeRead(void *, uint32_t offset, uint8_t *data, size_t length)
+{
+    if (offset >= file.size()) return 0;
+    if (length > file.size() - offset) length = file.size() - offset;
+    memcpy(data, file.data() + offset, length);
+    return length;
+}
+
+static size_t fakeWrite(void *, const uint8_t *data, size_t length)
+{
+    file.insert(file.end(), data, data + length);
+    return length;
+}
+
+static void fakeClose(void *) { fileOpen = false; }
+
+static int fakeEntry(void *, UsbFileSystemId_t, const char *path, uint16_t index, char *name, uint32_t &size, bool &directory)
+{
+    if (strcmp(path, "/")) return -1;
+    if (index >= 3) return 0;
+    strcpy(name, entries[index]);
+    directory = index == 2;
+    size = directory ? 0 : 100 + index;
+    return 1;
+}
+
+static bool fakeStat(void *, UsbFileSystemId_t, const char *path, uint32_t &size, bool &directory)
+{
+    directory = !strcmp(path, "/");
+    if (!directory && strcmp(path, "/run.csv")) return false;
+    size = directory ? 0 : file.size();
+    return true;
+}
+
+static bool fakeBusy(void *) { return filesBusy; }
+
+static const UsbFileSystem_t files = { nullptr, fakeOpen, fakeRead, fakeWrite, fakeClose, fakeEntry, fakeStat, fakeBusy };
+
+// the link's replies, decoded
+static std::vector<uint8_t> sent;
+
+static void linkWrite(void *, const uint8_t *data, size_t length) { sent.insert(sent.end(), data, data + length); }
+static void linkFlush(void *) { }
+static void linkSetBaud(void *, uint32_t) { }
+static uint32_t linkMillis(void *) { return 0; }
+
+static const UsbLinkTransport_t transport = { nullptr, linkWrite, linkFlush, linkSetBaud, linkMillis };
+
+static uint8_t sequence;
+
+/**
+ * Sends one request through a link and returns the reply type and payload
+ */
+static uint8_t request(UsbLink &link, uint8_t type, const std::vector<uint8_t> &payload, std::vector<uint8_t> &reply)
+{
+    sent.clear();
+    uint8_t frame[USBFRAME_MAX_ENCODED];
+    size_t size = usbframe_encode(type, ++sequence, payload.data(), payload.size(), frame);
+    for (size_t i = 0; i < size; ++i) link.feed(frame[i], 0);
+
+    UsbFrameDecoder decoder;
+    for (uint8_t byte : sent) {
+        if (decoder.feed(byte) != UsbFrameDecoder::FRAME_READY) continue;
+        reply.assign(decoder.payload(), decoder.payload() + decoder.payloadLength());
+        return decoder.type();
+    }
+    return 0;
+}
+
+static std::vector<uint8_t> openRequest(UsbFileMode_t mode, const char *path)
+{
+    std::vector<uint8_t> payload = { USBFILE_SD, mode };
+    payload.insert(payload.end(), path, path + strlen(path));
+    return payload;
+}
+
+static std::vector<uint8_t> offsetRequest(uint32_t offset, const std::vector<uint8_t> &data={})
+{
+    std::vector<uint8_t> payload(sizeof(offset));
+    memcpy(payload.data(), &offset, sizeof(offset));
+    payload.insert(payload.end(), data.begin(), data.end());
+    return payload;
+}
+
+static uint32_t replyWord(const std::vector<uint8_t> &reply, size_t at=0)
+{
+    uint32_t value;
+    memcpy(&value, reply.data() + at, sizeof(value));
+    return value;
+}
+
+void setUp()
+{
+    file.clear();
+    for (size_t i = 0; i < 2500; ++i) file.push_back(i * 13);
+    fileOpen = false;
+    filesBusy = false;
+}
+
+void tearDown()
+{ }
+
+void testCrcMatchesCheckValue()
+{
+    const char *check = "123456789";
+    TEST_ASSERT_EQUAL(0xCBF43926, usbfile_crc32(reinterpret_cast<const uint8_t *>(check), 9));
+    TEST_ASSERT_EQUAL(0xCBF43926, usbfile_crc32(reinterpret_cast<const uint8_t *>(check) + 4, 5,
+                                                usbfile_crc32(reinterpret_cast<const uint8_t *>(check), 4)));
+}
+
+void testReadsChunksAtAnyOffset()
+{
+    UsbLink link(transport);
+    UsbFileServer server(files);
+    TEST_ASSERT_TRUE(server.begin(link));
+    link.begin(0);
+
+    std::vector<uint8_t> reply;
+    TEST_ASSERT_EQUAL(USBFRAME_FILE_OPEN | USBFRAME_REPLY, request(link, USBFRAME_FILE_OPEN, openRequest(USBFILE_READ, "/run.csv"), reply));
+    UsbFileOpened_t opened;
+    memcpy(&opened, reply.data(), sizeof(opened));
+    TEST_ASSERT_EQUAL(2500, opened.size);
+    TEST_ASSERT_EQUAL(USBFILE_CHUNK_SIZE, opened.chunkSize);
+
+    // out of order, as replies to a window can be asked for again
+    uint32_t last = 2 * USBFILE_CHUNK_SIZE;
+    request(link, USBFRAME_FILE_READ, offsetRequest(last), reply);
+    TEST_ASSERT_EQUAL(last, replyWord(reply));
+    TEST_ASSERT_EQUAL(sizeof(uint32_t) + 2500 - last, reply.size());
+    TEST_ASSERT_EQUAL_MEMORY(file.data() + last, reply.data() + sizeof(uint32_t), 2500 - last);
+
+    request(link, USBFRAME_FILE_READ, offsetRequest(0), reply);
+    TEST_ASSERT_EQUAL(sizeof(uint32_t) + USBFILE_CHUNK_SIZE, reply.size());
+
+    request(link, USBFRAME_FILE_READ, offsetRequest(2500), reply);
+    TEST_ASSERT_EQUAL(sizeof(uint32_t), reply.size());
+}
+
+void testWritesOnlyInOrder()
+{
+    UsbLink link(transport);
+    UsbFileServer server(files);
+    server.begin(link);
+    link.begin(0);
+
+    std::vector<uint8_t> reply;
+    request(link, USBFRAME_FILE_OPEN, openRequest(USBFILE_WRITE, "/run.csv"), reply);
+    TEST_ASSERT_EQUAL(0, file.size());
+
+    std::vector<uint8_t> chunk(10, 0xAB);
+    request(link, USBFRAME_FILE_WRITE, offsetRequest(0, chunk), reply);
+    TEST_ASSERT_EQUAL(10, replyWord(reply));
+
+    // a gap is not written and the reply says where to go back to
+    request(link, USBFRAME_FILE_WRITE, offsetRequest(20, chunk), reply);
+    TEST_ASSERT_EQUAL(10, replyWord(reply));
+
+    // a repeat is acknowledged without writing it twice
+    request(link, USBFRAME_FILE_WRITE, offsetRequest(0, chunk), reply);
+    TEST_ASSERT_EQUAL(10, replyWord(reply));
+    TEST_ASSERT_EQUAL(10, file.size());
+
+    uint32_t read, written, outOfOrder;
+    server.stats(read, written, outOfOrder);
+    TEST_ASSERT_EQUAL(1, written);
+    TEST_ASSERT_EQUAL(1, outOfOrder);
+}
+
+void testAppendResumesFromSize()
+{
+    UsbLink link(transport);
+    UsbFileServer server(files);
+    server.begin(link);
+    link.begin(0);
+
+    std::vector<uint8_t> reply;
+    request(link, USBFRAME_FILE_OPEN, openRequest(USBFILE_APPEND, "/run.csv"), reply);
+    TEST_ASSERT_EQUAL(2500, replyWord(reply));
+
+    request(link, USBFRAME_FILE_WRITE, offsetRequest(2500, { 1, 2, 3 }), reply);
+    TEST_ASSERT_EQUAL(2503, replyWord(reply));
+    TEST_ASSERT_EQUAL(2503, file.size());
+}
+
+void testRequestsNeedOpenFile()
+{
+    UsbLink link(transport);
+    UsbFileServer server(files);
+    server.begin(link);
+    link.begin(0);
+
+    std::vector<uint8_t> reply;
+    TEST_ASSERT_EQUAL(USBFRAME_NAK | USBFRAME_REPLY, request(link, USBFRAME_FILE_READ, offsetRequest(0), reply));
+    TEST_ASSERT_EQUAL(USBFRAME_ERROR_NOT_OPEN, reply[0]);
+
+    TEST_ASSERT_EQUAL(USBFRAME_NAK | USBFRAME_REPLY, request(link, USBFRAME_FILE_OPEN, openRequest(USBFILE_READ, "/missing"), reply));
+    TEST_ASSERT_EQUAL(USBFRAME_ERROR_NOT_FOUND, reply[0]);
+
+    TEST_ASSERT_EQUAL(USBFRAME_NAK | USBFRAME_REPLY, request(link, USBFRAME_FILE_OPEN, openRequest(USBFILE_READ, "run.csv"), reply));
+    TEST_ASSERT_EQUAL(USBFRAME_ERROR_BAD_PAYLOAD, reply[0]);
+
+    // the file is there but BLE holds the file system
+    filesBusy = true;
+    TEST_ASSERT_EQUAL(USBFRAME_NAK | USBFRAME_REPLY, request(link, USBFRAME_FILE_OPEN, openRequest(USBFILE_READ, "/run.csv"), reply));
+    TEST_ASSERT_EQUAL(USBFRAME_ERROR_IO, reply[0]);
+}
+
+void testListsEntriesFromIndex()
+{
+    UsbLink link(transport);
+    UsbFileServer server(files);
+    server.begin(link);
+    link.begin(0);
+
+    std::vector<uint8_t> payload = { USBFILE_SD, 1, 0, '/' };
+    std::vector<uint8_t> reply;
+    request(link, USBFRAME_FILE_LIST, payload, reply);
+
+    // entries 1 and 2
+    UsbFileEntry_t entry;
+    memcpy(&entry, reply.data(), sizeof(entry));
+    TEST_ASSERT_EQUAL(101, entry.size);
+    TEST_ASSERT_EQUAL(5, entry.nameLength);
+    TEST_ASSERT_EQUAL_MEMORY("b.csv", reply.data() + sizeof(entry), 5);
+
+    memcpy(&entry, reply.data() + sizeof(entry) + 5, sizeof(entry));
+    TEST_ASSERT_EQUAL(USBFILE_DIRECTORY, entry.flags);
+    TEST_ASSERT_EQUAL(2 * sizeof(entry) + 5 + 4, reply.size());
+
+    payload[1] = 3;
+    request(link, USBFRAME_FILE_LIST, payload, reply);
+    TEST_ASSERT_EQUAL(0, reply.size());
+}
+
+void testCrcCoversPrefix()
+{
+    UsbLink link(transport);
+    UsbFileServer server(files);
+    server.begin(link);
+    link.begin(0);
+
+    uint32_t length = 1500;
+    std::vector<uint8_t> payload = { USBFILE_SD };
+    payload.insert(payload.end(), (uint8_t *) &length, (uint8_t *) &length + sizeof(length));
+    payload.insert(payload.end(), { '/', 'r', 'u', 'n', '.', 'c', 's', 'v' });
+
+    std::vector<uint8_t> reply;
+    request(link, USBFRAME_FILE_CRC, payload, reply);
+    TEST_ASSERT_EQUAL(1500, replyWord(reply));
+    TEST_ASSERT_EQUAL(usbfile_crc32(file.data(), 1500), replyWord(reply, sizeof(uint32_t)));
+    TEST_ASSERT_EQUAL(1500, replyWord(reply, 2 * sizeof(uint32_t)));
+    TEST_ASSERT_FALSE(fileOpen);
+}
+
+void testCrcOfLargeFileIsStepped()
+{
+    UsbLink link(transport);
+    UsbFileServer server(files);
+    server.begin(link);
+    link.begin(0);
+
+    file.clear();
+    for (size_t i = 0; i < 2 * USBFILE_CRC_STEP + 100; ++i) file.push_back(i * 7 + (i >> 8));
+
+    uint32_t length = UINT32_MAX;
+    std::vector<uint8_t> payload = { USBFILE_SD };
+    payload.insert(payload.end(), (uint8_t *) &length, (uint8_t *) &length + sizeof(length));
+    payload.insert(payload.end(), { '/', 'r', 'u', 'n', '.', 'c', 's', 'v' });
+
+    std::vector<uint8_t> reply;
+    request(link, USBFRAME_FILE_CRC, payload, reply);
+    TEST_ASSERT_EQUAL(USBFILE_CRC_STEP, replyWord(reply));
+    TEST_ASSERT_EQUAL(usbfile_crc32(file.data(), USBFILE_CRC_STEP), replyWord(reply, sizeof(uint32_t)));
+    TEST_ASSERT_EQUAL(file.size(), replyWord(reply, 2 * sizeof(uint32_t)));
+    TEST_ASSERT_TRUE(fileOpen);
+
+    // the link answers other requests in between
+    TEST_ASSERT_EQUAL(USBFRAME_ECHO | USBFRAME_REPLY, request(link, USBFRAME_ECHO, { 1, 2, 3 }, reply));
+
+    request(link, USBFRAME_FILE_CRC, payload, reply);
+    TEST_ASSERT_EQUAL(2 * USBFILE_CRC_STEP, replyWord(reply));
+
+    request(link, USBFRAME_FILE_CRC, payload, reply);
+    TEST_ASSERT_EQUAL(file.size(), replyWord(reply));
+    TEST_ASSERT_EQUAL(usbfile_crc32(file.data(), file.size()), replyWord(reply, sizeof(uint32_t)));
+    TEST_ASSERT_FALSE(fileOpen);
+
+    // opening a file ends a check part way through
+    request(link, USBFRAME_FILE_CRC, payload, reply);
+    request(link, USBFRAME_FILE_OPEN, openRequest(USBFILE_READ, "/run.csv"), reply);
+    request(link, USBFRAME_FILE_CRC, payload, reply);
+    TEST_ASSERT_EQUAL(USBFILE_CRC_STEP, replyWord(reply));
+}
+
+void testLinkEndClosesFile()
+{
+    UsbLink link(transport);
+    UsbFileServer server(files);
+    server.begin(link);
+    link.onEnd([](void *arg) { static_cast<UsbFileServer *>(arg)->close(); }, &server);
+    link.begin(0);
+
+    std::vector<uint8_t> reply;
+    request(link, USBFRAME_FILE_OPEN, openRequest(USBFILE_READ, "/run.csv"), reply);
+    TEST_ASSERT_TRUE(fileOpen);
+
+    request(link, USBFRAME_EXIT, {}, reply);
+    TEST_ASSERT_FALSE(fileOpen);
+}
+
+int main(int argc, char **argv)
+{
+    UNITY_BEGIN();
+    RUN_TEST(testCrcMatchesCheckValue);
+    RUN_TEST(testReadsChunksAtAnyOffset);
+    RUN_TEST(testWritesOnlyInOrder);
+    RUN_TEST(testAppendResumesFromSize);
+    RUN_TEST(testRequestsNeedOpenFile);
+    RUN_TEST(testListsEntriesFromIndex);
+    RUN_TEST(testCrcCoversPrefix);
+    RUN_TEST(testCrcOfLargeFileIsStepped);
+    RUN_TEST(testLinkEndClosesFile);
+    return UNITY_END();
+}
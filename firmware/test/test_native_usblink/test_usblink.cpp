@@ -0,0 +1,276 @@
+#include <unity.h>
+#include <string.h>
+#include <vector>
+#include "driver/usbframe.hpp"
+#include "driver/usblink.hpp"
+
+using namespace Driver;
+
+// what the link sent and the rates it switched to
+static std::vector<uint8_t> sent;
+static std::vector<uint32_t> bauds;
+
+static void fakeWrite(void *, const uint8_t *data, size_t length) { sent.insert(sent.end(), data, data + length); }
+static void fakeFlush(void *) { }
+static void fakeSetBaud(void *, uint32_t baud) { bauds.push_back(baud); }
+static uint32_t fakeMillis(void *) { return 0; }
+
+static const UsbLinkTransport_t transport = { nullptr, fakeWrite, fakeFlush, fakeSetBaud, fakeMillis };
+
+static void feedFrame(UsbLink &link, uint8_t type, uint8_t sequence, const void *payload, size_t length, uint32_t now=0)
+{
+    uint8_t frame[USBFRAME_MAX_ENCODED];
+    size_t size = usbframe_encode(type, sequence, static_cast<const uint8_t *>(payload), length, frame);
+    for (size_t i = 0; i < size; ++i) link.feed(frame[i], now);
+}
+
+/**
+ * Decodes everything the link sent, returning the frames in order
+ */
+static std::vector<std::vector<uint8_t>> sentFrames()
+{
+    std::vector<std::vector<uint8_t>> frames;
+    UsbFrameDecoder decoder;
+    for (uint8_t byte : sent) {
+        if (decoder.feed(byte) != UsbFrameDecoder::FRAME_READY) continue;
+        std::vector<uint8_t> frame = { decoder.type(), decoder.sequence() };
+        frame.insert(frame.end(), decoder.payload(), decoder.payload() + decoder.payloadLength());
+        frames.push_back(frame);
+    }
+    return frames;
+}
+
+void setUp()
+{
+    sent.clear();
+    bauds.clear();
+}
+
+void tearDown()
+{ }
+
+void testCrcMatchesCheckValue()
+{
+    const char *check = "123456789";
+    TEST_ASSERT_EQUAL_HEX16(0x29B1, usbframe_crc16(reinterpret_cast<const uint8_t *>(check), 9));
+}
+
+void testCobsRoundTripHasNoZeros()
+{
+    uint8_t data[600];
+    for (size_t i = 0; i < sizeof(data); ++i) data[i] = i % 3 ? i : 0;
+
+    uint8_t encoded[sizeof(data) + sizeof(data) / 254 + 1];
+    size_t length = usbframe_cobs_encode(data, sizeof(data), encoded);
+    TEST_ASSERT_NULL(memchr(encoded, 0, length));
+
+    uint8_t decoded[sizeof(data)];
+    TEST_ASSERT_EQUAL(sizeof(data), usbframe_cobs_decode(encoded, length, decoded, sizeof(decoded)));
+    TEST_ASSERT_EQUAL_MEMORY(data, decoded, sizeof(data));
+    TEST_ASSERT_EQUAL(0, usbframe_cobs_decode(encoded, length, decoded, sizeof(decoded) - 1));
+}
+
+void testDecoderSkipsTextBetweenFrames()
+{
+    const uint8_t payload[] = { 1, 0, 2 };
+    uint8_t frame[USBFRAME_MAX_ENCODED];
+    size_t size = usbframe_encode(USBFRAME_ECHO, 7, payload, sizeof(payload), frame);
+
+    std::vector<uint8_t> bytes(frame, frame + size);
+    const char *text = "[log] text from another task\n";
+    bytes.insert(bytes.end(), text, text + strlen(text));
+    bytes.insert(bytes.end(), frame, frame + size);
+
+    UsbFrameDecoder decoder;
+    int ready = 0, errors = 0;
+    for (uint8_t byte : bytes) {
+        UsbFrameDecoder::Result result = decoder.feed(byte);
+        if (result == UsbFrameDecoder::FRAME_ERROR) ++errors;
+        if (result != UsbFrameDecoder::FRAME_READY) continue;
+
+        ++ready;
+        TEST_ASSERT_EQUAL(USBFRAME_ECHO, decoder.type());
+        TEST_ASSERT_EQUAL(7, decoder.sequence());
+        TEST_ASSERT_EQUAL(sizeof(payload), decoder.payloadLength());
+        TEST_ASSERT_EQUAL_MEMORY(payload, decoder.payload(), sizeof(payload));
+    }
+    TEST_ASSERT_EQUAL(2, ready);
+    TEST_ASSERT_EQUAL(1, errors);
+}
+
+void testDecoderRejectsDamagedFrame()
+{
+    uint8_t frame[USBFRAME_MAX_ENCODED];
+    size_t size = usbframe_encode(USBFRAME_HELLO, 1, nullptr, 0, frame);
+    frame[2] ^= 0x10;
+
+    UsbFrameDecoder decoder;
+    UsbFrameDecoder::Result last = UsbFrameDecoder::FRAME_NONE;
+    for (size_t i = 0; i < size; ++i) last = decoder.feed(frame[i]);
+    TEST_ASSERT_EQUAL(UsbFrameDecoder::FRAME_ERROR, last);
+}
+
+void testRepeatedRequestGetsSameReply()
+{
+    UsbLink link(transport);
+    link.begin(0);
+
+    const uint8_t payload[] = { 'a', 'b' };
+    feedFrame(link, USBFRAME_ECHO, 3, payload, sizeof(payload));
+    feedFrame(link, USBFRAME_ECHO, 3, payload, sizeof(payload));
+
+    std::vector<std::vector<uint8_t>> frames = sentFrames();
+    TEST_ASSERT_EQUAL(2, frames.size());
+    TEST_ASSERT_TRUE(frames[0] == frames[1]);
+    TEST_ASSERT_EQUAL(USBFRAME_ECHO | USBFRAME_REPLY, frames[0][0]);
+
+    uint32_t requests, badFrames, duplicates, fallbacks;
+    link.stats(requests, badFrames, duplicates, fallbacks);
+    TEST_ASSERT_EQUAL(1, requests);
+    TEST_ASSERT_EQUAL(1, duplicates);
+}
+
+void testUnsupportedBaudIsRefused()
+{
+    UsbLink link(transport);
+    link.begin(0);
+
+    uint32_t baud = 57600;
+    feedFrame(link, USBFRAME_BAUD, 1, &baud, sizeof(baud));
+
+    std::vector<std::vector<uint8_t>> frames = sentFrames();
+    TEST_ASSERT_EQUAL(1, frames.size());
+    TEST_ASSERT_EQUAL(USBFRAME_NAK | USBFRAME_REPLY, frames[0][0]);
+    TEST_ASSERT_EQUAL(USBFRAME_ERROR_BAUD_UNSUPPORTED, frames[0][2]);
+    TEST_ASSERT_EQUAL(USBLINK_BASE_BAUD, link.currentBaud());
+}
+
+void testUnconfirmedBaudRevertsAfterTimeout()
+{
+    UsbLink link(transport);
+    link.begin(0);
+
+    uint32_t baud = 921600;
+    feedFrame(link, USBFRAME_BAUD, 1, &baud, sizeof(baud), 100);
+    TEST_ASSERT_EQUAL(921600, link.currentBaud());
+
+    link.poll(100 + USBLINK_CONFIRM_TIMEOUT - 1);
+    TEST_ASSERT_EQUAL(921600, link.currentBaud());
+    link.poll(100 + USBLINK_CONFIRM_TIMEOUT);
+    TEST_ASSERT_EQUAL(USBLINK_BASE_BAUD, link.currentBaud());
+}
+
+void testConfirmedBaudIsKept()
+{
+    UsbLink link(transport);
+    link.begin(0);
+
+    uint32_t baud = 460800;
+    feedFrame(link, USBFRAME_BAUD, 1, &baud, sizeof(baud), 100);
+    feedFrame(link, USBFRAME_HELLO, 2, nullptr, 0, 200);
+    link.poll(100 + USBLINK_CONFIRM_TIMEOUT);
+    TEST_ASSERT_EQUAL(460800, link.currentBaud());
+
+    UsbFrameHello_t hello;
+    std::vector<std::vector<uint8_t>> frames = sentFrames();
+    TEST_ASSERT_EQUAL(2 + sizeof(hello), frames.back().size());
+    memcpy(&hello, frames.back().data() + 2, sizeof(hello));
+    TEST_ASSERT_EQUAL(460800, hello.baud);
+}
+
+void testBadFramesDropToBaseBaud()
+{
+    UsbLink link(transport);
+    link.begin(0);
+
+    uint32_t baud = 230400;
+    feedFrame(link, USBFRAME_BAUD, 1, &baud, sizeof(baud));
+    feedFrame(link, USBFRAME_HELLO, 2, nullptr, 0);
+
+    const uint8_t noise[] = { 0x00, 0x13, 0x37, 0x00 };
+    for (int i = 0; i < USBLINK_FALLBACK_ERRORS - 1; ++i) {
+        for (uint8_t byte : noise) link.feed(byte, 0);
+    }
+    TEST_ASSERT_EQUAL(230400, link.currentBaud());
+
+    for (uint8_t byte : noise) link.feed(byte, 0);
+    TEST_ASSERT_EQUAL(USBLINK_BASE_BAUD, link.currentBaud());
+}
+
+void testRepeatedBaudSwitchesAgain()
+{
+    UsbLink link(transport);
+    link.begin(0);
+
+    // the reply is lost, the host's repeats can't be read and the device falls back
+    uint32_t baud = 230400;
+    feedFrame(link, USBFRAME_BAUD, 1, &baud, sizeof(baud));
+    const uint8_t noise[] = { 0x00, 0x13, 0x37, 0x00 };
+    for (int i = 0; i < USBLINK_FALLBACK_ERRORS; ++i) {
+        for (uint8_t byte : noise) link.feed(byte, 0);
+    }
+    TEST_ASSERT_EQUAL(USBLINK_BASE_BAUD, link.currentBaud());
+
+    // the last repeat arrives at the base rate and must switch, not just replay the reply
+    feedFrame(link, USBFRAME_BAUD, 1, &baud, sizeof(baud));
+    TEST_ASSERT_EQUAL(230400, link.currentBaud());
+}
+
+void testExitReturnsToConsole()
+{
+    UsbLink link(transport);
+    link.begin(0);
+    TEST_ASSERT_TRUE(link.active());
+
+    feedFrame(link, USBFRAME_EXIT, 1, nullptr, 0);
+    TEST_ASSERT_FALSE(link.active());
+    TEST_ASSERT_EQUAL(1, sentFrames().size());
+}
+
+static size_t handleDouble(void *, const uint8_t *payload, size_t length, uint8_t *reply, UsbFrameError_t &error)
+{
+    if (length != 1) {
+        error = USBFRAME_ERROR_BAD_PAYLOAD;
+        return 0;
+    }
+    reply[0] = payload[0] * 2;
+    return 1;
+}
+
+void testHandlersAnswerTheirType()
+{
+    UsbLink link(transport);
+    TEST_ASSERT_FALSE(link.addHandler(USBFRAME_ECHO, handleDouble));
+    TEST_ASSERT_TRUE(link.addHandler(0x10, handleDouble));
+    link.begin(0);
+
+    uint8_t value = 21;
+    feedFrame(link, 0x10, 1, &value, 1);
+    feedFrame(link, 0x10, 2, nullptr, 0);
+    feedFrame(link, 0x11, 3, nullptr, 0);
+
+    std::vector<std::vector<uint8_t>> frames = sentFrames();
+    TEST_ASSERT_EQUAL(3, frames.size());
+    TEST_ASSERT_EQUAL(0x10 | USBFRAME_REPLY, frames[0][0]);
+    TEST_ASSERT_EQUAL(42, frames[0][2]);
+    TEST_ASSERT_EQUAL(USBFRAME_ERROR_BAD_PAYLOAD, frames[1][2]);
+    TEST_ASSERT_EQUAL(USBFRAME_ERROR_UNKNOWN_TYPE, frames[2][2]);
+}
+
+int main(int argc, char **argv)
+{
+    UNITY_BEGIN();
+    RUN_TEST(testCrcMatchesCheckValue);
+    RUN_TEST(testCobsRoundTripHasNoZeros);
+    RUN_TEST(testDecoderSkipsTextBetweenFrames);
+    RUN_TEST(testDecoderRejectsDamagedFrame);
+    RUN_TEST(testRepeatedRequestGetsSameReply);
+    RUN_TEST(testUnsupportedBaudIsRefused);
+    RUN_TEST(testUnconfirmedBaudRevertsAfterTimeout);
+    RUN_TEST(testConfirmedBaudIsKept);
+    RUN_TEST(testBadFramesDropToBaseBaud);
+    RUN_TEST(testRepeatedBaudSwitchesAgain);
+    RUN_TEST(testExitReturnsToConsole);
+    RUN_TEST(testHandlersAnswerTheirType);
+    return UNITY_END();
+}
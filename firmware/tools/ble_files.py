@@ -0,0 +1,174 @@
+"""
+Lists, looks up and downloads files on the unit over BLE, through the bulk
+transfer characteristic (src/driver/bletransfer.hpp). The unit streams a
+download as notifications sized to the MTU, a window at a time.
+
+    python ble_files.py <address> ls <device path>
+    python ble_files.py <address> stat <device path>
+    python ble_files.py <address> get <device path> <local file> [--resume] [--spiffs]
+
+Needs bleak (pip install bleak). --resume carries on from the size of the local
+file, and checks only the part it downloads.
+"""
+
+import argparse
+import asyncio
+import os
+import struct
+import sys
+import time
+import zlib
+
+from bleak import BleakClient
+
+from ble_upload import (TRANSFER_UUID, OPENED, CLOSED, CLOSE, OK, STATUS, ACK_GAP, USBFILE_SD,
+                        OPENED_FORMAT, CLOSED_FORMAT, ACK_TIMEOUT, negotiated_mtu, report)
+
+# bletransfer.hpp
+READ, READ_ACK, LIST, STAT = 0x05, 0x06, 0x07, 0x08
+CHUNK, LISTED, STATED = 0x84, 0x85, 0x86
+USBFILE_SPIFFS = 1
+DIRECTORY = 0x01
+MIN_LIST_MTU = 3 + 2 + 6 + 96
+
+ENTRY_FORMAT = struct.Struct('<IBB')            # size, flags, name length
+STAT_FORMAT = struct.Struct('<BIB')             # status, size, flags
+
+
+class Notifications:
+    def __init__(self, client):
+        self.client = client
+        self.queue = asyncio.Queue()
+
+    async def start(self):
+        await self.client.start_notify(TRANSFER_UUID, lambda _, value: self.queue.put_nowait(bytes(value)))
+
+    async def expect(self, op, timeout=5.0):
+        while True:
+            packet = await asyncio.wait_for(self.queue.get(), timeout)
+            if packet[0] == op:
+                return packet[1:]
+
+    async def write(self, packet, response=True):
+        await self.client.write_gatt_char(TRANSFER_UUID, packet, response=response)
+
+
+async def list_directory(link, fs, path):
+    mtu = await negotiated_mtu(link.client)
+    if mtu < MIN_LIST_MTU:
+        raise RuntimeError('an MTU of %d is too small to list, %d needed' % (mtu, MIN_LIST_MTU))
+    first = 0
+    while True:
+        await link.write(struct.pack('<BBHH', LIST, fs, mtu, first) + path.encode())
+        reply = await link.expect(LISTED)
+        if reply[0] != OK:
+            raise RuntimeError('list failed: %s' % STATUS[reply[0]])
+        if len(reply) == 1:
+            return
+
+        used = 1
+        while used < len(reply):
+            size, flags, length = ENTRY_FORMAT.unpack_from(reply, used)
+            name = reply[used + ENTRY_FORMAT.size:used + ENTRY_FORMAT.size + length].decode(errors='replace')
+            print('%-40s %s' % (name + ('/' if flags & DIRECTORY else ''), '' if flags & DIRECTORY else size))
+            used += ENTRY_FORMAT.size + length
+            first += 1
+
+
+async def stat(link, fs, path):
+    await link.write(struct.pack('<BB', STAT, fs) + path.encode())
+    status, size, flags = STAT_FORMAT.unpack(await link.expect(STATED))
+    if status != OK:
+        raise RuntimeError('stat failed: %s' % STATUS[status])
+    print('%s: %s' % (path, 'directory' if flags & DIRECTORY else '%d bytes' % size))
+
+
+async def download(link, fs, path, local, resume):
+    offset = os.path.getsize(local) if resume and os.path.exists(local) else 0
+    mtu = await negotiated_mtu(link.client)
+    await link.write(struct.pack('<BBHI', READ, fs, mtu, offset) + path.encode())
+    status, size, data_size, ack_every, window = OPENED_FORMAT.unpack(await link.expect(OPENED))
+    if status != OK:
+        raise RuntimeError('download failed: %s' % STATUS[status])
+
+    total = size - offset
+    chunks = (total + data_size - 1) // data_size
+    print('MTU %d, %d bytes a chunk, %d chunks from offset %d' % (mtu, data_size, chunks, offset))
+
+    start = time.monotonic()
+    data = bytearray()
+    expected = 0
+    since_ack = 0
+    gap_sent = False
+    while expected < chunks:
+        try:
+            packet = await asyncio.wait_for(link.queue.get(), ACK_TIMEOUT)
+        except asyncio.TimeoutError:
+            # the tail of a window went missing, have it sent again
+            await link.write(struct.pack('<BBH', READ_ACK, ACK_GAP, expected & 0xFFFF), response=False)
+            continue
+
+        if packet[0] == CLOSED:
+            raise RuntimeError('download failed: %s' % STATUS[CLOSED_FORMAT.unpack(packet[1:])[0]])
+        if packet[0] != CHUNK:
+            continue
+
+        sequence = struct.unpack_from('<H', packet, 1)[0]
+        if sequence != expected & 0xFFFF:
+            # one out of sequence, ask once to go back
+            if not gap_sent:
+                gap_sent = True
+                await link.write(struct.pack('<BBH', READ_ACK, ACK_GAP, expected & 0xFFFF), response=False)
+            continue
+
+        data += packet[3:]
+        expected += 1
+        gap_sent = False
+        since_ack += 1
+        if since_ack >= ack_every or expected == chunks:
+            await link.write(struct.pack('<BBH', READ_ACK, 0, expected & 0xFFFF), response=False)
+            since_ack = 0
+
+    await link.write(struct.pack('<BII', CLOSE, len(data), zlib.crc32(data)))
+    closed = CLOSED_FORMAT.unpack(await link.expect(CLOSED))
+    if closed[0] != OK:
+        raise RuntimeError('download failed: %s' % STATUS[closed[0]])
+
+    with open(local, 'ab' if offset else 'wb') as f:
+        f.write(data)
+    report('download', len(data), time.monotonic() - start)
+
+
+async def main():
+    parser = argparse.ArgumentParser(description=__doc__.strip().splitlines()[0])
+    parser.add_argument('address')
+    parser.add_argument('command', choices=('ls', 'stat', 'get'))
+    parser.add_argument('path')
+    parser.add_argument('local', nargs='?')
+    parser.add_argument('--resume', action='store_true', help='carry on from the size of the local file')
+    parser.add_argument('--spiffs', action='store_true', help='SPIFFS rather than the SD card')
+    args = parser.parse_args()
+
+    if not args.path.startswith('/'):
+        parser.error('the device path must start with /')
+    if (args.command == 'get') != bool(args.local):
+        parser.error('get takes a local file, and only get')
+    fs = USBFILE_SPIFFS if args.spiffs else USBFILE_SD
+
+    async with BleakClient(args.address) as client:
+        link = Notifications(client)
+        await link.start()
+        if args.command == 'ls':
+            await list_directory(link, fs, args.path)
+        elif args.command == 'stat':
+            await stat(link, fs, args.path)
+        else:
+            await download(link, fs, args.path, args.local, args.resume)
+
+
+if __name__ == '__main__':
+    try:
+        asyncio.run(main())
+    except (RuntimeError, asyncio.TimeoutError) as e:
+        print('Error: %s' % (e or 'no reply'), file=sys.stderr)
+        sys.exit(1)
@@ -0,0 +1,64 @@
+"""
+Prints the unit's live telemetry over BLE (src/driver/bletelemetry.hpp): run
+state, time, flow rate, battery and which pumps answer, batched a notification
+per interval.
+
+    python ble_telemetry.py <address> [--interval ms]
+
+Needs bleak (pip install bleak). Stop with Ctrl+C.
+"""
+
+import argparse
+import asyncio
+import struct
+import sys
+
+from bleak import BleakClient
+
+from ble_upload import negotiated_mtu
+
+TELEMETRY_UUID = '19458a03-bce2-4f58-9e93-9eb648f3ddbf'
+
+HEADER_FORMAT = struct.Struct('<BH')            # count, period
+RECORD_FORMAT = struct.Struct('<BBBBIIHHB')     # state, flags, pump links, pump status, elapsed, remaining, rate, mV, SOC
+CONFIG_FORMAT = struct.Struct('<HH')            # interval, MTU
+
+STATES = ('idle', 'starting', 'running', 'stopping')
+PROGRAM = 0x01
+FOREVER = 0xFFFFFFFF
+MIN_INTERVAL, MAX_INTERVAL = 100, 10000
+
+
+def show(packet):
+    count, period = HEADER_FORMAT.unpack_from(packet)
+    for i in range(count):
+        state, flags, links, status, elapsed, remaining, rate, millivolts, soc = \
+            RECORD_FORMAT.unpack_from(packet, HEADER_FORMAT.size + i * RECORD_FORMAT.size)
+        left = 'untimed' if remaining == FOREVER else '%d s left' % (remaining // 1000)
+        print('%-8s%s %4d ul/min %6d s  %-12s %4.2f V %3d%%  pumps %s status 0x%02X' % (
+            STATES[state] if state < len(STATES) else state, ' (program)' if flags & PROGRAM else '',
+            rate, elapsed // 1000, left, millivolts / 1000, soc, bin(links)[2:], status))
+
+
+async def main():
+    parser = argparse.ArgumentParser(description=__doc__.strip().splitlines()[0])
+    parser.add_argument('address')
+    parser.add_argument('--interval', type=int, default=1000, help='ms between notifications')
+    args = parser.parse_args()
+
+    if not MIN_INTERVAL <= args.interval <= MAX_INTERVAL:
+        parser.error('the interval must be %d to %d ms' % (MIN_INTERVAL, MAX_INTERVAL))
+
+    async with BleakClient(args.address) as client:
+        mtu = await negotiated_mtu(client)
+        await client.write_gatt_char(TELEMETRY_UUID, CONFIG_FORMAT.pack(args.interval, mtu), response=True)
+        await client.start_notify(TELEMETRY_UUID, lambda _, value: show(bytes(value)))
+        while True:
+            await asyncio.sleep(1)
+
+
+if __name__ == '__main__':
+    try:
+        asyncio.run(main())
+    except KeyboardInterrupt:
+        sys.exit(0)
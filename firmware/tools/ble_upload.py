@@ -0,0 +1,255 @@
+"""
+Uploads a file to the SD card over BLE and reports the throughput, either
+through the bulk upload characteristic (src/driver/bletransfer.hpp) or, with
+--legacy, through COMMAND_WRITE and COMMAND_FILE_APPEND on the command
+characteristic, for comparing the two. --firmware sends a firmware image
+instead, straight into the ota_0 partition.
+
+    python ble_upload.py <address> <local file> <device path> [--legacy] [--resume]
+    python ble_upload.py <address> firmware.bin --firmware
+
+Needs bleak (pip install bleak). --resume carries on from the size of the file
+already on the card; it trusts that part rather than checking it. A firmware
+update reconnects once the unit has restarted into the factory firmware, which
+takes the image, and again to see it come back.
+"""
+
+import argparse
+import asyncio
+import hashlib
+import struct
+import sys
+import time
+import zlib
+
+from bleak import BleakClient
+
+COMS_UUID = 'f5db5ef9-c1d0-4d1b-8907-d3f2075872c5'
+TRANSFER_UUID = '693f1cf3-c3e2-4ba9-8077-3bf199e70cdc'
+
+# bletransfer.hpp
+OPEN, DATA, SYNC, CLOSE = 0x01, 0x02, 0x03, 0x04
+OPENED, ACK, CLOSED = 0x81, 0x82, 0x83
+OK, BAD_PACKET, NOT_OPEN, IO, SHORT, CRC, VERIFY, RESTARTING, BUSY, NOT_FOUND = range(10)
+STATUS = ('ok', 'bad packet', 'not open', 'file error', 'short', 'CRC mismatch', 'image rejected', 'restarting',
+          'busy, stop the run first', 'not found')
+ACK_GAP = 0x01
+USBFILE_SD, USBFILE_WRITE, USBFILE_APPEND = 0, 1, 2
+FIRMWARE = 0x80
+
+OPENED_FORMAT = struct.Struct('<BIHBB')         # status, size, data size, ack every, window
+ACK_FORMAT = struct.Struct('<BBHI')             # status, flags, next, received
+CLOSED_FORMAT = struct.Struct('<B' + ACK_FORMAT.format[1:] + 'II')
+
+ACK_TIMEOUT = 1.0                               # s without an ack before asking for one
+RESTART_WAIT = 5.0                              # s before reconnecting to a unit that restarted
+RECONNECT_TRIES = 6
+
+# BLE_Callback_Coms.h
+PROPS_REQUEST_FOR_SERVER_RESPONSE = 0x0010
+PROPS_REQUEST_FOR_NO_NOTIFY = 0x0080           # despite the name, asks for a notification once the command has run
+COMMAND_WRITE = 0x01
+COMMAND_STAGE_SMALL_BUFFER = 0x09
+COMMAND_FILE_CREATE = 0x0E
+COMMAND_FILE_APPEND = 0x11
+LEGACY_BUFFER = 256
+LEGACY_WRITE = 5
+
+
+def report(name, length, seconds):
+    rate = length / 1024 / seconds if seconds else 0
+    print('%s: %d bytes in %.1f s, %.1f KB/s' % (name, length, seconds, rate))
+
+
+async def negotiated_mtu(client):
+    # BlueZ only exchanges the MTU once something asks for it
+    acquire = getattr(client._backend, '_acquire_mtu', None)
+    if acquire:
+        try:
+            await acquire()
+        except Exception:
+            pass
+    return client.mtu_size
+
+
+class Restarting(Exception):
+    pass
+
+
+async def upload_bulk(client, data, path, resume, firmware=False):
+    notifications = asyncio.Queue()
+    await client.start_notify(TRANSFER_UUID, lambda _, value: notifications.put_nowait(bytes(value)))
+
+    async def expect(op, timeout=5.0):
+        while True:
+            packet = await asyncio.wait_for(notifications.get(), timeout)
+            if packet[0] == op:
+                return packet[1:]
+
+    mtu = await negotiated_mtu(client)
+    mode = USBFILE_APPEND if resume else USBFILE_WRITE
+    if firmware:
+        request = struct.pack('<BBBH', OPEN, FIRMWARE, USBFILE_WRITE, mtu)
+    else:
+        request = struct.pack('<BBBH', OPEN, USBFILE_SD, mode, mtu) + path.encode()
+    await client.write_gatt_char(TRANSFER_UUID, request, response=True)
+    status, size, data_size, ack_every, window = OPENED_FORMAT.unpack(await expect(OPENED, 30.0))
+    if status == RESTARTING:
+        raise Restarting()
+    if status != OK:
+        raise RuntimeError('open failed: %s' % STATUS[status])
+
+    data = data[size:] if resume else data
+    packets = (len(data) + data_size - 1) // data_size
+    print('MTU %d, %d bytes a packet, %d packets from offset %d' % (mtu, data_size, packets, size if resume else 0))
+
+    start = time.monotonic()
+    acked = 0
+    sent = 0
+    synced = False
+    while True:
+        while sent < packets and sent - acked < window:
+            chunk = data[sent * data_size:(sent + 1) * data_size]
+            await client.write_gatt_char(TRANSFER_UUID, struct.pack('<BH', DATA, sent & 0xFFFF) + chunk, response=False)
+            sent += 1
+
+        if acked == packets:
+            request = struct.pack('<BII', CLOSE, len(data), zlib.crc32(data))
+            if firmware:
+                request += hashlib.sha256(data).digest()
+            await client.write_gatt_char(TRANSFER_UUID, request, response=True)
+            closed = CLOSED_FORMAT.unpack(await expect(CLOSED, 30.0))
+            status, next_sequence, elapsed = closed[0], closed[3], closed[6]
+            if status == SHORT:
+                acked = sent = acked - ((acked - next_sequence) & 0xFFFF)
+                synced = False
+                continue
+            if status != OK:
+                raise RuntimeError('upload failed: %s' % STATUS[status])
+            report('firmware update' if firmware else 'bulk upload', len(data), time.monotonic() - start)
+            print('device: %.1f KB/s' % (len(data) / 1024 / (elapsed / 1000 or 0.001)))
+            return
+
+        # the last packets may not fill an ack interval
+        if sent == packets and not synced:
+            await client.write_gatt_char(TRANSFER_UUID, bytes([SYNC]), response=True)
+            synced = True
+
+        # wait for an ack, asking again if it was lost
+        try:
+            packet = await asyncio.wait_for(notifications.get(), ACK_TIMEOUT)
+        except asyncio.TimeoutError:
+            await client.write_gatt_char(TRANSFER_UUID, bytes([SYNC]), response=True)
+            continue
+        if packet[0] != ACK:
+            continue
+
+        status, flags, next_sequence, received = ACK_FORMAT.unpack(packet[1:])
+        if status != OK:
+            raise RuntimeError('upload failed: %s' % STATUS[status])
+        acked += (next_sequence - acked) & 0xFFFF
+        if flags & ACK_GAP:
+            sent = acked
+            synced = False
+
+
+async def upload_legacy(client, data, path):
+    # commands run on a worker after the write is acknowledged, so wait for each one's notification
+    done = asyncio.Queue()
+    await client.start_notify(COMS_UUID, lambda _, value: done.put_nowait(bytes(value)))
+
+    async def command(command, payload=b''):
+        props = PROPS_REQUEST_FOR_SERVER_RESPONSE | PROPS_REQUEST_FOR_NO_NOTIFY
+        await client.write_gatt_char(COMS_UUID, struct.pack('<HB', props, command) + payload, response=True)
+        await asyncio.wait_for(done.get(), 5.0)
+
+    async def fill(block):
+        for address in range(0, len(block), LEGACY_WRITE):
+            part = block[address:address + LEGACY_WRITE]
+            await command(COMMAND_WRITE, struct.pack('<H', address | len(part) << 11) + part)
+
+    start = time.monotonic()
+    await fill(path.encode() + b'\0')
+    await command(COMMAND_STAGE_SMALL_BUFFER)
+    await command(COMMAND_FILE_CREATE)
+
+    for offset in range(0, len(data), LEGACY_BUFFER):
+        block = data[offset:offset + LEGACY_BUFFER]
+        await fill(block)
+        await command(COMMAND_FILE_APPEND, struct.pack('<H', len(block)))
+
+    report('command upload', len(data), time.monotonic() - start)
+
+
+async def connect(address):
+    for attempt in range(RECONNECT_TRIES):
+        try:
+            client = BleakClient(address)
+            await client.connect()
+            return client
+        except Exception:
+            if attempt == RECONNECT_TRIES - 1:
+                raise
+            await asyncio.sleep(RESTART_WAIT)
+
+
+async def update_firmware(address, data):
+    start = time.monotonic()
+    for handed_over in (False, True):
+        client = await connect(address)
+        try:
+            await upload_bulk(client, data, '', False, firmware=True)
+            break
+        except Restarting:
+            if handed_over:
+                raise RuntimeError('the factory firmware did not take the image')
+            print('restarting into the factory firmware')
+        finally:
+            try:
+                await client.disconnect()
+            except Exception:
+                pass
+        await asyncio.sleep(RESTART_WAIT)
+
+    # the unit restarts into the new image
+    await asyncio.sleep(RESTART_WAIT)
+    client = await connect(address)
+    await client.disconnect()
+    report('firmware update, restarts included', len(data), time.monotonic() - start)
+
+
+async def main():
+    parser = argparse.ArgumentParser(description=__doc__.strip().splitlines()[0])
+    parser.add_argument('address')
+    parser.add_argument('local')
+    parser.add_argument('path', nargs='?')
+    parser.add_argument('--legacy', action='store_true', help='use the command characteristic')
+    parser.add_argument('--resume', action='store_true', help='carry on from the size already on the card')
+    parser.add_argument('--firmware', action='store_true', help='install the file as the main firmware')
+    args = parser.parse_args()
+
+    if args.firmware == bool(args.path):
+        parser.error('give either a device path or --firmware')
+    if args.path and not args.path.startswith('/'):
+        parser.error('the device path must start with /')
+
+    with open(args.local, 'rb') as f:
+        data = f.read()
+
+    if args.firmware:
+        await update_firmware(args.address, data)
+        return
+
+    async with BleakClient(args.address) as client:
+        if args.legacy:
+            await upload_legacy(client, data, args.path)
+        else:
+            await upload_bulk(client, data, args.path, args.resume)
+
+
+if __name__ == '__main__':
+    try:
+        asyncio.run(main())
+    except (RuntimeError, asyncio.TimeoutError) as e:
+        print('Error: %s' % (e or 'no reply'), file=sys.stderr)
+        sys.exit(1)
@@ -0,0 +1,428 @@
+// Native build of the MiClone driver's protocol layer, run against a serial
+// device such as the pty opened by pumpsim. The collector framing, command
+// exchanges and pump scheduler are the firmware's own sources, only the UART
+// is replaced.
+//
+//   pumpbench DEVICE throughput [-n COMMANDS] [--pumps N]
+//   pumpbench DEVICE startstop  [-n CYCLES] [--pumps N] [--rate UL_MIN] [--run MS]
+//   pumpbench DEVICE endurance  [-n CYCLES] [--pumps N] [--rate UL_MIN] [--run MS] [--max-failures N]
+//
+// Cycles run on every pump at once, -n per pump. A cycle with --run 0 is stopped
+// as soon as the pump is running, otherwise the run times out by itself
+//
+// Exits non-zero when a check fails, so it can gate CI
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <deque>
+#include <string>
+#include <vector>
+
+#include "driver/collectorlink.hpp"
+#include "driver/micloneprotocol.hpp"
+#include "driver/micloneschedule.hpp"
+
+using namespace Driver;
+
+/**
+ * Stands in for the IDF UART driver: bytes read from the device wait in a
+ * buffer and terminator positions are queued relative to the read position
+ */
+typedef struct {
+    int fd;
+    std::string rx;
+    std::deque<int> patterns;
+} BenchUart_t;
+
+typedef struct {
+    BenchUart_t uart;
+    CollectorLink *link;
+    std::deque<std::string> frames;
+    uint32_t replies;
+    uint32_t rejections;
+} BenchPort_t;
+
+static int64_t bench_micros()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t) now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+/* CollectorUartOps_t over a file descriptor */
+
+static int bench_uart_read(void *context, uint8_t *data, size_t length)
+{
+    BenchUart_t &uart = *static_cast<BenchUart_t *>(context);
+    size_t count = std::min(length, uart.rx.size());
+    memcpy(data, uart.rx.data(), count);
+    uart.rx.erase(0, count);
+    for (int &position : uart.patterns) position -= count;
+    return count;
+}
+
+static int bench_uart_write(void *context, const uint8_t *data, size_t length)
+{
+    BenchUart_t &uart = *static_cast<BenchUart_t *>(context);
+    return write(uart.fd, data, length);
+}
+
+static int bench_uart_pop_pattern(void *context)
+{
+    BenchUart_t &uart = *static_cast<BenchUart_t *>(context);
+    if (uart.patterns.empty()) return -1;
+    int position = uart.patterns.front();
+    uart.patterns.pop_front();
+    return position;
+}
+
+static void bench_uart_flush(void *context)
+{
+    BenchUart_t &uart = *static_cast<BenchUart_t *>(context);
+    uart.rx.clear();
+    uart.patterns.clear();
+
+    // and whatever the kernel is still holding
+    tcflush(uart.fd, TCIFLUSH);
+}
+
+static void bench_on_frame(const char *frame, size_t length, void *arg)
+{
+    static_cast<BenchPort_t *>(arg)->frames.push_back(std::string(frame, length));
+}
+
+/**
+ * Reads what is available within timeout and hands it to the link, like the
+ * collector port's event task does on the device
+ */
+static void bench_port_poll(BenchPort_t &port, uint32_t timeout)
+{
+    struct pollfd pfd = { port.uart.fd, POLLIN, 0 };
+    if (poll(&pfd, 1, timeout) <= 0) return;
+
+    uint8_t buffer[256];
+    ssize_t received = read(port.uart.fd, buffer, sizeof(buffer));
+    if (received <= 0) return;
+
+    bool pattern = false;
+    for (ssize_t i = 0; i < received; ++i) {
+        port.uart.rx.push_back(buffer[i]);
+        if (buffer[i] == COLLECTOR_LINE_TERMINATOR) {
+            port.uart.patterns.push_back(port.uart.rx.size() - 1);
+            pattern = true;
+        }
+    }
+
+    port.link->handleEvent(pattern ? COLLECTOR_UART_PATTERN : COLLECTOR_UART_DATA);
+}
+
+/* MiCloneTransport_t over the link */
+
+static bool bench_send(void *context, const char *command)
+{
+    return static_cast<BenchPort_t *>(context)->link->send(command);
+}
+
+static uint32_t bench_millis(void *)
+{
+    return bench_micros() / 1000;
+}
+
+static bool bench_receive(void *context, char *line, size_t size, uint32_t timeout)
+{
+    BenchPort_t &port = *static_cast<BenchPort_t *>(context);
+    uint32_t start = bench_millis(nullptr);
+
+    while (port.frames.empty()) {
+        uint32_t elapsed = bench_millis(nullptr) - start;
+        if (elapsed >= timeout) return false;
+        bench_port_poll(port, timeout - elapsed);
+    }
+
+    std::string frame = port.frames.front();
+    port.frames.pop_front();
+
+    size_t length = std::min(frame.size(), size - 1);
+    memcpy(line, frame.data(), length);
+    line[length] = '\0';
+    return true;
+}
+
+static void bench_flush(void *context)
+{
+    BenchPort_t &port = *static_cast<BenchPort_t *>(context);
+    port.link->reset();
+    port.frames.clear();
+}
+
+static void bench_sleep(void *, uint32_t ms)
+{
+    usleep(ms * 1000);
+}
+
+static void bench_on_reply(void *context, const char *, const MiCloneResponse_t &response)
+{
+    BenchPort_t &port = *static_cast<BenchPort_t *>(context);
+    ++port.replies;
+    if (response.error != MICLONE_ERROR_NONE) ++port.rejections;
+}
+
+static bool bench_open(BenchPort_t &port, const char *device)
+{
+    port.uart.fd = open(device, O_RDWR | O_NOCTTY);
+    if (port.uart.fd < 0) {
+        perror(device);
+        return false;
+    }
+
+    struct termios tio;
+    if (tcgetattr(port.uart.fd, &tio) == 0) {
+        cfmakeraw(&tio);
+        cfsetspeed(&tio, B9600);
+        tcsetattr(port.uart.fd, TCSANOW, &tio);
+    }
+
+    return true;
+}
+
+/* Reporting */
+
+typedef struct {
+    std::vector<int64_t> samples;   // us
+    uint32_t failures;
+} BenchSeries_t;
+
+static void bench_report(const char *name, BenchSeries_t &series, double seconds)
+{
+    std::vector<int64_t> &s = series.samples;
+    std::sort(s.begin(), s.end());
+
+    if (s.empty()) {
+        printf("%-10s no samples, %u failed\n", name, series.failures);
+        return;
+    }
+
+    int64_t total = 0;
+    for (int64_t sample : s) total += sample;
+
+    printf("%-10s n=%zu failed=%u  mean=%.2fms p50=%.2fms p99=%.2fms max=%.2fms",
+           name, s.size(), series.failures,
+           total / 1000.0 / s.size(), s[s.size() / 2] / 1000.0,
+           s[std::min(s.size() - 1, s.size() * 99 / 100)] / 1000.0, s.back() / 1000.0);
+    if (seconds > 0) printf("  %.1f/s", s.size() / seconds);
+    printf("\n");
+}
+
+/* Benchmarks */
+
+typedef struct {
+    uint32_t count;
+    uint16_t rate;
+    uint32_t run;           // ms between start and stop in cycles
+    uint32_t maxFailures;
+    uint8_t pumps;
+} BenchOptions_t;
+
+static bool bench_throughput(const MiCloneTransport_t &transport, const MiCloneTiming_t &timing, const BenchOptions_t &options)
+{
+    BenchSeries_t queries = {};
+    MiCloneResponse_t response;
+    char command[MICLONE_COMMAND_SIZE];
+    int64_t begin = bench_micros();
+
+    for (uint32_t i = 0; i < options.count; ++i) {
+        miclone_format_command(command, sizeof(command), miclone_pump_address(i % options.pumps), "Q");
+
+        int64_t start = bench_micros();
+        if (miclone_exchange(transport, timing, command, response, timing.attempts) == MICLONE_OK) {
+            queries.samples.push_back(bench_micros() - start);
+        }
+        else ++queries.failures;
+    }
+
+    bench_report("query", queries, (bench_micros() - begin) / 1e6);
+    return queries.failures <= options.maxFailures;
+}
+
+typedef struct {
+    MiCloneScheduler *scheduler;
+    uint32_t remaining[MICLONE_MAX_PUMPS];      // cycles left to start
+    int64_t started[MICLONE_MAX_PUMPS];         // us, when the cycle or its stop was requested
+    int64_t cycleStart[MICLONE_MAX_PUMPS];
+    bool stopSent[MICLONE_MAX_PUMPS];
+    bool changed;                               // a pump changed state in the last step
+    BenchSeries_t starts, stops, cycles;
+    uint32_t completed;
+} BenchCycles_t;
+
+static void bench_on_state(void *arg, uint8_t pump, MiCloneState_t from, MiCloneState_t to)
+{
+    BenchCycles_t &bench = *static_cast<BenchCycles_t *>(arg);
+    const MiClonePump_t &state = bench.scheduler->pump(pump);
+    int64_t now = bench_micros();
+    bench.changed = true;
+
+    if (from == MICLONE_STARTING) {
+        if (to == MICLONE_RUNNING) bench.starts.samples.push_back(now - bench.started[pump]);
+        else ++bench.starts.failures;
+    }
+
+    if (to != MICLONE_IDLE) return;
+
+    // a stop requested by the bench is timed from the request, a timed run from its end
+    if (!state.acknowledged) ++bench.stops.failures;
+    else if (bench.stopSent[pump]) bench.stops.samples.push_back(now - bench.started[pump]);
+
+    if (state.acknowledged && state.reason != MICLONE_STOP_ERROR) {
+        bench.cycles.samples.push_back(now - bench.cycleStart[pump]);
+    }
+    else {
+        ++bench.cycles.failures;
+        fprintf(stderr, "pump %c cycle failed: %s\n", state.address,
+                state.reason == MICLONE_STOP_ERROR ? miclone_result_str(state.stopResult) : "stop not acknowledged");
+    }
+
+    ++bench.completed;
+}
+
+static bool bench_cycles(const MiCloneTransport_t &transport, const MiCloneTiming_t &timing, const BenchOptions_t &options, bool progress)
+{
+    BenchCycles_t bench = {};
+    MiCloneScheduler scheduler(transport, timing, bench_on_state, &bench);
+    bench.scheduler = &scheduler;
+
+    for (uint8_t i = 0; i < options.pumps; ++i) {
+        scheduler.addPump(miclone_pump_address(i));
+        bench.remaining[i] = options.count;
+    }
+
+    uint32_t total = options.count * options.pumps;
+    int64_t begin = bench_micros();
+
+    while (bench.completed < total) {
+        for (uint8_t i = 0; i < options.pumps; ++i) {
+            const MiClonePump_t &pump = scheduler.pump(i);
+
+            if (pump.state == MICLONE_IDLE && bench.remaining[i]) {
+                --bench.remaining[i];
+                bench.started[i] = bench.cycleStart[i] = bench_micros();
+                bench.stopSent[i] = false;
+                scheduler.start(i, options.rate, options.run);
+            }
+            else if (pump.state == MICLONE_RUNNING && !options.run && !bench.stopSent[i]) {
+                bench.started[i] = bench_micros();
+                bench.stopSent[i] = true;
+                scheduler.stop(i);
+            }
+        }
+
+        // a state change may have left the bench something to do, such as stopping a run
+        uint32_t completed = bench.completed;
+        bench.changed = false;
+        uint32_t wait = scheduler.step(bench_millis(nullptr));
+        if (wait && !bench.changed) usleep(std::min<uint32_t>(wait, 100) * 1000);
+
+        if (progress && bench.completed / 100 != completed / 100) {
+            printf("%u cycles, %u failed\n", bench.completed, bench.cycles.failures);
+            fflush(stdout);
+        }
+    }
+
+    double seconds = (bench_micros() - begin) / 1e6;
+    uint32_t commands = 0;
+    for (uint8_t i = 0; i < options.pumps; ++i) commands += scheduler.pump(i).commands;
+
+    bench_report("start", bench.starts, 0);
+    bench_report("stop", bench.stops, 0);
+    bench_report("cycle", bench.cycles, seconds);
+    printf("%u pumps, %u commands, %.1f commands/s\n", options.pumps, commands, commands / seconds);
+
+    return bench.cycles.failures <= options.maxFailures;
+}
+
+static void bench_usage(const char *name)
+{
+    fprintf(stderr, "usage: %s DEVICE throughput|startstop|endurance [-n COUNT] [--pumps N] [--rate UL_MIN] "
+                    "[--run MS] [--timeout MS] [--poll MS] [--max-failures N]\n", name);
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 3) {
+        bench_usage(argv[0]);
+        return 2;
+    }
+
+    const char *device = argv[1];
+    const char *mode = argv[2];
+
+    BenchOptions_t options = { 100, 300, 0, 0, 1 };
+    MiCloneTiming_t timing = { MICLONE_RESPONSE_TIMEOUT, MICLONE_ATTEMPTS, MICLONE_POLL_INTERVAL, MICLONE_READY_TIMEOUT };
+
+    for (int i = 3; i + 1 < argc; i += 2) {
+        const char *arg = argv[i];
+        uint32_t value = strtoul(argv[i + 1], nullptr, 10);
+
+        if      (!strcmp(arg, "-n"))             options.count = value;
+        else if (!strcmp(arg, "--pumps"))        options.pumps = value;
+        else if (!strcmp(arg, "--rate"))         options.rate = value;
+        else if (!strcmp(arg, "--run"))          options.run = value;
+        else if (!strcmp(arg, "--max-failures")) options.maxFailures = value;
+        else if (!strcmp(arg, "--timeout"))      timing.timeout = value;
+        else if (!strcmp(arg, "--poll"))         timing.pollInterval = value;
+        else {
+            bench_usage(argv[0]);
+            return 2;
+        }
+    }
+
+    if (options.pumps < 1 || options.pumps > MICLONE_MAX_PUMPS) {
+        fprintf(stderr, "--pumps must be 1 to %d\n", MICLONE_MAX_PUMPS);
+        return 2;
+    }
+
+    BenchPort_t port;
+    port.replies = 0;
+    port.rejections = 0;
+    if (!bench_open(port, device)) return 1;
+
+    CollectorUartOps_t ops = { &port.uart, bench_uart_read, bench_uart_write, bench_uart_pop_pattern, bench_uart_flush };
+    CollectorLink link(ops, bench_on_frame, &port);
+    port.link = &link;
+
+    MiCloneTransport_t transport = {
+        &port,
+        bench_send,
+        bench_receive,
+        bench_flush,
+        bench_sleep,
+        bench_millis,
+        bench_on_reply
+    };
+
+    bool passed;
+    if      (!strcmp(mode, "throughput")) passed = bench_throughput(transport, timing, options);
+    else if (!strcmp(mode, "startstop"))  passed = bench_cycles(transport, timing, options, false);
+    else if (!strcmp(mode, "endurance"))  passed = bench_cycles(transport, timing, options, true);
+    else {
+        bench_usage(argv[0]);
+        return 2;
+    }
+
+    printf("link: %u frames, %u dropped, %u replies, %u rejected\n",
+           link.frameCount(), link.droppedFrameCount(), port.replies, port.rejections);
+    printf("%s\n", passed ? "PASS" : "FAIL");
+
+    close(port.uart.fd);
+    return passed ? 0 : 1;
+}
@@ -0,0 +1,354 @@
+// MiClone pump controller simulator. Opens a pseudo-terminal and answers the
+// commands the firmware sends as the controller would, with response delays and
+// optional error injection, so the driver can be exercised without hardware.
+//
+//   pumpsim [--link PATH] [--pumps N] [--baud BAUD] [--delay MS] [--jitter MS] [--settle MS]
+//           [--drop PCT] [--corrupt PCT] [--overflow PCT] [--seed N] [--verbose]
+//
+// --pumps answers addresses /1 to /N on the one line, like controllers sharing
+// an RS-485 bus. --baud adds the time the command and reply take on the wire
+//
+// The slave side of the pty is printed on stdout, and symlinked to PATH with --link.
+// SIGINT or SIGTERM prints the command counters and exits
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SIM_LINE_SIZE           128
+#define SIM_MAX_PUMPS           9
+#define SIM_REPLY_SIZE          7
+
+#define SIM_STATUS_BASE         0x40
+#define SIM_STATUS_READY        0x20
+
+// controller error codes, see MiCloneError_t
+#define SIM_ERROR_NONE              0
+#define SIM_ERROR_INVALID_COMMAND   2
+#define SIM_ERROR_INVALID_OPERAND   3
+#define SIM_ERROR_COMMAND_OVERFLOW  15
+
+typedef struct {
+    const char *link;
+    uint32_t pumps;
+    uint32_t baud;          // 0 for no line time
+    uint32_t delay;         // ms before each reply
+    uint32_t jitter;        // up to this many ms added to each delay
+    uint32_t settle;        // ms the controller stays busy after a terminate or valve move
+    uint32_t drop;          // percent of replies never sent
+    uint32_t corrupt;       // percent of replies with a damaged frame
+    uint32_t overflow;      // percent of commands answered with a command overflow
+    unsigned seed;
+    bool verbose;
+} SimOptions_t;
+
+typedef struct {
+    bool running;           // a program is executing
+    int64_t busyUntil;      // ms, not ready before this time
+    uint32_t velocity;
+    uint32_t valve;
+} SimPump_t;
+
+typedef struct {
+    uint32_t commands;
+    uint32_t replies;
+    uint32_t dropped;
+    uint32_t corrupted;
+    uint32_t overflows;
+    uint32_t rejected;
+    uint32_t starts;
+    uint32_t stops;
+} SimStats_t;
+
+static volatile sig_atomic_t _simQuit = 0;
+static SimOptions_t _options = { nullptr, 1, 0, 5, 0, 20, 0, 0, 0, 1, false };
+static SimPump_t _pumps[SIM_MAX_PUMPS] = {};
+static SimStats_t _stats = {};
+
+static int64_t sim_millis()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static void sim_sleep(uint32_t ms)
+{
+    struct timespec wait = { (time_t) (ms / 1000), (long) (ms % 1000) * 1000000L };
+    while (nanosleep(&wait, &wait) && errno == EINTR && !_simQuit) { }
+}
+
+static bool sim_chance(uint32_t percent)
+{
+    return percent && (uint32_t) (rand() % 100) < percent;
+}
+
+static void sim_on_signal(int)
+{
+    _simQuit = 1;
+}
+
+static bool sim_ready(const SimPump_t &pump)
+{
+    return !pump.running && sim_millis() >= pump.busyUntil;
+}
+
+/**
+ * Checks a program is a sequence of known commands, each a letter with an optional
+ * numeric operand. Returns an error code and the velocity operand, if any
+ */
+static uint8_t sim_check_program(const char *program, uint32_t &velocity)
+{
+    static const char *commands = "ZJgVIPODGMTQRLvcKkh";
+
+    for (const char *c = program; *c; ) {
+        if (!strchr(commands, *c)) return SIM_ERROR_INVALID_COMMAND;
+        char command = *c++;
+
+        uint32_t operand = 0;
+        bool hasOperand = false;
+        while (*c >= '0' && *c <= '9') {
+            operand = operand * 10 + (*c++ - '0');
+            hasOperand = true;
+            if (operand > 1000000) return SIM_ERROR_INVALID_OPERAND;
+        }
+
+        if (command == 'V' && hasOperand) {
+            if (operand < 1 || operand > 6000) return SIM_ERROR_INVALID_OPERAND;
+            velocity = operand;
+        }
+        if (command == 'J' && operand > 7) return SIM_ERROR_INVALID_OPERAND;
+    }
+
+    return SIM_ERROR_NONE;
+}
+
+/**
+ * Applies a command addressed to this controller. Returns the error code to reply with
+ */
+static uint8_t sim_execute(SimPump_t &pump, const char *body)
+{
+    if (!strcmp(body, "Q")) return SIM_ERROR_NONE;
+
+    size_t length = strlen(body);
+    if (!length || body[length - 1] != 'R') return SIM_ERROR_INVALID_COMMAND;
+
+    char program[SIM_LINE_SIZE];
+    memcpy(program, body, length - 1);
+    program[length - 1] = '\0';
+
+    uint32_t velocity = pump.velocity;
+    uint8_t error = sim_check_program(program, velocity);
+    if (error) return error;
+
+    int64_t now = sim_millis();
+
+    // terminate is accepted at any time, the plunger takes a moment to come to rest
+    if (strchr(program, 'T')) {
+        if (pump.running) ++_stats.stops;
+        pump.running = false;
+        pump.busyUntil = now + _options.settle;
+        if (program[0] == 'J') pump.valve = atoi(program + 1);
+        return SIM_ERROR_NONE;
+    }
+
+    // anything else while busy overflows the command buffer
+    if (!sim_ready(pump)) return SIM_ERROR_COMMAND_OVERFLOW;
+
+    if (program[0] == 'Z') {
+        // the start program loops until it is terminated
+        pump.running = true;
+        pump.velocity = velocity;
+        ++_stats.starts;
+        return SIM_ERROR_NONE;
+    }
+
+    if (program[0] == 'J') {
+        pump.valve = atoi(program + 1);
+        pump.busyUntil = now + _options.settle;
+    }
+
+    return SIM_ERROR_NONE;
+}
+
+static void sim_reply(int fd, const SimPump_t &pump, uint8_t error)
+{
+    char reply[SIM_REPLY_SIZE];
+    size_t length = 0;
+    uint8_t status = SIM_STATUS_BASE | (sim_ready(pump) ? SIM_STATUS_READY : 0) | (error & 0x0F);
+
+    reply[length++] = (char) 0xFF;
+    reply[length++] = '/';
+    reply[length++] = '0';
+    reply[length++] = status;
+    reply[length++] = 0x03;
+    reply[length++] = '\r';
+    reply[length++] = '\n';
+
+    if (sim_chance(_options.corrupt)) {
+        // either noise in place of the status byte or a lost ETX
+        if (rand() & 1) reply[3] = 0x15;
+        else reply[4] = '?';
+        ++_stats.corrupted;
+    }
+
+    if (write(fd, reply, length) == (ssize_t) length) ++_stats.replies;
+}
+
+static void sim_handle_line(int fd, const char *line)
+{
+    ++_stats.commands;
+    if (_options.verbose) fprintf(stderr, "<- %s\n", line);
+
+    // the command and its reply occupy the line, 10 bits a byte
+    uint32_t lineTime = _options.baud ? (strlen(line) + 1 + SIM_REPLY_SIZE) * 10000 / _options.baud : 0;
+
+    // other addresses share the bus and get no reply
+    uint32_t index = line[0] == '/' ? line[1] - '1' : SIM_MAX_PUMPS;
+    if (index >= _options.pumps) {
+        sim_sleep(lineTime);
+        return;
+    }
+    SimPump_t &pump = _pumps[index];
+
+    // an injected overflow drops the command without executing it, as the controller does
+    uint8_t error = sim_chance(_options.overflow) ? SIM_ERROR_COMMAND_OVERFLOW : sim_execute(pump, line + 2);
+    if (error == SIM_ERROR_COMMAND_OVERFLOW) ++_stats.overflows;
+    else if (error) ++_stats.rejected;
+
+    sim_sleep(lineTime + _options.delay + (_options.jitter ? rand() % (_options.jitter + 1) : 0));
+
+    if (sim_chance(_options.drop)) {
+        ++_stats.dropped;
+        return;
+    }
+
+    sim_reply(fd, pump, error);
+}
+
+static bool sim_parse_options(int argc, char **argv)
+{
+    for (int i = 1; i < argc; ++i) {
+        const char *arg = argv[i];
+        const char *value = i + 1 < argc ? argv[i + 1] : nullptr;
+
+        if (!strcmp(arg, "--verbose")) {
+            _options.verbose = true;
+            continue;
+        }
+        if (!value) return false;
+        ++i;
+
+        if      (!strcmp(arg, "--link"))     _options.link = value;
+        else if (!strcmp(arg, "--pumps"))    _options.pumps = atoi(value);
+        else if (!strcmp(arg, "--baud"))     _options.baud = atoi(value);
+        else if (!strcmp(arg, "--delay"))    _options.delay = atoi(value);
+        else if (!strcmp(arg, "--jitter"))   _options.jitter = atoi(value);
+        else if (!strcmp(arg, "--settle"))   _options.settle = atoi(value);
+        else if (!strcmp(arg, "--drop"))     _options.drop = atoi(value);
+        else if (!strcmp(arg, "--corrupt"))  _options.corrupt = atoi(value);
+        else if (!strcmp(arg, "--overflow")) _options.overflow = atoi(value);
+        else if (!strcmp(arg, "--seed"))     _options.seed = atoi(value);
+        else return false;
+    }
+
+    return _options.pumps >= 1 && _options.pumps <= SIM_MAX_PUMPS;
+}
+
+int main(int argc, char **argv)
+{
+    if (!sim_parse_options(argc, argv)) {
+        fprintf(stderr, "usage: %s [--link PATH] [--pumps N] [--baud BAUD] [--delay MS] [--jitter MS] [--settle MS] "
+                        "[--drop PCT] [--corrupt PCT] [--overflow PCT] [--seed N] [--verbose]\n", argv[0]);
+        return 2;
+    }
+    srand(_options.seed);
+
+    int master = posix_openpt(O_RDWR | O_NOCTTY);
+    if (master < 0 || grantpt(master) || unlockpt(master)) {
+        perror("pumpsim: pty");
+        return 1;
+    }
+
+    const char *slaveName = ptsname(master);
+
+    // hold the slave open so the master doesn't see a hangup between clients,
+    // and make it raw so CR and LF pass through untouched
+    int slave = open(slaveName, O_RDWR | O_NOCTTY);
+    struct termios tio;
+    if (slave < 0 || tcgetattr(slave, &tio)) {
+        perror("pumpsim: slave");
+        return 1;
+    }
+    cfmakeraw(&tio);
+    cfsetspeed(&tio, B9600);
+    tcsetattr(slave, TCSANOW, &tio);
+
+    if (_options.link) {
+        unlink(_options.link);
+        if (symlink(slaveName, _options.link)) {
+            perror("pumpsim: link");
+            return 1;
+        }
+    }
+
+    struct sigaction action = {};
+    action.sa_handler = sim_on_signal;
+    sigaction(SIGINT, &action, nullptr);
+    sigaction(SIGTERM, &action, nullptr);
+
+    printf("%s\n", slaveName);
+    fflush(stdout);
+
+    char line[SIM_LINE_SIZE];
+    size_t lineLength = 0;
+    bool discarding = false;
+
+    while (!_simQuit) {
+        struct pollfd pfd = { master, POLLIN, 0 };
+        if (poll(&pfd, 1, 100) <= 0) continue;
+
+        char buffer[256];
+        ssize_t received = read(master, buffer, sizeof(buffer));
+        if (received <= 0) {
+            if (received < 0 && errno != EAGAIN && errno != EINTR && errno != EIO) break;
+            continue;
+        }
+
+        // commands end in CR, a stray LF is ignored
+        for (ssize_t i = 0; i < received; ++i) {
+            char c = buffer[i];
+            if (c == '\n') continue;
+
+            if (c != '\r') {
+                if (lineLength < sizeof(line) - 1) line[lineLength++] = c;
+                else discarding = true;
+                continue;
+            }
+
+            line[lineLength] = '\0';
+            if (lineLength && !discarding) sim_handle_line(master, line);
+            lineLength = 0;
+            discarding = false;
+        }
+    }
+
+    if (_options.link) unlink(_options.link);
+
+    fprintf(stderr, "pumpsim: %u commands, %u replies, %u dropped, %u corrupted, "
+                    "%u overflows, %u rejected, %u starts, %u stops\n",
+            _stats.commands, _stats.replies, _stats.dropped, _stats.corrupted,
+            _stats.overflows, _stats.rejected, _stats.starts, _stats.stops);
+
+    close(slave);
+    close(master);
+    return 0;
+}
@@ -0,0 +1,114 @@
+"""
+Converts run telemetry recorded on the SD card (/runs/run_NNNN.bin) to CSV.
+
+    python runlog_to_csv.py run_0001.bin [run_0002.bin ...]
+
+Each input is written next to it with a .csv extension. The layout matches
+RunFileHeader_t and RunRecord_t in src/diagnostics/runrecorder.h.
+"""
+
+import csv
+import os
+import struct
+import sys
+
+MAGIC = 0x544E5552
+VERSION = 1
+
+HEADER = struct.Struct('<IHHII')
+RECORD = struct.Struct('<IIHHBBBB')
+
+RECORD_TYPES = {
+    1: 'start',
+    2: 'sample',
+    3: 'pump_ack',
+    4: 'rate',
+    5: 'touch',
+    6: 'stop',
+    7: 'dropped',
+}
+
+STOP_REASONS = ['complete', 'manual', 'error']
+TOUCH_ACTIONS = ['start', 'stop']
+
+STATUS_READY_BIT = 0x20
+STATUS_ERROR_MASK = 0x0F
+
+COLUMNS = ['time_ms', 'elapsed_ms', 'type', 'rate_ul_min', 'pump_status', 'pump_ready',
+           'pump_error', 'battery_mv', 'battery_soc', 'detail']
+
+
+def aprint(message):
+    print('-> {}'.format(message))
+
+
+def describe(record_type, arg, elapsed):
+    if record_type == 6:
+        return STOP_REASONS[arg] if arg < len(STOP_REASONS) else arg
+    if record_type == 5:
+        return TOUCH_ACTIONS[arg] if arg < len(TOUCH_ACTIONS) else arg
+    if record_type == 3:
+        return 'accepted' if arg else 'rejected'
+    if record_type == 7:
+        return '{} records lost'.format(elapsed)
+    return ''
+
+
+def convert(path):
+    with open(path, 'rb') as f:
+        data = f.read()
+
+    if len(data) < HEADER.size:
+        raise ValueError('file is too short')
+
+    magic, version, record_size, sample_interval, run_index = HEADER.unpack_from(data, 0)
+    if magic != MAGIC:
+        raise ValueError('not a run record')
+    if version != VERSION or record_size != RECORD.size:
+        raise ValueError('unsupported version {} with {} byte records'.format(version, record_size))
+
+    csv_path = os.path.splitext(path)[0] + '.csv'
+    count = 0
+
+    with open(csv_path, 'w', newline='') as out:
+        writer = csv.writer(out)
+        writer.writerow(COLUMNS)
+
+        # a trailing partial record means power was lost mid-write, it is skipped
+        for offset in range(HEADER.size, len(data) - RECORD.size + 1, RECORD.size):
+            time, elapsed, rate, millivolts, record_type, status, soc, arg = RECORD.unpack_from(data, offset)
+            writer.writerow([
+                time,
+                '' if record_type == 7 else elapsed,
+                RECORD_TYPES.get(record_type, record_type),
+                rate,
+                '0x{:02X}'.format(status),
+                int(bool(status & STATUS_READY_BIT)),
+                status & STATUS_ERROR_MASK,
+                millivolts,
+                soc,
+                describe(record_type, arg, elapsed),
+            ])
+            count += 1
+
+    aprint('Run {} ({} ms samples): {} records -> {}'.format(run_index, sample_interval, count, csv_path))
+
+
+def main(paths):
+    if not paths:
+        print(__doc__)
+        return 1
+
+    failed = False
+    for path in paths:
+        try:
+            convert(path)
+        except (OSError, ValueError) as e:
+            aprint('Error: {}: {}'.format(path, e))
+            failed = True
+
+    return 1 if failed else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main(sys.argv[1:]))
@@ -0,0 +1,24 @@
+#!/bin/sh
+# Mirrors usbsim's screen over a link that loses frames, taps it, and compares
+# the copy the viewer ends up with against the screen the simulator ends up with
+#
+#   screen_check.sh BUILD_DIR
+
+set -e
+
+build=$1
+link=$build/screenview.tty
+
+rm -f "$build/screen.ppm" "$build/view.ppm"
+
+"$build/usbsim" --link "$link" --drop 2 --seed 9 --screen-dump "$build/screen.ppm" > /dev/null 2>&1 &
+pid=$!
+trap 'kill $pid 2> /dev/null; wait $pid' EXIT
+for i in 1 2 3 4 5 6 7 8 9 10; do [ -e "$link" ] && break; sleep 0.1; done
+
+"$build/screenview" "$link" --baud 115200 --tap 200,150 --snapshot "$build/view.ppm"
+
+kill $pid
+wait $pid || true
+trap - EXIT
+cmp "$build/screen.ppm" "$build/view.ppm"
@@ -0,0 +1,426 @@
+// Mirrors the unit's display over the binary USB-C link, for seeing what an
+// operator in the field sees.
+//
+//   screenview DEVICE [--max-baud BAUD | --baud BAUD] [--scale N] [--touch]
+//   screenview DEVICE [--max-baud BAUD | --baud BAUD] [--tap X,Y] --snapshot PPM
+//
+// The first form opens a window that follows the display live. With --touch,
+// clicks and drags in the window are sent to the unit as touches, which it only
+// accepts after "!screen-touch on" on its console. The second form copies the
+// screen once, optionally taps it and copies the result, and writes it to PPM.
+// The window needs X11; without it only --snapshot is built in.
+//
+// Only tiles the device saw change are sent, run-length encoded, so a screen the
+// UI keeps repainting with the same content costs almost nothing on the link
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <vector>
+
+#ifdef SCREENVIEW_X11
+#include <X11/Xlib.h>
+#include <X11/Xutil.h>
+#include <sys/select.h>
+#endif
+
+#include "../usbhost/usbhost.hpp"
+#include "driver/screenmirror.hpp"
+
+#define SCREENVIEW_IDLE_POLL        100     // ms between polls while nothing changes
+#define SCREENVIEW_TAP_HOLD         150     // ms a --tap is held, long enough for the touch debounce
+#define SCREENVIEW_DRAG_INTERVAL    40      // ms between touch moves sent while dragging
+
+using namespace Driver;
+
+typedef struct {
+    const char *device;
+    uint32_t maxBaud;
+    uint32_t baud;          // 0 to negotiate
+    int scale;
+    bool touch;
+    const char *snapshot;
+    bool tap;
+    uint16_t tapX;
+    uint16_t tapY;
+} ViewOptions_t;
+
+static ViewOptions_t _options = { nullptr, 921600, 0, 1, false, nullptr, false, 0, 0 };
+
+// the screen as the host has it
+static ScreenMirrorInfo_t _info;
+static std::vector<uint16_t> _screen;
+
+typedef struct {
+    uint32_t polls;
+    uint32_t tiles;
+    uint64_t bytes;         // reply payloads
+} ViewStats_t;
+
+static ViewStats_t _stats = { };
+
+static bool _touchRefused = false;
+
+static double view_seconds()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static void view_sleep(uint32_t ms)
+{
+    struct timespec wait = { (time_t) (ms / 1000), (long) (ms % 1000) * 1000000L };
+    nanosleep(&wait, nullptr);
+}
+
+static bool view_parse_options(int argc, char **argv)
+{
+    for (int i = 1; i < argc; ++i) {
+        const char *arg = argv[i];
+
+        if (!strcmp(arg, "--touch")) {
+            _options.touch = true;
+            continue;
+        }
+        if (arg[0] != '-') {
+            if (_options.device) return false;
+            _options.device = arg;
+            continue;
+        }
+        if (++i == argc) return false;
+        const char *value = argv[i];
+
+        if      (!strcmp(arg, "--max-baud"))    _options.maxBaud = atoi(value);
+        else if (!strcmp(arg, "--baud"))        _options.baud = atoi(value);
+        else if (!strcmp(arg, "--scale"))       _options.scale = atoi(value);
+        else if (!strcmp(arg, "--snapshot"))    _options.snapshot = value;
+        else if (!strcmp(arg, "--tap")) {
+            unsigned x, y;
+            if (sscanf(value, "%u,%u", &x, &y) != 2) return false;
+            _options.tap = true;
+            _options.tapX = x;
+            _options.tapY = y;
+        }
+        else return false;
+    }
+
+    return _options.device && _options.scale >= 1 && _options.scale <= 4 && (!_options.tap || _options.snapshot);
+}
+
+static bool view_start(UsbHost &host)
+{
+    std::vector<uint8_t> reply;
+    if (!host.request(USBFRAME_SCREEN_START, nullptr, 0, reply) || reply.size() != sizeof(_info)) return false;
+
+    memcpy(&_info, reply.data(), sizeof(_info));
+    if (_info.format != SCREENMIRROR_RLE565 || !_info.tileSize || !_info.width || !_info.height) return false;
+
+    _screen.assign(_info.width * _info.height, 0);
+    return true;
+}
+
+/**
+ * @brief Asks for the next damaged tiles and paints them into _screen
+ *
+ * @param painted called with each tile painted, for the window to redraw
+ * @return false no reply, or one that doesn't decode
+ */
+template <typename Painted>
+static bool view_poll(UsbHost &host, ScreenMirrorPoll_t &header, Painted painted)
+{
+    std::vector<uint8_t> reply;
+    if (!host.request(USBFRAME_SCREEN_POLL, nullptr, 0, reply) || reply.size() < sizeof(header)) return false;
+    ++_stats.polls;
+    _stats.bytes += reply.size();
+
+    memcpy(&header, reply.data(), sizeof(header));
+    size_t offset = sizeof(header);
+    uint16_t columns = (_info.width + _info.tileSize - 1) / _info.tileSize;
+    std::vector<uint16_t> pixels(_info.tileSize * _info.tileSize);
+
+    for (uint16_t i = 0; i < header.tiles; ++i) {
+        uint16_t tile;
+        if (reply.size() - offset < sizeof(tile)) return false;
+        memcpy(&tile, reply.data() + offset, sizeof(tile));
+        offset += sizeof(tile);
+
+        uint16_t x = (tile % columns) * _info.tileSize;
+        uint16_t y = (tile / columns) * _info.tileSize;
+        if (x >= _info.width || y >= _info.height) return false;
+        uint16_t w = _info.width - x < _info.tileSize ? _info.width - x : _info.tileSize;
+        uint16_t h = _info.height - y < _info.tileSize ? _info.height - y : _info.tileSize;
+
+        size_t used = screenmirror_rle_decode(reply.data() + offset, reply.size() - offset, pixels.data(), w * h);
+        if (!used) return false;
+        offset += used;
+
+        for (uint16_t row = 0; row < h; ++row) {
+            memcpy(&_screen[(y + row) * _info.width + x], &pixels[row * w], w * sizeof(uint16_t));
+        }
+        ++_stats.tiles;
+        painted(x, y, w, h);
+    }
+
+    return offset == reply.size();
+}
+
+// polls until the device has nothing left to send
+static bool view_sync(UsbHost &host)
+{
+    ScreenMirrorPoll_t header = { 0, 1 };
+    while (header.tiles || header.pending) {
+        if (!view_poll(host, header, [](uint16_t, uint16_t, uint16_t, uint16_t) { })) return false;
+    }
+    return true;
+}
+
+static bool view_touch(UsbHost &host, ScreenMirrorTouchType_t type, int x, int y)
+{
+    if (x < 0 || y < 0 || x >= _info.width || y >= _info.height) return false;
+
+    ScreenMirrorTouch_t touch = { type, (uint16_t) x, (uint16_t) y };
+    std::vector<uint8_t> reply;
+    UsbFrameError_t error = USBFRAME_ERROR_NONE;
+    if (host.request(USBFRAME_SCREEN_TOUCH, reinterpret_cast<const uint8_t *>(&touch), sizeof(touch), reply, &error)) return true;
+
+    if (error == USBFRAME_ERROR_REFUSED && !_touchRefused) {
+        fprintf(stderr, "screenview: the unit refuses touches, enable them on its console with !screen-touch on\n");
+        _touchRefused = true;
+    }
+    return false;
+}
+
+static bool view_write_ppm(const char *path)
+{
+    FILE *f = fopen(path, "wb");
+    if (!f) return false;
+
+    fprintf(f, "P6\n%d %d\n255\n", _info.width, _info.height);
+    for (uint16_t pixel : _screen) {
+        uint8_t rgb[3] = { (uint8_t) ((pixel >> 11) << 3), (uint8_t) (((pixel >> 5) & 0x3F) << 2), (uint8_t) ((pixel & 0x1F) << 3) };
+        fwrite(rgb, 1, sizeof(rgb), f);
+    }
+    return !fclose(f);
+}
+
+static bool view_snapshot(UsbHost &host)
+{
+    if (!view_sync(host)) return false;
+
+    if (_options.tap) {
+        if (!view_touch(host, SCREENMIRROR_TOUCH_DOWN, _options.tapX, _options.tapY)) return false;
+        view_sleep(SCREENVIEW_TAP_HOLD);
+        if (!view_touch(host, SCREENMIRROR_TOUCH_UP, _options.tapX, _options.tapY)) return false;
+        if (!view_sync(host)) return false;
+    }
+
+    if (!view_write_ppm(_options.snapshot)) {
+        perror("screenview: snapshot");
+        return false;
+    }
+    return true;
+}
+
+#ifdef SCREENVIEW_X11
+
+/**
+ * @brief Follows the screen in a window until it is closed or q is pressed
+ */
+static bool view_window(UsbHost &host)
+{
+    Display *display = XOpenDisplay(nullptr);
+    if (!display) {
+        fprintf(stderr, "screenview: cannot open the X display, use --snapshot without one\n");
+        return false;
+    }
+
+    const int scale = _options.scale;
+    const int width = _info.width * scale;
+    const int height = _info.height * scale;
+    int screen = DefaultScreen(display);
+    Visual *visual = DefaultVisual(display, screen);
+    if (DefaultDepth(display, screen) < 24) {
+        fprintf(stderr, "screenview: needs a 24 or 32-bit display\n");
+        XCloseDisplay(display);
+        return false;
+    }
+
+    Window window = XCreateSimpleWindow(display, RootWindow(display, screen), 0, 0, width, height, 0, 0, 0);
+    XSelectInput(display, window, ExposureMask | KeyPressMask | ButtonPressMask | ButtonReleaseMask | Button1MotionMask);
+    Atom closed = XInternAtom(display, "WM_DELETE_WINDOW", False);
+    XSetWMProtocols(display, window, &closed, 1);
+    XMapWindow(display, window);
+    GC gc = XCreateGC(display, window, 0, nullptr);
+
+    // XDestroyImage frees the pixels
+    uint32_t *pixels = static_cast<uint32_t *>(calloc(width * height, sizeof(uint32_t)));
+    XImage *image = XCreateImage(display, visual, DefaultDepth(display, screen), ZPixmap, 0,
+                                 reinterpret_cast<char *>(pixels), width, height, 32, 0);
+
+    auto painted = [&](uint16_t x, uint16_t y, uint16_t w, uint16_t h) {
+        for (int row = y * scale; row < (y + h) * scale; ++row) {
+            for (int column = x * scale; column < (x + w) * scale; ++column) {
+                uint16_t pixel = _screen[(row / scale) * _info.width + column / scale];
+                pixels[row * width + column] = ((pixel >> 11) << 19) | (((pixel >> 5) & 0x3F) << 10) | ((pixel & 0x1F) << 3);
+            }
+        }
+        XPutImage(display, window, gc, image, x * scale, y * scale, x * scale, y * scale, w * scale, h * scale);
+    };
+
+    bool ok = true;
+    bool running = true;
+    bool pressed = false;
+    double nextPoll = 0;
+    double nextMove = 0;
+    double rateStart = view_seconds();
+    uint64_t rateBytes = _stats.bytes;
+    int fd = ConnectionNumber(display);
+
+    while (running) {
+        while (XPending(display)) {
+            XEvent event;
+            XNextEvent(display, &event);
+
+            switch (event.type) {
+            case Expose:
+                painted(0, 0, _info.width, _info.height);
+                break;
+
+            case KeyPress:
+                if (XLookupKeysym(&event.xkey, 0) == XK_q) running = false;
+                break;
+
+            case ClientMessage:
+                if ((Atom) event.xclient.data.l[0] == closed) running = false;
+                break;
+
+            case ButtonPress:
+                if (_options.touch && event.xbutton.button == Button1) {
+                    pressed = view_touch(host, SCREENMIRROR_TOUCH_DOWN, event.xbutton.x / scale, event.xbutton.y / scale);
+                    nextPoll = 0;
+                }
+                break;
+
+            case MotionNotify:
+                if (pressed && view_seconds() >= nextMove) {
+                    view_touch(host, SCREENMIRROR_TOUCH_MOVE, event.xmotion.x / scale, event.xmotion.y / scale);
+                    nextMove = view_seconds() + SCREENVIEW_DRAG_INTERVAL / 1000.0;
+                }
+                break;
+
+            case ButtonRelease:
+                if (pressed && event.xbutton.button == Button1) {
+                    // off the window the touch ends where it was last seen
+                    int x = event.xbutton.x / scale;
+                    int y = event.xbutton.y / scale;
+                    x = x < 0 ? 0 : x >= _info.width ? _info.width - 1 : x;
+                    y = y < 0 ? 0 : y >= _info.height ? _info.height - 1 : y;
+                    view_touch(host, SCREENMIRROR_TOUCH_UP, x, y);
+                    pressed = false;
+                    nextPoll = 0;
+                }
+                break;
+            }
+        }
+        if (!running) break;
+
+        double now = view_seconds();
+        if (now >= nextPoll) {
+            ScreenMirrorPoll_t header;
+            if (!view_poll(host, header, painted)) {
+                fprintf(stderr, "screenview: lost the unit\n");
+                ok = false;
+                break;
+            }
+            nextPoll = header.tiles || header.pending ? 0 : now + SCREENVIEW_IDLE_POLL / 1000.0;
+            XFlush(display);
+        }
+
+        if (now - rateStart >= 1) {
+            char title[96];
+            snprintf(title, sizeof(title), "screenview %ux%u at %u baud, %.1f KB/s",
+                     _info.width, _info.height, host.baud(), (_stats.bytes - rateBytes) / 1024.0 / (now - rateStart));
+            XStoreName(display, window, title);
+            rateStart = now;
+            rateBytes = _stats.bytes;
+        }
+
+        // sleep until the next poll unless the window has something to say
+        if (nextPoll > now) {
+            fd_set fds;
+            FD_ZERO(&fds);
+            FD_SET(fd, &fds);
+            struct timeval wait = { 0, (long) ((nextPoll - now) * 1e6) };
+            select(fd + 1, &fds, nullptr, nullptr, &wait);
+        }
+    }
+
+    XDestroyImage(image);
+    XFreeGC(display, gc);
+    XDestroyWindow(display, window);
+    XCloseDisplay(display);
+    return ok;
+}
+
+#else
+
+static bool view_window(UsbHost &)
+{
+    fprintf(stderr, "screenview: built without X11, only --snapshot is available\n");
+    return false;
+}
+
+#endif
+
+int main(int argc, char **argv)
+{
+    if (!view_parse_options(argc, argv)) {
+        fprintf(stderr, "usage: %s DEVICE [--max-baud BAUD | --baud BAUD] [--scale N] [--touch]\n"
+                        "       %s DEVICE [--max-baud BAUD | --baud BAUD] [--tap X,Y] --snapshot PPM\n",
+                argv[0], argv[0]);
+        return 2;
+    }
+
+    UsbHost host;
+    if (!host.open(_options.device)) {
+        perror("screenview: open");
+        return 1;
+    }
+
+    if (!host.enterBinary()) {
+        fprintf(stderr, "screenview: no answer in binary mode\n");
+        return 1;
+    }
+
+    bool switched = !_options.baud;
+    for (int attempt = 0; attempt < 3 && !switched; ++attempt) switched = host.setBaud(_options.baud);
+    if (!switched) {
+        fprintf(stderr, "screenview: device did not follow to %u baud\n", _options.baud);
+        return 1;
+    }
+
+    uint32_t baud = _options.baud ? _options.baud : host.negotiate(_options.maxBaud);
+    fprintf(stderr, "link at %u baud\n", baud);
+
+    if (!view_start(host)) {
+        fprintf(stderr, "screenview: the unit does not mirror its screen\n");
+        host.exitBinary();
+        return 1;
+    }
+
+    double start = view_seconds();
+    bool ok = _options.snapshot ? view_snapshot(host) : view_window(host);
+    double seconds = view_seconds() - start;
+
+    const UsbHost::Stats_t &stats = host.stats();
+    size_t raw = _info.width * _info.height * sizeof(uint16_t);
+    fprintf(stderr, "%u polls, %u tiles in %llu bytes (a full screen is %zu), %.1f KB/s over %.1fs, %u retries\n",
+            _stats.polls, _stats.tiles, (unsigned long long) _stats.bytes, raw,
+            seconds > 0 ? _stats.bytes / 1024.0 / seconds : 0.0, seconds, stats.retries);
+
+    host.exitBinary();
+    return ok ? 0 : 1;
+}
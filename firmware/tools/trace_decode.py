@@ -0,0 +1,150 @@
+"""
+Turns binary TRACE() records written to the SD card (/trace.bin) back into text,
+using the format strings kept in the firmware ELF.
+
+    python trace_decode.py firmware.elf trace.bin [trace.bin ...]
+
+The ELF must be the build that wrote the records; the strings are in its
+.trace_fmt section, which is never flashed. The record layout matches TRACE()
+in src/diagnostics/trace.h: a length byte, the format's offset in .trace_fmt
+(uint16), ms since boot (uint32), then the arguments, all little endian.
+"""
+
+import re
+import struct
+import sys
+
+SECTION = '.trace_fmt'
+
+CONVERSION = re.compile(r'%(?P<flags>[-+ #0]*)(?P<width>\*|\d+)?(?:\.(?P<precision>\*|\d*))?'
+                        r'(?P<length>hh|h|ll|l|j|z|t|L|q)?(?P<conversion>[diouxXcsfFeEgGaAp%])')
+
+WIDE_LENGTHS = ('ll', 'j', 'q')
+
+
+def read_section(path, name):
+    """Returns the contents of a section of a little endian ELF file."""
+    with open(path, 'rb') as f:
+        elf = f.read()
+
+    if elf[:4] != b'\x7fELF' or elf[5] != 1:
+        raise ValueError('%s is not a little endian ELF file' % path)
+
+    if elf[4] == 1:
+        shoff, = struct.unpack_from('<I', elf, 0x20)
+        shentsize, shnum, shstrndx = struct.unpack_from('<HHH', elf, 0x2E)
+        header = struct.Struct('<IIIIII')       # name, type, flags, addr, offset, size
+    else:
+        shoff, = struct.unpack_from('<Q', elf, 0x28)
+        shentsize, shnum, shstrndx = struct.unpack_from('<HHH', elf, 0x3A)
+        header = struct.Struct('<IIQQQQ')
+
+    sections = [header.unpack_from(elf, shoff + i * shentsize) for i in range(shnum)]
+    names = sections[shstrndx]
+    for section in sections:
+        start = names[4] + section[0]
+        if elf[start:elf.index(b'\0', start)].decode() == name:
+            return elf[section[4]:section[4] + section[5]]
+
+    raise ValueError('%s has no %s section, was it built with TRACE()?' % (path, name))
+
+
+def c_string(data, offset):
+    end = data.index(b'\0', offset)
+    return data[offset:end].decode(errors='replace'), end + 1
+
+
+class Arguments:
+    def __init__(self, data):
+        self.data = data
+        self.offset = 0
+
+    def take(self, layout):
+        value, = struct.unpack_from(layout, self.data, self.offset)
+        self.offset += struct.calcsize(layout)
+        return value
+
+    def text(self):
+        length = self.take('<B')
+        value = self.data[self.offset:self.offset + length]
+        if len(value) != length:
+            raise struct.error('string runs past the record')
+        self.offset += length
+        return value.decode(errors='replace')
+
+
+def render(format, arguments):
+    """printf for the recorded arguments, which are consumed in format order."""
+    def convert(match):
+        conversion = match.group('conversion')
+        if conversion == '%':
+            return '%'
+
+        width = match.group('width') or ''
+        if width == '*':
+            width = str(arguments.take('<i'))
+        precision = match.group('precision')
+        if precision == '*':
+            precision = str(arguments.take('<i'))
+        spec = '%' + match.group('flags') + width + ('.' + precision if precision is not None else '')
+
+        if conversion == 's':
+            return (spec + 's') % arguments.text()
+        if conversion in 'fFeEgG':
+            return (spec + conversion) % arguments.take('<f')
+        if conversion in 'aA':
+            return arguments.take('<f').hex()
+        if conversion == 'p':
+            return '0x%08x' % arguments.take('<I')
+
+        wide = match.group('length') in WIDE_LENGTHS
+        signed = conversion in 'di'
+        value = arguments.take(('<q' if signed else '<Q') if wide else ('<i' if signed else '<I'))
+        if conversion == 'c':
+            return (spec + 'c') % chr(value & 0xFF)
+        return (spec + {'i': 'd', 'u': 'd'}.get(conversion, conversion)) % value
+
+    return CONVERSION.sub(convert, format)
+
+
+def decode(formats, trace, out):
+    offset = 0
+    last_time = None
+
+    while offset < len(trace):
+        length = trace[offset]
+        record = trace[offset + 1:offset + 1 + length]
+        offset += 1 + length
+        if len(record) != length or length < 6:
+            out.write('<record cut short at the end of the file>\n')
+            break
+
+        id, time = struct.unpack_from('<HI', record)
+        if last_time is not None and time < last_time:
+            out.write('---- reboot ----\n')
+        last_time = time
+
+        try:
+            location, next = c_string(formats, id)
+            format, _ = c_string(formats, next)
+            text = render(format, Arguments(record[6:]))
+        except (ValueError, IndexError, struct.error):
+            location, text = '?', '<record with unknown format %d, is this the right ELF?>' % id
+
+        out.write('%10.3f  %s: %s\n' % (time / 1000.0, location, text.rstrip('\n')))
+
+
+def main(argv):
+    if len(argv) < 3:
+        print(__doc__.strip())
+        return 2
+
+    formats = read_section(argv[1], SECTION)
+    for path in argv[2:]:
+        with open(path, 'rb') as f:
+            decode(formats, f.read(), sys.stdout)
+    return 0
+
+
+if __name__ == '__main__':
+    sys.exit(main(sys.argv))
@@ -0,0 +1,88 @@
+// Records TRACE() calls the way the board does, and writes what printf makes of
+// the same calls next to them, for make check to compare with trace_decode.py
+//
+//   tracecheck RECORDS EXPECTED
+//
+// Linked without PIE like the firmware, so .trace_fmt offsets are the IDs
+
+#include <stdint.h>
+#include <stdio.h>
+#include "diagnostics/trace.h"
+
+static FILE *_records;
+static FILE *_expected;
+static uint32_t _time = 0;
+static uint32_t _dropped = 0;
+
+namespace Diagnostics
+{
+    uint32_t trace_time()
+    {
+        return _time += 125;
+    }
+
+    void trace_write(const uint8_t *record, size_t length)
+    {
+        fwrite(record, 1, length, _records);
+    }
+
+    void trace_dropped()
+    {
+        ++_dropped;
+    }
+}
+
+#define CHECK(format, ...)                                      \
+    do {                                                        \
+        TRACE(format, ##__VA_ARGS__);                           \
+        fprintf(_expected, format "\n", ##__VA_ARGS__);         \
+    } while (0)
+
+enum Page_t { PAGE_HOME = 2 };
+
+int main(int argc, char **argv)
+{
+    if (argc != 3) {
+        fprintf(stderr, "usage: %s RECORDS EXPECTED\n", argv[0]);
+        return 2;
+    }
+    _records = fopen(argv[1], "wb");
+    _expected = fopen(argv[2], "w");
+    if (!_records || !_expected) {
+        perror("tracecheck");
+        return 1;
+    }
+
+    const char *name = "calibration";
+    char buffer[8] = "home";
+    int16_t x = -320;
+    uint16_t y = 65000;
+    uint64_t uptime = 5000000000ULL;
+    int64_t offset = -5000000000LL;
+    float error = 1.5f;
+
+    CHECK("started");
+    CHECK("-> Raw is: (%d, %d)", x, y);
+    CHECK("-> Error: %.1fpx rms, %5.2fpx max, %g", error, -0.25, 1e6f);
+    CHECK("RAM: %u of %u bytes, %d%% used", 120000u, 300000u, 40);
+    CHECK("page \"%s\" -> \"%-6s\" (%d)", name, buffer, PAGE_HOME);
+    CHECK("%c%c 0x%04x %08X %o", 'o', 'k', 0xBEEF, 0xC0FFEEu, 8);
+    CHECK("uptime %llu, offset %lld", (unsigned long long) uptime, (long long) offset);
+    CHECK("%*d|%-*d|%.*s", 5, 42, 4, 7, 3, "truncated");
+
+    // cut to TRACE_STRING_SIZE on the board, so it is not compared
+    TRACE("long %s", "0123456789012345678901234567890123456789");
+    fprintf(_expected, "long %.*s\n", TRACE_STRING_SIZE, "0123456789012345678901234567890123456789");
+
+    // too long for one record, dropped and counted
+    TRACE("%s %s %s", "012345678901234567890123", "012345678901234567890123", "012345678901234567890123");
+
+    fclose(_records);
+    fclose(_expected);
+
+    if (_dropped != 1) {
+        fprintf(stderr, "tracecheck: %u records dropped, expected 1\n", _dropped);
+        return 1;
+    }
+    return 0;
+}
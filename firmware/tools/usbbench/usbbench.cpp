@@ -0,0 +1,96 @@
+// Binary USB-C link benchmark. Switches the device (or usbsim) to binary mode,
+// negotiates the fastest clean baud and echoes a block of data through it.
+//
+//   usbbench DEVICE [--max-baud BAUD] [--bytes N] [--payload N] [--expect-baud BAUD]
+//
+// Exits non-zero when the link can't be set up, the echo fails, or the
+// negotiated baud differs from --expect-baud
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../usbhost/usbhost.hpp"
+
+typedef struct {
+    const char *device;
+    uint32_t maxBaud;
+    uint32_t bytes;
+    uint32_t payload;
+    uint32_t expectBaud;    // 0 for any
+} BenchOptions_t;
+
+static BenchOptions_t _options = { nullptr, 921600, 256 * 1024, USBFRAME_MAX_PAYLOAD, 0 };
+
+static bool bench_parse_options(int argc, char **argv)
+{
+    for (int i = 1; i < argc; ++i) {
+        const char *arg = argv[i];
+
+        if (arg[0] != '-') {
+            if (_options.device) return false;
+            _options.device = arg;
+            continue;
+        }
+
+        const char *value = i + 1 < argc ? argv[++i] : nullptr;
+        if (!value) return false;
+
+        if      (!strcmp(arg, "--max-baud"))    _options.maxBaud = atoi(value);
+        else if (!strcmp(arg, "--bytes"))       _options.bytes = atoi(value);
+        else if (!strcmp(arg, "--payload"))     _options.payload = atoi(value);
+        else if (!strcmp(arg, "--expect-baud")) _options.expectBaud = atoi(value);
+        else return false;
+    }
+
+    return _options.device && _options.payload >= 1 && _options.payload <= USBFRAME_MAX_PAYLOAD;
+}
+
+static void bench_print_stats(const UsbHost &host)
+{
+    const UsbHost::Stats_t &stats = host.stats();
+    printf("  %u requests, %u retries, %u failed, %u bad frames, %u fallbacks\n",
+           stats.requests, stats.retries, stats.failures, stats.badFrames, stats.fallbacks);
+}
+
+int main(int argc, char **argv)
+{
+    if (!bench_parse_options(argc, argv)) {
+        fprintf(stderr, "usage: %s DEVICE [--max-baud BAUD] [--bytes N] [--payload N] [--expect-baud BAUD]\n", argv[0]);
+        return 2;
+    }
+
+    UsbHost host;
+    if (!host.open(_options.device)) {
+        perror("usbbench: open");
+        return 1;
+    }
+
+    if (!host.enterBinary()) {
+        fprintf(stderr, "usbbench: no answer in binary mode\n");
+        return 1;
+    }
+
+    uint32_t baud = host.negotiate(_options.maxBaud);
+    printf("negotiated %u baud\n", baud);
+
+    double seconds = 0;
+    bool ok = host.echo(_options.bytes, _options.payload, seconds);
+    if (ok) {
+        printf("echoed %u bytes in %u byte frames: %.2fs, %.1f KB/s each way\n",
+               _options.bytes, _options.payload, seconds, seconds > 0 ? _options.bytes / 1024.0 / seconds : 0.0);
+    }
+    else {
+        fprintf(stderr, "usbbench: echo failed\n");
+    }
+    bench_print_stats(host);
+
+    if (!host.exitBinary()) fprintf(stderr, "usbbench: no reply to exit\n");
+
+    if (_options.expectBaud && baud != _options.expectBaud) {
+        fprintf(stderr, "usbbench: expected %u baud\n", _options.expectBaud);
+        return 1;
+    }
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,42 @@
+#!/bin/sh
+# Downloads and uploads through usbsim on a link that loses frames, then resumes
+# both from a partial copy, comparing every result with the original
+#
+#   transfer_check.sh BUILD_DIR
+
+set -e
+
+build=$1
+root=$build/usbroot
+link=$build/usbfile.tty
+
+rm -rf "$root"
+mkdir -p "$root/sd/logs" "$root/spiffs"
+head -c 300000 /dev/urandom > "$root/sd/logs/run.csv"
+head -c 120000 /dev/urandom > "$build/upload.bin"
+
+"$build/usbsim" --link "$link" --root "$root" --drop 2 --seed 5 > /dev/null &
+pid=$!
+trap 'kill $pid 2> /dev/null; wait $pid' EXIT
+for i in 1 2 3 4 5 6 7 8 9 10; do [ -e "$link" ] && break; sleep 0.1; done
+
+"$build/usbfile" "$link" --baud 230400 ls sd /logs | grep -q "300000  run.csv"
+
+rm -f "$build/run.csv"
+"$build/usbfile" "$link" --baud 230400 get sd /logs/run.csv "$build/run.csv"
+cmp "$root/sd/logs/run.csv" "$build/run.csv"
+
+# an interrupted download: only the rest is fetched
+truncate -s 100000 "$build/run.csv"
+"$build/usbfile" "$link" --baud 230400 get sd /logs/run.csv "$build/run.csv" --resume | grep -q "resumed from 100000"
+cmp "$root/sd/logs/run.csv" "$build/run.csv"
+
+"$build/usbfile" "$link" --baud 230400 put spiffs "$build/upload.bin" /upload.bin
+cmp "$build/upload.bin" "$root/spiffs/upload.bin"
+
+# an interrupted upload
+truncate -s 50000 "$root/spiffs/upload.bin"
+"$build/usbfile" "$link" --baud 230400 put spiffs "$build/upload.bin" /upload.bin --resume | grep -q "resumed from 50000"
+cmp "$build/upload.bin" "$root/spiffs/upload.bin"
+
+echo PASS
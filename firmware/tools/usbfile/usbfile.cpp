@@ -0,0 +1,134 @@
+// Copies files to and from the SD card and SPIFFS over the binary USB-C link,
+// without taking the card out of the unit.
+//
+//   usbfile DEVICE [--max-baud BAUD | --baud BAUD] ls   sd|spiffs PATH
+//   usbfile DEVICE [--max-baud BAUD | --baud BAUD] get  sd|spiffs REMOTE LOCAL [--resume]
+//   usbfile DEVICE [--max-baud BAUD | --baud BAUD] put  sd|spiffs LOCAL REMOTE [--resume]
+//
+// The link is negotiated up to --max-baud, or set straight to --baud.
+// --resume carries on from a partial copy left by an interrupted transfer, once
+// the part already copied is confirmed the same on both ends. Every transfer is
+// checked end to end with a CRC-32 of the whole file
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../usbhost/usbfileclient.hpp"
+
+using namespace Driver;
+
+typedef struct {
+    const char *device;
+    uint32_t maxBaud;
+    uint32_t baud;          // 0 to negotiate
+    bool resume;
+    const char *args[4];    // command, file system, then one or two paths
+    int numArgs;
+} FileOptions_t;
+
+static FileOptions_t _options = { nullptr, 921600, 0, false, { }, 0 };
+
+static bool file_parse_options(int argc, char **argv)
+{
+    for (int i = 1; i < argc; ++i) {
+        const char *arg = argv[i];
+
+        if (!strcmp(arg, "--resume")) {
+            _options.resume = true;
+        }
+        else if (!strcmp(arg, "--max-baud")) {
+            if (++i == argc) return false;
+            _options.maxBaud = atoi(argv[i]);
+        }
+        else if (!strcmp(arg, "--baud")) {
+            if (++i == argc) return false;
+            _options.baud = atoi(argv[i]);
+        }
+        else if (!_options.device) {
+            _options.device = arg;
+        }
+        else {
+            if (_options.numArgs == 4) return false;
+            _options.args[_options.numArgs++] = arg;
+        }
+    }
+
+    return _options.device && _options.numArgs >= 3 &&
+           (!strcmp(_options.args[1], "sd") || !strcmp(_options.args[1], "spiffs"));
+}
+
+static void file_print_transfer(const char *verb, const UsbFileClient::Transfer_t &transfer)
+{
+    printf("%s %u bytes", verb, transfer.bytes);
+    if (transfer.resumedFrom) printf(", resumed from %u", transfer.resumedFrom);
+    printf(" in %.2fs, %.1f KB/s, %u chunks resent\n", transfer.seconds,
+           transfer.seconds > 0 ? transfer.bytes / 1024.0 / transfer.seconds : 0.0, transfer.resent);
+}
+
+int main(int argc, char **argv)
+{
+    if (!file_parse_options(argc, argv)) {
+        fprintf(stderr, "usage: %s DEVICE [--max-baud BAUD | --baud BAUD] ls sd|spiffs PATH\n"
+                        "       %s DEVICE [--max-baud BAUD | --baud BAUD] get sd|spiffs REMOTE LOCAL [--resume]\n"
+                        "       %s DEVICE [--max-baud BAUD | --baud BAUD] put sd|spiffs LOCAL REMOTE [--resume]\n",
+                argv[0], argv[0], argv[0]);
+        return 2;
+    }
+
+    const char *command = _options.args[0];
+    UsbFileSystemId_t fs = strcmp(_options.args[1], "sd") ? USBFILE_SPIFFS : USBFILE_SD;
+
+    UsbHost host;
+    if (!host.open(_options.device)) {
+        perror("usbfile: open");
+        return 1;
+    }
+    if (!host.enterBinary()) {
+        fprintf(stderr, "usbfile: no answer in binary mode\n");
+        return 1;
+    }
+
+    bool switched = !_options.baud;
+    for (int attempt = 0; attempt < 3 && !switched; ++attempt) switched = host.setBaud(_options.baud);
+    if (!switched) {
+        fprintf(stderr, "usbfile: device did not follow to %u baud\n", _options.baud);
+        return 1;
+    }
+    uint32_t baud = _options.baud ? _options.baud : host.negotiate(_options.maxBaud);
+    fprintf(stderr, "link at %u baud\n", baud);
+
+    UsbFileClient client(host);
+    UsbFileClient::Transfer_t transfer;
+    bool ok = false;
+
+    if (!strcmp(command, "ls") && _options.numArgs == 3) {
+        std::vector<UsbFileClient::Entry_t> entries;
+        ok = client.list(fs, _options.args[2], entries);
+        for (const UsbFileClient::Entry_t &entry : entries) {
+            if (entry.directory) printf("%10s  %s/\n", "", entry.name.c_str());
+            else printf("%10u  %s\n", entry.size, entry.name.c_str());
+        }
+    }
+    else if (!strcmp(command, "get") && _options.numArgs == 4) {
+        ok = client.download(fs, _options.args[2], _options.args[3], _options.resume, transfer);
+        if (ok) file_print_transfer("received", transfer);
+    }
+    else if (!strcmp(command, "put") && _options.numArgs == 4) {
+        ok = client.upload(fs, _options.args[2], _options.args[3], _options.resume, transfer);
+        if (ok) file_print_transfer("sent", transfer);
+    }
+    else {
+        fprintf(stderr, "usbfile: unknown command \"%s\"\n", command);
+        return 2;
+    }
+
+    if (!ok) fprintf(stderr, "usbfile: %s failed, device error %d\n", command, client.lastError());
+
+    const UsbHost::Stats_t &stats = host.stats();
+    fprintf(stderr, "%u requests, %u bad frames, %u fallbacks\n", stats.requests, stats.badFrames, stats.fallbacks);
+
+    host.exitBinary();
+    return ok ? 0 : 1;
+}
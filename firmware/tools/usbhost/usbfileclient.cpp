@@ -0,0 +1,309 @@
+#include "usbfileclient.hpp"
+
+#include <fcntl.h>
+#include <map>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+using namespace Driver;
+
+static double client_seconds()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+// CRC-32 of the first length bytes of a local file
+static bool local_crc(int fd, uint32_t length, uint32_t &crc)
+{
+    uint8_t buffer[4096];
+    crc = 0;
+
+    for (uint32_t offset = 0; offset < length; ) {
+        size_t chunk = length - offset < sizeof(buffer) ? length - offset : sizeof(buffer);
+        if (pread(fd, buffer, chunk, offset) != (ssize_t) chunk) return false;
+        crc = usbfile_crc32(buffer, chunk, crc);
+        offset += chunk;
+    }
+    return true;
+}
+
+UsbFileClient::UsbFileClient(UsbHost &host)
+    : host(host)
+    , error(USBFRAME_ERROR_NONE)
+{ }
+
+bool UsbFileClient::open(UsbFileSystemId_t fs, const char *path, UsbFileMode_t mode, UsbFileOpened_t &opened)
+{
+    UsbFileOpen_t request = { fs, mode };
+    std::vector<uint8_t> payload((const uint8_t *) &request, (const uint8_t *) &request + sizeof(request));
+    payload.insert(payload.end(), path, path + strlen(path));
+
+    std::vector<uint8_t> reply;
+    error = USBFRAME_ERROR_NONE;
+    if (!host.request(USBFRAME_FILE_OPEN, payload.data(), payload.size(), reply, &error) || reply.size() != sizeof(opened)) return false;
+
+    memcpy(&opened, reply.data(), sizeof(opened));
+    return opened.chunkSize && opened.window;
+}
+
+bool UsbFileClient::close()
+{
+    std::vector<uint8_t> reply;
+    return host.request(USBFRAME_FILE_CLOSE, nullptr, 0, reply, &error);
+}
+
+bool UsbFileClient::list(UsbFileSystemId_t fs, const char *path, std::vector<Entry_t> &entries)
+{
+    entries.clear();
+
+    while (true) {
+        uint16_t index = entries.size();
+        std::vector<uint8_t> payload(1 + sizeof(index));
+        payload[0] = fs;
+        memcpy(payload.data() + 1, &index, sizeof(index));
+        payload.insert(payload.end(), path, path + strlen(path));
+
+        std::vector<uint8_t> reply;
+        if (!host.request(USBFRAME_FILE_LIST, payload.data(), payload.size(), reply, &error)) return false;
+        if (reply.empty()) return true;
+
+        for (size_t used = 0; used + sizeof(UsbFileEntry_t) <= reply.size(); ) {
+            UsbFileEntry_t entry;
+            memcpy(&entry, reply.data() + used, sizeof(entry));
+            used += sizeof(entry);
+            if (used + entry.nameLength > reply.size()) return false;
+
+            Entry_t listed = { std::string((const char *) reply.data() + used, entry.nameLength), entry.size,
+                               (entry.flags & USBFILE_DIRECTORY) != 0 };
+            entries.push_back(listed);
+            used += entry.nameLength;
+        }
+    }
+}
+
+bool UsbFileClient::crc(UsbFileSystemId_t fs, const char *path, uint32_t length, uint32_t &covered, uint32_t &crc)
+{
+    std::vector<uint8_t> payload(1 + sizeof(length));
+    payload[0] = fs;
+    memcpy(payload.data() + 1, &length, sizeof(length));
+    payload.insert(payload.end(), path, path + strlen(path));
+
+    // each reply covers another step of the file, until it reaches the end
+    uint32_t end;
+    do {
+        std::vector<uint8_t> reply;
+        if (!host.request(USBFRAME_FILE_CRC, payload.data(), payload.size(), reply, &error, USBHOST_ATTEMPTS, USBFILECLIENT_CRC_TIMEOUT) ||
+            reply.size() != 3 * sizeof(uint32_t)) {
+            return false;
+        }
+
+        memcpy(&covered, reply.data(), sizeof(covered));
+        memcpy(&crc, reply.data() + sizeof(covered), sizeof(crc));
+        memcpy(&end, reply.data() + 2 * sizeof(covered), sizeof(end));
+    } while (covered < end);
+    return true;
+}
+
+bool UsbFileClient::matches(UsbFileSystemId_t fs, const char *remote, int fd, uint32_t length)
+{
+    uint32_t covered, remoteCrc, localCrc;
+    return crc(fs, remote, length, covered, remoteCrc) && covered == length &&
+           local_crc(fd, length, localCrc) && localCrc == remoteCrc;
+}
+
+bool UsbFileClient::download(UsbFileSystemId_t fs, const char *remote, const char *local, bool resume, Transfer_t &transfer)
+{
+    memset(&transfer, 0, sizeof(transfer));
+
+    int fd = ::open(local, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) return false;
+
+    // carry on from the local copy only if the device has the same bytes at the start
+    struct stat info;
+    uint32_t start = 0;
+    if (resume && !fstat(fd, &info) && info.st_size > 0 && matches(fs, remote, fd, info.st_size)) start = info.st_size;
+    if (ftruncate(fd, start)) {
+        ::close(fd);
+        return false;
+    }
+
+    UsbFileOpened_t opened;
+    if (!open(fs, remote, USBFILE_READ, opened) || start > opened.size) {
+        ::close(fd);
+        return false;
+    }
+
+    transfer.resumedFrom = start;
+    double began = client_seconds();
+    uint32_t timeout = host.replyTimeout(opened.chunkSize) * opened.window;
+
+    // chunks asked for and not yet received, by offset
+    std::map<uint32_t, bool> outstanding;
+    uint32_t next = start;
+    uint32_t received = start;
+    uint32_t timeouts = 0;
+    bool ok = true;
+
+    while (ok && received < opened.size) {
+        while (outstanding.size() < opened.window && next < opened.size) {
+            if (host.post(USBFRAME_FILE_READ, (const uint8_t *) &next, sizeof(next)) < 0) ok = false;
+            outstanding[next] = true;
+            next += opened.chunkSize;
+        }
+
+        uint8_t type, seq;
+        std::vector<uint8_t> reply;
+        if (!host.next(timeout, type, seq, reply)) {
+            // the requests or their replies were lost, ask for every missing chunk again
+            if (++timeouts > USBFILECLIENT_TIMEOUTS) {
+                ok = false;
+                break;
+            }
+            if (timeouts == USBFILECLIENT_TIMEOUTS / 2) host.recover();
+
+            for (auto &chunk : outstanding) {
+                uint32_t offset = chunk.first;
+                host.post(USBFRAME_FILE_READ, (const uint8_t *) &offset, sizeof(offset));
+                ++transfer.resent;
+            }
+            timeout = host.replyTimeout(opened.chunkSize) * opened.window;
+            continue;
+        }
+
+        if (type == (USBFRAME_NAK | USBFRAME_REPLY)) {
+            error = reply.empty() ? USBFRAME_ERROR_NONE : (UsbFrameError_t) reply[0];
+            ok = false;
+            break;
+        }
+        if (type != (USBFRAME_FILE_READ | USBFRAME_REPLY) || reply.size() < sizeof(uint32_t)) continue;
+
+        uint32_t offset;
+        memcpy(&offset, reply.data(), sizeof(offset));
+        size_t length = reply.size() - sizeof(offset);
+
+        // a repeat of a chunk already written
+        if (!outstanding.count(offset)) continue;
+        timeouts = 0;
+
+        size_t expected = opened.size - offset < opened.chunkSize ? opened.size - offset : opened.chunkSize;
+        if (length != expected || pwrite(fd, reply.data() + sizeof(offset), length, offset) != (ssize_t) length) {
+            ok = false;
+            break;
+        }
+
+        outstanding.erase(offset);
+        received += length;
+    }
+
+    transfer.bytes = received - start;
+    transfer.seconds = client_seconds() - began;
+
+    // the transfer is only good if both ends agree on every byte
+    ok = ok && close() && matches(fs, remote, fd, opened.size);
+    ::close(fd);
+    return ok;
+}
+
+bool UsbFileClient::upload(UsbFileSystemId_t fs, const char *local, const char *remote, bool resume, Transfer_t &transfer)
+{
+    memset(&transfer, 0, sizeof(transfer));
+
+    int fd = ::open(local, O_RDONLY);
+    struct stat info;
+    if (fd < 0 || fstat(fd, &info)) return false;
+    uint32_t size = info.st_size;
+
+    // carry on from the device's copy only if it matches the start of the local file
+    UsbFileOpened_t opened;
+    uint32_t start = 0;
+    if (resume && open(fs, remote, USBFILE_APPEND, opened) && opened.size && opened.size <= size &&
+        matches(fs, remote, fd, opened.size)) {
+        start = opened.size;
+    }
+
+    if (!open(fs, remote, start ? USBFILE_APPEND : USBFILE_WRITE, opened) || opened.size != start) {
+        ::close(fd);
+        return false;
+    }
+
+    transfer.resumedFrom = start;
+    double began = client_seconds();
+    uint32_t timeout = host.replyTimeout(opened.chunkSize) * opened.window;
+
+    // what each sequence number carried, and in which go-back it was sent
+    uint32_t sentOffset[256] = { };
+    uint32_t sentEpoch[256] = { };
+    uint32_t epoch = 0;
+
+    std::vector<uint8_t> payload(sizeof(uint32_t) + opened.chunkSize);
+    uint32_t acked = start;
+    uint32_t next = start;
+    uint32_t timeouts = 0;
+    bool ok = true;
+
+    while (ok && acked < size) {
+        while (next < size && next - acked < (uint32_t) opened.window * opened.chunkSize) {
+            size_t length = size - next < opened.chunkSize ? size - next : opened.chunkSize;
+            memcpy(payload.data(), &next, sizeof(next));
+            if (pread(fd, payload.data() + sizeof(next), length, next) != (ssize_t) length) {
+                ok = false;
+                break;
+            }
+
+            int seq = host.post(USBFRAME_FILE_WRITE, payload.data(), sizeof(next) + length);
+            if (seq < 0) {
+                ok = false;
+                break;
+            }
+            sentOffset[seq] = next;
+            sentEpoch[seq] = epoch;
+            next += length;
+        }
+
+        uint8_t type, seq;
+        std::vector<uint8_t> reply;
+        if (!host.next(timeout, type, seq, reply)) {
+            // go back to the first chunk the device has not confirmed
+            if (++timeouts > USBFILECLIENT_TIMEOUTS) {
+                ok = false;
+                break;
+            }
+            if (timeouts == USBFILECLIENT_TIMEOUTS / 2) host.recover();
+
+            transfer.resent += (next - acked + opened.chunkSize - 1) / opened.chunkSize;
+            next = acked;
+            ++epoch;
+            continue;
+        }
+
+        if (type == (USBFRAME_NAK | USBFRAME_REPLY)) {
+            error = reply.empty() ? USBFRAME_ERROR_NONE : (UsbFrameError_t) reply[0];
+            ok = false;
+            break;
+        }
+        if (type != (USBFRAME_FILE_WRITE | USBFRAME_REPLY) || reply.size() != sizeof(uint32_t)) continue;
+        timeouts = 0;
+
+        uint32_t expected;
+        memcpy(&expected, reply.data(), sizeof(expected));
+        if (expected > acked) acked = expected;
+
+        // the device skipped a chunk after a gap: go back once for every chunk sent after it
+        if (sentEpoch[seq] == epoch && sentOffset[seq] > expected && next > expected) {
+            transfer.resent += (next - expected + opened.chunkSize - 1) / opened.chunkSize;
+            next = expected;
+            ++epoch;
+        }
+    }
+
+    transfer.bytes = acked - start;
+    transfer.seconds = client_seconds() - began;
+
+    ok = ok && close() && matches(fs, remote, fd, size);
+    ::close(fd);
+    return ok;
+}
@@ -0,0 +1,71 @@
+#pragma once
+
+// SD and SPIFFS transfers over a UsbHost, see src/driver/usbfile.hpp. Reads and
+// writes keep the window the device asks for in flight, and both resume a
+// partial copy once its CRC matches the other end
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "usbhost.hpp"
+#include "driver/usbfile.hpp"
+
+#define USBFILECLIENT_TIMEOUTS      8       // windows in a row with no reply before a transfer fails
+#define USBFILECLIENT_CRC_TIMEOUT   2000    // ms for the device to checksum USBFILE_CRC_STEP bytes
+
+class UsbFileClient
+{
+public:
+    typedef struct {
+        std::string name;
+        uint32_t size;
+        bool directory;
+    } Entry_t;
+
+    typedef struct {
+        uint32_t bytes;             // moved this time, not counting a resumed part
+        uint32_t resumedFrom;       // offset carried on from
+        uint32_t resent;            // chunks sent or asked for again
+        double seconds;
+    } Transfer_t;
+
+    UsbFileClient(UsbHost &host);
+
+    bool list(Driver::UsbFileSystemId_t fs, const char *path, std::vector<Entry_t> &entries);
+
+    /**
+     * @brief CRC-32 of the first length bytes of a file on the device
+     *
+     * @param covered set to the bytes the CRC covers, less than length for a shorter file
+     */
+    bool crc(Driver::UsbFileSystemId_t fs, const char *path, uint32_t length, uint32_t &covered, uint32_t &crc);
+
+    /**
+     * @brief Copies a file from the device
+     *
+     * @param resume carry on from the end of local if it matches the start of the remote file
+     */
+    bool download(Driver::UsbFileSystemId_t fs, const char *remote, const char *local, bool resume, Transfer_t &transfer);
+
+    /**
+     * @brief Copies a file to the device
+     *
+     * @param resume carry on from the end of the remote file if it matches the start of local
+     */
+    bool upload(Driver::UsbFileSystemId_t fs, const char *local, const char *remote, bool resume, Transfer_t &transfer);
+
+    Driver::UsbFrameError_t lastError() const { return error; }
+
+private:
+    UsbHost &host;
+    Driver::UsbFrameError_t error;
+
+    bool open(Driver::UsbFileSystemId_t fs, const char *path, Driver::UsbFileMode_t mode, Driver::UsbFileOpened_t &opened);
+    bool close();
+
+    /**
+     * @brief Checks the device holds the same bytes as the first length of a local file
+     */
+    bool matches(Driver::UsbFileSystemId_t fs, const char *remote, int fd, uint32_t length);
+};
@@ -0,0 +1,329 @@
+#include "usbhost.hpp"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <string.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+using namespace Driver;
+
+static const uint32_t _hostBauds[] = { 921600, 460800, 230400, 115200, 9600 };
+
+static int64_t host_millis()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static speed_t host_speed(uint32_t baud)
+{
+    switch (baud) {
+    case 9600:      return B9600;
+    case 115200:    return B115200;
+    case 230400:    return B230400;
+    case 460800:    return B460800;
+    case 921600:    return B921600;
+    default:        return 0;
+    }
+}
+
+UsbHost::UsbHost()
+    : fd(-1)
+    , currentBaud(USBLINK_BASE_BAUD)
+    , sequence(0)
+    , failuresInRow(0)
+    , pending(0)
+    , received(0)
+{
+    memset(&counters, 0, sizeof(counters));
+}
+
+UsbHost::~UsbHost()
+{
+    close();
+}
+
+bool UsbHost::open(const char *path)
+{
+    fd = ::open(path, O_RDWR | O_NOCTTY);
+    if (fd < 0) return false;
+
+    struct termios tio;
+    if (tcgetattr(fd, &tio)) return false;
+    cfmakeraw(&tio);
+    tio.c_cc[VMIN] = 0;
+    tio.c_cc[VTIME] = 0;
+    if (tcsetattr(fd, TCSANOW, &tio)) return false;
+
+    return setLocalBaud(USBLINK_BASE_BAUD);
+}
+
+void UsbHost::close()
+{
+    if (fd >= 0) ::close(fd);
+    fd = -1;
+}
+
+bool UsbHost::setLocalBaud(uint32_t baud)
+{
+    struct termios tio;
+    speed_t speed = host_speed(baud);
+    if (!speed || tcgetattr(fd, &tio)) return false;
+
+    tcdrain(fd);
+    cfsetspeed(&tio, speed);
+    if (tcsetattr(fd, TCSANOW, &tio)) return false;
+
+    currentBaud = baud;
+    decoder.reset();
+    pending = received = 0;
+    return true;
+}
+
+// reads and drops whatever arrives for a while, such as console text
+void UsbHost::drain(uint32_t ms)
+{
+    int64_t end = host_millis() + ms;
+    uint8_t buffer[256];
+
+    while (host_millis() < end) {
+        struct pollfd pfd = { fd, POLLIN, 0 };
+        if (poll(&pfd, 1, end - host_millis()) > 0 && read(fd, buffer, sizeof(buffer)) <= 0) break;
+    }
+    decoder.reset();
+    pending = received = 0;
+}
+
+uint32_t UsbHost::replyTimeout(size_t length) const
+{
+    // the request and the reply on the wire, 10 bits a byte, plus time to answer
+    return 200 + 2 * (length + USBFRAME_MAX_ENCODED - USBFRAME_MAX_PAYLOAD) * 10000 / currentBaud
+               + 2 * length * 10000 / currentBaud;
+}
+
+bool UsbHost::send(uint8_t type, const uint8_t *payload, size_t length)
+{
+    uint8_t frame[USBFRAME_MAX_ENCODED];
+    size_t size = usbframe_encode(type, sequence, payload, length, frame);
+    if (!size) return false;
+
+    for (size_t written = 0; written < size; ) {
+        ssize_t count = write(fd, frame + written, size - written);
+        if (count < 0) {
+            if (errno == EAGAIN || errno == EINTR) continue;
+            return false;
+        }
+        written += count;
+    }
+
+    counters.bytesSent += size;
+    return true;
+}
+
+bool UsbHost::next(uint32_t timeout, uint8_t &type, uint8_t &seq, std::vector<uint8_t> &reply)
+{
+    int64_t deadline = host_millis() + timeout;
+
+    while (true) {
+        // bytes left over from the last read may already hold the next frame
+        while (pending < received) {
+            switch (decoder.feed(buffer[pending++])) {
+            case UsbFrameDecoder::FRAME_READY:
+                type = decoder.type();
+                seq = decoder.sequence();
+                reply.assign(decoder.payload(), decoder.payload() + decoder.payloadLength());
+                return true;
+
+            case UsbFrameDecoder::FRAME_ERROR:
+                ++counters.badFrames;
+                break;
+
+            default:
+                break;
+            }
+        }
+
+        int64_t left = deadline - host_millis();
+        if (left <= 0) return false;
+
+        struct pollfd pfd = { fd, POLLIN, 0 };
+        if (poll(&pfd, 1, left) <= 0) continue;
+
+        ssize_t count = read(fd, buffer, sizeof(buffer));
+        if (count <= 0) continue;
+        counters.bytesReceived += count;
+        pending = 0;
+        received = count;
+    }
+}
+
+int UsbHost::receive(uint8_t type, uint8_t seq, uint32_t timeout, std::vector<uint8_t> &reply, UsbFrameError_t &error, bool &nak)
+{
+    int64_t deadline = host_millis() + timeout;
+    uint8_t replyType, replySeq;
+
+    while (true) {
+        int64_t left = deadline - host_millis();
+        if (left <= 0 || !next(left, replyType, replySeq, reply)) return 0;
+
+        // a late reply to an earlier request is skipped
+        if (replySeq != seq) continue;
+
+        if (replyType == (USBFRAME_NAK | USBFRAME_REPLY)) {
+            nak = true;
+            error = reply.size() ? (UsbFrameError_t) reply[0] : USBFRAME_ERROR_NONE;
+            return 1;
+        }
+        if (replyType == (type | USBFRAME_REPLY)) return 1;
+    }
+}
+
+bool UsbHost::request(uint8_t type, const uint8_t *payload, size_t length, std::vector<uint8_t> &reply,
+                      UsbFrameError_t *error, uint8_t attempts, uint32_t timeout)
+{
+    ++sequence;
+    ++counters.requests;
+
+    for (uint8_t attempt = 0; attempt < attempts; ++attempt) {
+        if (attempt) ++counters.retries;
+        if (!send(type, payload, length)) return false;
+
+        UsbFrameError_t nakError = USBFRAME_ERROR_NONE;
+        bool nak = false;
+        if (!receive(type, sequence, timeout ? timeout : replyTimeout(length), reply, nakError, nak)) continue;
+
+        failuresInRow = 0;
+        if (error) *error = nakError;
+        return !nak;
+    }
+
+    ++counters.failures;
+
+    // requests keep failing at a high rate, meet the device at the base rate
+    if (++failuresInRow >= USBHOST_FALLBACK_FAILURES && currentBaud != USBLINK_BASE_BAUD) {
+        failuresInRow = 0;
+        recover();
+    }
+    return false;
+}
+
+int UsbHost::post(uint8_t type, const uint8_t *payload, size_t length)
+{
+    ++sequence;
+    ++counters.requests;
+    return send(type, payload, length) ? sequence : -1;
+}
+
+bool UsbHost::hello(UsbFrameHello_t &hello)
+{
+    std::vector<uint8_t> reply;
+    if (!request(USBFRAME_HELLO, nullptr, 0, reply) || reply.size() != sizeof(hello)) return false;
+    memcpy(&hello, reply.data(), sizeof(hello));
+    return true;
+}
+
+bool UsbHost::enterBinary()
+{
+    static const char command[] = "\r!binary\r";
+
+    for (int attempt = 0; attempt < 3; ++attempt) {
+        if (write(fd, command, sizeof(command) - 1) != (ssize_t) sizeof(command) - 1) return false;
+
+        // the console's answer is text, dropped before the first frame
+        drain(200);
+
+        UsbFrameHello_t info;
+        if (hello(info)) return info.version == USBFRAME_VERSION;
+    }
+    return false;
+}
+
+bool UsbHost::exitBinary()
+{
+    std::vector<uint8_t> reply;
+    bool ok = request(USBFRAME_EXIT, nullptr, 0, reply);
+    setLocalBaud(USBLINK_BASE_BAUD);
+    return ok;
+}
+
+bool UsbHost::recover()
+{
+    ++counters.fallbacks;
+    setLocalBaud(USBLINK_BASE_BAUD);
+
+    // each hello the device can't read counts towards its own fallback
+    std::vector<uint8_t> reply;
+    for (int attempt = 0; attempt < USBLINK_FALLBACK_ERRORS + 3; ++attempt) {
+        if (request(USBFRAME_HELLO, nullptr, 0, reply, nullptr, 1)) return true;
+    }
+
+    // or it is still waiting for a switch to be confirmed
+    drain(USBLINK_CONFIRM_TIMEOUT);
+    return request(USBFRAME_HELLO, nullptr, 0, reply, nullptr, 1);
+}
+
+bool UsbHost::setBaud(uint32_t baud)
+{
+    if (!host_speed(baud)) return false;
+    if (baud == currentBaud) return true;
+
+    uint32_t previous = currentBaud;
+    std::vector<uint8_t> reply;
+    uint8_t payload[sizeof(baud)];
+    memcpy(payload, &baud, sizeof(baud));
+
+    if (!request(USBFRAME_BAUD, payload, sizeof(payload), reply) || reply.size() != sizeof(baud)) return false;
+
+    setLocalBaud(baud);
+    drain(USBHOST_SWITCH_DELAY);
+
+    UsbFrameHello_t info;
+    if (hello(info) && info.baud == baud) return true;
+
+    // the device goes back by itself once the switch is not confirmed in time
+    setLocalBaud(previous);
+    drain(USBLINK_CONFIRM_TIMEOUT);
+    return false;
+}
+
+uint32_t UsbHost::negotiate(uint32_t maxBaud)
+{
+    std::vector<uint8_t> payload(USBFRAME_MAX_PAYLOAD);
+    for (size_t i = 0; i < payload.size(); ++i) payload[i] = i * 7;
+
+    for (uint32_t baud : _hostBauds) {
+        if (baud > maxBaud || baud == USBLINK_BASE_BAUD) continue;
+        if (!setBaud(baud)) continue;
+
+        // a rate is kept only if full frames pass both ways without a single retry
+        bool clean = true;
+        std::vector<uint8_t> reply;
+        for (int i = 0; i < USBHOST_VERIFY_FRAMES && clean; ++i) {
+            clean = request(USBFRAME_ECHO, payload.data(), payload.size(), reply, nullptr, 1) && reply == payload;
+        }
+        if (clean) return baud;
+
+        if (currentBaud != USBLINK_BASE_BAUD) recover();
+    }
+
+    return currentBaud;
+}
+
+bool UsbHost::echo(size_t bytes, size_t payloadSize, double &seconds)
+{
+    std::vector<uint8_t> payload(payloadSize);
+    std::vector<uint8_t> reply;
+    int64_t start = host_millis();
+
+    for (size_t sent = 0; sent < bytes; sent += payloadSize) {
+        for (size_t i = 0; i < payloadSize; ++i) payload[i] = (sent + i) * 31;
+        if (!request(USBFRAME_ECHO, payload.data(), payloadSize, reply) || reply != payload) return false;
+    }
+
+    seconds = (host_millis() - start) / 1000.0;
+    return true;
+}
@@ -0,0 +1,137 @@
+#pragma once
+
+// Host side of the binary mode of the USB-C link, see src/driver/usblink.hpp.
+// Opens the serial device, switches the console to binary mode, negotiates the
+// fastest baud the link carries cleanly and sends requests with retries
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+#include "driver/usbframe.hpp"
+#include "driver/usblink.hpp"
+
+#define USBHOST_ATTEMPTS            3       // sends of a request before it fails
+#define USBHOST_FALLBACK_FAILURES   2       // failed requests in a row before dropping to the base baud
+#define USBHOST_VERIFY_FRAMES       8       // full size echoes a new baud must pass without a retry
+#define USBHOST_SWITCH_DELAY        50      // ms between the baud reply and talking at the new rate
+
+class UsbHost
+{
+public:
+    typedef struct {
+        uint32_t requests;
+        uint32_t retries;           // requests sent again after a timeout or a bad reply
+        uint32_t failures;          // requests that got no reply in USBHOST_ATTEMPTS
+        uint32_t badFrames;         // received blocks that failed to decode, console text included
+        uint32_t fallbacks;         // drops to the base baud
+        uint64_t bytesSent;
+        uint64_t bytesReceived;
+    } Stats_t;
+
+    UsbHost();
+    ~UsbHost();
+
+    bool open(const char *path);
+    void close();
+
+    /**
+     * @brief Sends "!binary" to the text console and waits for the device to answer a hello
+     */
+    bool enterBinary();
+
+    /**
+     * @brief Returns the device to the text console at the base baud
+     */
+    bool exitBinary();
+
+    bool hello(Driver::UsbFrameHello_t &hello);
+
+    /**
+     * @brief Sends a request and waits for its reply, sending it again with the
+     *          same sequence number when no good reply arrives in time
+     *
+     * @param reply the reply payload
+     * @param attempts sends before giving up
+     * @param timeout ms to wait for each reply, 0 for the time the frames take on the wire
+     * @return false No reply, or the device answered with a NAK (error is set)
+     */
+    bool request(uint8_t type, const uint8_t *payload, size_t length, std::vector<uint8_t> &reply,
+                 Driver::UsbFrameError_t *error=nullptr, uint8_t attempts=USBHOST_ATTEMPTS, uint32_t timeout=0);
+
+    /**
+     * @brief Sends a request without waiting for its reply, to keep several in flight
+     *
+     * @return int its sequence number, -1 if it could not be sent
+     */
+    int post(uint8_t type, const uint8_t *payload, size_t length);
+
+    /**
+     * @brief Waits for the next reply to any request
+     *
+     * @param type the reply type, USBFRAME_REPLY included
+     * @return false Nothing arrived in time
+     */
+    bool next(uint32_t timeout, uint8_t &type, uint8_t &sequence, std::vector<uint8_t> &reply);
+
+    /**
+     * @brief ms to allow for a request and its reply with length bytes of payload at the current baud
+     */
+    uint32_t replyTimeout(size_t length) const;
+
+    /**
+     * @brief Switches both ends to another baud and checks the device is heard there
+     *
+     * @return false The device did not follow, both ends are back at the old rate
+     */
+    bool setBaud(uint32_t baud);
+
+    /**
+     * @brief Tries the supported rates from maxBaud down and keeps the first one
+     *          that carries USBHOST_VERIFY_FRAMES full frames without a retry
+     *
+     * @return uint32_t the rate both ends settled on
+     */
+    uint32_t negotiate(uint32_t maxBaud);
+
+    /**
+     * @brief Drops to the base baud and says hello until the device answers there
+     */
+    bool recover();
+
+    /**
+     * @brief Echoes bytes in frames of payloadSize and checks they come back unchanged
+     *
+     * @param seconds time taken
+     * @return false A frame failed or came back different
+     */
+    bool echo(size_t bytes, size_t payloadSize, double &seconds);
+
+    uint32_t baud() const { return currentBaud; }
+    const Stats_t &stats() const { return counters; }
+
+private:
+    int fd;
+    uint32_t currentBaud;
+    uint8_t sequence;
+    uint8_t failuresInRow;
+    Driver::UsbFrameDecoder decoder;
+    Stats_t counters;
+
+    // bytes read but not yet fed to the decoder, a read can hold more than one frame
+    uint8_t buffer[512];
+    size_t pending;
+    size_t received;
+
+    bool setLocalBaud(uint32_t baud);
+    bool send(uint8_t type, const uint8_t *payload, size_t length);
+
+    /**
+     * @brief Waits for the reply to a request
+     *
+     * @return 1 reply, 0 timeout
+     */
+    int receive(uint8_t type, uint8_t seq, uint32_t timeout, std::vector<uint8_t> &reply, Driver::UsbFrameError_t &error, bool &nak);
+
+    void drain(uint32_t ms);
+};
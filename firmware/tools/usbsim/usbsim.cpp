@@ -0,0 +1,551 @@
+// USB-C link simulator. Opens a pseudo-terminal and runs the firmware's binary
+// link (src/driver/usblink.cpp) behind a minimal text console, so the host
+// library can be exercised without a board.
+//
+//   usbsim [--link PATH] [--root DIR] [--noisy-above BAUD] [--corrupt PCT] [--drop PCT]
+//          [--chatter MS] [--animate MS] [--screen-dump PPM] [--seed N] [--verbose]
+//
+// --root serves DIR/sd and DIR/spiffs as the two file systems for file transfers.
+// A 480x320 screen with a page drawn on it is mirrored; touches from the host
+// draw a dot. --animate repaints the page every MS with a progress bar moved on,
+// and --screen-dump writes the screen as it ended up to PPM on exit.
+// --drop loses PCT percent of binary replies and damages PCT percent of received
+// reads at any baud, for exercising retries.
+// The console answers "!binary" and "!ping". The baud the host set on its end of
+// the pty is compared with the simulated device's: while they differ every byte
+// other than 0x00 arrives as noise, as on a real UART. Above --noisy-above, --corrupt
+// percent of bytes are damaged in both directions. --chatter prints a log line
+// every MS, which lands between frames as the firmware's logging does.
+// Bytes are paced at the simulated baud, 10 bits a byte
+//
+// The slave side of the pty is printed on stdout, and symlinked to PATH with --link.
+// SIGINT or SIGTERM prints the link counters and exits
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "driver/usblink.hpp"
+#include "driver/usbfile.hpp"
+#include "driver/screenmirror.hpp"
+
+#define SIM_LINE_SIZE           128
+#define SIM_SCREEN_WIDTH        480
+#define SIM_SCREEN_HEIGHT       320
+
+typedef struct {
+    const char *link;
+    const char *root;       // holds sd/ and spiffs/, nullptr for no files
+    uint32_t noisyAbove;    // 0 for a clean line at every baud
+    uint32_t corrupt;       // percent of bytes damaged above noisyAbove
+    uint32_t drop;          // percent of binary replies lost and received reads damaged
+    uint32_t chatter;       // ms between log lines, 0 for none
+    uint32_t animate;       // ms between repaints, 0 for a still screen
+    const char *screenDump;
+    unsigned seed;
+    bool verbose;
+} SimOptions_t;
+
+typedef struct {
+    uint32_t corrupted;     // bytes damaged by noise
+    uint32_t garbled;       // bytes lost to a baud mismatch
+    uint32_t dropped;       // replies and reads lost to --drop
+    uint32_t switches;
+} SimStats_t;
+
+static volatile sig_atomic_t _simQuit = 0;
+static SimOptions_t _options = { nullptr, nullptr, 0, 0, 0, 0, 0, nullptr, 1, false };
+static SimStats_t _stats = {};
+
+static int _master = -1;
+static int _slave = -1;
+static uint32_t _deviceBaud = USBLINK_BASE_BAUD;
+
+static int64_t sim_millis()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (int64_t) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static void sim_sleep(uint32_t ms)
+{
+    struct timespec wait = { (time_t) (ms / 1000), (long) (ms % 1000) * 1000000L };
+    while (nanosleep(&wait, &wait) && errno == EINTR && !_simQuit) { }
+}
+
+static bool sim_chance(uint32_t percent)
+{
+    return percent && (uint32_t) (rand() % 100) < percent;
+}
+
+static void sim_on_signal(int)
+{
+    _simQuit = 1;
+}
+
+static uint32_t sim_host_baud()
+{
+    struct termios tio;
+    if (tcgetattr(_slave, &tio)) return 0;
+
+    switch (cfgetospeed(&tio)) {
+    case B9600:     return 9600;
+    case B115200:   return 115200;
+    case B230400:   return 230400;
+    case B460800:   return 460800;
+    case B921600:   return 921600;
+    default:        return 0;
+    }
+}
+
+/**
+ * Passes bytes through the simulated line: noise above --noisy-above and
+ * garbage while the two ends disagree on the baud. Delimiters survive either,
+ * so the receiver sees bad frames rather than one endless block
+ */
+static void sim_line(uint8_t *data, size_t length)
+{
+    bool mismatch = sim_host_baud() != _deviceBaud;
+    bool noisy = _options.noisyAbove && _deviceBaud > _options.noisyAbove;
+
+    for (size_t i = 0; i < length; ++i) {
+        if (data[i] == USBFRAME_DELIMITER) continue;
+
+        if (mismatch) {
+            data[i] = (rand() % 255) + 1;
+            ++_stats.garbled;
+        }
+        else if (noisy && sim_chance(_options.corrupt)) {
+            data[i] ^= 1 << (rand() % 8);
+            if (!data[i]) data[i] = 0x55;
+            ++_stats.corrupted;
+        }
+    }
+}
+
+/**
+ * Sends bytes to the host at the simulated baud
+ *
+ * @param frame a binary reply, which --drop may lose on the way
+ */
+static void sim_send(const uint8_t *data, size_t length, bool frame)
+{
+    uint8_t buffer[USBFRAME_MAX_ENCODED];
+    if (length > sizeof(buffer)) return;
+
+    memcpy(buffer, data, length);
+    sim_line(buffer, length);
+    sim_sleep(length * 10000 / _deviceBaud);
+
+    if (frame && sim_chance(_options.drop)) {
+        ++_stats.dropped;
+        return;
+    }
+
+    for (size_t written = 0; written < length; ) {
+        ssize_t count = write(_master, buffer + written, length - written);
+        if (count < 0) {
+            if (errno == EAGAIN || errno == EINTR) continue;
+            return;
+        }
+        written += count;
+    }
+}
+
+static void sim_write(void *, const uint8_t *data, size_t length)
+{
+    sim_send(data, length, true);
+}
+
+static void sim_print(const char *text)
+{
+    sim_send(reinterpret_cast<const uint8_t *>(text), strlen(text), false);
+}
+
+static void sim_flush(void *)
+{
+    // writes are paced as they go, nothing is left queued
+}
+
+static void sim_set_baud(void *, uint32_t baud)
+{
+    if (_options.verbose) fprintf(stderr, "baud %u -> %u\n", _deviceBaud, baud);
+    _deviceBaud = baud;
+    ++_stats.switches;
+}
+
+static uint32_t sim_link_millis(void *)
+{
+    return (uint32_t) sim_millis();
+}
+
+static const Driver::UsbLinkTransport_t _transport = { nullptr, sim_write, sim_flush, sim_set_baud, sim_link_millis };
+static Driver::UsbLink _usbLink(_transport);
+
+/* the file systems, directories under --root */
+
+static int _file = -1;
+
+static bool sim_path(Driver::UsbFileSystemId_t fs, const char *path, char *full, size_t size)
+{
+    if (!_options.root || strstr(path, "..")) return false;
+    return snprintf(full, size, "%s/%s%s", _options.root, fs == Driver::USBFILE_SD ? "sd" : "spiffs", path) < (int) size;
+}
+
+static void sim_file_close(void *)
+{
+    if (_file >= 0) close(_file);
+    _file = -1;
+}
+
+static bool sim_file_open(void *context, Driver::UsbFileSystemId_t fs, const char *path, Driver::UsbFileMode_t mode, uint32_t &size)
+{
+    sim_file_close(context);
+
+    char full[512];
+    if (!sim_path(fs, path, full, sizeof(full))) return false;
+
+    static const int flags[] = { O_RDONLY, O_WRONLY | O_CREAT | O_TRUNC, O_WRONLY | O_CREAT | O_APPEND };
+    _file = open(full, flags[mode], 0644);
+
+    struct stat info;
+    if (_file < 0 || fstat(_file, &info) || !S_ISREG(info.st_mode)) {
+        sim_file_close(context);
+        return false;
+    }
+
+    size = info.st_size;
+    return true;
+}
+
+static size_t sim_file_read(void *, uint32_t offset, uint8_t *data, size_t length)
+{
+    ssize_t count = pread(_file, data, length, offset);
+    return count > 0 ? count : 0;
+}
+
+static size_t sim_file_write(void *, const uint8_t *data, size_t length)
+{
+    ssize_t count = write(_file, data, length);
+    return count > 0 ? count : 0;
+}
+
+static int sim_file_entry(void *, Driver::UsbFileSystemId_t fs, const char *path, uint16_t index,
+                          char *name, uint32_t &size, bool &directory)
+{
+    char full[512];
+    DIR *dir = sim_path(fs, path, full, sizeof(full)) ? opendir(full) : nullptr;
+    if (!dir) return -1;
+
+    int found = 0;
+    uint16_t at = 0;
+    for (struct dirent *entry = readdir(dir); entry; entry = readdir(dir)) {
+        if (entry->d_name[0] == '.' || at++ != index) continue;
+
+        char entryPath[1024];
+        struct stat info;
+        snprintf(entryPath, sizeof(entryPath), "%s/%s", full, entry->d_name);
+        if (stat(entryPath, &info)) break;
+
+        snprintf(name, USBFILE_PATH_SIZE + 1, "%.*s", USBFILE_PATH_SIZE, entry->d_name);
+        directory = S_ISDIR(info.st_mode);
+        size = directory ? 0 : info.st_size;
+        found = 1;
+        break;
+    }
+
+    closedir(dir);
+    return found;
+}
+
+static bool sim_file_stat(void *, Driver::UsbFileSystemId_t fs, const char *path, uint32_t &size, bool &directory)
+{
+    char full[512];
+    struct stat info;
+    if (!sim_path(fs, path, full, sizeof(full)) || stat(full, &info)) return false;
+
+    directory = S_ISDIR(info.st_mode);
+    size = directory ? 0 : info.st_size;
+    return true;
+}
+
+static const Driver::UsbFileSystem_t _files = { nullptr, sim_file_open, sim_file_read, sim_file_write, sim_file_close, sim_file_entry,
+                                                sim_file_stat, nullptr };
+static Driver::UsbFileServer _usbFiles(_files);
+
+/* the screen, in memory */
+
+static uint16_t _screen[SIM_SCREEN_WIDTH * SIM_SCREEN_HEIGHT];
+static uint32_t _repaints = 0;
+
+static void sim_screen_size(void *, uint16_t &width, uint16_t &height)
+{
+    width = SIM_SCREEN_WIDTH;
+    height = SIM_SCREEN_HEIGHT;
+}
+
+static void sim_screen_read(void *, uint16_t x, uint16_t y, uint16_t width, uint16_t height, uint16_t *pixels)
+{
+    for (uint16_t row = 0; row < height; ++row) {
+        memcpy(pixels + row * width, _screen + (y + row) * SIM_SCREEN_WIDTH + x, width * sizeof(uint16_t));
+    }
+}
+
+static const Driver::ScreenMirrorDisplay_t _display = { nullptr, sim_screen_size, sim_screen_read };
+static Driver::ScreenMirror _screenMirror(_display);
+
+// what the firmware's tft.fillRect() does, damage included
+static void sim_fill(int32_t x, int32_t y, int32_t w, int32_t h, uint16_t colour)
+{
+    for (int32_t row = y; row < y + h && row < SIM_SCREEN_HEIGHT; ++row) {
+        for (int32_t column = x; column < x + w && column < SIM_SCREEN_WIDTH; ++column) {
+            if (row >= 0 && column >= 0) _screen[row * SIM_SCREEN_WIDTH + column] = colour;
+        }
+    }
+    _screenMirror.damage(x, y, w, h);
+}
+
+/**
+ * A page as the firmware draws one: background, title bar, buttons and lines of
+ * 6x8 "characters" from the seed, then a progress bar --animate moves along
+ */
+static void sim_paint()
+{
+    unsigned text = _options.seed;
+
+    sim_fill(0, 0, SIM_SCREEN_WIDTH, SIM_SCREEN_HEIGHT, 0x18E3);
+    sim_fill(0, 0, SIM_SCREEN_WIDTH, 32, 0x041F);
+    for (int32_t button = 0; button < 4; ++button) {
+        sim_fill(16 + button * 116, 250, 100, 50, button == 1 ? 0x07E0 : 0xC618);
+    }
+
+    for (int32_t line = 0; line < 8; ++line) {
+        for (int32_t character = 0; character < 60; ++character) {
+            text = text * 1103515245 + 12345;
+            for (int32_t dot = 0; dot < 48; ++dot) {
+                if ((text >> (dot % 24)) & 1) {
+                    sim_fill(20 + character * 7 + dot % 6, 48 + line * 22 + dot / 6, 1, 1, 0xFFFF);
+                }
+            }
+        }
+    }
+
+    sim_fill(20, 226, 440, 12, 0x0000);
+    sim_fill(20, 226, (_repaints * 8) % 440, 12, 0xFD20);
+}
+
+static bool sim_touch(void *, Driver::ScreenMirrorTouchType_t type, uint16_t x, uint16_t y)
+{
+    if (_options.verbose) fprintf(stderr, "touch %d at %u, %u\n", type, x, y);
+    if (type != Driver::SCREENMIRROR_TOUCH_UP) sim_fill(x - 3, y - 3, 7, 7, 0xF800);
+    return true;
+}
+
+static bool sim_screen_dump(const char *path)
+{
+    FILE *f = fopen(path, "wb");
+    if (!f) return false;
+
+    fprintf(f, "P6\n%d %d\n255\n", SIM_SCREEN_WIDTH, SIM_SCREEN_HEIGHT);
+    for (uint16_t pixel : _screen) {
+        uint8_t rgb[3] = { (uint8_t) ((pixel >> 11) << 3), (uint8_t) (((pixel >> 5) & 0x3F) << 2), (uint8_t) ((pixel & 0x1F) << 3) };
+        fwrite(rgb, 1, sizeof(rgb), f);
+    }
+    return !fclose(f);
+}
+
+static void sim_link_end(void *)
+{
+    _usbFiles.close();
+    _screenMirror.stop();
+}
+
+static void sim_handle_line(const char *line)
+{
+    if (_options.verbose) fprintf(stderr, "<- %s\n", line);
+
+    if (!strcmp(line, "!binary")) {
+        char reply[64];
+        snprintf(reply, sizeof(reply), "-> Binary mode at %d baud, frames only until exit\n", USBLINK_BASE_BAUD);
+        sim_print(reply);
+        _usbLink.begin((uint32_t) sim_millis());
+    }
+    else if (!strcmp(line, "!ping")) {
+        sim_print("-> pong\n");
+    }
+    else {
+        sim_print("-> Unknown command\n");
+    }
+}
+
+static bool sim_parse_options(int argc, char **argv)
+{
+    for (int i = 1; i < argc; ++i) {
+        const char *arg = argv[i];
+        const char *value = i + 1 < argc ? argv[i + 1] : nullptr;
+
+        if (!strcmp(arg, "--verbose")) {
+            _options.verbose = true;
+            continue;
+        }
+        if (!value) return false;
+        ++i;
+
+        if      (!strcmp(arg, "--link"))        _options.link = value;
+        else if (!strcmp(arg, "--root"))        _options.root = value;
+        else if (!strcmp(arg, "--noisy-above")) _options.noisyAbove = atoi(value);
+        else if (!strcmp(arg, "--corrupt"))     _options.corrupt = atoi(value);
+        else if (!strcmp(arg, "--drop"))        _options.drop = atoi(value);
+        else if (!strcmp(arg, "--chatter"))     _options.chatter = atoi(value);
+        else if (!strcmp(arg, "--animate"))     _options.animate = atoi(value);
+        else if (!strcmp(arg, "--screen-dump")) _options.screenDump = value;
+        else if (!strcmp(arg, "--seed"))        _options.seed = atoi(value);
+        else return false;
+    }
+
+    return _options.corrupt <= 100 && _options.drop <= 100;
+}
+
+int main(int argc, char **argv)
+{
+    if (!sim_parse_options(argc, argv)) {
+        fprintf(stderr, "usage: %s [--link PATH] [--root DIR] [--noisy-above BAUD] [--corrupt PCT] [--drop PCT] [--chatter MS] "
+                        "[--animate MS] [--screen-dump PPM] [--seed N] [--verbose]\n", argv[0]);
+        return 2;
+    }
+    srand(_options.seed);
+
+    _usbFiles.begin(_usbLink);
+    _screenMirror.begin(_usbLink);
+    _screenMirror.onTouch(sim_touch);
+    _usbLink.onEnd(sim_link_end);
+    sim_paint();
+
+    _master = posix_openpt(O_RDWR | O_NOCTTY);
+    if (_master < 0 || grantpt(_master) || unlockpt(_master)) {
+        perror("usbsim: pty");
+        return 1;
+    }
+
+    const char *slaveName = ptsname(_master);
+
+    // hold the slave open so the master doesn't see a hangup between clients, and
+    // to read the baud the host sets on its end
+    _slave = open(slaveName, O_RDWR | O_NOCTTY);
+    struct termios tio;
+    if (_slave < 0 || tcgetattr(_slave, &tio)) {
+        perror("usbsim: slave");
+        return 1;
+    }
+    cfmakeraw(&tio);
+    cfsetspeed(&tio, B9600);
+    tcsetattr(_slave, TCSANOW, &tio);
+
+    if (_options.link) {
+        unlink(_options.link);
+        if (symlink(slaveName, _options.link)) {
+            perror("usbsim: link");
+            return 1;
+        }
+    }
+
+    struct sigaction action = {};
+    action.sa_handler = sim_on_signal;
+    sigaction(SIGINT, &action, nullptr);
+    sigaction(SIGTERM, &action, nullptr);
+
+    printf("%s\n", slaveName);
+    fflush(stdout);
+
+    char line[SIM_LINE_SIZE];
+    size_t lineLength = 0;
+    int64_t nextChatter = sim_millis() + _options.chatter;
+    int64_t nextRepaint = sim_millis() + _options.animate;
+    uint32_t chatterCount = 0;
+
+    while (!_simQuit) {
+        struct pollfd pfd = { _master, POLLIN, 0 };
+        int ready = poll(&pfd, 1, 10);
+
+        if (_options.chatter && sim_millis() >= nextChatter) {
+            char text[64];
+            snprintf(text, sizeof(text), "[log] chatter %u\n", ++chatterCount);
+            sim_print(text);
+            nextChatter = sim_millis() + _options.chatter;
+        }
+
+        if (_options.animate && sim_millis() >= nextRepaint) {
+            ++_repaints;
+            sim_paint();
+            nextRepaint = sim_millis() + _options.animate;
+        }
+
+        if (ready > 0) {
+            uint8_t buffer[256];
+            ssize_t received = read(_master, buffer, sizeof(buffer));
+            if (received < 0 && errno != EAGAIN && errno != EINTR && errno != EIO) break;
+
+            if (received > 0) {
+                // the host's bytes take their time on the wire too
+                sim_line(buffer, received);
+                sim_sleep(received * 10000 / _deviceBaud);
+
+                if (_usbLink.active() && sim_chance(_options.drop)) {
+                    buffer[rand() % received] ^= 0x01;
+                    ++_stats.dropped;
+                }
+            }
+
+            for (ssize_t i = 0; i < received; ++i) {
+                if (_usbLink.active()) {
+                    _usbLink.feed(buffer[i], (uint32_t) sim_millis());
+                    continue;
+                }
+
+                char c = buffer[i];
+                if (c == '\n') continue;
+                if (c != '\r') {
+                    if (lineLength < sizeof(line) - 1) line[lineLength++] = c;
+                    continue;
+                }
+
+                line[lineLength] = '\0';
+                if (lineLength) sim_handle_line(line);
+                lineLength = 0;
+            }
+        }
+
+        _usbLink.poll((uint32_t) sim_millis());
+    }
+
+    if (_options.link) unlink(_options.link);
+    if (_options.screenDump && !sim_screen_dump(_options.screenDump)) perror("usbsim: screen dump");
+
+    uint32_t requests, badFrames, duplicates, fallbacks;
+    uint32_t chunksRead, chunksWritten, outOfOrder;
+    uint32_t tilesSent, tilesUnchanged, tileBytes;
+    _usbLink.stats(requests, badFrames, duplicates, fallbacks);
+    _usbFiles.stats(chunksRead, chunksWritten, outOfOrder);
+    _screenMirror.stats(tilesSent, tilesUnchanged, tileBytes);
+    fprintf(stderr, "usbsim: %u requests, %u bad frames, %u repeated, %u fallbacks, "
+                    "%u baud switches, %u bytes corrupted, %u bytes garbled, %u dropped, "
+                    "%u chunks read, %u chunks written, %u out of order, "
+                    "%u tiles sent in %u bytes, %u unchanged\n",
+            requests, badFrames, duplicates, fallbacks, _stats.switches, _stats.corrupted, _stats.garbled, _stats.dropped,
+            chunksRead, chunksWritten, outOfOrder, tilesSent, tileBytes, tilesUnchanged);
+
+    close(_slave);
+    close(_master);
+    return 0;
+}